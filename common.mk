@@ -20,6 +20,11 @@ common_libs := liblog libutils libcutils libhardware
 common_flags := -DDEBUG_CALC_FPS -Wno-missing-field-initializers
 common_flags += -Werror
 
+#Kernel takes a region of interest in MSMFB_DISPLAY_COMMIT
+ifeq ($(TARGET_USES_PARTIAL_UPDATE),true)
+    common_flags     += -DPARTIAL_UPDATE
+endif
+
 ifeq ($(TARGET_BOARD_PLATFORM),msm7x30)
     common_flags += -D_MSM7X30_
 endif
@@ -26,14 +26,64 @@ LOCAL_ADDITIONAL_DEPENDENCIES := $(common_deps)
 
 ifeq ($(TARGET_USES_C2D_COMPOSITION),true)
     LOCAL_CFLAGS += -DCOPYBIT_Z180=1 -DC2D_SUPPORT_DISPLAY=1
-    LOCAL_SRC_FILES := copybit_c2d.cpp software_converter.cpp
+    LOCAL_SRC_FILES := copybit_c2d.cpp software_converter.cpp worker_pool.cpp
     include $(BUILD_SHARED_LIBRARY)
 else
     ifneq ($(call is-chipset-in-board-platform,msm7630),true)
         ifeq ($(call is-board-platform-in-list,$(MSM7K_BOARD_PLATFORMS)),true)
             LOCAL_CFLAGS += -DCOPYBIT_MSM7K=1
-            LOCAL_SRC_FILES := software_converter.cpp copybit.cpp
+            LOCAL_C_INCLUDES += system/core/libsync
+            LOCAL_SHARED_LIBRARIES += libsync
+            LOCAL_SRC_FILES := software_converter.cpp worker_pool.cpp copybit.cpp
             include $(BUILD_SHARED_LIBRARY)
         endif
     endif
 endif
+
+# Software backend for COMPOSITION_TYPE_CPU, loaded by class name
+include $(CLEAR_VARS)
+LOCAL_MODULE                  := copybit.cpu.$(TARGET_BOARD_PLATFORM)
+LOCAL_MODULE_PATH             := $(TARGET_OUT_SHARED_LIBRARIES)/hw
+LOCAL_MODULE_TAGS             := optional
+LOCAL_C_INCLUDES              := $(common_includes) $(kernel_includes)
+LOCAL_SHARED_LIBRARIES        := $(common_libs) libmemalloc
+LOCAL_CFLAGS                  := $(common_flags) -DLOG_TAG=\"qdcopybit\"
+LOCAL_ADDITIONAL_DEPENDENCIES := $(common_deps)
+LOCAL_SRC_FILES               := copybit_cpu.cpp worker_pool.cpp
+include $(BUILD_SHARED_LIBRARY)
+
+# Software libC2D2 for the host, lets the C2D copybit path run off-device
+include $(CLEAR_VARS)
+LOCAL_MODULE                  := libC2D2
+LOCAL_MODULE_TAGS             := optional
+LOCAL_CFLAGS                  := -DLOG_TAG=\"c2dsoft\"
+LOCAL_SRC_FILES               := c2d_soft.cpp
+LOCAL_SHARED_LIBRARIES        := liblog
+LOCAL_LDLIBS                  := -lpthread
+include $(BUILD_HOST_SHARED_LIBRARY)
+
+# Host benchmark of the C2D copybit path, draws through the libC2D2 above
+include $(CLEAR_VARS)
+LOCAL_MODULE                  := copybit_c2d_bench
+LOCAL_MODULE_TAGS             := optional
+LOCAL_C_INCLUDES              := $(common_includes) $(kernel_includes)
+LOCAL_CFLAGS                  := -DLOG_TAG=\"qdcopybit\" -DCOPYBIT_Z180=1 \
+                                 -DC2D_SUPPORT_DISPLAY=1
+LOCAL_SRC_FILES               := c2d_bench.cpp copybit_c2d.cpp \
+                                 software_converter.cpp worker_pool.cpp
+LOCAL_SHARED_LIBRARIES        := liblog libcutils
+LOCAL_REQUIRED_MODULES        := libC2D2
+LOCAL_LDLIBS                  := -lpthread -lrt -ldl
+include $(BUILD_HOST_EXECUTABLE)
+
+# Host throughput benchmark of the NV12 macrotile converter
+include $(CLEAR_VARS)
+LOCAL_MODULE                  := copybit_detile_bench
+LOCAL_MODULE_TAGS             := optional
+LOCAL_C_INCLUDES              := $(common_includes)
+LOCAL_CFLAGS                  := -DLOG_TAG=\"qdcopybit\"
+LOCAL_SRC_FILES               := detile_bench.cpp software_converter.cpp \
+                                 worker_pool.cpp
+LOCAL_SHARED_LIBRARIES        := liblog libcutils
+LOCAL_LDLIBS                  := -lpthread -lrt
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,455 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host benchmark of the C2D copybit path. It is linked with copybit_c2d.cpp
+ * and runs frames of blits through the device's stretch and flush entry
+ * points, with the draws done by the software libC2D2. It prints the CPU
+ * time copybit spends queueing the blits of a frame separately from the
+ * flush, which includes the software composition.
+ *
+ * Gralloc buffers are stood in for by heap memory, the allocator below
+ * replaces libmemalloc for the layers and the temp. buffers copybit
+ * allocates. Like the ION allocator it calls the gralloc unmap listeners
+ * when a buffer is freed, and it hands a freed block back to the next
+ * allocation of the same size. After the timed frames, one layer is freed
+ * and reallocated in place and a frame is drawn with it, which must not
+ * find the GPU mapping cached for the old buffer.
+ *
+ * usage: copybit_c2d_bench [layers [frames [width height]]]
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <copybit.h>
+#include <alloc_controller.h>
+#include <memalloc.h>
+#include "gralloc_priv.h"
+#include "gr.h"
+
+using gralloc::IMemAlloc;
+using gralloc::alloc_data;
+
+extern struct copybit_module_t HAL_MODULE_INFO_SYM;
+
+/* Heap backed stand-in for the ION allocator */
+class HostAlloc : public IMemAlloc {
+public:
+    HostAlloc() : mSpare(NULL), mSpareSize(0) {
+        pthread_mutex_init(&mLock, NULL);
+    }
+    virtual ~HostAlloc() {
+        free(mSpare);
+        pthread_mutex_destroy(&mLock);
+    }
+    virtual int alloc_buffer(alloc_data& data) {
+        pthread_mutex_lock(&mLock);
+        // Reuse the last freed block like the kernel reuses an unmapped
+        // range, so a stale mapping keyed on the address would be found
+        if (mSpare && mSpareSize == data.size) {
+            data.base = mSpare;
+            mSpare = NULL;
+        } else {
+            data.base = malloc(data.size);
+        }
+        pthread_mutex_unlock(&mLock);
+        if (!data.base)
+            return -ENOMEM;
+        data.fd = dup(sNullFd);
+        data.offset = 0;
+        return 0;
+    }
+    virtual int free_buffer(void *base, size_t size, int offset, int fd) {
+        int err = 0;
+        if (base)
+            err = unmap_buffer(base, size, offset);
+        close(fd);
+        return err;
+    }
+    virtual int map_buffer(void **, size_t, int, int) { return -EINVAL; }
+    virtual int unmap_buffer(void *base, size_t size, int) {
+        gralloc::notifyUnmapListeners(base, size);
+        pthread_mutex_lock(&mLock);
+        free(mSpare);
+        mSpare = base;
+        mSpareSize = size;
+        pthread_mutex_unlock(&mLock);
+        return 0;
+    }
+    virtual int clean_buffer(void *, size_t, int, int) { return 0; }
+    static int sNullFd;
+private:
+    pthread_mutex_t mLock;
+    void *mSpare;
+    size_t mSpareSize;
+};
+
+int HostAlloc::sNullFd = -1;
+
+class HostController : public gralloc::IAllocController {
+public:
+    virtual int allocate(alloc_data& data, int) {
+        data.allocType = private_handle_t::PRIV_FLAGS_USES_ION;
+        return mAlloc.alloc_buffer(data);
+    }
+    virtual IMemAlloc* getAllocator(int) { return &mAlloc; }
+private:
+    HostAlloc mAlloc;
+};
+
+namespace gralloc {
+IAllocController* IAllocController::getInstance(void)
+{
+    static HostController sHostController;
+    return &sHostController;
+}
+
+#define MAX_UNMAP_LISTENERS 4
+
+static struct {
+    unmap_listener_t listener;
+    void *cookie;
+} sUnmapListeners[MAX_UNMAP_LISTENERS];
+static pthread_mutex_t sUnmapListenerLock = PTHREAD_MUTEX_INITIALIZER;
+
+int addUnmapListener(unmap_listener_t listener, void *cookie)
+{
+    int err = -ENOMEM;
+    pthread_mutex_lock(&sUnmapListenerLock);
+    for (int i = 0; i < MAX_UNMAP_LISTENERS; i++) {
+        if (sUnmapListeners[i].listener == NULL) {
+            sUnmapListeners[i].listener = listener;
+            sUnmapListeners[i].cookie = cookie;
+            err = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sUnmapListenerLock);
+    return err;
+}
+
+void removeUnmapListener(unmap_listener_t listener, void *cookie)
+{
+    pthread_mutex_lock(&sUnmapListenerLock);
+    for (int i = 0; i < MAX_UNMAP_LISTENERS; i++) {
+        if (sUnmapListeners[i].listener == listener &&
+            sUnmapListeners[i].cookie == cookie) {
+            sUnmapListeners[i].listener = NULL;
+            sUnmapListeners[i].cookie = NULL;
+        }
+    }
+    pthread_mutex_unlock(&sUnmapListenerLock);
+}
+
+void notifyUnmapListeners(void *base, size_t size)
+{
+    pthread_mutex_lock(&sUnmapListenerLock);
+    for (int i = 0; i < MAX_UNMAP_LISTENERS; i++) {
+        if (sUnmapListeners[i].listener)
+            sUnmapListeners[i].listener(sUnmapListeners[i].cookie,
+                                        base, size);
+    }
+    pthread_mutex_unlock(&sUnmapListenerLock);
+}
+}
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static private_handle_t* alloc_handle(int format, int width, int height,
+                                      size_t size)
+{
+    alloc_data data;
+    memset(&data, 0, sizeof(data));
+    data.fd = -1;
+    data.size = size;
+    if (gralloc::IAllocController::getInstance()->allocate(data, 0))
+        return NULL;
+    memset(data.base, 0x80, size);
+    private_handle_t *hnd = new private_handle_t(data.fd, size,
+            data.allocType, 0, format, width, height);
+    hnd->base = (int)(intptr_t)data.base;
+    return hnd;
+}
+
+static void free_handle(private_handle_t *hnd)
+{
+    if (hnd) {
+        IMemAlloc *memalloc =
+            gralloc::IAllocController::getInstance()->getAllocator(hnd->flags);
+        memalloc->free_buffer((void *)(intptr_t)hnd->base, hnd->size,
+                              hnd->offset, hnd->fd);
+        delete hnd;
+    }
+}
+
+/* Region made of a single rectangle */
+struct single_region : public copybit_region_t {
+    copybit_rect_t rect;
+    mutable bool done;
+};
+
+static int single_region_next(struct copybit_region_t const *region,
+                              struct copybit_rect_t *rect)
+{
+    const single_region *r = static_cast<const single_region *>(region);
+    if (r->done)
+        return 0;
+    *rect = r->rect;
+    r->done = true;
+    return 1;
+}
+
+struct layer {
+    private_handle_t *hnd;
+    copybit_image_t image;
+    copybit_rect_t src_rect;
+    copybit_rect_t dst_rect;
+    int blending;
+};
+
+static void set_image(copybit_image_t& image, private_handle_t *hnd)
+{
+    image.w = hnd->width;
+    image.h = hnd->height;
+    image.format = hnd->format;
+    image.base = (void *)(intptr_t)hnd->base;
+    image.handle = (native_handle_t *)hnd;
+    image.horiz_padding = 0;
+    image.vert_padding = 0;
+}
+
+/* Queue the blits of all layers into dst. Returns the time spent, or a
+ * negative value on failure */
+static double queue_frame(copybit_device_t *dev, copybit_image_t& dst,
+                          layer *layers, int num_layers, int width,
+                          int height)
+{
+    double start = now_sec();
+    for (int i = 0; i < num_layers; i++) {
+        layer& l = layers[i];
+        copybit_params_t params;
+        copybit_params_init(&params);
+        copybit_params_set(&params, COPYBIT_FRAMEBUFFER_WIDTH, width);
+        copybit_params_set(&params, COPYBIT_FRAMEBUFFER_HEIGHT, height);
+        copybit_params_set(&params, COPYBIT_TRANSFORM, 0);
+        copybit_params_set(&params, COPYBIT_PLANE_ALPHA, 255);
+        copybit_params_set(&params, COPYBIT_BLEND_MODE, l.blending);
+        copybit_params_set(&params, COPYBIT_BLIT_TO_FRAMEBUFFER,
+                           COPYBIT_ENABLE);
+        dev->set_parameters(dev, &params);
+
+        single_region region;
+        region.next = single_region_next;
+        region.rect = l.dst_rect;
+        region.done = false;
+        if (dev->stretch(dev, &dst, &l.image, &l.dst_rect, &l.src_rect,
+                         &region) < 0) {
+            fprintf(stderr, "stretch of layer %d failed\n", i);
+            return -1;
+        }
+    }
+    return now_sec() - start;
+}
+
+/* Flush the queued blits. Returns the time spent, or a negative value on
+ * failure */
+static double flush_frame(copybit_device_t *dev)
+{
+    double start = now_sec();
+    int fd = -1;
+    if (dev->flush_get_fence(dev, &fd))
+        return -1;
+    if (fd >= 0)
+        close(fd);
+    return now_sec() - start;
+}
+
+/* GPU map cache misses so far, from the device dump */
+static int get_map_misses(copybit_device_t *dev, unsigned int *misses)
+{
+    char buf[4096] = "";
+    unsigned int hits;
+    dev->dump(dev, buf, sizeof(buf));
+    const char *stats = strstr(buf, "GPU map cache:");
+    if (!stats ||
+        sscanf(stats, "GPU map cache: hits=%u misses=%u", &hits, misses) != 2)
+        return -1;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int num_layers = 4;
+    int frames = 100;
+    int width = 1280;
+    int height = 720;
+    if (argc >= 2)
+        num_layers = atoi(argv[1]);
+    if (argc >= 3)
+        frames = atoi(argv[2]);
+    if (argc >= 5) {
+        width = atoi(argv[3]);
+        height = atoi(argv[4]);
+    }
+    if (num_layers <= 0 || frames <= 0 || width <= 0 || height <= 0) {
+        fprintf(stderr, "usage: %s [layers [frames [width height]]]\n",
+                argv[0]);
+        return 1;
+    }
+
+    HostAlloc::sNullFd = open("/dev/null", O_RDWR);
+    copybit_device_t *dev = NULL;
+    if (HostAlloc::sNullFd < 0 ||
+        copybit_open(&HAL_MODULE_INFO_SYM.common, &dev) || !dev) {
+        fprintf(stderr, "cannot open the C2D copybit device\n");
+        return 1;
+    }
+
+    // An RGBA framebuffer target with RGBA layers stacked on it, scaled
+    // and blended, and an NV12 layer whose width is not 32 aligned, which
+    // takes a temp. buffer and a conversion, like a video
+    private_handle_t *fb = alloc_handle(HAL_PIXEL_FORMAT_RGBA_8888,
+                                        width, height, width * height * 4);
+    layer *layers = new layer[num_layers];
+    for (int i = 0; i < num_layers; i++) {
+        layer& l = layers[i];
+        bool video = (i == 0 && num_layers > 1);
+        int w = video ? ALIGN(width / 2, 16) + 8 : width - 32 * i;
+        int h = video ? height / 2 : height - 16 * i;
+        if (w < 64) w = 64;
+        if (h < 64) h = 64;
+        int format = video ? (int)HAL_PIXEL_FORMAT_YCbCr_420_SP :
+                             (int)HAL_PIXEL_FORMAT_RGBA_8888;
+        size_t size = video ? ALIGN(w, 16) * h * 3 / 2 + 4096 :
+                              (size_t)w * h * 4;
+        l.hnd = alloc_handle(format, w, h, size);
+        if (!l.hnd) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        set_image(l.image, l.hnd);
+        l.src_rect.l = 0;
+        l.src_rect.t = 0;
+        l.src_rect.r = w;
+        l.src_rect.b = h;
+        l.dst_rect.l = (i * 24) % (width / 4);
+        l.dst_rect.t = (i * 16) % (height / 4);
+        l.dst_rect.r = width - (i * 8) % (width / 4);
+        l.dst_rect.b = height - (i * 8) % (height / 4);
+        l.blending = video ? COPYBIT_BLENDING_NONE : COPYBIT_BLENDING_PREMULT;
+    }
+
+    copybit_image_t dst;
+    set_image(dst, fb);
+    double queue_secs = 0, flush_secs = 0;
+    for (int f = 0; f < frames; f++) {
+        double queue = queue_frame(dev, dst, layers, num_layers, width,
+                                   height);
+        if (queue < 0)
+            return 1;
+        double flush = flush_frame(dev);
+        if (flush < 0) {
+            fprintf(stderr, "flush of frame %d failed\n", f);
+            return 1;
+        }
+        queue_secs += queue;
+        flush_secs += flush;
+    }
+    dev->finish(dev);
+
+    // Free the last layer once its draws are done and allocate its
+    // replacement, which gets the same address back and the lowest free
+    // fd, i.e. the same one. The frame drawn with it must map it afresh.
+    layer& reused = layers[num_layers - 1];
+    private_handle_t *old_hnd = reused.hnd;
+    int old_base = old_hnd->base;
+    int old_fd = old_hnd->fd;
+    unsigned int misses_before, misses_after;
+    if (get_map_misses(dev, &misses_before)) {
+        fprintf(stderr, "no GPU map cache statistics in the dump\n");
+        return 1;
+    }
+    free_handle(old_hnd);
+    reused.hnd = alloc_handle(reused.image.format, reused.image.w,
+                              reused.image.h,
+                              (size_t)reused.image.w * reused.image.h * 4);
+    if (!reused.hnd) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    set_image(reused.image, reused.hnd);
+    if (queue_frame(dev, dst, layers, num_layers, width, height) < 0 ||
+        flush_frame(dev) < 0) {
+        fprintf(stderr, "frame with the reused buffer failed\n");
+        return 1;
+    }
+    dev->finish(dev);
+    if (get_map_misses(dev, &misses_after)) {
+        fprintf(stderr, "no GPU map cache statistics in the dump\n");
+        return 1;
+    }
+    bool same_key = reused.hnd->base == old_base && reused.hnd->fd == old_fd;
+    printf("reused buffer: same address and fd=%s, new mappings=%u\n",
+           same_key ? "yes" : "no", misses_after - misses_before);
+    if (misses_after == misses_before) {
+        fprintf(stderr, "the reused buffer hit the stale GPU mapping\n");
+        return 1;
+    }
+
+    printf("%d layers on %dx%d, %d frames\n", num_layers, width, height,
+           frames);
+    printf("queue %8.1f us/frame %8.1f us/blit\n",
+           queue_secs * 1e6 / frames, queue_secs * 1e6 / frames / num_layers);
+    printf("flush %8.1f us/frame (software composition included)\n",
+           flush_secs * 1e6 / frames);
+    if (dev->dump) {
+        char buf[4096] = "";
+        dev->dump(dev, buf, sizeof(buf));
+        printf("%s", buf);
+    }
+
+    copybit_close(dev);
+    for (int i = 0; i < num_layers; i++)
+        free_handle(layers[i].hnd);
+    delete [] layers;
+    free_handle(fb);
+    close(HostAlloc::sNullFd);
+    return 0;
+}
@@ -0,0 +1,642 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Software implementation of the libC2D2 entry points used by
+ * copybit_c2d.cpp. It is built as a host libC2D2.so so the C2D copybit
+ * path can be run and profiled without a GPU. Draws composite on the CPU
+ * straight into the host pointers of the surface definitions, the GPU
+ * addresses handed out by c2dMapAddr are only tracked for leaks and
+ * double unmaps. Every draw completes before c2dDraw returns, so flushes
+ * and timestamps are bookkeeping only.
+ */
+
+#include <cutils/log.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "c2d2.h"
+
+#define SOFT_GPU_ADDR_BASE  0x10000000
+#define SOFT_PAGE_SIZE      4096
+
+struct soft_surface {
+    bool used;
+    bool yuv;
+    C2D_RGB_SURFACE_DEF rgb;
+    C2D_YUV_SURFACE_DEF yuv_def;
+};
+
+struct soft_mapping {
+    uint32 gpuaddr;
+    uint32 len;
+};
+
+struct soft_pixel {
+    int r;
+    int g;
+    int b;
+    int a;
+};
+
+static pthread_mutex_t sLock = PTHREAD_MUTEX_INITIALIZER;
+static soft_surface *sSurfaces = NULL;      // surface id - 1 indexes this
+static uint32 sSurfaceSize = 0;
+static soft_mapping *sMappings = NULL;
+static uint32 sMappingCount = 0;
+static uint32 sMappingSize = 0;
+static uint32 sNextGpuAddr = SOFT_GPU_ADDR_BASE;
+static uint32 sTimestamp = 0;
+
+/* Grow a table to hold at least needed entries, zeroing the new ones */
+static bool grow_table(void **table, uint32 *size, uint32 needed,
+                       size_t elem_size)
+{
+    if (needed <= *size)
+        return true;
+    uint32 new_size = *size ? *size * 2 : 16;
+    while (new_size < needed)
+        new_size *= 2;
+    void *grown = realloc(*table, new_size * elem_size);
+    if (!grown)
+        return false;
+    memset((char *)grown + *size * elem_size, 0,
+           (new_size - *size) * elem_size);
+    *table = grown;
+    *size = new_size;
+    return true;
+}
+
+static soft_surface* get_surface(uint32 surface_id)
+{
+    if (surface_id == 0 || surface_id > sSurfaceSize ||
+        !sSurfaces[surface_id - 1].used)
+        return NULL;
+    return &sSurfaces[surface_id - 1];
+}
+
+static bool is_yuv_type(C2D_SURFACE_TYPE surface_type)
+{
+    int base = surface_type & ~(C2D_SURFACE_WITH_PHYS |
+                                C2D_SURFACE_WITH_PHYS_DUMMY);
+    return base == C2D_SURFACE_YUV_HOST || base == C2D_SURFACE_YUV_EXT;
+}
+
+static C2D_STATUS set_definition(soft_surface *surface,
+                                 C2D_SURFACE_TYPE surface_type,
+                                 void *surface_definition)
+{
+    if (!surface_definition)
+        return C2D_STATUS_INVALID_PARAM;
+    surface->yuv = is_yuv_type(surface_type);
+    if (surface->yuv)
+        memcpy(&surface->yuv_def, surface_definition,
+               sizeof(C2D_YUV_SURFACE_DEF));
+    else
+        memcpy(&surface->rgb, surface_definition,
+               sizeof(C2D_RGB_SURFACE_DEF));
+    return C2D_STATUS_OK;
+}
+
+static inline int clamp_255(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* BT.601 video range */
+static void yuv_to_rgb(int y, int u, int v, soft_pixel *p)
+{
+    int c = 298 * (y - 16);
+    int d = u - 128;
+    int e = v - 128;
+    p->r = clamp_255((c + 409 * e + 128) >> 8);
+    p->g = clamp_255((c - 100 * d - 208 * e + 128) >> 8);
+    p->b = clamp_255((c + 516 * d + 128) >> 8);
+    p->a = 255;
+}
+
+static void rgb_to_yuv(const soft_pixel *p, int *y, int *u, int *v)
+{
+    *y = clamp_255(((66 * p->r + 129 * p->g + 25 * p->b + 128) >> 8) + 16);
+    *u = clamp_255(((-38 * p->r - 74 * p->g + 112 * p->b + 128) >> 8) + 128);
+    *v = clamp_255(((112 * p->r - 94 * p->g - 18 * p->b + 128) >> 8) + 128);
+}
+
+/* Chroma planes of a YUV surface, u/v point at the first sample of a row
+ * pair and step advances to the next sample */
+static void yuv_chroma(const C2D_YUV_SURFACE_DEF *def, int x, int y,
+                       uint8_t **u, uint8_t **v)
+{
+    int format = def->format & 0xFF;
+    uint8_t *plane1 = (uint8_t *)def->plane1 + (y / 2) * def->stride1;
+    uint8_t *plane2 = (uint8_t *)def->plane2 + (y / 2) * def->stride2;
+    switch (format) {
+        case C2D_COLOR_FORMAT_420_NV12 & 0xFF:
+            *u = plane1 + (x / 2) * 2;
+            *v = *u + 1;
+            break;
+        case C2D_COLOR_FORMAT_420_NV21 & 0xFF:
+            *v = plane1 + (x / 2) * 2;
+            *u = *v + 1;
+            break;
+        case C2D_COLOR_FORMAT_420_YV12 & 0xFF:
+            *v = plane1 + x / 2;
+            *u = plane2 + x / 2;
+            break;
+        default:
+            *u = plane1 + x / 2;
+            *v = plane2 + x / 2;
+            break;
+    }
+}
+
+static bool is_supported_yuv(uint32 format)
+{
+    switch (format & 0xFF) {
+        case C2D_COLOR_FORMAT_420_NV12 & 0xFF:
+        case C2D_COLOR_FORMAT_420_NV21 & 0xFF:
+        case C2D_COLOR_FORMAT_420_YV12 & 0xFF:
+        case C2D_COLOR_FORMAT_420_I420 & 0xFF:
+            return !(format & C2D_FORMAT_MACROTILED);
+        default:
+            return false;
+    }
+}
+
+static bool is_supported_rgb(uint32 format)
+{
+    switch (format & 0xFF) {
+        case C2D_COLOR_FORMAT_565_RGB:
+        case C2D_COLOR_FORMAT_8888_ARGB:
+        case C2D_COLOR_FORMAT_8888_RGBA:
+        case C2D_COLOR_FORMAT_5551_RGBA:
+        case C2D_COLOR_FORMAT_4444_RGBA:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void read_pixel(const soft_surface *s, int x, int y, soft_pixel *p)
+{
+    if (s->yuv) {
+        const C2D_YUV_SURFACE_DEF *def = &s->yuv_def;
+        uint8_t *u, *v;
+        int luma = ((uint8_t *)def->plane0)[y * def->stride0 + x];
+        yuv_chroma(def, x, y, &u, &v);
+        yuv_to_rgb(luma, *u, *v, p);
+        return;
+    }
+
+    const C2D_RGB_SURFACE_DEF *def = &s->rgb;
+    uint8_t *row = (uint8_t *)def->buffer + y * def->stride;
+    switch (def->format & 0xFF) {
+        case C2D_COLOR_FORMAT_565_RGB: {
+            uint16_t c = ((uint16_t *)row)[x];
+            p->r = ((c >> 11) & 0x1F) * 255 / 31;
+            p->g = ((c >> 5) & 0x3F) * 255 / 63;
+            p->b = (c & 0x1F) * 255 / 31;
+            p->a = 255;
+            break;
+        }
+        case C2D_COLOR_FORMAT_5551_RGBA: {
+            uint16_t c = ((uint16_t *)row)[x];
+            p->r = ((c >> 11) & 0x1F) * 255 / 31;
+            p->g = ((c >> 6) & 0x1F) * 255 / 31;
+            p->b = ((c >> 1) & 0x1F) * 255 / 31;
+            p->a = (c & 1) ? 255 : 0;
+            break;
+        }
+        case C2D_COLOR_FORMAT_4444_RGBA: {
+            uint16_t c = ((uint16_t *)row)[x];
+            p->r = ((c >> 12) & 0xF) * 17;
+            p->g = ((c >> 8) & 0xF) * 17;
+            p->b = ((c >> 4) & 0xF) * 17;
+            p->a = (c & 0xF) * 17;
+            break;
+        }
+        case C2D_COLOR_FORMAT_8888_RGBA: {
+            uint8_t *c = row + x * 4;
+            p->a = c[0];
+            p->b = c[1];
+            p->g = c[2];
+            p->r = c[3];
+            break;
+        }
+        default: {
+            // 8888_ARGB, little endian B G R A in memory
+            uint8_t *c = row + x * 4;
+            p->b = c[0];
+            p->g = c[1];
+            p->r = c[2];
+            p->a = c[3];
+            break;
+        }
+    }
+    if (def->format & C2D_FORMAT_SWAP_RB) {
+        int r = p->r;
+        p->r = p->b;
+        p->b = r;
+    }
+    if (def->format & C2D_FORMAT_DISABLE_ALPHA)
+        p->a = 255;
+}
+
+static void write_pixel(soft_surface *s, int x, int y, const soft_pixel *p)
+{
+    if (s->yuv) {
+        C2D_YUV_SURFACE_DEF *def = &s->yuv_def;
+        int luma, cb, cr;
+        rgb_to_yuv(p, &luma, &cb, &cr);
+        ((uint8_t *)def->plane0)[y * def->stride0 + x] = luma;
+        if (!(x & 1) && !(y & 1)) {
+            uint8_t *u, *v;
+            yuv_chroma(def, x, y, &u, &v);
+            // The hardware swaps the chroma of YUV targets, copybit
+            // compensates in get_c2d_format_for_yuv_destination
+            *u = cr;
+            *v = cb;
+        }
+        return;
+    }
+
+    C2D_RGB_SURFACE_DEF *def = &s->rgb;
+    uint8_t *row = (uint8_t *)def->buffer + y * def->stride;
+    int r = p->r, b = p->b;
+    if (def->format & C2D_FORMAT_SWAP_RB) {
+        r = p->b;
+        b = p->r;
+    }
+    switch (def->format & 0xFF) {
+        case C2D_COLOR_FORMAT_565_RGB:
+            ((uint16_t *)row)[x] = ((r >> 3) << 11) | ((p->g >> 2) << 5) |
+                                   (b >> 3);
+            break;
+        case C2D_COLOR_FORMAT_5551_RGBA:
+            ((uint16_t *)row)[x] = ((r >> 3) << 11) | ((p->g >> 3) << 6) |
+                                   ((b >> 3) << 1) | (p->a >= 128);
+            break;
+        case C2D_COLOR_FORMAT_4444_RGBA:
+            ((uint16_t *)row)[x] = ((r >> 4) << 12) | ((p->g >> 4) << 8) |
+                                   ((b >> 4) << 4) | (p->a >> 4);
+            break;
+        case C2D_COLOR_FORMAT_8888_RGBA: {
+            uint8_t *c = row + x * 4;
+            c[0] = p->a;
+            c[1] = b;
+            c[2] = p->g;
+            c[3] = r;
+            break;
+        }
+        default: {
+            uint8_t *c = row + x * 4;
+            c[0] = b;
+            c[1] = p->g;
+            c[2] = r;
+            c[3] = (def->format & C2D_FORMAT_DISABLE_ALPHA) ? 255 : p->a;
+            break;
+        }
+    }
+}
+
+static void surface_size(const soft_surface *s, int *w, int *h)
+{
+    if (s->yuv) {
+        *w = s->yuv_def.width;
+        *h = s->yuv_def.height;
+    } else {
+        *w = s->rgb.width;
+        *h = s->rgb.height;
+    }
+}
+
+static bool surface_supported(const soft_surface *s)
+{
+    if (s->yuv)
+        return is_supported_yuv(s->yuv_def.format) && s->yuv_def.plane0;
+    return is_supported_rgb(s->rgb.format) && s->rgb.buffer;
+}
+
+/* Map a pixel of the rotated target space to the target surface. C2D
+ * rotates counter-clockwise, set_rects in copybit_c2d.cpp relies on it. */
+static void target_to_surface(int rotation, int w, int h, int lx, int ly,
+                              int *px, int *py)
+{
+    switch (rotation) {
+        case 1:  *px = ly;         *py = h - 1 - lx; break;
+        case 2:  *px = w - 1 - lx; *py = h - 1 - ly; break;
+        case 3:  *px = w - 1 - ly; *py = lx;         break;
+        default: *px = lx;         *py = ly;         break;
+    }
+}
+
+static void draw_object(soft_surface *target, uint32 target_config,
+                        const C2D_OBJECT *object)
+{
+    soft_surface *source = get_surface(object->surface_id);
+    if (!source || !surface_supported(source)) {
+        ALOGE("%s: unsupported source surface %u", __FUNCTION__,
+              object->surface_id);
+        return;
+    }
+
+    uint32 config = object->config_mask;
+    int src_w, src_h, dst_w, dst_h;
+    surface_size(source, &src_w, &src_h);
+    surface_size(target, &dst_w, &dst_h);
+
+    int rotation = (target_config & C2D_TARGET_ROTATION_MASK) >>
+                   C2D_OVERRIDE_TARGET_CONFIG_TARGET_ROTATION_SHIFT_MASK;
+    if (config & C2D_OVERRIDE_GLOBAL_TARGET_ROTATE_CONFIG)
+        rotation = (config >>
+                    C2D_OVERRIDE_SOURCE_CONFIG_TARGET_ROTATION_SHIFT_MASK) & 3;
+
+    C2D_RECT src = {0, 0, src_w, src_h};
+    if (config & C2D_SOURCE_RECT_BIT) {
+        src.x = object->source_rect.x >> 16;
+        src.y = object->source_rect.y >> 16;
+        src.width = object->source_rect.width >> 16;
+        src.height = object->source_rect.height >> 16;
+    }
+    bool rotated = rotation & 1;
+    C2D_RECT trg = {0, 0, rotated ? dst_h : dst_w, rotated ? dst_w : dst_h};
+    if (config & C2D_TARGET_RECT_BIT) {
+        trg.x = object->target_rect.x >> 16;
+        trg.y = object->target_rect.y >> 16;
+        trg.width = object->target_rect.width >> 16;
+        trg.height = object->target_rect.height >> 16;
+    }
+    C2D_RECT clip = {0, 0, dst_w, dst_h};
+    if (config & C2D_SCISSOR_RECT_BIT)
+        clip = object->scissor_rect;
+    if (trg.width <= 0 || trg.height <= 0 || src.width <= 0 ||
+        src.height <= 0)
+        return;
+
+    bool blend = !(config & C2D_ALPHA_BLEND_NONE);
+    bool premultiplied = !source->yuv &&
+                         (source->rgb.format & C2D_FORMAT_PREMULTIPLIED);
+    int global_alpha = (config & C2D_GLOBAL_ALPHA_BIT) ?
+                       (int)object->global_alpha : 255;
+    // The hardware does not swap red and blue for YUV targets either
+    bool swap_rb = target->yuv && !source->yuv;
+
+    for (int ly = trg.y; ly < trg.y + trg.height; ly++) {
+        int v = src.y + (int)((int64_t)(ly - trg.y) * src.height /
+                              trg.height);
+        if (config & C2D_MIRROR_V_BIT)
+            v = 2 * src.y + src.height - 1 - v;
+        if (v < 0 || v >= src_h)
+            continue;
+        for (int lx = trg.x; lx < trg.x + trg.width; lx++) {
+            int px, py;
+            target_to_surface(rotation, dst_w, dst_h, lx, ly, &px, &py);
+            if (px < clip.x || px >= clip.x + clip.width ||
+                py < clip.y || py >= clip.y + clip.height ||
+                px < 0 || px >= dst_w || py < 0 || py >= dst_h)
+                continue;
+            int u = src.x + (int)((int64_t)(lx - trg.x) * src.width /
+                                  trg.width);
+            if (config & C2D_MIRROR_H_BIT)
+                u = 2 * src.x + src.width - 1 - u;
+            if (u < 0 || u >= src_w)
+                continue;
+
+            soft_pixel s;
+            read_pixel(source, u, v, &s);
+            if (swap_rb) {
+                int r = s.r;
+                s.r = s.b;
+                s.b = r;
+            }
+            if (config & C2D_NO_PIXEL_ALPHA_BIT)
+                s.a = 255;
+            if (global_alpha < 255) {
+                if (premultiplied) {
+                    s.r = s.r * global_alpha / 255;
+                    s.g = s.g * global_alpha / 255;
+                    s.b = s.b * global_alpha / 255;
+                }
+                s.a = s.a * global_alpha / 255;
+            }
+            if (blend && s.a < 255) {
+                soft_pixel d;
+                read_pixel(target, px, py, &d);
+                int inv = 255 - s.a;
+                if (premultiplied) {
+                    s.r = clamp_255(s.r + d.r * inv / 255);
+                    s.g = clamp_255(s.g + d.g * inv / 255);
+                    s.b = clamp_255(s.b + d.b * inv / 255);
+                } else {
+                    s.r = (s.r * s.a + d.r * inv) / 255;
+                    s.g = (s.g * s.a + d.g * inv) / 255;
+                    s.b = (s.b * s.a + d.b * inv) / 255;
+                }
+                s.a = clamp_255(s.a + d.a * inv / 255);
+            }
+            write_pixel(target, px, py, &s);
+        }
+    }
+}
+
+extern "C" {
+
+C2D_API C2D_STATUS c2dCreateSurface( uint32 *surface_id,
+                                     uint32 surface_bits,
+                                     C2D_SURFACE_TYPE surface_type,
+                                     void *surface_definition )
+{
+    if (!surface_id)
+        return C2D_STATUS_INVALID_PARAM;
+    pthread_mutex_lock(&sLock);
+    uint32 index = 0;
+    while (index < sSurfaceSize && sSurfaces[index].used)
+        index++;
+    if (!grow_table((void **)&sSurfaces, &sSurfaceSize, index + 1,
+                    sizeof(soft_surface))) {
+        pthread_mutex_unlock(&sLock);
+        return C2D_STATUS_OUT_OF_MEMORY;
+    }
+    C2D_STATUS status = set_definition(&sSurfaces[index], surface_type,
+                                       surface_definition);
+    if (status == C2D_STATUS_OK) {
+        sSurfaces[index].used = true;
+        *surface_id = index + 1;
+    }
+    pthread_mutex_unlock(&sLock);
+    return status;
+}
+
+C2D_API C2D_STATUS c2dUpdateSurface( uint32 surface_id,
+                                     uint32 surface_bits,
+                                     C2D_SURFACE_TYPE surface_type,
+                                     void *surface_definition )
+{
+    pthread_mutex_lock(&sLock);
+    soft_surface *surface = get_surface(surface_id);
+    C2D_STATUS status = surface ?
+        set_definition(surface, surface_type, surface_definition) :
+        C2D_STATUS_INVALID_PARAM;
+    pthread_mutex_unlock(&sLock);
+    return status;
+}
+
+C2D_API C2D_STATUS c2dReadSurface( uint32 surface_id,
+                                   C2D_SURFACE_TYPE surface_type,
+                                   void *surface_definition,
+                                   int32 x, int32 y )
+{
+    return C2D_STATUS_NOT_SUPPORTED;
+}
+
+C2D_API C2D_STATUS c2dDestroySurface( uint32 surface_id )
+{
+    pthread_mutex_lock(&sLock);
+    soft_surface *surface = get_surface(surface_id);
+    if (surface)
+        memset(surface, 0, sizeof(*surface));
+    pthread_mutex_unlock(&sLock);
+    return surface ? C2D_STATUS_OK : C2D_STATUS_INVALID_PARAM;
+}
+
+C2D_API C2D_STATUS c2dDraw( uint32 target_id,
+                            uint32 target_config, C2D_RECT *target_scissor,
+                            uint32 target_mask_id, uint32 target_color_key,
+                            C2D_OBJECT *objects_list, uint32 num_objects )
+{
+    pthread_mutex_lock(&sLock);
+    soft_surface *target = get_surface(target_id);
+    if (!target || !surface_supported(target)) {
+        pthread_mutex_unlock(&sLock);
+        ALOGE("%s: unsupported target surface %u", __FUNCTION__, target_id);
+        return C2D_STATUS_INVALID_PARAM;
+    }
+    C2D_OBJECT *object = objects_list;
+    for (uint32 i = 0; object && i < num_objects; i++) {
+        draw_object(target, target_config, object);
+        object = object->next;
+    }
+    pthread_mutex_unlock(&sLock);
+    return C2D_STATUS_OK;
+}
+
+C2D_API C2D_STATUS c2dFlush( uint32 target_id, c2d_ts_handle *timestamp)
+{
+    pthread_mutex_lock(&sLock);
+    bool valid = get_surface(target_id) != NULL;
+    if (timestamp)
+        *timestamp = (c2d_ts_handle)(uintptr_t)++sTimestamp;
+    pthread_mutex_unlock(&sLock);
+    return valid ? C2D_STATUS_OK : C2D_STATUS_INVALID_PARAM;
+}
+
+C2D_API C2D_STATUS c2dWaitTimestamp( c2d_ts_handle timestamp )
+{
+    // Draws complete inside c2dDraw
+    return C2D_STATUS_OK;
+}
+
+C2D_API C2D_STATUS c2dFinish( uint32 target_id )
+{
+    pthread_mutex_lock(&sLock);
+    bool valid = get_surface(target_id) != NULL;
+    pthread_mutex_unlock(&sLock);
+    return valid ? C2D_STATUS_OK : C2D_STATUS_INVALID_PARAM;
+}
+
+C2D_API C2D_STATUS c2dMapAddr ( int mem_fd, void * hostptr, uint32 len,
+                                uint32 offset, uint32 flags, void ** gpuaddr)
+{
+    if (!hostptr || !len || !gpuaddr)
+        return C2D_STATUS_INVALID_PARAM;
+    pthread_mutex_lock(&sLock);
+    if (!grow_table((void **)&sMappings, &sMappingSize, sMappingCount + 1,
+                    sizeof(soft_mapping))) {
+        pthread_mutex_unlock(&sLock);
+        return C2D_STATUS_OUT_OF_MEMORY;
+    }
+    soft_mapping *mapping = &sMappings[sMappingCount++];
+    mapping->gpuaddr = sNextGpuAddr;
+    mapping->len = len;
+    sNextGpuAddr += (len + SOFT_PAGE_SIZE - 1) & ~(SOFT_PAGE_SIZE - 1);
+    if (sNextGpuAddr < SOFT_GPU_ADDR_BASE)
+        sNextGpuAddr = SOFT_GPU_ADDR_BASE;
+    *gpuaddr = (void *)(uintptr_t)mapping->gpuaddr;
+    pthread_mutex_unlock(&sLock);
+    return C2D_STATUS_OK;
+}
+
+C2D_API C2D_STATUS c2dUnMapAddr (void * gpuaddr)
+{
+    uint32 addr = (uint32)(uintptr_t)gpuaddr;
+    pthread_mutex_lock(&sLock);
+    for (uint32 i = 0; i < sMappingCount; i++) {
+        if (sMappings[i].gpuaddr == addr) {
+            sMappings[i] = sMappings[--sMappingCount];
+            pthread_mutex_unlock(&sLock);
+            return C2D_STATUS_OK;
+        }
+    }
+    pthread_mutex_unlock(&sLock);
+    ALOGE("%s: 0x%x is not mapped", __FUNCTION__, addr);
+    return C2D_STATUS_INVALID_PARAM;
+}
+
+C2D_API C2D_STATUS c2dGetDriverCapabilities( C2D_DRIVER_INFO * driver_info)
+{
+    if (!driver_info)
+        return C2D_STATUS_INVALID_PARAM;
+    memset(driver_info, 0, sizeof(*driver_info));
+    driver_info->capabilities_mask =
+        C2D_DRIVER_SUPPORTS_GLOBAL_ALPHA_OP |
+        C2D_DRIVER_SUPPORTS_NO_PIXEL_ALPHA_OP |
+        C2D_DRIVER_SUPPORTS_TARGET_ROTATE_OP |
+        C2D_DRIVER_SUPPORTS_OVERRIDE_TARGET_ROTATE_OP |
+        C2D_DRIVER_SUPPORTS_MIRROR_H_OP |
+        C2D_DRIVER_SUPPORTS_MIRROR_V_OP |
+        C2D_DRIVER_SUPPORTS_SCISSOR_RECT_OP |
+        C2D_DRIVER_SUPPORTS_SOURCE_RECT_OP |
+        C2D_DRIVER_SUPPORTS_TARGET_RECT_OP |
+        C2D_DRIVER_SUPPORTS_FLUSH_WITH_FENCE_FD_OP;
+    return C2D_STATUS_OK;
+}
+
+C2D_API C2D_STATUS c2dCreateFenceFD( uint32 target_id, c2d_ts_handle timestamp,
+                                     int32 *fd)
+{
+    if (!fd)
+        return C2D_STATUS_INVALID_PARAM;
+    // Already signaled, the draw is complete
+    *fd = -1;
+    return C2D_STATUS_OK;
+}
+
+} // extern "C"
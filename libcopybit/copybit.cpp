@@ -28,18 +28,23 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 
 #include <copybit.h>
+#include <sw_sync.h>
 
 #include "gralloc_priv.h"
 #include "software_converter.h"
 
 #define DEBUG_MDP_ERRORS 1
 
+/* Requests queued across stretch calls before a MSMFB_BLIT is forced */
+#define MAX_BLIT_REQ_COUNT 48
+
 /******************************************************************************/
 
 #if defined(COPYBIT_MSM7K)
@@ -54,6 +59,12 @@
 
 /******************************************************************************/
 
+/** Requests of one MSMFB_BLIT, laid out as mdp_blit_req_list */
+struct blit_req_list {
+    uint32_t count;
+    struct mdp_blit_req req[MAX_BLIT_REQ_COUNT];
+};
+
 /** State information for each device instance */
 struct copybit_context_t {
     struct copybit_device_t device;
@@ -61,6 +72,18 @@ struct copybit_context_t {
     uint8_t mAlpha;
     int     mFlags;
     bool    mBlitToFB;
+    struct copybit_params_t mParams; // last value of each parameter
+    struct blit_req_list mList;      // framebuffer blits not yet submitted
+    /* Submission thread, runs one handed off list at a time */
+    pthread_t mThread;
+    pthread_mutex_t mLock;
+    pthread_cond_t mCond;            // signals hand offs and completions
+    struct blit_req_list mSubmitList;
+    bool    mSubmitPending;          // mSubmitList is queued or running
+    bool    mStop;
+    int     mSubmitStatus;           // first error of the handed off lists
+    int     mTimelineFd;             // sw_sync timeline, -1 submits inline
+    uint32_t mTimelineValue;         // value of the last hand off
 };
 
 /**
@@ -263,6 +286,63 @@ static int msm_copybit(struct copybit_context_t *dev, void const *list)
     }
 }
 
+/** submission thread, signals the timeline once a list has completed */
+static void* submit_thread(void *data)
+{
+    struct copybit_context_t *ctx = (struct copybit_context_t *)data;
+    pthread_mutex_lock(&ctx->mLock);
+    while (true) {
+        while (!ctx->mSubmitPending && !ctx->mStop)
+            pthread_cond_wait(&ctx->mCond, &ctx->mLock);
+        if (!ctx->mSubmitPending)
+            break;
+        pthread_mutex_unlock(&ctx->mLock);
+        int status = msm_copybit(ctx, &ctx->mSubmitList);
+        sw_sync_timeline_inc(ctx->mTimelineFd, 1);
+        pthread_mutex_lock(&ctx->mLock);
+        if (status != 0 && ctx->mSubmitStatus == 0)
+            ctx->mSubmitStatus = status;
+        ctx->mSubmitPending = false;
+        pthread_cond_broadcast(&ctx->mCond);
+    }
+    pthread_mutex_unlock(&ctx->mLock);
+    return NULL;
+}
+
+/** wait for the handed off list, returns its status. mLock held */
+static int wait_idle(struct copybit_context_t *ctx)
+{
+    while (ctx->mSubmitPending)
+        pthread_cond_wait(&ctx->mCond, &ctx->mLock);
+    int status = ctx->mSubmitStatus;
+    ctx->mSubmitStatus = 0;
+    return status;
+}
+
+/** submit the queued requests, in the order they were added. Lists are
+ *  handed to the submission thread when there is one, one at a time so
+ *  the blending order is kept. mLock held */
+static int submit_pending(struct copybit_context_t *ctx)
+{
+    int status = 0;
+    if (ctx->mList.count == 0)
+        return 0;
+    if (ctx->mTimelineFd < 0) {
+        status = msm_copybit(ctx, &ctx->mList);
+    } else {
+        while (ctx->mSubmitPending)
+            pthread_cond_wait(&ctx->mCond, &ctx->mLock);
+        memcpy(&ctx->mSubmitList, &ctx->mList,
+               sizeof(ctx->mList.count) +
+               ctx->mList.count * sizeof(ctx->mList.req[0]));
+        ctx->mSubmitPending = true;
+        ctx->mTimelineValue++;
+        pthread_cond_signal(&ctx->mCond);
+    }
+    ctx->mList.count = 0;
+    return status;
+}
+
 /*****************************************************************************/
 
 /** Set a parameter to value */
@@ -342,12 +422,44 @@ static int set_parameter_copybit(
                 status = -EINVAL;
                 break;
         }
+        if (status == 0) {
+            // Rotation and transform share the orientation flags
+            if (name == COPYBIT_ROTATION_DEG)
+                ctx->mParams.mask &= ~(1 << COPYBIT_TRANSFORM);
+            else if (name == COPYBIT_TRANSFORM)
+                ctx->mParams.mask &= ~(1 << COPYBIT_ROTATION_DEG);
+            copybit_params_set(&ctx->mParams, name, value);
+        }
     } else {
         status = -EINVAL;
     }
     return status;
 }
 
+/** Set the parameters of a block that differ from the current ones */
+static int set_parameters_copybit(
+    struct copybit_device_t *dev,
+    struct copybit_params_t const *params)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    int status = 0;
+    if (!ctx || !params) {
+        return -EINVAL;
+    }
+    for (int name = 0; name < COPYBIT_PARAMETER_COUNT; name++) {
+        uint32_t bit = 1 << name;
+        if (!(params->mask & bit))
+            continue;
+        if ((ctx->mParams.mask & bit) &&
+            ctx->mParams.value[name] == params->value[name])
+            continue;
+        if (set_parameter_copybit(dev, name, params->value[name]))
+            status = -EINVAL;
+    }
+    return status;
+}
+
+
 /** Get a static info value */
 static int get(struct copybit_device_t *dev, int name)
 {
@@ -389,10 +501,7 @@ static int stretch_copybit(
     int status = 0;
     private_handle_t *yv12_handle = NULL;
     if (ctx) {
-        struct {
-            uint32_t count;
-            struct mdp_blit_req req[12];
-        } list;
+        struct blit_req_list *list = &ctx->mList;
 
         if (ctx->mAlpha < 255) {
             switch (src->format) {
@@ -451,14 +560,15 @@ static int stretch_copybit(
                 return -EINVAL;
             }
         }
-        const uint32_t maxCount = sizeof(list.req)/sizeof(list.req[0]);
         const struct copybit_rect_t bounds = { 0, 0, dst->w, dst->h };
         struct copybit_rect_t clip;
-        list.count = 0;
+        // Requests below this one were queued by earlier calls, a failure
+        // here takes back only what this call added
+        int first = list->count;
         status = 0;
         while ((status == 0) && region->next(region, &clip)) {
             intersect(&clip, &bounds, &clip);
-            mdp_blit_req* req = &list.req[list.count];
+            mdp_blit_req* req = &list->req[list->count];
             int flags = 0;
 
             private_handle_t* src_hnd = (private_handle_t*)src->handle;
@@ -477,13 +587,28 @@ static int stretch_copybit(
             if (req->dst_rect.w<=0 || req->dst_rect.h<=0)
                 continue;
 
-            if (++list.count == maxCount) {
-                status = msm_copybit(ctx, &list);
-                list.count = 0;
+            if (++list->count == MAX_BLIT_REQ_COUNT) {
+                pthread_mutex_lock(&ctx->mLock);
+                status = submit_pending(ctx);
+                pthread_mutex_unlock(&ctx->mLock);
+                first = 0;
             }
         }
-        if ((status == 0) && list.count) {
-            status = msm_copybit(ctx, &list);
+        // Framebuffer blits of all layers go out in one MSMFB_BLIT from
+        // flush_get_fence. Anything else, and blits from a converted
+        // source that is freed below, are submitted right away, after
+        // the queued requests so the blending order is kept, and waited
+        // for.
+        if ((status == 0) && (!ctx->mBlitToFB || yv12_handle)) {
+            pthread_mutex_lock(&ctx->mLock);
+            status = submit_pending(ctx);
+            if (status == 0)
+                status = wait_idle(ctx);
+            pthread_mutex_unlock(&ctx->mLock);
+            first = 0;
+        }
+        if (status != 0 && list->count > first) {
+            list->count = first;
         }
     } else {
         ALOGE ("%s : Invalid COPYBIT context", __FUNCTION__);
@@ -506,9 +631,45 @@ static int blit_copybit(
     return stretch_copybit(dev, dst, src, &dr, &sr, region);
 }
 
+/* MSMFB_BLIT has no fence of its own, the returned fence is on the
+ * timeline of the submission thread and signals once every list handed
+ * off so far has completed. -1 when the blits ran inline. */
+static int flush_get_fence_copybit(struct copybit_device_t *dev, int* fd)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    if (!ctx || !fd)
+        return -EINVAL;
+    pthread_mutex_lock(&ctx->mLock);
+    int status = submit_pending(ctx);
+    *fd = -1;
+    if (ctx->mTimelineFd >= 0 && ctx->mSubmitPending) {
+        *fd = sw_sync_fence_create(ctx->mTimelineFd, "copybit",
+                                   ctx->mTimelineValue);
+        if (*fd < 0) {
+            ALOGE("%s: fence creation failed (%s)", __FUNCTION__,
+                  strerror(errno));
+            status = wait_idle(ctx);
+        }
+    }
+    // Errors of earlier hand offs are reported here
+    if (status == 0) {
+        status = ctx->mSubmitStatus;
+        ctx->mSubmitStatus = 0;
+    }
+    pthread_mutex_unlock(&ctx->mLock);
+    return status;
+}
+
 static int finish_copybit(struct copybit_device_t *dev)
 {
-    // NOP for MDP copybit
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    if (!ctx)
+        return -EINVAL;
+    pthread_mutex_lock(&ctx->mLock);
+    int status = submit_pending(ctx);
+    int idle_status = wait_idle(ctx);
+    pthread_mutex_unlock(&ctx->mLock);
+    return status ? status : idle_status;
 }
 
 /*****************************************************************************/
@@ -518,6 +679,18 @@ static int close_copybit(struct hw_device_t *dev)
 {
     struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
     if (ctx) {
+        if (ctx->mFD >= 0)
+            finish_copybit(&ctx->device);
+        if (ctx->mTimelineFd >= 0) {
+            pthread_mutex_lock(&ctx->mLock);
+            ctx->mStop = true;
+            pthread_cond_signal(&ctx->mCond);
+            pthread_mutex_unlock(&ctx->mLock);
+            pthread_join(ctx->mThread, NULL);
+            close(ctx->mTimelineFd);
+        }
+        pthread_cond_destroy(&ctx->mCond);
+        pthread_mutex_destroy(&ctx->mLock);
         close(ctx->mFD);
         free(ctx);
     }
@@ -534,16 +707,21 @@ static int open_copybit(const struct hw_module_t* module, const char* name,
     memset(ctx, 0, sizeof(*ctx));
 
     ctx->device.common.tag = HARDWARE_DEVICE_TAG;
-    ctx->device.common.version = 1;
+    ctx->device.common.version = COPYBIT_DEVICE_API_VERSION_2;
     ctx->device.common.module = const_cast<hw_module_t*>(module);
     ctx->device.common.close = close_copybit;
     ctx->device.set_parameter = set_parameter_copybit;
+    ctx->device.set_parameters = set_parameters_copybit;
     ctx->device.get = get;
     ctx->device.blit = blit_copybit;
     ctx->device.stretch = stretch_copybit;
     ctx->device.finish = finish_copybit;
+    ctx->device.flush_get_fence = flush_get_fence_copybit;
     ctx->mAlpha = MDP_ALPHA_NOP;
     ctx->mFlags = 0;
+    pthread_mutex_init(&ctx->mLock, NULL);
+    pthread_cond_init(&ctx->mCond, NULL);
+    ctx->mTimelineFd = -1;
     ctx->mFD = open("/dev/graphics/fb0", O_RDWR, 0);
     if (ctx->mFD < 0) {
         status = errno;
@@ -567,6 +745,17 @@ static int open_copybit(const struct hw_module_t* module, const char* name,
     }
 
     if (status == 0) {
+        // Without sw_sync the blits stay on the caller's thread
+        ctx->mTimelineFd = sw_sync_timeline_create();
+        if (ctx->mTimelineFd < 0) {
+            ALOGE("%s: no sw_sync timeline, submitting synchronously",
+                  __FUNCTION__);
+        } else if (pthread_create(&ctx->mThread, NULL, submit_thread,
+                                  ctx) != 0) {
+            ALOGE("%s: failed to start the submission thread", __FUNCTION__);
+            close(ctx->mTimelineFd);
+            ctx->mTimelineFd = -1;
+        }
         *device = &ctx->device.common;
     } else {
         close_copybit(&ctx->device.common);
@@ -39,6 +39,16 @@ __BEGIN_DECLS
  */
 #define COPYBIT_HARDWARE_COPYBIT0 "copybit0"
 
+/**
+ * Device versions, reported in hw_device_t.version. Members appended to
+ * copybit_device_t are only present from the version that added them.
+ */
+#define COPYBIT_DEVICE_API_VERSION_1    1
+/* Adds set_parameters */
+#define COPYBIT_DEVICE_API_VERSION_2    2
+/* Adds dump */
+#define COPYBIT_DEVICE_API_VERSION_3    3
+
 /* supported pixel-formats. these must be compatible with
  * graphics/PixelFormat.java, ui/PixelFormat.h, pixelflinger/format.h
  */
@@ -77,6 +87,8 @@ enum {
     COPYBIT_FRAMEBUFFER_WIDTH = 7,
     /* FB height */
     COPYBIT_FRAMEBUFFER_HEIGHT = 8,
+    /* number of parameters, not a parameter */
+    COPYBIT_PARAMETER_COUNT = 9,
 };
 
 /* values for copybit_set_parameter(COPYBIT_TRANSFORM) */
@@ -160,6 +172,14 @@ struct copybit_region_t {
     int (*next)(struct copybit_region_t const *region, struct copybit_rect_t *rect);
 };
 
+/* Parameter block for set_parameters */
+struct copybit_params_t {
+    /* (1 << name) for every parameter set in value */
+    uint32_t mask;
+    /* value of each COPYBIT_xxx parameter, indexed by name */
+    int value[COPYBIT_PARAMETER_COUNT];
+};
+
 /**
  * Every hardware module must have a data structure named HAL_MODULE_INFO_SYM
  * and the fields of this data structure must begin with hw_module_t
@@ -250,9 +270,45 @@ struct copybit_device_t {
     * @return 0 if successful
     */
   int (*flush_get_fence)(struct copybit_device_t *dev, int* fd);
+
+  /**
+    * Set all parameters of a parameter block at once. Equivalent to
+    * set_parameter for each parameter in the block, in name order, but
+    * taking the device lock once and skipping values already set.
+    * Present from COPYBIT_DEVICE_API_VERSION_2.
+    *
+    * @param dev from open
+    * @param params the parameters to change
+    *
+    * @return 0 if successful
+    */
+  int (*set_parameters)(struct copybit_device_t *dev,
+                        struct copybit_params_t const *params);
+
+  /**
+    * Describe the device state for dumpsys. May be NULL. Present from
+    * COPYBIT_DEVICE_API_VERSION_3.
+    *
+    * @param dev from open
+    * @param buff gets the NUL terminated state
+    * @param buff_len size of buff
+    */
+  void (*dump)(struct copybit_device_t *dev, char *buff, int buff_len);
 };
 
 
+/** convenience API for building parameter blocks */
+
+static inline void copybit_params_init(struct copybit_params_t* params) {
+    params->mask = 0;
+}
+
+static inline void copybit_params_set(struct copybit_params_t* params,
+                                      int name, int value) {
+    params->mask |= (1 << name);
+    params->value[name] = value;
+}
+
 /** convenience API for opening and closing a device */
 
 static inline int copybit_open(const struct hw_module_t* module,
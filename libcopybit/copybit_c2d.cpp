@@ -18,12 +18,15 @@
  * limitations under the License.
  */
 #include <cutils/log.h>
+#include <cutils/atomic.h>
 #include <sys/resource.h>
 #include <sys/prctl.h>
+#include <semaphore.h>
 
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <errno.h>
 #include <fcntl.h>
 
@@ -100,14 +103,20 @@ C2D_STATUS (*LINK_c2dCreateFenceFD) ( uint32 target_id, c2d_ts_handle timestamp,
 #endif
 
 // The following defines can be changed as required i.e. as we encounter
-// complex use cases.
-#define MAX_RGB_SURFACES 8        // Max. RGB layers currently supported per draw
-#define MAX_YUV_2_PLANE_SURFACES 4// Max. 2-plane YUV layers currently supported per draw
-#define MAX_YUV_3_PLANE_SURFACES 1// Max. 3-plane YUV layers currently supported per draw
-// +1 for the destination surface. We cannot have multiple destination surfaces.
-#define MAX_SURFACES (MAX_RGB_SURFACES + MAX_YUV_2_PLANE_SURFACES + MAX_YUV_3_PLANE_SURFACES + 1)
+// complex use cases. The surface pools and the blit list grow past these
+// as needed, they are only what is set up when the device is opened.
+#define MAX_RGB_SURFACES 8        // RGB source surfaces created up front
+#define MAX_YUV_2_PLANE_SURFACES 4// 2-plane YUV source surfaces created up front
+#define MAX_YUV_3_PLANE_SURFACES 1// 3-plane YUV source surfaces created up front
 #define NUM_SURFACE_TYPES 3      // RGB_SURFACE + YUV_SURFACE_2_PLANES + YUV_SURFACE_3_PLANES
-#define MAX_BLIT_OBJECT_COUNT 50 // Max. blit objects that can be passed per draw
+#define MAX_BLIT_OBJECT_COUNT 50 // Blit objects allocated up front
+#define MAX_POOL_SURFACES 32     // Surfaces a pool may grow to
+#define GPU_MAP_CACHE_SIZE 32    // GPU mappings kept across draws
+#define DEBUG_GPU_MAP 0
+#define DRAW_QUEUE_DEPTH 3       // Flushed frames tracked by the wait thread
+#define TEMP_POOL_SIZE 6             // Temp. buffers kept across blits,
+                                     // shared by all size classes
+#define TEMP_POOL_MAX_IDLE_MS 2000   // Idle temp. buffers are freed after this
 
 enum {
     RGB_SURFACE,
@@ -129,40 +138,160 @@ enum eC2DFlags {
 static gralloc::IAllocController* sAlloc = 0;
 /******************************************************************************/
 
+/* A GPU mapping of a buffer, kept until the buffer is unmapped by gralloc
+ * or the entry is evicted */
+struct gpu_map_entry {
+    int fd;
+    void *base;
+    int offset;
+    size_t size;
+    uint32 gpuaddr;
+    uint64_t last_use;          // gpu_map_clock at the last lookup
+};
+
+/* A pooled temp. buffer for sources and destinations C2D cannot use
+ * directly */
+struct temp_buffer {
+    alloc_data data;            // data.fd is -1 while the slot is empty
+    bool in_use;                // taken by the current blit
+    int64_t last_use_ms;
+};
+
+/* A flushed frame waiting for the GPU. The flushing thread fills it, the
+ * wait thread owns it from then on until the frame completes. */
+struct pending_draw {
+    void *time_stamp;           // release point of the frame's last flush
+    uint64_t map_clock;         // gpu_map_clock at the flush
+    unsigned int *unmaps;       // GPU addresses to unmap once done
+    int unmap_count;
+    int unmap_size;
+    int64_t submit_us;          // flush time, for the wait latency
+    int32_t frame;              // frame_seq of the flushed frame
+};
+
+/* The definition last loaded into a C2D surface. A surface showing the
+ * same buffer again only patches what changed, or skips the update. */
+struct surface_def {
+    bool valid;
+    int fd;                     // buffer identity
+    int base;
+    int offset;
+    int format;                 // android format
+    int flags;                  // eC2DFlags used for the definition
+    uint32_t width;
+    uint32_t height;
+    uint32 gpuaddr;
+    union {
+        C2D_RGB_SURFACE_DEF rgb;
+        C2D_YUV_SURFACE_DEF yuv;
+    };
+};
+
+/* C2D surfaces of one type. These templates are created to avoid the
+ * expensive create/destroy of C2D surfaces; more are created when a frame
+ * needs them. Surfaces handed out stay reserved until the draws using
+ * them complete. */
+struct surface_pool {
+    C2D_OBJECT_STR *objects;
+    struct surface_def *defs;   // definition loaded into each surface
+    int32_t *frames;            // frame_seq each surface was last drawn in
+    int size;                   // entries allocated in objects
+    int defs_size;              // entries allocated in defs
+    int frames_size;            // entries allocated in frames
+    int capacity;               // surfaces created
+};
+
+/* The destination a run of blit objects is drawn to */
+struct blit_target {
+    int fd;
+    int base;
+    int offset;
+    int format;
+    int width;
+    int height;
+    unsigned int transform;     // target transform without override support
+};
+
+/* A run of the blit list drawn with one LINK_c2dDraw */
+struct blit_segment {
+    struct blit_target key;
+    uint32 surface_id;          // C2D surface of the destination
+    int start;                  // first object in the blit list
+    int count;
+};
+
 /** State information for each device instance */
 struct copybit_context_t {
     struct copybit_device_t device;
-    // Templates for the various source surfaces. These templates are created
-    // to avoid the expensive create/destroy C2D Surfaces
-    C2D_OBJECT_STR blit_rgb_object[MAX_RGB_SURFACES];
-    C2D_OBJECT_STR blit_yuv_2_plane_object[MAX_YUV_2_PLANE_SURFACES];
-    C2D_OBJECT_STR blit_yuv_3_plane_object[MAX_YUV_3_PLANE_SURFACES];
-    C2D_OBJECT_STR blit_list[MAX_BLIT_OBJECT_COUNT]; // Z-ordered list of blit objects
+    struct surface_pool src_pool[NUM_SURFACE_TYPES];
+    struct surface_pool dst_pool[NUM_SURFACE_TYPES];
+    C2D_OBJECT_STR *blit_list;  // Z-ordered list of blit objects
+    int blit_list_size;
+    struct blit_segment *segments; // blit list runs, one per destination
+    int segment_count;
+    int segment_list_size;
+    uint32 last_target;         // destination of the last draw
+    int frame_draws;            // LINK_c2dDraw calls this frame
+    // Surfaces are tagged with the frame they are drawn in. Frames before
+    // done_frame are complete, so their surfaces can be handed out again.
+    int32_t frame_seq;          // frame the queued blits belong to
+    volatile int32_t done_frame;
+    int frame_finishes;         // early draw-finishes this frame
     C2D_DRIVER_INFO c2d_driver_info;
     void *libc2d2;
-    alloc_data temp_src_buffer;
-    alloc_data temp_dst_buffer;
-    unsigned int dst[NUM_SURFACE_TYPES]; // dst surfaces
-    unsigned int mapped_gpu_addr[MAX_SURFACES]; // GPU addresses mapped inside copybit
-    int blit_rgb_count;         // Total RGB surfaces being blit
-    int blit_yuv_2_plane_count; // Total 2 plane YUV surfaces being
-    int blit_yuv_3_plane_count; // Total 3 plane YUV  surfaces being blit
+    temp_buffer temp_pool[TEMP_POOL_SIZE];
+    convert_fence_t temp_src_convert; // pending copy into the temp. source
+    // Handles describing the temp. buffers, reused by every blit
+    private_handle_t *temp_src_hnd;
+    private_handle_t *temp_dst_hnd;
+    // GPU addresses to unmap once the pending draw completes
+    unsigned int *mapped_gpu_addr;
+    int mapped_gpu_count;
+    int mapped_gpu_size;
+    // GPU mappings made inside copybit, reused across draws. Entries used
+    // at or after gpu_map_busy_clock may be referenced by a pending draw.
+    struct gpu_map_entry gpu_map_cache[GPU_MAP_CACHE_SIZE];
+    uint64_t gpu_map_clock;
+    uint64_t gpu_map_busy_clock;
+    unsigned int gpu_map_hits;
+    unsigned int gpu_map_misses;
+    pthread_mutex_t gpu_map_lock; // guards the cache and mapped_gpu_addr
     int blit_count;             // Total blit objects.
     unsigned int trg_transform;      /* target transform */
     int fb_width;
     int fb_height;
     int src_global_alpha;
     int config_mask;
-    int dst_surface_type;
+    struct copybit_params_t params; // parameters applied since the last blit
     bool is_premultiplied_alpha;
-    void* time_stamp;
 
-    // used for signaling the wait thread
-    bool wait_timestamp;
+    volatile int32_t temp_pool_held; // temp. buffers allocated in the pool
+
+    // Frames flushed and not yet known to be complete. The flushing thread
+    // fills draw_queue[draw_head], the wait thread retires
+    // draw_queue[draw_tail]; draw_free and draw_pending count the slots.
+    struct pending_draw draw_queue[DRAW_QUEUE_DEPTH];
+    volatile int32_t draw_head;
+    volatile int32_t draw_tail;
+    sem_t draw_free;
+    int draw_pending;           // under draw_lock
+    pthread_mutex_t draw_lock;
+    pthread_cond_t draw_cond;   // on CLOCK_MONOTONIC, signals draw_pending
+    // Completion statistics for the dump
+    int32_t draws_max_in_flight;
+    unsigned int draws_retired;
+    int64_t draws_wait_total_us;
+    int64_t draws_wait_max_us;
+    // Draw statistics of the flushed frames for the dump
+    unsigned int stats_frames;
+    unsigned int stats_draws;
+    unsigned int stats_finishes;
+    int last_frame_draws;
+    int last_frame_finishes;
+    int max_frame_draws;
     pthread_t wait_thread_id;
     bool stop_thread;
-    pthread_mutex_t wait_cleanup_lock;
-    pthread_cond_t wait_cleanup_cond;
+    pthread_mutex_t wait_cleanup_lock; // serializes parameters and flushes
 
 };
 
@@ -186,6 +315,8 @@ struct yuvPlaneInfo {
 
 static int open_copybit(const struct hw_module_t* module, const char* name,
                         struct hw_device_t** device);
+static void put_temp_buffers(copybit_context_t *ctx);
+static void trim_temp_buffers(copybit_context_t *ctx);
 
 static struct hw_module_methods_t copybit_module_methods = {
 open:  open_copybit
@@ -207,40 +338,347 @@ tag: HARDWARE_MODULE_TAG,
 };
 
 
-/* thread function which waits on the timeStamp and cleans up the surfaces */
+/* Make room for needed elements in a growable array */
+static bool grow_array(void **array, int *size, int needed, size_t elem_size)
+{
+    if (needed <= *size)
+        return true;
+    int new_size = *size ? *size : 8;
+    while (new_size < needed)
+        new_size *= 2;
+    void *grown = realloc(*array, new_size * elem_size);
+    if (!grown) {
+        ALOGE("%s: out of memory growing to %d", __FUNCTION__, new_size);
+        return false;
+    }
+    memset((char *)grown + *size * elem_size, 0,
+           (new_size - *size) * elem_size);
+    *array = grown;
+    *size = new_size;
+    return true;
+}
+
+/* Queue a GPU address to be unmapped once the pending draw completes,
+ * called with gpu_map_lock held */
+static void defer_unmap(copybit_context_t* ctx, uint32 gpuaddr)
+{
+    if (!grow_array((void **)&ctx->mapped_gpu_addr, &ctx->mapped_gpu_size,
+                    ctx->mapped_gpu_count + 1, sizeof(unsigned int))) {
+        ALOGE("%s: no deferred unmap slot, unmapping now", __FUNCTION__);
+        LINK_c2dUnMapAddr((void*)gpuaddr);
+        return;
+    }
+    ctx->mapped_gpu_addr[ctx->mapped_gpu_count++] = gpuaddr;
+}
+
+/* Drop a cache entry, keeping its mapping alive if a pending draw
+ * may still use it. Called with gpu_map_lock held */
+static void gpu_map_evict(copybit_context_t* ctx, gpu_map_entry *entry)
+{
+    if (entry->last_use >= ctx->gpu_map_busy_clock)
+        defer_unmap(ctx, entry->gpuaddr);
+    else
+        LINK_c2dUnMapAddr((void*)entry->gpuaddr);
+    memset(entry, 0, sizeof(*entry));
+}
+
+/* Called once every draw flushed up to clock has completed */
+static void gpu_map_draw_done(copybit_context_t* ctx, uint64_t clock)
+{
+    pthread_mutex_lock(&ctx->gpu_map_lock);
+    for (int i = 0; i < ctx->mapped_gpu_count; i++) {
+        if (ctx->mapped_gpu_addr[i]) {
+            LINK_c2dUnMapAddr( (void*)ctx->mapped_gpu_addr[i]);
+            ctx->mapped_gpu_addr[i] = 0;
+        }
+    }
+    ctx->mapped_gpu_count = 0;
+    if (clock > ctx->gpu_map_busy_clock)
+        ctx->gpu_map_busy_clock = clock;
+    pthread_mutex_unlock(&ctx->gpu_map_lock);
+}
+
+/* gralloc unmap listener. The buffer at base is going away, so the cached
+ * mapping must not be found by a later buffer reusing the address. */
+static void gpu_map_invalidate(void *cookie, void *base, size_t size)
+{
+    copybit_context_t* ctx = (copybit_context_t*)cookie;
+    uintptr_t start = (uintptr_t)base;
+    pthread_mutex_lock(&ctx->gpu_map_lock);
+    for (int i = 0; i < GPU_MAP_CACHE_SIZE; i++) {
+        gpu_map_entry *entry = &ctx->gpu_map_cache[i];
+        uintptr_t addr = (uintptr_t)entry->base;
+        if (entry->gpuaddr && addr >= start && addr < start + size)
+            gpu_map_evict(ctx, entry);
+    }
+    pthread_mutex_unlock(&ctx->gpu_map_lock);
+}
+
+/* Create a C2D surface of the given type, its contents are set with
+ * LINK_c2dUpdateSurface before every use */
+static int create_surface(int type, uint32 *surface_id)
+{
+    C2D_RGB_SURFACE_DEF surfDefinition = {0};
+    C2D_YUV_SURFACE_DEF yuvSurfaceDef = {0};
+    void *surface_def;
+    int surface_type;
+
+    if (type == RGB_SURFACE) {
+        surfDefinition.buffer = (void*)0xdddddddd;
+        surfDefinition.phys = (void*)0xdddddddd;
+        surfDefinition.stride = 1 * 4;
+        surfDefinition.width = 1;
+        surfDefinition.height = 1;
+        surfDefinition.format = C2D_COLOR_FORMAT_8888_ARGB;
+        surface_def = &surfDefinition;
+        surface_type = C2D_SURFACE_RGB_HOST;
+    } else {
+        yuvSurfaceDef.format = C2D_COLOR_FORMAT_420_NV12;
+        yuvSurfaceDef.width = 4;
+        yuvSurfaceDef.height = 4;
+        yuvSurfaceDef.plane0 = (void*)0xaaaaaaaa;
+        yuvSurfaceDef.phys0 = (void*) 0xaaaaaaaa;
+        yuvSurfaceDef.stride0 = 4;
+
+        yuvSurfaceDef.plane1 = (void*)0xaaaaaaaa;
+        yuvSurfaceDef.phys1 = (void*) 0xaaaaaaaa;
+        yuvSurfaceDef.stride1 = 4;
+        if (type == YUV_SURFACE_3_PLANES) {
+            yuvSurfaceDef.format = C2D_COLOR_FORMAT_420_YV12;
+            yuvSurfaceDef.plane2 = (void*)0xaaaaaaaa;
+            yuvSurfaceDef.phys2 = (void*) 0xaaaaaaaa;
+            yuvSurfaceDef.stride2 = 4;
+        }
+        surface_def = &yuvSurfaceDef;
+        surface_type = C2D_SURFACE_YUV_HOST;
+    }
+
+    if (LINK_c2dCreateSurface(surface_id, C2D_TARGET | C2D_SOURCE,
+                              (C2D_SURFACE_TYPE)(surface_type |
+                                                 C2D_SURFACE_WITH_PHYS |
+                                                 C2D_SURFACE_WITH_PHYS_DUMMY),
+                              surface_def)) {
+        ALOGE("%s: create surface of type %d failed", __FUNCTION__, type);
+        *surface_id = 0;
+        return COPYBIT_FAILURE;
+    }
+    return COPYBIT_SUCCESS;
+}
+
+/* Add a surface to the pool */
+static int add_surface(struct surface_pool *pool, int type)
+{
+    if (!grow_array((void **)&pool->objects, &pool->size, pool->capacity + 1,
+                    sizeof(C2D_OBJECT_STR)) ||
+        !grow_array((void **)&pool->defs, &pool->defs_size, pool->capacity + 1,
+                    sizeof(struct surface_def)) ||
+        !grow_array((void **)&pool->frames, &pool->frames_size,
+                    pool->capacity + 1, sizeof(int32_t)))
+        return COPYBIT_FAILURE;
+    uint32 surface_id = 0;
+    if (create_surface(type, &surface_id) != COPYBIT_SUCCESS)
+        return COPYBIT_FAILURE;
+    pool->objects[pool->capacity].surface_id = surface_id;
+    pool->frames[pool->capacity] = 0;
+    pool->capacity++;
+    return COPYBIT_SUCCESS;
+}
+
+/* Index of a surface no queued or flushed draw holds, or -1. Scanning from
+ * the start keeps giving the same surfaces to the same layers, which lets
+ * their definitions be reused. */
+static int find_free_surface(copybit_context_t* ctx, struct surface_pool *pool)
+{
+    int32_t done = android_atomic_acquire_load(&ctx->done_frame);
+    for (int i = 0; i < pool->capacity; i++) {
+        if ((int32_t)(pool->frames[i] - done) < 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Index of a free surface of the pool, creating one while the pool is below
+ * MAX_POOL_SURFACES. Returns -1 if every surface is held. */
+static int reserve_surface(copybit_context_t* ctx, struct surface_pool *pool,
+                           int type)
+{
+    int index = find_free_surface(ctx, pool);
+    if (index >= 0)
+        return index;
+    if (pool->capacity >= MAX_POOL_SURFACES ||
+        add_surface(pool, type) != COPYBIT_SUCCESS)
+        return -1;
+    return pool->capacity - 1;
+}
+
+/* True if some pool is at MAX_POOL_SURFACES and draws hold all of it */
+static bool surfaces_exhausted(copybit_context_t* ctx)
+{
+    for (int i = 0; i < NUM_SURFACE_TYPES; i++) {
+        if ((ctx->src_pool[i].capacity >= MAX_POOL_SURFACES &&
+             find_free_surface(ctx, &ctx->src_pool[i]) < 0) ||
+            (ctx->dst_pool[i].capacity >= MAX_POOL_SURFACES &&
+             find_free_surface(ctx, &ctx->dst_pool[i]) < 0))
+            return true;
+    }
+    return false;
+}
+
+/* Mark the frames up to frame complete. Called with gpu_map_lock held. */
+static void set_done_frame(copybit_context_t* ctx, int32_t frame)
+{
+    if ((int32_t)(frame + 1 - ctx->done_frame) > 0)
+        android_atomic_release_store(frame + 1, &ctx->done_frame);
+}
+
+static void destroy_surface_pool(struct surface_pool *pool)
+{
+    for (int i = 0; i < pool->capacity; i++) {
+        if (pool->objects[i].surface_id)
+            LINK_c2dDestroySurface(pool->objects[i].surface_id);
+    }
+    free(pool->objects);
+    free(pool->defs);
+    free(pool->frames);
+    pool->objects = NULL;
+    pool->defs = NULL;
+    pool->frames = NULL;
+    pool->size = 0;
+    pool->defs_size = 0;
+    pool->frames_size = 0;
+    pool->capacity = 0;
+}
+
+static int64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Frames flushed and not yet retired by the wait thread */
+static int draws_in_flight(copybit_context_t* ctx)
+{
+    return android_atomic_acquire_load(&ctx->draw_head) -
+           android_atomic_acquire_load(&ctx->draw_tail);
+}
+
+/* Release what a completed frame was holding on to */
+static void retire_draw(copybit_context_t* ctx, struct pending_draw *draw)
+{
+    pthread_mutex_lock(&ctx->gpu_map_lock);
+    for (int i = 0; i < draw->unmap_count; i++) {
+        if (draw->unmaps[i])
+            LINK_c2dUnMapAddr((void*)draw->unmaps[i]);
+    }
+    draw->unmap_count = 0;
+    if (draw->map_clock > ctx->gpu_map_busy_clock)
+        ctx->gpu_map_busy_clock = draw->map_clock;
+    // Hand the frame's surfaces out again
+    set_done_frame(ctx, draw->frame);
+    pthread_mutex_unlock(&ctx->gpu_map_lock);
+}
+
+/* Wait on cond until the CLOCK_MONOTONIC time deadline, the condition
+ * was set up for that clock where the platform needs it */
+static int cond_timedwait_monotonic(pthread_cond_t *cond, pthread_mutex_t *lock,
+                                    const struct timespec *deadline)
+{
+#if defined(HAVE_PTHREAD_COND_TIMEDWAIT_MONOTONIC)
+    return pthread_cond_timedwait_monotonic_np(cond, lock, deadline);
+#else
+    return pthread_cond_timedwait(cond, lock, deadline);
+#endif
+}
+
+static void init_draw_cond(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#if !defined(HAVE_PTHREAD_COND_TIMEDWAIT_MONOTONIC)
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/* Hand a flushed frame, or the stop request, to the wait thread */
+static void post_draw(copybit_context_t* ctx)
+{
+    pthread_mutex_lock(&ctx->draw_lock);
+    ctx->draw_pending++;
+    pthread_cond_signal(&ctx->draw_cond);
+    pthread_mutex_unlock(&ctx->draw_lock);
+}
+
+/* Wait for a posted frame. The wait only times out while the temp. pool
+ * holds buffers, then it returns false once nothing was flushed for
+ * TEMP_POOL_MAX_IDLE_MS. An idle device with an empty pool sleeps. */
+static bool wait_draw(copybit_context_t* ctx)
+{
+    bool posted = true;
+    pthread_mutex_lock(&ctx->draw_lock);
+    while (!ctx->draw_pending) {
+        if (!android_atomic_acquire_load(&ctx->temp_pool_held)) {
+            pthread_cond_wait(&ctx->draw_cond, &ctx->draw_lock);
+            continue;
+        }
+        struct timespec idle;
+        clock_gettime(CLOCK_MONOTONIC, &idle);
+        idle.tv_sec += TEMP_POOL_MAX_IDLE_MS / 1000;
+        idle.tv_nsec += (TEMP_POOL_MAX_IDLE_MS % 1000) * 1000000;
+        if (idle.tv_nsec >= 1000000000) {
+            idle.tv_sec++;
+            idle.tv_nsec -= 1000000000;
+        }
+        if (cond_timedwait_monotonic(&ctx->draw_cond, &ctx->draw_lock,
+                                     &idle) == ETIMEDOUT &&
+            !ctx->draw_pending) {
+            posted = false;
+            break;
+        }
+    }
+    if (posted)
+        ctx->draw_pending--;
+    pthread_mutex_unlock(&ctx->draw_lock);
+    return posted;
+}
+
+/* thread function which waits on the flushed frames in order and cleans
+ * up after them */
 static void* c2d_wait_loop(void* ptr) {
     copybit_context_t* ctx = (copybit_context_t*)(ptr);
     char thread_name[64] = "copybitWaitThr";
     prctl(PR_SET_NAME, (unsigned long) &thread_name, 0, 0, 0);
     setpriority(PRIO_PROCESS, 0, HAL_PRIORITY_URGENT_DISPLAY);
 
-    while(ctx->stop_thread == false) {
-        pthread_mutex_lock(&ctx->wait_cleanup_lock);
-        while(ctx->wait_timestamp == false && !ctx->stop_thread) {
-            pthread_cond_wait(&(ctx->wait_cleanup_cond),
-                              &(ctx->wait_cleanup_lock));
+    while(true) {
+        if (!wait_draw(ctx)) {
+            // Nothing was flushed for a while, release idle temp. buffers
+            trim_temp_buffers(ctx);
+            continue;
         }
-        if(ctx->wait_timestamp) {
-            if(LINK_c2dWaitTimestamp(ctx->time_stamp)) {
-                ALOGE("%s: LINK_c2dWaitTimeStamp ERROR!!", __FUNCTION__);
-            }
-            ctx->wait_timestamp = false;
-            // Unmap any mapped addresses.
-            for (int i = 0; i < MAX_SURFACES; i++) {
-                if (ctx->mapped_gpu_addr[i]) {
-                    LINK_c2dUnMapAddr( (void*)ctx->mapped_gpu_addr[i]);
-                    ctx->mapped_gpu_addr[i] = 0;
-                }
-            }
-            // Reset the counts after the draw.
-            ctx->blit_rgb_count = 0;
-            ctx->blit_yuv_2_plane_count = 0;
-            ctx->blit_yuv_3_plane_count = 0;
-            ctx->blit_count = 0;
+        // Only this thread moves the tail
+        int32_t tail = ctx->draw_tail;
+        if (android_atomic_acquire_load(&ctx->draw_head) == tail) {
+            // Woken without a frame, only done to stop the thread
+            if(ctx->stop_thread)
+                break;
+            continue;
         }
-        pthread_mutex_unlock(&ctx->wait_cleanup_lock);
-        if(ctx->stop_thread)
-            break;
+        struct pending_draw *draw = &ctx->draw_queue[tail % DRAW_QUEUE_DEPTH];
+        if(LINK_c2dWaitTimestamp(draw->time_stamp)) {
+            ALOGE("%s: LINK_c2dWaitTimeStamp ERROR!!", __FUNCTION__);
+        }
+        int64_t latency = now_us() - draw->submit_us;
+        ctx->draws_wait_total_us += latency;
+        if (latency > ctx->draws_wait_max_us)
+            ctx->draws_wait_max_us = latency;
+        ctx->draws_retired++;
+        // Unmap addresses the completed draw was holding on to.
+        retire_draw(ctx, draw);
+        android_atomic_release_store(tail + 1, &ctx->draw_tail);
+        sem_post(&ctx->draw_free);
     }
     pthread_exit(NULL);
     return NULL;
@@ -349,23 +787,74 @@ static uint32 c2d_get_gpuaddr(copybit_context_t* ctx, struct private_handle_t *h
         return 0;
     }
 
+    // Entries are keyed on fd, base, offset and size. They are dropped by
+    // the gralloc unmap listener, which runs before the fd is closed and
+    // the address is reused. Only ION buffers mapped into this process
+    // report their unmap, other buffers are mapped for one frame.
+    bool cacheable = (handle->flags & private_handle_t::PRIV_FLAGS_USES_ION) &&
+                     !(handle->flags & private_handle_t::PRIV_FLAGS_SECURE_BUFFER) &&
+                     handle->base;
+
+    pthread_mutex_lock(&ctx->gpu_map_lock);
+    uint64_t now = ++ctx->gpu_map_clock;
+
+    // Look for a mapping made for the same buffer by an earlier draw
+    gpu_map_entry *victim = NULL;
+    for (int i = 0; cacheable && i < GPU_MAP_CACHE_SIZE; i++) {
+        gpu_map_entry *entry = &ctx->gpu_map_cache[i];
+        if (entry->gpuaddr && entry->fd == handle->fd &&
+            entry->base == (void*)handle->base &&
+            entry->offset == handle->offset &&
+            entry->size == (size_t)handle->size) {
+            entry->last_use = now;
+            ctx->gpu_map_hits++;
+            pthread_mutex_unlock(&ctx->gpu_map_lock);
+            return entry->gpuaddr;
+        }
+        if (!victim || entry->last_use < victim->last_use)
+            victim = entry;
+    }
+    ctx->gpu_map_misses++;
+
     rc = LINK_c2dMapAddr(handle->fd, (void*)handle->base, handle->size,
                                       handle->offset, memtype, (void**)&gpuaddr);
 
-    if (rc == C2D_STATUS_OK) {
-        // We have mapped the GPU address inside copybit. We need to unmap this
-        // address after the blit. Store this address
-        for (int i = 0; i < MAX_SURFACES; i++) {
-            if (ctx->mapped_gpu_addr[i] == 0) {
-                ctx->mapped_gpu_addr[i] = (uint32) gpuaddr;
-                mapped_idx = i;
-                break;
-            }
-        }
+    if (rc != C2D_STATUS_OK) {
+        pthread_mutex_unlock(&ctx->gpu_map_lock);
+        return 0;
+    }
 
+    if (!cacheable) {
+        // Unmapped once the frame's draw completes
+        if (!grow_array((void **)&ctx->mapped_gpu_addr, &ctx->mapped_gpu_size,
+                        ctx->mapped_gpu_count + 1, sizeof(unsigned int))) {
+            LINK_c2dUnMapAddr((void*)gpuaddr);
+            pthread_mutex_unlock(&ctx->gpu_map_lock);
+            return 0;
+        }
+        mapped_idx = ctx->mapped_gpu_count;
+        ctx->mapped_gpu_addr[ctx->mapped_gpu_count++] = (uint32) gpuaddr;
+        pthread_mutex_unlock(&ctx->gpu_map_lock);
         return (uint32) gpuaddr;
     }
-    return 0;
+
+    if (victim->gpuaddr) {
+        ALOGD_IF(DEBUG_GPU_MAP, "%s: evicting 0x%x hits=%u misses=%u",
+                 __FUNCTION__, victim->gpuaddr, ctx->gpu_map_hits,
+                 ctx->gpu_map_misses);
+        gpu_map_evict(ctx, victim);
+    }
+    victim->fd = handle->fd;
+    victim->base = (void*)handle->base;
+    victim->offset = handle->offset;
+    victim->size = handle->size;
+    victim->gpuaddr = (uint32) gpuaddr;
+    victim->last_use = now;
+    pthread_mutex_unlock(&ctx->gpu_map_lock);
+
+    // The cache owns the mapping, there is nothing to unmap per draw
+    mapped_idx = -1;
+    return (uint32) gpuaddr;
 }
 
 static void unmap_gpuaddr(copybit_context_t* ctx, int mapped_idx)
@@ -373,10 +862,12 @@ static void unmap_gpuaddr(copybit_context_t* ctx, int mapped_idx)
     if (!ctx || (mapped_idx == -1))
         return;
 
+    pthread_mutex_lock(&ctx->gpu_map_lock);
     if (ctx->mapped_gpu_addr[mapped_idx]) {
         LINK_c2dUnMapAddr( (void*)ctx->mapped_gpu_addr[mapped_idx]);
         ctx->mapped_gpu_addr[mapped_idx] = 0;
     }
+    pthread_mutex_unlock(&ctx->gpu_map_lock);
 }
 
 static int is_supported_rgb_format(int format)
@@ -426,15 +917,6 @@ static int is_supported_yuv_format(int format)
     }
 }
 
-static int is_valid_destination_format(int format)
-{
-    if (format == HAL_PIXEL_FORMAT_YCbCr_420_SP_TILED) {
-        // C2D does not support NV12Tile as a destination format.
-        return COPYBIT_FAILURE;
-    }
-    return COPYBIT_SUCCESS;
-}
-
 static int calculate_yuv_offset_and_stride(const bufferInfo& info,
                                            yuvPlaneInfo& yuvInfo)
 {
@@ -482,15 +964,22 @@ static int calculate_yuv_offset_and_stride(const bufferInfo& info,
 /** create C2D surface from copybit image */
 static int set_image(copybit_context_t* ctx, uint32 surfaceId,
                       const struct copybit_image_t *rhs,
-                      const eC2DFlags flags, int &mapped_idx)
+                      const eC2DFlags flags, int &mapped_idx,
+                      struct surface_def *def = NULL)
 {
     struct private_handle_t* handle = (struct private_handle_t*)rhs->handle;
     C2D_SURFACE_TYPE surfaceType;
     int status = COPYBIT_SUCCESS;
     uint32 gpuaddr = 0;
     int c2d_format;
+    struct surface_def local_def;
     mapped_idx = -1;
 
+    if (!def) {
+        def = &local_def;
+        def->valid = false;
+    }
+
     if (flags & FLAGS_YUV_DESTINATION) {
         c2d_format = get_c2d_format_for_yuv_destination(rhs->format);
     } else {
@@ -517,64 +1006,89 @@ static int set_image(copybit_context_t* ctx, uint32 surfaceId,
         gpuaddr = handle->gpuaddr;
     }
 
+    bool same_buffer = def->valid && def->fd == handle->fd &&
+                       def->base == handle->base &&
+                       def->offset == handle->offset &&
+                       def->format == rhs->format && def->flags == flags;
+    bool same_size = same_buffer && def->width == rhs->w &&
+                     def->height == rhs->h;
+    if (same_size && def->gpuaddr == gpuaddr) {
+        // The surface still holds this definition
+        return COPYBIT_SUCCESS;
+    }
+    def->valid = false;
+
     /* create C2D surface */
     if(is_supported_rgb_format(rhs->format) == COPYBIT_SUCCESS) {
         /* RGB */
-        C2D_RGB_SURFACE_DEF surfaceDef;
+        C2D_RGB_SURFACE_DEF *surfaceDef = &def->rgb;
 
         surfaceType = (C2D_SURFACE_TYPE) (C2D_SURFACE_RGB_HOST | C2D_SURFACE_WITH_PHYS);
 
-        surfaceDef.phys = (void*) gpuaddr;
-        surfaceDef.buffer = (void*) (handle->base);
-
-        surfaceDef.format = c2d_format |
-            ((flags & FLAGS_PREMULTIPLIED_ALPHA) ? C2D_FORMAT_PREMULTIPLIED : 0);
-        surfaceDef.width = rhs->w;
-        surfaceDef.height = rhs->h;
-        int aligned_width = ALIGN(surfaceDef.width,32);
-        surfaceDef.stride = (aligned_width * c2diGetBpp(surfaceDef.format))>>3;
+        surfaceDef->phys = (void*) gpuaddr;
+        if (!same_size) {
+            surfaceDef->buffer = (void*) (handle->base);
+            surfaceDef->format = c2d_format |
+                ((flags & FLAGS_PREMULTIPLIED_ALPHA) ? C2D_FORMAT_PREMULTIPLIED : 0);
+            surfaceDef->width = rhs->w;
+            surfaceDef->height = rhs->h;
+            int aligned_width = ALIGN(surfaceDef->width,32);
+            surfaceDef->stride = (aligned_width * c2diGetBpp(surfaceDef->format))>>3;
+        }
 
         if(LINK_c2dUpdateSurface( surfaceId,C2D_TARGET | C2D_SOURCE, surfaceType,
-                                  &surfaceDef)) {
+                                  surfaceDef)) {
             ALOGE("%s: RGB Surface c2dUpdateSurface ERROR", __FUNCTION__);
             unmap_gpuaddr(ctx, mapped_idx);
             status = COPYBIT_FAILURE;
         }
     } else if (is_supported_yuv_format(rhs->format) == COPYBIT_SUCCESS) {
-        C2D_YUV_SURFACE_DEF surfaceDef;
-        memset(&surfaceDef, 0, sizeof(surfaceDef));
+        C2D_YUV_SURFACE_DEF *surfaceDef = &def->yuv;
         surfaceType = (C2D_SURFACE_TYPE)(C2D_SURFACE_YUV_HOST | C2D_SURFACE_WITH_PHYS);
-        surfaceDef.format = c2d_format;
-
-        bufferInfo info;
-        info.width = rhs->w;
-        info.height = rhs->h;
-        info.format = rhs->format;
 
-        yuvPlaneInfo yuvInfo = {0};
-        status = calculate_yuv_offset_and_stride(info, yuvInfo);
-        if(status != COPYBIT_SUCCESS) {
-            ALOGE("%s: calculate_yuv_offset_and_stride error", __FUNCTION__);
-            unmap_gpuaddr(ctx, mapped_idx);
-        }
+        if (same_size) {
+            // Only the mapping moved, keep the plane layout
+            uint32 plane1_offset = (uint32)surfaceDef->phys1 - def->gpuaddr;
+            uint32 plane2_offset = (uint32)surfaceDef->phys2 - def->gpuaddr;
+            surfaceDef->phys0 = (void*) (gpuaddr);
+            surfaceDef->phys1 = (void*) (gpuaddr + plane1_offset);
+            if (3 == get_num_planes(rhs->format))
+                surfaceDef->phys2 = (void*) (gpuaddr + plane2_offset);
+        } else {
+            memset(surfaceDef, 0, sizeof(*surfaceDef));
+            surfaceDef->format = c2d_format;
+
+            bufferInfo info;
+            info.width = rhs->w;
+            info.height = rhs->h;
+            info.format = rhs->format;
+
+            yuvPlaneInfo yuvInfo = {0};
+            status = calculate_yuv_offset_and_stride(info, yuvInfo);
+            if(status != COPYBIT_SUCCESS) {
+                ALOGE("%s: calculate_yuv_offset_and_stride error", __FUNCTION__);
+                unmap_gpuaddr(ctx, mapped_idx);
+                return status;
+            }
 
-        surfaceDef.width = rhs->w;
-        surfaceDef.height = rhs->h;
-        surfaceDef.plane0 = (void*) (handle->base);
-        surfaceDef.phys0 = (void*) (gpuaddr);
-        surfaceDef.stride0 = yuvInfo.yStride;
-
-        surfaceDef.plane1 = (void*) (handle->base + yuvInfo.plane1_offset);
-        surfaceDef.phys1 = (void*) (gpuaddr + yuvInfo.plane1_offset);
-        surfaceDef.stride1 = yuvInfo.plane1_stride;
-        if (3 == get_num_planes(rhs->format)) {
-            surfaceDef.plane2 = (void*) (handle->base + yuvInfo.plane2_offset);
-            surfaceDef.phys2 = (void*) (gpuaddr + yuvInfo.plane2_offset);
-            surfaceDef.stride2 = yuvInfo.plane2_stride;
+            surfaceDef->width = rhs->w;
+            surfaceDef->height = rhs->h;
+            surfaceDef->plane0 = (void*) (handle->base);
+            surfaceDef->phys0 = (void*) (gpuaddr);
+            surfaceDef->stride0 = yuvInfo.yStride;
+
+            surfaceDef->plane1 = (void*) (handle->base + yuvInfo.plane1_offset);
+            surfaceDef->phys1 = (void*) (gpuaddr + yuvInfo.plane1_offset);
+            surfaceDef->stride1 = yuvInfo.plane1_stride;
+            if (3 == get_num_planes(rhs->format)) {
+                surfaceDef->plane2 = (void*) (handle->base + yuvInfo.plane2_offset);
+                surfaceDef->phys2 = (void*) (gpuaddr + yuvInfo.plane2_offset);
+                surfaceDef->stride2 = yuvInfo.plane2_stride;
+            }
         }
 
         if(LINK_c2dUpdateSurface( surfaceId,C2D_TARGET | C2D_SOURCE, surfaceType,
-                                  &surfaceDef)) {
+                                  surfaceDef)) {
             ALOGE("%s: YUV Surface c2dUpdateSurface ERROR", __FUNCTION__);
             unmap_gpuaddr(ctx, mapped_idx);
             status = COPYBIT_FAILURE;
@@ -585,36 +1099,59 @@ static int set_image(copybit_context_t* ctx, uint32 surfaceId,
         status = COPYBIT_FAILURE;
     }
 
+    if (status == COPYBIT_SUCCESS) {
+        def->valid = true;
+        def->fd = handle->fd;
+        def->base = handle->base;
+        def->offset = handle->offset;
+        def->format = rhs->format;
+        def->flags = flags;
+        def->width = rhs->w;
+        def->height = rhs->h;
+        def->gpuaddr = gpuaddr;
+    }
     return status;
 }
 
-/** copy the bits */
-static int msm_copybit(struct copybit_context_t *ctx, unsigned int target)
+/** copy the bits, one draw per destination in the blit list */
+static int msm_copybit(struct copybit_context_t *ctx)
 {
+    int status = COPYBIT_SUCCESS;
     if (ctx->blit_count == 0) {
         return COPYBIT_SUCCESS;
     }
 
-    for (int i = 0; i < ctx->blit_count; i++)
-    {
-        ctx->blit_list[i].next = &(ctx->blit_list[i+1]);
-    }
-    ctx->blit_list[ctx->blit_count-1].next = NULL;
-    uint32_t target_transform = ctx->trg_transform;
-    if (ctx->c2d_driver_info.capabilities_mask &
-        C2D_DRIVER_SUPPORTS_OVERRIDE_TARGET_ROTATE_OP) {
-        // For A3xx - set 0x0 as the transform is set in the config_mask
-        target_transform = 0x0;
-    }
-    if(LINK_c2dDraw(target, target_transform, 0x0, 0, 0, ctx->blit_list,
-                    ctx->blit_count)) {
-        ALOGE("%s: LINK_c2dDraw ERROR", __FUNCTION__);
-        return COPYBIT_FAILURE;
+    for (int i = 0; i < ctx->segment_count; i++) {
+        struct blit_segment *segment = &ctx->segments[i];
+        if (segment->count == 0)
+            continue;
+        C2D_OBJECT_STR *list = &ctx->blit_list[segment->start];
+        for (int j = 0; j < segment->count - 1; j++)
+        {
+            list[j].next = &(list[j+1]);
+        }
+        list[segment->count-1].next = NULL;
+        if(LINK_c2dDraw(segment->surface_id, segment->key.transform, 0x0, 0, 0,
+                        list, segment->count)) {
+            ALOGE("%s: LINK_c2dDraw ERROR", __FUNCTION__);
+            status = COPYBIT_FAILURE;
+        }
+        ctx->last_target = segment->surface_id;
+        ctx->frame_draws++;
     }
-    return COPYBIT_SUCCESS;
+    // The surfaces stay reserved until the draws complete
+    ctx->blit_count = 0;
+    ctx->segment_count = 0;
+    return status;
 }
 
-
+/* Destination surface to flush or finish when nothing was drawn */
+static uint32 current_target(struct copybit_context_t *ctx)
+{
+    if (ctx->last_target)
+        return ctx->last_target;
+    return ctx->dst_pool[RGB_SURFACE].objects[0].surface_id;
+}
 
 static int flush_get_fence_copybit (struct copybit_device_t *dev, int* fd)
 {
@@ -622,24 +1159,75 @@ static int flush_get_fence_copybit (struct copybit_device_t *dev, int* fd)
     int status = COPYBIT_FAILURE;
     if (!ctx)
         return COPYBIT_FAILURE;
+    // Wait for a free queue slot, at most DRAW_QUEUE_DEPTH frames are
+    // in flight
+    while (sem_wait(&ctx->draw_free) && errno == EINTR);
     pthread_mutex_lock(&ctx->wait_cleanup_lock);
-    status = msm_copybit(ctx, ctx->dst[ctx->dst_surface_type]);
-
-    if(LINK_c2dFlush(ctx->dst[ctx->dst_surface_type], &ctx->time_stamp)) {
+    int32_t head = ctx->draw_head;
+    struct pending_draw *draw = &ctx->draw_queue[head % DRAW_QUEUE_DEPTH];
+    status = msm_copybit(ctx);
+    // The frame's blits are done with their temp. buffers
+    put_temp_buffers(ctx);
+
+    // Submit every destination drawn to; the fence of the last flush
+    // covers the earlier ones.
+    for (int type = 0; type < NUM_SURFACE_TYPES; type++) {
+        struct surface_pool *pool = &ctx->dst_pool[type];
+        for (int i = 0; i < pool->capacity; i++) {
+            if (pool->frames[i] != ctx->frame_seq ||
+                pool->objects[i].surface_id == ctx->last_target)
+                continue;
+            if(LINK_c2dFlush(pool->objects[i].surface_id, &draw->time_stamp)) {
+                ALOGE("%s: LINK_c2dFlush ERROR", __FUNCTION__);
+                status = COPYBIT_FAILURE;
+            }
+        }
+    }
+    if(LINK_c2dFlush(current_target(ctx), &draw->time_stamp)) {
         ALOGE("%s: LINK_c2dFlush ERROR", __FUNCTION__);
         // unlock the mutex and return failure
         pthread_mutex_unlock(&ctx->wait_cleanup_lock);
+        sem_post(&ctx->draw_free);
         return COPYBIT_FAILURE;
     }
-    if(LINK_c2dCreateFenceFD(ctx->dst[ctx->dst_surface_type], ctx->time_stamp,
-                                                                        fd)) {
+    if(LINK_c2dCreateFenceFD(current_target(ctx), draw->time_stamp, fd)) {
         ALOGE("%s: LINK_c2dCreateFenceFD ERROR", __FUNCTION__);
         status = COPYBIT_FAILURE;
     }
+    ctx->stats_frames++;
+    ctx->stats_draws += ctx->frame_draws;
+    ctx->stats_finishes += ctx->frame_finishes;
+    ctx->last_frame_draws = ctx->frame_draws;
+    ctx->last_frame_finishes = ctx->frame_finishes;
+    if (ctx->frame_draws > ctx->max_frame_draws)
+        ctx->max_frame_draws = ctx->frame_draws;
+    ctx->frame_draws = 0;
+    ctx->frame_finishes = 0;
     if(status == COPYBIT_SUCCESS) {
-        //signal the wait_thread
-        ctx->wait_timestamp = true;
-        pthread_cond_signal(&ctx->wait_cleanup_cond);
+        // Mappings deferred up to here are released when this frame
+        // completes, the list moves into the queue entry
+        pthread_mutex_lock(&ctx->gpu_map_lock);
+        draw->map_clock = ctx->gpu_map_clock;
+        unsigned int *unmaps = draw->unmaps;
+        int unmap_size = draw->unmap_size;
+        draw->unmaps = ctx->mapped_gpu_addr;
+        draw->unmap_size = ctx->mapped_gpu_size;
+        draw->unmap_count = ctx->mapped_gpu_count;
+        ctx->mapped_gpu_addr = unmaps;
+        ctx->mapped_gpu_size = unmap_size;
+        ctx->mapped_gpu_count = 0;
+        pthread_mutex_unlock(&ctx->gpu_map_lock);
+        draw->submit_us = now_us();
+        // The frame's surfaces stay held until the wait thread retires it
+        draw->frame = ctx->frame_seq++;
+        //hand the frame to the wait thread
+        android_atomic_release_store(head + 1, &ctx->draw_head);
+        int in_flight = draws_in_flight(ctx);
+        if (in_flight > ctx->draws_max_in_flight)
+            ctx->draws_max_in_flight = in_flight;
+        post_draw(ctx);
+    } else {
+        sem_post(&ctx->draw_free);
     }
     pthread_mutex_unlock(&ctx->wait_cleanup_lock);
     return status;
@@ -651,29 +1239,61 @@ static int finish_copybit(struct copybit_device_t *dev)
     if (!ctx)
         return COPYBIT_FAILURE;
 
-   int status = msm_copybit(ctx, ctx->dst[ctx->dst_surface_type]);
-
-   if(LINK_c2dFinish(ctx->dst[ctx->dst_surface_type])) {
+    int status = msm_copybit(ctx);
+
+    for (int type = 0; type < NUM_SURFACE_TYPES; type++) {
+        struct surface_pool *pool = &ctx->dst_pool[type];
+        for (int i = 0; i < pool->capacity; i++) {
+            if (pool->frames[i] != ctx->frame_seq ||
+                pool->objects[i].surface_id == ctx->last_target)
+                continue;
+            if(LINK_c2dFinish(pool->objects[i].surface_id)) {
+                ALOGE("%s: LINK_c2dFinish ERROR", __FUNCTION__);
+                status = COPYBIT_FAILURE;
+            }
+        }
+    }
+    if(LINK_c2dFinish(current_target(ctx))) {
         ALOGE("%s: LINK_c2dFinish ERROR", __FUNCTION__);
         return COPYBIT_FAILURE;
     }
 
-    // Unmap any mapped addresses.
-    for (int i = 0; i < MAX_SURFACES; i++) {
-        if (ctx->mapped_gpu_addr[i]) {
-            LINK_c2dUnMapAddr( (void*)ctx->mapped_gpu_addr[i]);
-            ctx->mapped_gpu_addr[i] = 0;
-        }
-    }
-
-    // Reset the counts after the draw.
-    ctx->blit_rgb_count = 0;
-    ctx->blit_yuv_2_plane_count = 0;
-    ctx->blit_yuv_3_plane_count = 0;
-    ctx->blit_count = 0;
+    // The draws are done, the surfaces can be reused.
+    pthread_mutex_lock(&ctx->gpu_map_lock);
+    uint64_t done_clock = ctx->gpu_map_clock;
+    set_done_frame(ctx, ctx->frame_seq++);
+    pthread_mutex_unlock(&ctx->gpu_map_lock);
+    // Unmap addresses the completed draw was holding on to.
+    gpu_map_draw_done(ctx, done_clock);
     return status;
 }
 
+static void dump_copybit(struct copybit_device_t *dev, char *buff,
+                         int buff_len)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    if (!ctx || !buff || buff_len <= 0)
+        return;
+    unsigned int retired = ctx->draws_retired;
+    int64_t avg_us = retired ? ctx->draws_wait_total_us / retired : 0;
+    unsigned int frames = ctx->stats_frames;
+    snprintf(buff, buff_len,
+             "  C2D copybit: frames in flight=%d (max %d of %d)"
+             " retired=%u wait avg=%lldus max=%lldus\n"
+             "  C2D draws per frame: last=%d avg=%u.%02u max=%d"
+             " early finishes: last=%d total=%u\n"
+             "  C2D GPU map cache: hits=%u misses=%u\n",
+             draws_in_flight(ctx), ctx->draws_max_in_flight,
+             DRAW_QUEUE_DEPTH, retired, (long long)avg_us,
+             (long long)ctx->draws_wait_max_us,
+             ctx->last_frame_draws,
+             frames ? ctx->stats_draws / frames : 0,
+             frames ? (ctx->stats_draws * 100 / frames) % 100 : 0,
+             ctx->max_frame_draws, ctx->last_frame_finishes,
+             ctx->stats_finishes,
+             ctx->gpu_map_hits, ctx->gpu_map_misses);
+}
+
 /** setup rectangles */
 static void set_rects(struct copybit_context_t *ctx,
                       C2D_OBJECT *c2dObject,
@@ -729,19 +1349,10 @@ static void set_rects(struct copybit_context_t *ctx,
 /*****************************************************************************/
 
 /** Set a parameter to value */
-static int set_parameter_copybit(
-    struct copybit_device_t *dev,
-    int name,
-    int value)
+/* Apply one parameter, called with wait_cleanup_lock held */
+static int apply_parameter(struct copybit_context_t* ctx, int name, int value)
 {
-    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
     int status = COPYBIT_SUCCESS;
-    if (!ctx) {
-        ALOGE("%s: null context", __FUNCTION__);
-        return -EINVAL;
-    }
-
-    pthread_mutex_lock(&ctx->wait_cleanup_lock);
     switch(name) {
         case COPYBIT_PLANE_ALPHA:
         {
@@ -793,13 +1404,9 @@ static int set_parameter_copybit(
             if (ctx->c2d_driver_info.capabilities_mask &
                 C2D_DRIVER_SUPPORTS_OVERRIDE_TARGET_ROTATE_OP) {
                 ctx->config_mask |= config_mask;
-            } else {
-                // The transform for this surface does not match the current
-                // target transform. Draw all previous surfaces. This will be
-                // changed once we have a new mechanism to send different
-                // target rotations to c2d.
-                finish_copybit(dev);
             }
+            // Without override support the target transform is part of the
+            // blit segment, a change starts a new draw instead of a finish.
             ctx->trg_transform = transform;
         }
         break;
@@ -820,6 +1427,52 @@ static int set_parameter_copybit(
             status = -EINVAL;
             break;
     }
+    if (status == COPYBIT_SUCCESS) {
+        copybit_params_set(&ctx->params, name, value);
+    }
+    return status;
+}
+
+static int set_parameter_copybit(
+    struct copybit_device_t *dev,
+    int name,
+    int value)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    int status = COPYBIT_SUCCESS;
+    if (!ctx) {
+        ALOGE("%s: null context", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&ctx->wait_cleanup_lock);
+    status = apply_parameter(ctx, name, value);
+    pthread_mutex_unlock(&ctx->wait_cleanup_lock);
+    return status;
+}
+
+static int set_parameters_copybit(
+    struct copybit_device_t *dev,
+    struct copybit_params_t const *params)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    int status = COPYBIT_SUCCESS;
+    if (!ctx || !params) {
+        ALOGE("%s: null context or parameters", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&ctx->wait_cleanup_lock);
+    for (int name = 0; name < COPYBIT_PARAMETER_COUNT; name++) {
+        uint32_t bit = 1 << name;
+        if (!(params->mask & bit))
+            continue;
+        if ((ctx->params.mask & bit) &&
+            ctx->params.value[name] == params->value[name])
+            continue;
+        if (apply_parameter(ctx, name, params->value[name]))
+            status = -EINVAL;
+    }
     pthread_mutex_unlock(&ctx->wait_cleanup_lock);
     return status;
 }
@@ -886,6 +1539,10 @@ static bool need_temp_buffer(struct copybit_image_t const *img)
     if (COPYBIT_SUCCESS == is_supported_rgb_format(img->format))
         return false;
 
+    // Formats C2D cannot read at all go through an NV12 copy
+    if (COPYBIT_SUCCESS != is_supported_yuv_format(img->format))
+        return true;
+
     struct private_handle_t* handle = (struct private_handle_t*)img->handle;
 
     // The width parameter in the handle contains the aligned_w. We check if we
@@ -913,42 +1570,25 @@ static void populate_buffer_info(struct copybit_image_t const *img, bufferInfo&
  */
 static size_t get_size(const bufferInfo& info)
 {
-    size_t size = 0;
-    int w = info.width;
-    int h = info.height;
-    int aligned_w = ALIGN(w, 32);
-    switch(info.format) {
-        case HAL_PIXEL_FORMAT_NV12_ENCODEABLE:
-            {
-                // Chroma for this format is aligned to 2K.
-                size = ALIGN((aligned_w*h), 2048) +
-                        ALIGN(aligned_w/2, 32) * (h/2) *2;
-                size = ALIGN(size, 4096);
-            } break;
-        case HAL_PIXEL_FORMAT_YCbCr_420_SP:
-        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
-            {
-                size = aligned_w * h +
-                       ALIGN(aligned_w/2, 32) * (h/2) * 2;
-                size = ALIGN(size, 4096);
-            } break;
-        default: break;
-    }
-    return size;
+    yuv_plane_layout planes;
+    if (get_yuv_plane_layout(info.format, info.width, info.height,
+                             YUV_LAYOUT_C2D, planes) != COPYBIT_SUCCESS)
+        return 0;
+    return ALIGN(planes.size, 4096);
 }
 
 /* Function to allocate memory for the temporary buffer. This memory is
  * allocated from Ashmem. It is the caller's responsibility to free this
  * memory.
  */
-static int get_temp_buffer(const bufferInfo& info, alloc_data& data)
+static int alloc_temp_buffer(size_t size, alloc_data& data)
 {
     ALOGD("%s E", __FUNCTION__);
     // Alloc memory from system heap
     data.base = 0;
     data.fd = -1;
     data.offset = 0;
-    data.size = get_size(info);
+    data.size = size;
     data.align = getpagesize();
     data.uncached = true;
     int allocFlags = GRALLOC_USAGE_PRIVATE_SYSTEM_HEAP;
@@ -965,54 +1605,163 @@ static int get_temp_buffer(const bufferInfo& info, alloc_data& data)
     int err = sAlloc->allocate(data, allocFlags);
     if (0 != err) {
         ALOGE("%s: allocate failed", __FUNCTION__);
+        data.fd = -1;
         return COPYBIT_FAILURE;
     }
 
     ALOGD("%s X", __FUNCTION__);
     return err;
 }
-
-/* Function to free the temporary allocated memory.*/
 static void free_temp_buffer(alloc_data &data)
 {
     if (-1 != data.fd) {
         IMemAlloc* memalloc = sAlloc->getAllocator(data.allocType);
         memalloc->free_buffer(data.base, data.size, 0, data.fd);
+        data.fd = -1;
+        data.base = 0;
+        data.size = 0;
+    }
+}
+
+static int64_t now_ms()
+{
+    return now_us() / 1000;
+}
+
+/* Round a temp. buffer size up to its size class, a multiple of an eighth
+ * of the next power of two. That leaves four classes between consecutive
+ * powers of two, so nearby resolutions share buffers and the rounding
+ * wastes at most a quarter of the requested size. */
+static size_t temp_size_class(size_t size)
+{
+    size_t pow2 = 4096;
+    while (pow2 < size)
+        pow2 <<= 1;
+    return ALIGN(size, (pow2 >= 8 * 4096) ? pow2 / 8 : 4096);
+}
+
+/* Get a temp. buffer big enough for info, reusing a pooled one of the same
+ * size class when there is one */
+static alloc_data* get_temp_buffer(copybit_context_t *ctx,
+                                   const bufferInfo& info)
+{
+    size_t size = get_size(info);
+    if (!size)
+        return NULL;
+    size = temp_size_class(size);
+
+    temp_buffer *slot = NULL;
+    for (int i = 0; i < TEMP_POOL_SIZE; i++) {
+        temp_buffer *buf = &ctx->temp_pool[i];
+        if (buf->in_use)
+            continue;
+        if (buf->data.fd != -1 && buf->data.size == size) {
+            slot = buf;
+            break;
+        }
+        // Otherwise prefer an empty slot, then the least recently used
+        if (!slot || (slot->data.fd != -1 &&
+                      (buf->data.fd == -1 ||
+                       buf->last_use_ms < slot->last_use_ms)))
+            slot = buf;
+    }
+    if (!slot) {
+        ALOGE("%s: all temp. buffers are in use", __FUNCTION__);
+        return NULL;
+    }
+    if (slot->data.size != size) {
+        free_temp_buffer(slot->data);
+        int err = alloc_temp_buffer(size, slot->data);
+        update_temp_pool_held(ctx);
+        if (err != COPYBIT_SUCCESS)
+            return NULL;
+    }
+    slot->in_use = true;
+    slot->last_use_ms = now_ms();
+    return &slot->data;
+}
+
+/* Publish how many temp. buffers the pool holds, the wait thread only
+ * keeps a trim timeout armed while there are some */
+static void update_temp_pool_held(copybit_context_t *ctx)
+{
+    int32_t held = 0;
+    for (int i = 0; i < TEMP_POOL_SIZE; i++) {
+        if (ctx->temp_pool[i].data.fd != -1)
+            held++;
+    }
+    android_atomic_release_store(held, &ctx->temp_pool_held);
+}
+
+/* Return the temp. buffers of the previous blit to the pool. Blits using
+ * temp. buffers are finished before they return, so all of them are idle.
+ * Buffers idle for longer than TEMP_POOL_MAX_IDLE_MS are freed. Called
+ * with wait_cleanup_lock held. */
+static void put_temp_buffers(copybit_context_t *ctx)
+{
+    int64_t now = now_ms();
+    for (int i = 0; i < TEMP_POOL_SIZE; i++) {
+        temp_buffer *buf = &ctx->temp_pool[i];
+        if (buf->in_use) {
+            buf->in_use = false;
+            buf->last_use_ms = now;
+        } else if (buf->data.fd != -1 &&
+                   now - buf->last_use_ms > TEMP_POOL_MAX_IDLE_MS) {
+            free_temp_buffer(buf->data);
+        }
     }
+    update_temp_pool_held(ctx);
+}
+
+/* Free the temp. buffers once copybit has been idle for a while, so they
+ * do not outlive the use case that needed them. Called from the wait
+ * thread when nothing was flushed for TEMP_POOL_MAX_IDLE_MS. */
+static void trim_temp_buffers(copybit_context_t *ctx)
+{
+    pthread_mutex_lock(&ctx->wait_cleanup_lock);
+    put_temp_buffers(ctx);
+    pthread_mutex_unlock(&ctx->wait_cleanup_lock);
+}
+
+static void free_temp_buffers(copybit_context_t *ctx)
+{
+    for (int i = 0; i < TEMP_POOL_SIZE; i++) {
+        free_temp_buffer(ctx->temp_pool[i].data);
+        ctx->temp_pool[i].in_use = false;
+    }
+    update_temp_pool_held(ctx);
 }
 
 /* Function to perform the software color conversion. Convert the
- * C2D compatible format to the Android compatible format
+ * C2D compatible format to the Android compatible format, or the other
+ * way round. The source is in src_format and the destination in
+ * rhs->format, which may differ when the source is not a C2D format.
  */
-static int copy_image(private_handle_t *src_handle,
+static int copy_image(private_handle_t *src_handle, int src_format,
                       struct copybit_image_t const *rhs,
-                      eConversionType conversionType)
+                      eConversionType conversionType,
+                      convert_fence_t *fence = NULL)
 {
     if (src_handle->fd == -1) {
         ALOGE("%s: src_handle fd is invalid", __FUNCTION__);
         return COPYBIT_FAILURE;
     }
 
-    // Copy the info.
-    int ret = COPYBIT_SUCCESS;
-    switch(rhs->format) {
-        case HAL_PIXEL_FORMAT_NV12_ENCODEABLE:
-        case HAL_PIXEL_FORMAT_YCbCr_420_SP:
-        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
-            {
-                if (CONVERT_TO_ANDROID_FORMAT == conversionType) {
-                    return convert_yuv_c2d_to_yuv_android(src_handle, rhs);
-                } else {
-                    return convert_yuv_android_to_yuv_c2d(src_handle, rhs);
-                }
+    if (!is_yuv_conversion_supported(src_format, rhs->format)) {
+        ALOGE("%s: invalid conversion 0x%x -> 0x%x", __FUNCTION__,
+              src_format, rhs->format);
+        return COPYBIT_FAILURE;
+    }
 
-            } break;
-        default: {
-            ALOGE("%s: invalid format 0x%x", __FUNCTION__, rhs->format);
-            ret = COPYBIT_FAILURE;
-        } break;
+    private_handle_t *dst_handle = (private_handle_t *)rhs->handle;
+    if (CONVERT_TO_ANDROID_FORMAT == conversionType) {
+        return convert_yuv(src_handle, src_format, YUV_LAYOUT_C2D,
+                           dst_handle, rhs->format, YUV_LAYOUT_ANDROID,
+                           rhs->w, rhs->h, fence);
     }
-    return ret;
+    return convert_yuv(src_handle, src_format, YUV_LAYOUT_ANDROID,
+                       dst_handle, rhs->format, YUV_LAYOUT_C2D,
+                       rhs->w, rhs->h, fence);
 }
 
 static void delete_handle(private_handle_t *handle)
@@ -1023,6 +1772,22 @@ static void delete_handle(private_handle_t *handle)
     }
 }
 
+/* Point a context handle at nothing, ready to describe a temp. buffer */
+static private_handle_t* reset_handle(private_handle_t *handle,
+                                      const bufferInfo& info)
+{
+    handle->fd = -1;
+    handle->size = 0;
+    handle->flags = 0;
+    handle->offset = 0;
+    handle->base = 0;
+    handle->gpuaddr = 0;
+    handle->format = info.format;
+    handle->width = info.width;
+    handle->height = info.height;
+    return handle;
+}
+
 static bool need_to_execute_draw(struct copybit_context_t* ctx,
                                           eC2DFlags flags)
 {
@@ -1035,6 +1800,52 @@ static bool need_to_execute_draw(struct copybit_context_t* ctx,
     return false;
 }
 
+/* Point the blit at dst_image. Blits to the destination of the last blit
+ * segment, with the same target transform, are drawn together; anything
+ * else takes a new destination surface and starts a new segment. */
+static int set_blit_target(struct copybit_context_t *ctx,
+                           copybit_image_t *dst_image, int surface_type,
+                           eC2DFlags flags, int &mapped_idx)
+{
+    private_handle_t *handle = (private_handle_t *)dst_image->handle;
+    struct blit_target key;
+    memset(&key, 0, sizeof(key));
+    key.fd = handle->fd;
+    key.base = handle->base;
+    key.offset = handle->offset;
+    key.format = dst_image->format;
+    key.width = dst_image->w;
+    key.height = dst_image->h;
+    // For A3xx the transform is set in the config_mask of each object
+    if (!(ctx->c2d_driver_info.capabilities_mask &
+          C2D_DRIVER_SUPPORTS_OVERRIDE_TARGET_ROTATE_OP))
+        key.transform = ctx->trg_transform;
+
+    if (ctx->segment_count &&
+        !memcmp(&ctx->segments[ctx->segment_count - 1].key, &key, sizeof(key)))
+        return COPYBIT_SUCCESS;
+
+    struct surface_pool *pool = &ctx->dst_pool[surface_type];
+    int index = reserve_surface(ctx, pool, surface_type);
+    if (index < 0 ||
+        !grow_array((void **)&ctx->segments, &ctx->segment_list_size,
+                    ctx->segment_count + 1, sizeof(struct blit_segment))) {
+        return COPYBIT_FAILURE;
+    }
+    uint32 surface_id = pool->objects[index].surface_id;
+    if (set_image(ctx, surface_id, dst_image, flags, mapped_idx,
+                  &pool->defs[index]))
+        return COPYBIT_FAILURE;
+    pool->frames[index] = ctx->frame_seq;
+
+    struct blit_segment *segment = &ctx->segments[ctx->segment_count++];
+    segment->key = key;
+    segment->surface_id = surface_id;
+    segment->start = ctx->blit_count;
+    segment->count = 0;
+    return COPYBIT_SUCCESS;
+}
+
 /** do a stretch blit type operation */
 static int stretch_copybit_internal(
     struct copybit_device_t *dev,
@@ -1057,6 +1868,15 @@ static int stretch_copybit_internal(
         return -EINVAL;
     }
 
+    // The temp. buffers of the previous blit can be reused from here on
+    put_temp_buffers(ctx);
+    // A pool that cannot grow any further and has every surface held by
+    // queued or in flight draws is freed up by finishing them
+    if (surfaces_exhausted(ctx)) {
+        ctx->frame_finishes++;
+        finish_copybit(dev);
+    }
+
     if (src->w > MAX_DIMENSION || src->h > MAX_DIMENSION) {
         ALOGE("%s: src dimension error", __FUNCTION__);
         return -EINVAL;
@@ -1068,12 +1888,6 @@ static int stretch_copybit_internal(
         return -EINVAL;
     }
 
-    if (is_valid_destination_format(dst->format) == COPYBIT_FAILURE) {
-        ALOGE("%s: Invalid destination format format = 0x%x", __FUNCTION__,
-                                                              dst->format);
-        return COPYBIT_FAILURE;
-    }
-
     int dst_surface_type;
     if (is_supported_rgb_format(dst->format) == COPYBIT_SUCCESS) {
         dst_surface_type = RGB_SURFACE;
@@ -1096,20 +1910,6 @@ static int stretch_copybit_internal(
         return COPYBIT_FAILURE;
     }
 
-    if (ctx->blit_rgb_count == MAX_RGB_SURFACES ||
-        ctx->blit_yuv_2_plane_count == MAX_YUV_2_PLANE_SURFACES ||
-        ctx->blit_yuv_3_plane_count == MAX_YUV_2_PLANE_SURFACES ||
-        ctx->blit_count == MAX_BLIT_OBJECT_COUNT ||
-        ctx->dst_surface_type != dst_surface_type) {
-        // we have reached the max. limits of our internal structures or
-        // changed the target.
-        // Draw the remaining surfaces. We need to do the finish here since
-        // we need to free up the surface templates.
-        finish_copybit(dev);
-    }
-
-    ctx->dst_surface_type = dst_surface_type;
-
     // Update the destination
     copybit_image_t dst_image;
     dst_image.w = dst->w;
@@ -1119,39 +1919,50 @@ static int stretch_copybit_internal(
     // Check if we need a temp. copy for the destination. We'd need this the destination
     // width is not aligned to 32. This case occurs for YUV formats. RGB formats are
     // aligned to 32.
-    bool need_temp_dst = need_temp_buffer(dst);
+    // C2D does not support NV12Tile as a destination format, it renders into
+    // a linear NV12 copy that is tiled back once the draw completes.
+    bool tiled_dst = (dst->format == HAL_PIXEL_FORMAT_YCbCr_420_SP_TILED);
+    bool need_temp_dst = tiled_dst || need_temp_buffer(dst);
     bufferInfo dst_info;
     populate_buffer_info(dst, dst_info);
-    private_handle_t* dst_hnd = new private_handle_t(-1, 0, 0, 0, dst_info.format,
-                                                     dst_info.width, dst_info.height);
-    if (dst_hnd == NULL) {
-        ALOGE("%s: dst_hnd is null", __FUNCTION__);
-        return COPYBIT_FAILURE;
+    if (tiled_dst) {
+        dst_info.format = HAL_PIXEL_FORMAT_YCbCr_420_SP;
+        dst_image.format = HAL_PIXEL_FORMAT_YCbCr_420_SP;
     }
+    private_handle_t* dst_hnd = reset_handle(ctx->temp_dst_hnd, dst_info);
     if (need_temp_dst) {
-        if (get_size(dst_info) != ctx->temp_dst_buffer.size) {
-            free_temp_buffer(ctx->temp_dst_buffer);
-            // Create a temp buffer and set that as the destination.
-            if (COPYBIT_FAILURE == get_temp_buffer(dst_info, ctx->temp_dst_buffer)) {
-                ALOGE("%s: get_temp_buffer(dst) failed", __FUNCTION__);
-                delete_handle(dst_hnd);
-                return COPYBIT_FAILURE;
-            }
+        // Get a temp buffer and set that as the destination.
+        alloc_data *temp_dst = get_temp_buffer(ctx, dst_info);
+        if (!temp_dst) {
+            ALOGE("%s: get_temp_buffer(dst) failed", __FUNCTION__);
+            return COPYBIT_FAILURE;
         }
-        dst_hnd->fd = ctx->temp_dst_buffer.fd;
-        dst_hnd->size = ctx->temp_dst_buffer.size;
-        dst_hnd->flags = ctx->temp_dst_buffer.allocType;
-        dst_hnd->base = (int)(ctx->temp_dst_buffer.base);
-        dst_hnd->offset = ctx->temp_dst_buffer.offset;
+        dst_hnd->fd = temp_dst->fd;
+        dst_hnd->size = temp_dst->size;
+        dst_hnd->flags = temp_dst->allocType;
+        dst_hnd->base = (int)(temp_dst->base);
+        dst_hnd->offset = temp_dst->offset;
         dst_hnd->gpuaddr = 0;
         dst_image.handle = dst_hnd;
+        if (tiled_dst) {
+            // Only the clipped area is drawn, start from the current contents
+            status = convert_yuv((private_handle_t *)dst->handle, dst->format,
+                                 YUV_LAYOUT_ANDROID, dst_hnd, dst_info.format,
+                                 YUV_LAYOUT_C2D, dst->w, dst->h);
+            if (status == COPYBIT_FAILURE) {
+                ALOGE("%s: detiling the destination failed", __FUNCTION__);
+                return COPYBIT_FAILURE;
+            }
+            IMemAlloc* memalloc = sAlloc->getAllocator(dst_hnd->flags);
+            memalloc->clean_buffer((void *)(dst_hnd->base), dst_hnd->size,
+                                   dst_hnd->offset, dst_hnd->fd);
+        }
     }
 
-    status = set_image(ctx, ctx->dst[ctx->dst_surface_type], &dst_image,
-                       (eC2DFlags)flags, mapped_dst_idx);
+    status = set_blit_target(ctx, &dst_image, dst_surface_type,
+                             (eC2DFlags)flags, mapped_dst_idx);
     if(status) {
         ALOGE("%s: dst: set_image error", __FUNCTION__);
-        delete_handle(dst_hnd);
         unmap_gpuaddr(ctx, mapped_dst_idx);
         return COPYBIT_FAILURE;
     }
@@ -1160,29 +1971,37 @@ static int stretch_copybit_internal(
     flags = 0;
     if(is_supported_rgb_format(src->format) == COPYBIT_SUCCESS) {
         src_surface_type = RGB_SURFACE;
-        src_surface = ctx->blit_rgb_object[ctx->blit_rgb_count];
     } else if (is_supported_yuv_format(src->format) == COPYBIT_SUCCESS) {
         int num_planes = get_num_planes(src->format);
         if (num_planes == 2) {
             src_surface_type = YUV_SURFACE_2_PLANES;
-            src_surface = ctx->blit_yuv_2_plane_object[ctx->blit_yuv_2_plane_count];
         } else if (num_planes == 3) {
             src_surface_type = YUV_SURFACE_3_PLANES;
-            src_surface = ctx->blit_yuv_3_plane_object[ctx->blit_yuv_2_plane_count];
         } else {
             ALOGE("%s: src number of YUV planes is invalid src format = 0x%x",
                   __FUNCTION__, src->format);
-            delete_handle(dst_hnd);
             unmap_gpuaddr(ctx, mapped_dst_idx);
             return -EINVAL;
         }
+    } else if (is_yuv_conversion_supported(src->format,
+                                           HAL_PIXEL_FORMAT_YCbCr_420_SP)) {
+        // Converted to NV12 in the temporary source buffer below
+        src_surface_type = YUV_SURFACE_2_PLANES;
     } else {
         ALOGE("%s: Invalid source surface format 0x%x", __FUNCTION__,
                                                         src->format);
-        delete_handle(dst_hnd);
         unmap_gpuaddr(ctx, mapped_dst_idx);
         return -EINVAL;
     }
+    struct surface_pool *src_pool = &ctx->src_pool[src_surface_type];
+    int src_index = reserve_surface(ctx, src_pool, src_surface_type);
+    if (src_index < 0) {
+        ALOGE("%s: no source surface of type %d", __FUNCTION__,
+              src_surface_type);
+        unmap_gpuaddr(ctx, mapped_dst_idx);
+        return COPYBIT_FAILURE;
+    }
+    src_surface = src_pool->objects[src_index];
 
     copybit_image_t src_image;
     src_image.w = src->w;
@@ -1191,68 +2010,50 @@ static int stretch_copybit_internal(
     src_image.handle = src->handle;
 
     bool need_temp_src = need_temp_buffer(src);
-    bufferInfo src_info;
-    populate_buffer_info(src, src_info);
-    private_handle_t* src_hnd = new private_handle_t(-1, 0, 0, 0, src_info.format,
-                                                 src_info.width, src_info.height);
-    if (NULL == src_hnd) {
-        ALOGE("%s: src_hnd is null", __FUNCTION__);
-        delete_handle(dst_hnd);
-        unmap_gpuaddr(ctx, mapped_dst_idx);
-        return COPYBIT_FAILURE;
+    if (is_supported_yuv_format(src->format) != COPYBIT_SUCCESS &&
+        is_supported_rgb_format(src->format) != COPYBIT_SUCCESS) {
+        src_image.format = HAL_PIXEL_FORMAT_YCbCr_420_SP;
     }
+    bufferInfo src_info;
+    populate_buffer_info(&src_image, src_info);
+    private_handle_t* src_hnd = reset_handle(ctx->temp_src_hnd, src_info);
     if (need_temp_src) {
-        if (get_size(src_info) != ctx->temp_src_buffer.size) {
-            free_temp_buffer(ctx->temp_src_buffer);
-            // Create a temp buffer and set that as the destination.
-            if (COPYBIT_SUCCESS != get_temp_buffer(src_info,
-                                               ctx->temp_src_buffer)) {
-                ALOGE("%s: get_temp_buffer(src) failed", __FUNCTION__);
-                delete_handle(dst_hnd);
-                delete_handle(src_hnd);
-                unmap_gpuaddr(ctx, mapped_dst_idx);
-                return COPYBIT_FAILURE;
-            }
+        // Get a temp buffer and set that as the source.
+        alloc_data *temp_src = get_temp_buffer(ctx, src_info);
+        if (!temp_src) {
+            ALOGE("%s: get_temp_buffer(src) failed", __FUNCTION__);
+            unmap_gpuaddr(ctx, mapped_dst_idx);
+            return COPYBIT_FAILURE;
         }
-        src_hnd->fd = ctx->temp_src_buffer.fd;
-        src_hnd->size = ctx->temp_src_buffer.size;
-        src_hnd->flags = ctx->temp_src_buffer.allocType;
-        src_hnd->base = (int)(ctx->temp_src_buffer.base);
-        src_hnd->offset = ctx->temp_src_buffer.offset;
+        src_hnd->fd = temp_src->fd;
+        src_hnd->size = temp_src->size;
+        src_hnd->flags = temp_src->allocType;
+        src_hnd->base = (int)(temp_src->base);
+        src_hnd->offset = temp_src->offset;
         src_hnd->gpuaddr = 0;
         src_image.handle = src_hnd;
 
-        // Copy the source.
-        status = copy_image((private_handle_t *)src->handle, &src_image,
-                                CONVERT_TO_C2D_FORMAT);
+        // Start copying the source. Large frames are repacked on the
+        // worker pool while the C2D surfaces are set up below; the copy
+        // is waited for before the cache flush and the draw.
+        status = copy_image((private_handle_t *)src->handle, src->format,
+                            &src_image, CONVERT_TO_C2D_FORMAT,
+                            &ctx->temp_src_convert);
         if (status == COPYBIT_FAILURE) {
             ALOGE("%s:copy_image failed in temp source",__FUNCTION__);
-            delete_handle(dst_hnd);
-            delete_handle(src_hnd);
             unmap_gpuaddr(ctx, mapped_dst_idx);
             return status;
         }
-
-        // Flush the cache
-        IMemAlloc* memalloc = sAlloc->getAllocator(src_hnd->flags);
-        if (memalloc->clean_buffer((void *)(src_hnd->base), src_hnd->size,
-                                   src_hnd->offset, src_hnd->fd)) {
-            ALOGE("%s: clean_buffer failed", __FUNCTION__);
-            delete_handle(dst_hnd);
-            delete_handle(src_hnd);
-            unmap_gpuaddr(ctx, mapped_dst_idx);
-            return COPYBIT_FAILURE;
-        }
     }
 
     flags |= (ctx->is_premultiplied_alpha) ? FLAGS_PREMULTIPLIED_ALPHA : 0;
-    flags |= (ctx->dst_surface_type != RGB_SURFACE) ? FLAGS_YUV_DESTINATION : 0;
+    flags |= (dst_surface_type != RGB_SURFACE) ? FLAGS_YUV_DESTINATION : 0;
     status = set_image(ctx, src_surface.surface_id, &src_image,
-                       (eC2DFlags)flags, mapped_src_idx);
+                       (eC2DFlags)flags, mapped_src_idx,
+                       &src_pool->defs[src_index]);
     if(status) {
         ALOGE("%s: set_image (src) error", __FUNCTION__);
-        delete_handle(dst_hnd);
-        delete_handle(src_hnd);
+        wait_for_conversion(&ctx->temp_src_convert);
         unmap_gpuaddr(ctx, mapped_dst_idx);
         unmap_gpuaddr(ctx, mapped_src_idx);
         return COPYBIT_FAILURE;
@@ -1266,14 +2067,13 @@ static int stretch_copybit_internal(
             src_surface.config_mask &= ~C2D_ALPHA_BLEND_NONE;
             if(!(src_surface.global_alpha)) {
                 // src alpha is zero
-                delete_handle(dst_hnd);
-                delete_handle(src_hnd);
+                wait_for_conversion(&ctx->temp_src_convert);
                 unmap_gpuaddr(ctx, mapped_dst_idx);
                 unmap_gpuaddr(ctx, mapped_src_idx);
                 return COPYBIT_FAILURE;
             }
         } else {
-            int c2d_format = get_format(src->format);
+            int c2d_format = get_format(src_image.format);
             if(is_alpha(c2d_format))
                 src_surface.config_mask &= ~C2D_ALPHA_BLEND_NONE;
             else
@@ -1283,43 +2083,52 @@ static int stretch_copybit_internal(
         src_surface.config_mask |= C2D_ALPHA_BLEND_NONE;
     }
 
-    if (src_surface_type == RGB_SURFACE) {
-        ctx->blit_rgb_object[ctx->blit_rgb_count] = src_surface;
-        ctx->blit_rgb_count++;
-    } else if (src_surface_type == YUV_SURFACE_2_PLANES) {
-        ctx->blit_yuv_2_plane_object[ctx->blit_yuv_2_plane_count] = src_surface;
-        ctx->blit_yuv_2_plane_count++;
-    } else {
-        ctx->blit_yuv_3_plane_object[ctx->blit_yuv_3_plane_count] = src_surface;
-        ctx->blit_yuv_3_plane_count++;
+    if (need_temp_src) {
+        status = wait_for_conversion(&ctx->temp_src_convert);
+        // Flush the cache
+        IMemAlloc* memalloc = sAlloc->getAllocator(src_hnd->flags);
+        if (status == COPYBIT_FAILURE ||
+            memalloc->clean_buffer((void *)(src_hnd->base), src_hnd->size,
+                                   src_hnd->offset, src_hnd->fd)) {
+            ALOGE("%s: temp source copy or clean_buffer failed", __FUNCTION__);
+            unmap_gpuaddr(ctx, mapped_dst_idx);
+            unmap_gpuaddr(ctx, mapped_src_idx);
+            return COPYBIT_FAILURE;
+        }
     }
 
+    src_pool->objects[src_index] = src_surface;
+    src_pool->frames[src_index] = ctx->frame_seq;
+
+    struct blit_segment *segment = &ctx->segments[ctx->segment_count - 1];
     struct copybit_rect_t clip;
     while ((status == 0) && region->next(region, &clip)) {
         set_rects(ctx, &(src_surface), dst_rect, src_rect, &clip);
-        if (ctx->blit_count == MAX_BLIT_OBJECT_COUNT) {
-            ALOGW("Reached end of blit count");
-            finish_copybit(dev);
+        if (!grow_array((void **)&ctx->blit_list, &ctx->blit_list_size,
+                        ctx->blit_count + 1, sizeof(C2D_OBJECT_STR))) {
+            status = COPYBIT_FAILURE;
+            break;
         }
         ctx->blit_list[ctx->blit_count] = src_surface;
         ctx->blit_count++;
+        segment->count++;
     }
 
     // Check if we need to perform an early draw-finish.
     flags |= (need_temp_dst || need_temp_src) ? FLAGS_TEMP_SRC_DST : 0;
     if (need_to_execute_draw(ctx, (eC2DFlags)flags))
     {
+        ctx->frame_finishes++;
         finish_copybit(dev);
     }
 
     if (need_temp_dst) {
         // copy the temp. destination without the alignment to the actual
         // destination.
-        status = copy_image(dst_hnd, dst, CONVERT_TO_ANDROID_FORMAT);
+        status = copy_image(dst_hnd, dst_info.format, dst,
+                            CONVERT_TO_ANDROID_FORMAT);
         if (status == COPYBIT_FAILURE) {
             ALOGE("%s:copy_image failed in temp Dest",__FUNCTION__);
-            delete_handle(dst_hnd);
-            delete_handle(src_hnd);
             unmap_gpuaddr(ctx, mapped_dst_idx);
             unmap_gpuaddr(ctx, mapped_src_idx);
             return status;
@@ -1329,13 +2138,13 @@ static int stretch_copybit_internal(
         memalloc->clean_buffer((void *)(dst_hnd->base), dst_hnd->size,
                                dst_hnd->offset, dst_hnd->fd);
     }
-    delete_handle(dst_hnd);
-    delete_handle(src_hnd);
 
     ctx->is_premultiplied_alpha = false;
     ctx->fb_width = 0;
     ctx->fb_height = 0;
     ctx->config_mask = 0;
+    // The blend, alpha and transform state above is per blit
+    copybit_params_init(&ctx->params);
     return status;
 }
 
@@ -1365,9 +2174,14 @@ static int blit_copybit(
     struct copybit_image_t const *src,
     struct copybit_region_t const *region)
 {
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
     struct copybit_rect_t dr = { 0, 0, dst->w, dst->h };
     struct copybit_rect_t sr = { 0, 0, src->w, src->h };
-    return stretch_copybit_internal(dev, dst, src, &dr, &sr, region, false);
+    int status;
+    pthread_mutex_lock(&ctx->wait_cleanup_lock);
+    status = stretch_copybit_internal(dev, dst, src, &dr, &sr, region, false);
+    pthread_mutex_unlock(&ctx->wait_cleanup_lock);
+    return status;
 }
 
 /*****************************************************************************/
@@ -1378,36 +2192,41 @@ static void clean_up(copybit_context_t* ctx)
     if (!ctx)
         return;
 
-    // stop the wait_cleanup_thread
-    pthread_mutex_lock(&ctx->wait_cleanup_lock);
+    // stop the wait_cleanup_thread, it retires the queued frames first
     ctx->stop_thread = true;
-    // Signal waiting thread
-    pthread_cond_signal(&ctx->wait_cleanup_cond);
-    pthread_mutex_unlock(&ctx->wait_cleanup_lock);
+    post_draw(ctx);
     // waits for the cleanup thread to exit
     pthread_join(ctx->wait_thread_id, &ret);
+    // Only now, the thread trims the temp. buffers while it runs
+    free_temp_buffers(ctx);
     pthread_mutex_destroy(&ctx->wait_cleanup_lock);
-    pthread_cond_destroy (&ctx->wait_cleanup_cond);
-
-    for (int i = 0; i < NUM_SURFACE_TYPES; i++) {
-        if (ctx->dst[i])
-            LINK_c2dDestroySurface(ctx->dst[i]);
-    }
-
-    for (int i = 0; i < MAX_RGB_SURFACES; i++) {
-        if (ctx->blit_rgb_object[i].surface_id)
-            LINK_c2dDestroySurface(ctx->blit_rgb_object[i].surface_id);
+    sem_destroy(&ctx->draw_free);
+    pthread_cond_destroy(&ctx->draw_cond);
+    pthread_mutex_destroy(&ctx->draw_lock);
+    for (int i = 0; i < DRAW_QUEUE_DEPTH; i++) {
+        free(ctx->draw_queue[i].unmaps);
     }
 
-    for (int i = 0; i < MAX_YUV_2_PLANE_SURFACES; i++) {
-        if (ctx->blit_yuv_2_plane_object[i].surface_id)
-            LINK_c2dDestroySurface(ctx->blit_yuv_2_plane_object[i].surface_id);
+    // Release the cached GPU mappings, nothing is in flight any more
+    gralloc::removeUnmapListener(gpu_map_invalidate, ctx);
+    gpu_map_draw_done(ctx, ctx->gpu_map_clock);
+    for (int i = 0; i < GPU_MAP_CACHE_SIZE; i++) {
+        if (ctx->gpu_map_cache[i].gpuaddr)
+            LINK_c2dUnMapAddr((void*)ctx->gpu_map_cache[i].gpuaddr);
     }
+    ALOGD_IF(DEBUG_GPU_MAP, "%s: GPU map cache hits=%u misses=%u",
+             __FUNCTION__, ctx->gpu_map_hits, ctx->gpu_map_misses);
+    pthread_mutex_destroy(&ctx->gpu_map_lock);
 
-    for (int i = 0; i < MAX_YUV_3_PLANE_SURFACES; i++) {
-        if (ctx->blit_yuv_3_plane_object[i].surface_id)
-            LINK_c2dDestroySurface(ctx->blit_yuv_3_plane_object[i].surface_id);
+    for (int i = 0; i < NUM_SURFACE_TYPES; i++) {
+        destroy_surface_pool(&ctx->dst_pool[i]);
+        destroy_surface_pool(&ctx->src_pool[i]);
     }
+    delete_handle(ctx->temp_src_hnd);
+    delete_handle(ctx->temp_dst_hnd);
+    free(ctx->blit_list);
+    free(ctx->segments);
+    free(ctx->mapped_gpu_addr);
 
     if (ctx->libc2d2) {
         ::dlclose(ctx->libc2d2);
@@ -1421,10 +2240,6 @@ static void clean_up(copybit_context_t* ctx)
 static int close_copybit(struct hw_device_t *dev)
 {
     struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
-    if (ctx) {
-        free_temp_buffer(ctx->temp_src_buffer);
-        free_temp_buffer(ctx->temp_dst_buffer);
-    }
     clean_up(ctx);
     return 0;
 }
@@ -1434,8 +2249,6 @@ static int open_copybit(const struct hw_module_t* module, const char* name,
                         struct hw_device_t** device)
 {
     int status = COPYBIT_SUCCESS;
-    C2D_RGB_SURFACE_DEF surfDefinition = {0};
-    C2D_YUV_SURFACE_DEF yuvSurfaceDef = {0} ;
     struct copybit_context_t *ctx;
     char fbName[64];
 
@@ -1447,6 +2260,12 @@ static int open_copybit(const struct hw_module_t* module, const char* name,
 
     /* initialize drawstate */
     memset(ctx, 0, sizeof(*ctx));
+    // Before any clean_up, which frees the temp. buffers
+    for (int i = 0; i < TEMP_POOL_SIZE; i++) {
+        ctx->temp_pool[i].data.fd = -1;
+        ctx->temp_pool[i].data.base = 0;
+        ctx->temp_pool[i].data.size = 0;
+    }
     ctx->libc2d2 = ::dlopen("libC2D2.so", RTLD_NOW);
     if (!ctx->libc2d2) {
         ALOGE("FATAL ERROR: could not dlopen libc2d2.so: %s", dlerror());
@@ -1489,152 +2308,44 @@ static int open_copybit(const struct hw_module_t* module, const char* name,
     }
 
     ctx->device.common.tag = HARDWARE_DEVICE_TAG;
-    ctx->device.common.version = 1;
+    ctx->device.common.version = COPYBIT_DEVICE_API_VERSION_3;
     ctx->device.common.module = (hw_module_t*)(module);
     ctx->device.common.close = close_copybit;
     ctx->device.set_parameter = set_parameter_copybit;
+    ctx->device.set_parameters = set_parameters_copybit;
     ctx->device.get = get;
     ctx->device.blit = blit_copybit;
     ctx->device.stretch = stretch_copybit;
     ctx->device.finish = finish_copybit;
     ctx->device.flush_get_fence = flush_get_fence_copybit;
-
-    /* Create RGB Surface */
-    surfDefinition.buffer = (void*)0xdddddddd;
-    surfDefinition.phys = (void*)0xdddddddd;
-    surfDefinition.stride = 1 * 4;
-    surfDefinition.width = 1;
-    surfDefinition.height = 1;
-    surfDefinition.format = C2D_COLOR_FORMAT_8888_ARGB;
-    if (LINK_c2dCreateSurface(&(ctx->dst[RGB_SURFACE]), C2D_TARGET | C2D_SOURCE,
-                              (C2D_SURFACE_TYPE)(C2D_SURFACE_RGB_HOST |
-                                                 C2D_SURFACE_WITH_PHYS |
-                                                 C2D_SURFACE_WITH_PHYS_DUMMY ),
-                                                 &surfDefinition)) {
-        ALOGE("%s: create ctx->dst_surface[RGB_SURFACE] failed", __FUNCTION__);
-        ctx->dst[RGB_SURFACE] = 0;
-        clean_up(ctx);
-        status = COPYBIT_FAILURE;
-        *device = NULL;
-        return status;
-    }
-
-    unsigned int surface_id = 0;
-    for (int i = 0; i < MAX_RGB_SURFACES; i++)
-    {
-        if (LINK_c2dCreateSurface(&surface_id, C2D_TARGET | C2D_SOURCE,
-                              (C2D_SURFACE_TYPE)(C2D_SURFACE_RGB_HOST |
-                                                 C2D_SURFACE_WITH_PHYS |
-                                                 C2D_SURFACE_WITH_PHYS_DUMMY ),
-                                                 &surfDefinition)) {
-            ALOGE("%s: create RGB source surface %d failed", __FUNCTION__, i);
-            ctx->blit_rgb_object[i].surface_id = 0;
+    ctx->device.dump = dump_copybit;
+
+    /* Create the initial surfaces, one destination and the source
+     * templates of each type. The pools grow when a frame needs more. */
+    const int initial_sources[NUM_SURFACE_TYPES] = {
+        MAX_RGB_SURFACES, MAX_YUV_2_PLANE_SURFACES, MAX_YUV_3_PLANE_SURFACES
+    };
+    for (int type = 0; type < NUM_SURFACE_TYPES; type++) {
+        if (add_surface(&ctx->dst_pool[type], type) != COPYBIT_SUCCESS) {
             status = COPYBIT_FAILURE;
             break;
-        } else {
-            ctx->blit_rgb_object[i].surface_id = surface_id;
-            ALOGW("%s i = %d surface_id=%d",  __FUNCTION__, i,
-                                          ctx->blit_rgb_object[i].surface_id);
         }
-    }
-
-    if (status == COPYBIT_FAILURE) {
-        clean_up(ctx);
-        status = COPYBIT_FAILURE;
-        *device = NULL;
-        return status;
-    }
-
-    // Create 2 plane YUV surfaces
-    yuvSurfaceDef.format = C2D_COLOR_FORMAT_420_NV12;
-    yuvSurfaceDef.width = 4;
-    yuvSurfaceDef.height = 4;
-    yuvSurfaceDef.plane0 = (void*)0xaaaaaaaa;
-    yuvSurfaceDef.phys0 = (void*) 0xaaaaaaaa;
-    yuvSurfaceDef.stride0 = 4;
-
-    yuvSurfaceDef.plane1 = (void*)0xaaaaaaaa;
-    yuvSurfaceDef.phys1 = (void*) 0xaaaaaaaa;
-    yuvSurfaceDef.stride1 = 4;
-    if (LINK_c2dCreateSurface(&(ctx->dst[YUV_SURFACE_2_PLANES]),
-                              C2D_TARGET | C2D_SOURCE,
-                              (C2D_SURFACE_TYPE)(C2D_SURFACE_YUV_HOST |
-                               C2D_SURFACE_WITH_PHYS |
-                               C2D_SURFACE_WITH_PHYS_DUMMY),
-                              &yuvSurfaceDef)) {
-        ALOGE("%s: create ctx->dst[YUV_SURFACE_2_PLANES] failed", __FUNCTION__);
-        ctx->dst[YUV_SURFACE_2_PLANES] = 0;
-        clean_up(ctx);
-        status = COPYBIT_FAILURE;
-        *device = NULL;
-        return status;
-    }
-
-    for (int i=0; i < MAX_YUV_2_PLANE_SURFACES; i++)
-    {
-        if (LINK_c2dCreateSurface(&surface_id, C2D_TARGET | C2D_SOURCE,
-                              (C2D_SURFACE_TYPE)(C2D_SURFACE_YUV_HOST |
-                                                 C2D_SURFACE_WITH_PHYS |
-                                                 C2D_SURFACE_WITH_PHYS_DUMMY ),
-                              &yuvSurfaceDef)) {
-            ALOGE("%s: create YUV source %d failed", __FUNCTION__, i);
-            ctx->blit_yuv_2_plane_object[i].surface_id = 0;
-            status = COPYBIT_FAILURE;
-            break;
-        } else {
-            ctx->blit_yuv_2_plane_object[i].surface_id = surface_id;
-            ALOGW("%s: 2 Plane YUV i=%d surface_id=%d",  __FUNCTION__, i,
-                                   ctx->blit_yuv_2_plane_object[i].surface_id);
+        for (int i = 0; i < initial_sources[type]; i++) {
+            if (add_surface(&ctx->src_pool[type], type) != COPYBIT_SUCCESS) {
+                status = COPYBIT_FAILURE;
+                break;
+            }
         }
-    }
-
-    if (status == COPYBIT_FAILURE) {
-        clean_up(ctx);
-        status = COPYBIT_FAILURE;
-        *device = NULL;
-        return status;
-    }
-
-    // Create YUV 3 plane surfaces
-    yuvSurfaceDef.format = C2D_COLOR_FORMAT_420_YV12;
-    yuvSurfaceDef.plane2 = (void*)0xaaaaaaaa;
-    yuvSurfaceDef.phys2 = (void*) 0xaaaaaaaa;
-    yuvSurfaceDef.stride2 = 4;
-
-    if (LINK_c2dCreateSurface(&(ctx->dst[YUV_SURFACE_3_PLANES]),
-                              C2D_TARGET | C2D_SOURCE,
-                              (C2D_SURFACE_TYPE)(C2D_SURFACE_YUV_HOST |
-                                                 C2D_SURFACE_WITH_PHYS |
-                                                 C2D_SURFACE_WITH_PHYS_DUMMY),
-                              &yuvSurfaceDef)) {
-        ALOGE("%s: create ctx->dst[YUV_SURFACE_3_PLANES] failed", __FUNCTION__);
-        ctx->dst[YUV_SURFACE_3_PLANES] = 0;
-        clean_up(ctx);
-        status = COPYBIT_FAILURE;
-        *device = NULL;
-        return status;
-    }
-
-    for (int i=0; i < MAX_YUV_3_PLANE_SURFACES; i++)
-    {
-        if (LINK_c2dCreateSurface(&(surface_id),
-                              C2D_TARGET | C2D_SOURCE,
-                              (C2D_SURFACE_TYPE)(C2D_SURFACE_YUV_HOST |
-                                                 C2D_SURFACE_WITH_PHYS |
-                                                 C2D_SURFACE_WITH_PHYS_DUMMY),
-                              &yuvSurfaceDef)) {
-            ALOGE("%s: create 3 plane YUV surface %d failed", __FUNCTION__, i);
-            ctx->blit_yuv_3_plane_object[i].surface_id = 0;
-            status = COPYBIT_FAILURE;
+        if (status == COPYBIT_FAILURE)
             break;
-        } else {
-            ctx->blit_yuv_3_plane_object[i].surface_id = surface_id;
-            ALOGW("%s: 3 Plane YUV i=%d surface_id=%d",  __FUNCTION__, i,
-                                   ctx->blit_yuv_3_plane_object[i].surface_id);
-        }
     }
 
-    if (status == COPYBIT_FAILURE) {
+    ctx->temp_src_hnd = new private_handle_t(-1, 0, 0, 0, 0, 0, 0);
+    ctx->temp_dst_hnd = new private_handle_t(-1, 0, 0, 0, 0, 0, 0);
+    if (status == COPYBIT_FAILURE || !ctx->temp_src_hnd ||
+        !ctx->temp_dst_hnd ||
+        !grow_array((void **)&ctx->blit_list, &ctx->blit_list_size,
+                    MAX_BLIT_OBJECT_COUNT, sizeof(C2D_OBJECT_STR))) {
         clean_up(ctx);
         status = COPYBIT_FAILURE;
         *device = NULL;
@@ -1651,26 +2362,27 @@ static int open_copybit(const struct hw_module_t* module, const char* name,
     // Initialize context variables.
     ctx->trg_transform = C2D_TARGET_ROTATE_0;
 
-    ctx->temp_src_buffer.fd = -1;
-    ctx->temp_src_buffer.base = 0;
-    ctx->temp_src_buffer.size = 0;
-
-    ctx->temp_dst_buffer.fd = -1;
-    ctx->temp_dst_buffer.base = 0;
-    ctx->temp_dst_buffer.size = 0;
-
     ctx->fb_width = 0;
     ctx->fb_height = 0;
 
-    ctx->blit_rgb_count = 0;
-    ctx->blit_yuv_2_plane_count = 0;
-    ctx->blit_yuv_3_plane_count = 0;
     ctx->blit_count = 0;
-
-    ctx->wait_timestamp = false;
+    ctx->segment_count = 0;
+    ctx->last_target = 0;
+    // Surfaces start out tagged with frame 0, which is complete
+    ctx->frame_seq = 1;
+    ctx->done_frame = 1;
+
+    ctx->draw_head = 0;
+    ctx->draw_tail = 0;
     ctx->stop_thread = false;
     pthread_mutex_init(&(ctx->wait_cleanup_lock), NULL);
-    pthread_cond_init(&(ctx->wait_cleanup_cond), NULL);
+    sem_init(&ctx->draw_free, 0, DRAW_QUEUE_DEPTH);
+    ctx->draw_pending = 0;
+    pthread_mutex_init(&ctx->draw_lock, NULL);
+    init_draw_cond(&ctx->draw_cond);
+    pthread_mutex_init(&(ctx->gpu_map_lock), NULL);
+    // Drop cached GPU mappings when gralloc unmaps their buffers
+    gralloc::addUnmapListener(gpu_map_invalidate, ctx);
     /* Start the wait thread */
     pthread_attr_t attr;
     pthread_attr_init(&attr);
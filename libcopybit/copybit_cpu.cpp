@@ -0,0 +1,958 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Software copybit backend used with COMPOSITION_TYPE_CPU, on targets
+ * where neither C2D nor the MDP blitter can be used. It is also a
+ * reference implementation of the copybit semantics the hardware
+ * backends are expected to follow.
+ *
+ * Pixels are processed in a canonical RGBA_8888 form: sources are
+ * fetched with bilinear filtering (or copied directly when the blit is
+ * unscaled and untransformed), blended into the destination and
+ * written back in the destination format. The destination is split in
+ * row tiles that are spread across the copybit worker pool.
+ */
+
+#include <cutils/log.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <copybit.h>
+#include <alloc_controller.h>
+#include <memalloc.h>
+
+#include "gralloc_priv.h"
+#include "worker_pool.h"
+
+#ifdef __ARM_HAVE_NEON
+#include <arm_neon.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using gralloc::IMemAlloc;
+
+#define MAX_SCALE_FACTOR    (16)
+#define MAX_DIMENSION       (4096)
+// Destination rows handed to a worker at a time
+#define TILE_ROWS           (32)
+// Pixels processed per span, bounds the per-thread scratch buffers
+#define SPAN_PIXELS         (256)
+// Clip rectangles gathered per batch of work
+#define MAX_CLIP_RECTS      (64)
+// Source buffers whose cleaned rows are remembered until the flush
+#define MAX_CLEAN_SRCS      (16)
+
+/******************************************************************************/
+
+struct copybit_context_t;
+
+/* Parameters of one stretch shared by all the tiles */
+struct cpu_blit_t {
+    const copybit_context_t *ctx;
+    const uint8_t *src;
+    uint8_t *dst;
+    int src_format;
+    int dst_format;
+    int src_stride;              // in pixels
+    int dst_stride;              // in pixels
+    copybit_rect_t src_rect;
+    copybit_rect_t dst_rect;
+    bool direct;                 // unscaled and untransformed
+    // Source position of a destination pixel in 16.16 fixed point:
+    // s = origin + x * dx + y * dy
+    int64_t sx_origin, sy_origin;
+    int64_t sx_dx, sy_dx, sx_dy, sy_dy;
+    copybit_rect_t rects[MAX_CLIP_RECTS];
+    int tiles[MAX_CLIP_RECTS + 1]; // prefix sum of the tiles of each rect
+    int num_rects;
+};
+
+/* Source rows cleaned since the last flush */
+struct clean_range_t {
+    const private_handle_t *hnd;
+    int top;                     // in bytes from the start of the buffer
+    int bottom;
+};
+
+/** State information for each device instance */
+struct copybit_context_t {
+    struct copybit_device_t device;
+    pthread_mutex_t lock;
+    int mAlpha;                  // plane alpha, 0 - 255
+    int mTransform;              // COPYBIT_TRANSFORM_xxx
+    int mBlend;                  // COPYBIT_BLENDING_xxx
+    bool mBlitToFB;
+    private_handle_t *mDirtyDst; // destination written since the last flush
+    struct copybit_params_t mParams; // last value of each parameter
+    struct clean_range_t mCleanSrc[MAX_CLEAN_SRCS];
+    int mNumCleanSrc;
+    cpu_blit_t mBlit;            // the stretch in progress, under lock
+};
+
+/**
+ * Common hardware methods
+ */
+
+static int open_copybit(const struct hw_module_t* module, const char* name,
+                        struct hw_device_t** device);
+
+static struct hw_module_methods_t copybit_module_methods = {
+open:  open_copybit
+};
+
+/*
+ * The COPYBIT Module
+ */
+struct copybit_module_t HAL_MODULE_INFO_SYM = {
+common: {
+tag: HARDWARE_MODULE_TAG,
+     version_major: 1,
+     version_minor: 0,
+     id: COPYBIT_HARDWARE_MODULE_ID,
+     name: "QCT COPYBIT CPU Module",
+     author: "Qualcomm",
+     methods: &copybit_module_methods
+        }
+};
+
+/******************************************************************************/
+
+/** min of int a, b */
+static inline int min(int a, int b) {
+    return (a<b) ? a : b;
+}
+
+/** max of int a, b */
+static inline int max(int a, int b) {
+    return (a>b) ? a : b;
+}
+
+/** Determine the intersection of lhs & rhs store in out */
+static void intersect(struct copybit_rect_t *out,
+                      const struct copybit_rect_t *lhs,
+                      const struct copybit_rect_t *rhs) {
+    out->l = max(lhs->l, rhs->l);
+    out->t = max(lhs->t, rhs->t);
+    out->r = min(lhs->r, rhs->r);
+    out->b = min(lhs->b, rhs->b);
+}
+
+static int get_bpp(int format)
+{
+    switch (format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+            return 4;
+        case HAL_PIXEL_FORMAT_RGB_565:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+/* x * y / 255, exact for 8 bit inputs */
+static inline uint32_t mul255(uint32_t x, uint32_t y)
+{
+    uint32_t t = x * y + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+/*
+ * Format conversion to and from the canonical RGBA_8888 pixel, which
+ * holds R in the low byte and A in the high byte.
+ */
+static void load_span(const uint8_t *src, int format, uint32_t *out, int count)
+{
+    switch (format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+            memcpy(out, src, count * 4);
+            break;
+        case HAL_PIXEL_FORMAT_RGBX_8888: {
+            const uint32_t *s = (const uint32_t *)src;
+            for (int i = 0; i < count; i++)
+                out[i] = s[i] | 0xFF000000;
+        } break;
+        case HAL_PIXEL_FORMAT_BGRA_8888: {
+            const uint32_t *s = (const uint32_t *)src;
+            for (int i = 0; i < count; i++) {
+                uint32_t p = s[i];
+                out[i] = (p & 0xFF00FF00) | ((p >> 16) & 0xFF) |
+                         ((p & 0xFF) << 16);
+            }
+        } break;
+        case HAL_PIXEL_FORMAT_RGB_565: {
+            const uint16_t *s = (const uint16_t *)src;
+            for (int i = 0; i < count; i++) {
+                uint32_t p = s[i];
+                uint32_t r = (p >> 11) & 0x1F;
+                uint32_t g = (p >> 5) & 0x3F;
+                uint32_t b = p & 0x1F;
+                r = (r << 3) | (r >> 2);
+                g = (g << 2) | (g >> 4);
+                b = (b << 3) | (b >> 2);
+                out[i] = 0xFF000000 | (b << 16) | (g << 8) | r;
+            }
+        } break;
+    }
+}
+
+static void store_span(uint8_t *dst, int format, const uint32_t *in, int count)
+{
+    switch (format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+            memcpy(dst, in, count * 4);
+            break;
+        case HAL_PIXEL_FORMAT_RGBX_8888: {
+            uint32_t *d = (uint32_t *)dst;
+            for (int i = 0; i < count; i++)
+                d[i] = in[i] | 0xFF000000;
+        } break;
+        case HAL_PIXEL_FORMAT_BGRA_8888: {
+            uint32_t *d = (uint32_t *)dst;
+            for (int i = 0; i < count; i++) {
+                uint32_t p = in[i];
+                d[i] = (p & 0xFF00FF00) | ((p >> 16) & 0xFF) |
+                       ((p & 0xFF) << 16);
+            }
+        } break;
+        case HAL_PIXEL_FORMAT_RGB_565: {
+            uint16_t *d = (uint16_t *)dst;
+            for (int i = 0; i < count; i++) {
+                uint32_t p = in[i];
+                d[i] = (uint16_t)(((p & 0xF8) << 8) | ((p >> 5) & 0x7E0) |
+                                  ((p >> 19) & 0x1F));
+            }
+        } break;
+    }
+}
+
+/*
+ * Bilinear interpolation. Each kernel takes the four neighbours of count
+ * pixels and 8 bit horizontal / vertical weights.
+ */
+static inline uint32_t lerp_pixel(uint32_t a, uint32_t b, uint32_t f)
+{
+    // Two channels per operation, the weights sum to 256 so every lane
+    // stays within 16 bits
+    uint32_t rb = (((a & 0x00FF00FF) * (256 - f) +
+                    (b & 0x00FF00FF) * f) >> 8) & 0x00FF00FF;
+    uint32_t ag = ((((a >> 8) & 0x00FF00FF) * (256 - f) +
+                    ((b >> 8) & 0x00FF00FF) * f)) & 0xFF00FF00;
+    return rb | ag;
+}
+
+static void bilinear_c(const uint32_t *p00, const uint32_t *p01,
+                       const uint32_t *p10, const uint32_t *p11,
+                       const uint16_t *fx, const uint16_t *fy,
+                       uint32_t *out, int count)
+{
+    for (int i = 0; i < count; i++) {
+        uint32_t top = lerp_pixel(p00[i], p01[i], fx[i]);
+        uint32_t bottom = lerp_pixel(p10[i], p11[i], fx[i]);
+        out[i] = lerp_pixel(top, bottom, fy[i]);
+    }
+}
+
+#if defined(__SSE2__)
+/* Lerp of 2 pixels widened to 16 bit lanes, weights broadcast per pixel */
+static inline __m128i lerp_sse2(__m128i a, __m128i b, __m128i w)
+{
+    __m128i iw = _mm_sub_epi16(_mm_set1_epi16(256), w);
+    return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(a, iw),
+                                        _mm_mullo_epi16(b, w)), 8);
+}
+
+static void bilinear_sse2(const uint32_t *p00, const uint32_t *p01,
+                          const uint32_t *p10, const uint32_t *p11,
+                          const uint16_t *fx, const uint16_t *fy,
+                          uint32_t *out, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128i wx = _mm_set_epi16(fx[i+1], fx[i+1], fx[i+1], fx[i+1],
+                                   fx[i], fx[i], fx[i], fx[i]);
+        __m128i wy = _mm_set_epi16(fy[i+1], fy[i+1], fy[i+1], fy[i+1],
+                                   fy[i], fy[i], fy[i], fy[i]);
+        __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p00 + i)), zero);
+        __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p01 + i)), zero);
+        __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p10 + i)), zero);
+        __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p11 + i)), zero);
+        __m128i top = lerp_sse2(a, b, wx);
+        __m128i bottom = lerp_sse2(c, d, wx);
+        __m128i res = lerp_sse2(top, bottom, wy);
+        _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(res, res));
+    }
+    bilinear_c(p00 + i, p01 + i, p10 + i, p11 + i, fx + i, fy + i,
+               out + i, count - i);
+}
+#endif
+
+#ifdef __ARM_HAVE_NEON
+static inline uint16x8_t lerp_neon(uint16x8_t a, uint16x8_t b, uint16x8_t w)
+{
+    uint16x8_t iw = vsubq_u16(vdupq_n_u16(256), w);
+    return vshrq_n_u16(vmlaq_u16(vmulq_u16(a, iw), b, w), 8);
+}
+
+static void bilinear_neon(const uint32_t *p00, const uint32_t *p01,
+                          const uint32_t *p10, const uint32_t *p11,
+                          const uint16_t *fx, const uint16_t *fy,
+                          uint32_t *out, int count)
+{
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        uint16x4_t wx0 = vdup_n_u16(fx[i]), wx1 = vdup_n_u16(fx[i+1]);
+        uint16x4_t wy0 = vdup_n_u16(fy[i]), wy1 = vdup_n_u16(fy[i+1]);
+        uint16x8_t wx = vcombine_u16(wx0, wx1);
+        uint16x8_t wy = vcombine_u16(wy0, wy1);
+        uint16x8_t a = vmovl_u8(vld1_u8((const uint8_t *)(p00 + i)));
+        uint16x8_t b = vmovl_u8(vld1_u8((const uint8_t *)(p01 + i)));
+        uint16x8_t c = vmovl_u8(vld1_u8((const uint8_t *)(p10 + i)));
+        uint16x8_t d = vmovl_u8(vld1_u8((const uint8_t *)(p11 + i)));
+        uint16x8_t top = lerp_neon(a, b, wx);
+        uint16x8_t bottom = lerp_neon(c, d, wx);
+        vst1_u8((uint8_t *)(out + i), vmovn_u16(lerp_neon(top, bottom, wy)));
+    }
+    bilinear_c(p00 + i, p01 + i, p10 + i, p11 + i, fx + i, fy + i,
+               out + i, count - i);
+}
+#endif
+
+/*
+ * Blending of a span of canonical pixels into the destination span.
+ *   premultiplied: d = s * pa + d * (1 - sa * pa)
+ *   coverage:      d = s * sa * pa + d * (1 - sa * pa)
+ * with the destination alpha following the premultiplied equation in
+ * both cases. Opaque layers with plane alpha are treated as premultiplied
+ * with a source alpha of one.
+ */
+static void blend_c(uint32_t *dst, const uint32_t *src, int count,
+                    bool coverage, uint32_t pa)
+{
+    for (int i = 0; i < count; i++) {
+        uint32_t s = src[i], d = dst[i];
+        uint32_t sa = mul255(s >> 24, pa);
+        uint32_t cm = coverage ? sa : pa;
+        uint32_t k = 255 - sa;
+        uint32_t r = mul255(s & 0xFF, cm) + mul255(d & 0xFF, k);
+        uint32_t g = mul255((s >> 8) & 0xFF, cm) + mul255((d >> 8) & 0xFF, k);
+        uint32_t b = mul255((s >> 16) & 0xFF, cm) + mul255((d >> 16) & 0xFF, k);
+        uint32_t a = sa + mul255(d >> 24, k);
+        dst[i] = (min(a, 255) << 24) | (min(b, 255) << 16) |
+                 (min(g, 255) << 8) | min(r, 255);
+    }
+}
+
+#if defined(__SSE2__)
+/* x * y / 255 on 16 bit lanes holding 8 bit values */
+static inline __m128i mul255_sse2(__m128i x, __m128i y)
+{
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(x, y), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static void blend_sse2(uint32_t *dst, const uint32_t *src, int count,
+                       bool coverage, uint32_t pa)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vpa = _mm_set1_epi16((short)pa);
+    const __m128i v255 = _mm_set1_epi16(255);
+    // Selects the alpha lane of each pixel
+    const __m128i amask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128i s = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(src + i)), zero);
+        __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(dst + i)), zero);
+        // Broadcast the source alpha to every lane of its pixel
+        __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF);
+        __m128i sa = mul255_sse2(a, vpa);
+        __m128i cm = coverage ?
+                _mm_or_si128(_mm_and_si128(amask, vpa), _mm_andnot_si128(amask, sa)) :
+                vpa;
+        __m128i k = _mm_sub_epi16(v255, sa);
+        __m128i res = _mm_add_epi16(mul255_sse2(s, cm), mul255_sse2(d, k));
+        _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(res, res));
+    }
+    blend_c(dst + i, src + i, count - i, coverage, pa);
+}
+#endif
+
+#ifdef __ARM_HAVE_NEON
+static inline uint16x8_t mul255_neon(uint16x8_t x, uint16x8_t y)
+{
+    uint16x8_t t = vaddq_u16(vmulq_u16(x, y), vdupq_n_u16(128));
+    return vshrq_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8);
+}
+
+static void blend_neon(uint32_t *dst, const uint32_t *src, int count,
+                       bool coverage, uint32_t pa)
+{
+    static const uint16_t kAlphaLanes[8] = { 0, 0, 0, 0xFFFF, 0, 0, 0, 0xFFFF };
+    const uint16x8_t amask = vld1q_u16(kAlphaLanes);
+    const uint16x8_t vpa = vdupq_n_u16((uint16_t)pa);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        uint16x8_t s = vmovl_u8(vld1_u8((const uint8_t *)(src + i)));
+        uint16x8_t d = vmovl_u8(vld1_u8((const uint8_t *)(dst + i)));
+        uint16x4_t a0 = vdup_n_u16(src[i] >> 24);
+        uint16x4_t a1 = vdup_n_u16(src[i + 1] >> 24);
+        uint16x8_t sa = mul255_neon(vcombine_u16(a0, a1), vpa);
+        uint16x8_t cm = coverage ? vbslq_u16(amask, vpa, sa) : vpa;
+        uint16x8_t k = vsubq_u16(vdupq_n_u16(255), sa);
+        uint16x8_t res = vaddq_u16(mul255_neon(s, cm), mul255_neon(d, k));
+        vst1_u8((uint8_t *)(dst + i), vqmovn_u16(res));
+    }
+    blend_c(dst + i, src + i, count - i, coverage, pa);
+}
+#endif
+
+typedef void (*bilinear_fn)(const uint32_t *, const uint32_t *,
+                            const uint32_t *, const uint32_t *,
+                            const uint16_t *, const uint16_t *,
+                            uint32_t *, int);
+typedef void (*blend_fn)(uint32_t *, const uint32_t *, int, bool, uint32_t);
+
+#if defined(__ARM_HAVE_NEON)
+static const bilinear_fn sBilinear = bilinear_neon;
+static const blend_fn sBlend = blend_neon;
+#elif defined(__SSE2__)
+static const bilinear_fn sBilinear = bilinear_sse2;
+static const blend_fn sBlend = blend_sse2;
+#else
+static const bilinear_fn sBilinear = bilinear_c;
+static const blend_fn sBlend = blend_c;
+#endif
+
+/******************************************************************************/
+
+/* Fetch count filtered source pixels for the destination span at (x, y) */
+static void fetch_span(const cpu_blit_t *blit, int x, int y,
+                       uint32_t *out, int count)
+{
+    const copybit_rect_t& sr = blit->src_rect;
+    int bpp = get_bpp(blit->src_format);
+
+    if (blit->direct) {
+        int sx = x - blit->dst_rect.l + sr.l;
+        int sy = y - blit->dst_rect.t + sr.t;
+        load_span(blit->src + (sy * blit->src_stride + sx) * bpp,
+                  blit->src_format, out, count);
+        return;
+    }
+
+    uint32_t p[4][SPAN_PIXELS];
+    uint16_t fx[SPAN_PIXELS], fy[SPAN_PIXELS];
+    int64_t sx = blit->sx_origin + x * blit->sx_dx + y * blit->sx_dy;
+    int64_t sy = blit->sy_origin + x * blit->sy_dx + y * blit->sy_dy;
+    for (int i = 0; i < count; i++, sx += blit->sx_dx, sy += blit->sy_dx) {
+        // Clamp the filter footprint to the source crop
+        int x0 = (int)(sx >> 16), y0 = (int)(sy >> 16);
+        fx[i] = (uint16_t)((sx >> 8) & 0xFF);
+        fy[i] = (uint16_t)((sy >> 8) & 0xFF);
+        if (x0 < sr.l) { x0 = sr.l; fx[i] = 0; }
+        if (y0 < sr.t) { y0 = sr.t; fy[i] = 0; }
+        int x1 = min(x0 + 1, sr.r - 1);
+        int y1 = min(y0 + 1, sr.b - 1);
+        x0 = min(x0, sr.r - 1);
+        y0 = min(y0, sr.b - 1);
+        const uint8_t *row0 = blit->src + y0 * blit->src_stride * bpp;
+        const uint8_t *row1 = blit->src + y1 * blit->src_stride * bpp;
+        load_span(row0 + x0 * bpp, blit->src_format, &p[0][i], 1);
+        load_span(row0 + x1 * bpp, blit->src_format, &p[1][i], 1);
+        load_span(row1 + x0 * bpp, blit->src_format, &p[2][i], 1);
+        load_span(row1 + x1 * bpp, blit->src_format, &p[3][i], 1);
+    }
+    sBilinear(p[0], p[1], p[2], p[3], fx, fy, out, count);
+}
+
+/* Compose one tile of destination rows */
+static int blit_tile(void *arg, int band, int num_bands)
+{
+    const cpu_blit_t *blit = (const cpu_blit_t *)arg;
+    const copybit_context_t *ctx = blit->ctx;
+
+    int r = 0;
+    while (band >= blit->tiles[r + 1])
+        r++;
+    const copybit_rect_t& rect = blit->rects[r];
+    int top = rect.t + (band - blit->tiles[r]) * TILE_ROWS;
+    int bottom = min(top + TILE_ROWS, rect.b);
+
+    bool opaque = (ctx->mBlend == COPYBIT_BLENDING_NONE);
+    bool blend = !opaque || ctx->mAlpha < 255;
+    bool coverage = (ctx->mBlend == COPYBIT_BLENDING_COVERAGE);
+    int dbpp = get_bpp(blit->dst_format);
+    uint32_t src[SPAN_PIXELS], dst[SPAN_PIXELS];
+
+    for (int y = top; y < bottom; y++) {
+        uint8_t *drow = blit->dst + y * blit->dst_stride * dbpp;
+        for (int x = rect.l; x < rect.r; x += SPAN_PIXELS) {
+            int count = min(SPAN_PIXELS, rect.r - x);
+            fetch_span(blit, x, y, src, count);
+            if (blend) {
+                if (opaque) {
+                    for (int i = 0; i < count; i++)
+                        src[i] |= 0xFF000000;
+                }
+                load_span(drow + x * dbpp, blit->dst_format, dst, count);
+                sBlend(dst, src, count, coverage, ctx->mAlpha);
+                store_span(drow + x * dbpp, blit->dst_format, dst, count);
+            } else {
+                store_span(drow + x * dbpp, blit->dst_format, src, count);
+            }
+        }
+    }
+    return 0;
+}
+
+/* Set up the mapping from destination pixels to source coordinates */
+static void set_mapping(const copybit_context_t *ctx, cpu_blit_t *blit)
+{
+    const copybit_rect_t& sr = blit->src_rect;
+    const copybit_rect_t& dr = blit->dst_rect;
+    double sw = sr.r - sr.l, sh = sr.b - sr.t;
+    double dw = dr.r - dr.l, dh = dr.b - dr.t;
+
+    blit->direct = (ctx->mTransform == 0) && (sw == dw) && (sh == dh);
+
+    // Normalized destination coordinates u, v in [0, 1) are taken back
+    // through the transform: the rotation is applied after the flips.
+    // Everything is affine, so evaluate the origin and both derivatives.
+    double m[3][2]; // source position of (0,0), d/dx and d/dy
+    for (int i = 0; i < 3; i++) {
+        double x = (i == 1) ? 1.0 : 0.0, y = (i == 2) ? 1.0 : 0.0;
+        double u = (i == 0) ? (0.5 - dr.l) / dw : x / dw;
+        double v = (i == 0) ? (0.5 - dr.t) / dh : y / dh;
+        bool origin = (i == 0);
+        if (ctx->mTransform & COPYBIT_TRANSFORM_ROT_90) {
+            double t = u;
+            u = v;
+            v = origin ? 1.0 - t : -t;
+        }
+        if (ctx->mTransform & COPYBIT_TRANSFORM_FLIP_H)
+            u = origin ? 1.0 - u : -u;
+        if (ctx->mTransform & COPYBIT_TRANSFORM_FLIP_V)
+            v = origin ? 1.0 - v : -v;
+        m[i][0] = origin ? sr.l + u * sw - 0.5 : u * sw;
+        m[i][1] = origin ? sr.t + v * sh - 0.5 : v * sh;
+    }
+    blit->sx_origin = (int64_t)(m[0][0] * 65536.0);
+    blit->sy_origin = (int64_t)(m[0][1] * 65536.0);
+    blit->sx_dx = (int64_t)(m[1][0] * 65536.0);
+    blit->sy_dx = (int64_t)(m[1][1] * 65536.0);
+    blit->sx_dy = (int64_t)(m[2][0] * 65536.0);
+    blit->sy_dy = (int64_t)(m[2][1] * 65536.0);
+}
+
+/* Run the gathered clip rectangles across the worker pool */
+static int run_blit(cpu_blit_t *blit)
+{
+    if (!blit->num_rects)
+        return 0;
+    copybit_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.run = blit_tile;
+    job.arg = blit;
+    job.num_bands = blit->tiles[blit->num_rects];
+    copybit_job_submit(&job);
+    int status = copybit_job_wait(&job);
+    blit->num_rects = 0;
+    return status;
+}
+
+/* Write back and drop the cache lines of len bytes at start of a buffer
+ * the CPU accesses */
+static void clean_buffer(private_handle_t *hnd, int start, int len)
+{
+    if (!hnd || (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER))
+        return;
+    gralloc::IAllocController* alloc = gralloc::IAllocController::getInstance();
+    IMemAlloc* memalloc = alloc ? alloc->getAllocator(hnd->flags) : NULL;
+    if (memalloc && memalloc->clean_buffer((void *)(hnd->base + start), len,
+                                           hnd->offset + start, hnd->fd)) {
+        ALOGE("%s: clean_buffer failed", __FUNCTION__);
+    }
+}
+
+/* Drop stale cache lines of the source rows a blit reads. The producer
+ * wrote them behind the CPU caches, each row only needs it once a frame */
+static void clean_src_rows(copybit_context_t *ctx, private_handle_t *hnd,
+                           int stride, int top, int bottom)
+{
+    int start = top * stride;
+    int end = min(bottom * stride, hnd->size);
+    if (start >= end)
+        return;
+
+    struct clean_range_t *range = NULL;
+    for (int i = 0; i < ctx->mNumCleanSrc; i++) {
+        if (ctx->mCleanSrc[i].hnd == hnd) {
+            range = &ctx->mCleanSrc[i];
+            break;
+        }
+    }
+    if (range && start >= range->top && end <= range->bottom)
+        return;
+    clean_buffer(hnd, start, end - start);
+
+    if (!range) {
+        if (ctx->mNumCleanSrc == MAX_CLEAN_SRCS)
+            return;
+        range = &ctx->mCleanSrc[ctx->mNumCleanSrc++];
+        range->hnd = hnd;
+    } else if (start <= range->bottom && end >= range->top) {
+        // Overlapping or adjacent, the union is clean
+        range->top = min(range->top, start);
+        range->bottom = max(range->bottom, end);
+        return;
+    }
+    range->top = start;
+    range->bottom = end;
+}
+
+/* Write back the cache lines of a destination the CPU rendered into */
+static void flush_dst(copybit_context_t *ctx)
+{
+    private_handle_t *hnd = ctx->mDirtyDst;
+    ctx->mDirtyDst = NULL;
+    if (hnd)
+        clean_buffer(hnd, 0, hnd->size);
+}
+
+/*****************************************************************************/
+
+/* Apply one parameter, called with ctx->lock held */
+static int apply_parameter(struct copybit_context_t* ctx, int name, int value)
+{
+    int status = 0;
+    switch(name) {
+        case COPYBIT_ROTATION_DEG:
+            switch (value) {
+                case 0:   ctx->mTransform = 0; break;
+                case 90:  ctx->mTransform = COPYBIT_TRANSFORM_ROT_90; break;
+                case 180: ctx->mTransform = COPYBIT_TRANSFORM_ROT_180; break;
+                case 270: ctx->mTransform = COPYBIT_TRANSFORM_ROT_270; break;
+                default:
+                    ALOGE("Invalid value for COPYBIT_ROTATION_DEG");
+                    status = -EINVAL;
+                    break;
+            }
+            break;
+        case COPYBIT_PLANE_ALPHA:
+            if (value < 0)      value = 255;
+            if (value >= 256)   value = 255;
+            ctx->mAlpha = value;
+            break;
+        case COPYBIT_TRANSFORM:
+            ctx->mTransform = value & 0x7;
+            break;
+        case COPYBIT_BLEND_MODE:
+            ctx->mBlend = value;
+            break;
+        case COPYBIT_BLIT_TO_FRAMEBUFFER:
+            ctx->mBlitToFB = (value == COPYBIT_ENABLE);
+            break;
+        case COPYBIT_DITHER:
+        case COPYBIT_BLUR:
+        case COPYBIT_FRAMEBUFFER_WIDTH:
+        case COPYBIT_FRAMEBUFFER_HEIGHT:
+            // Not needed by the software path
+            break;
+        default:
+            ALOGE("%s: default case param=0x%x", __FUNCTION__, name);
+            status = -EINVAL;
+            break;
+    }
+    if (status == 0) {
+        // Rotation and transform both set mTransform
+        if (name == COPYBIT_ROTATION_DEG)
+            ctx->mParams.mask &= ~(1 << COPYBIT_TRANSFORM);
+        else if (name == COPYBIT_TRANSFORM)
+            ctx->mParams.mask &= ~(1 << COPYBIT_ROTATION_DEG);
+        copybit_params_set(&ctx->mParams, name, value);
+    }
+    return status;
+}
+
+/** Set a parameter to value */
+static int set_parameter_copybit(
+    struct copybit_device_t *dev,
+    int name,
+    int value)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    int status = 0;
+    if (!ctx) {
+        ALOGE("%s: null context", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    status = apply_parameter(ctx, name, value);
+    pthread_mutex_unlock(&ctx->lock);
+    return status;
+}
+
+/** Set the parameters of a block that differ from the current ones */
+static int set_parameters_copybit(
+    struct copybit_device_t *dev,
+    struct copybit_params_t const *params)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    int status = 0;
+    if (!ctx || !params) {
+        ALOGE("%s: null context or parameters", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    for (int name = 0; name < COPYBIT_PARAMETER_COUNT; name++) {
+        uint32_t bit = 1 << name;
+        if (!(params->mask & bit))
+            continue;
+        if ((ctx->mParams.mask & bit) &&
+            ctx->mParams.value[name] == params->value[name])
+            continue;
+        if (apply_parameter(ctx, name, params->value[name]))
+            status = -EINVAL;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return status;
+}
+
+
+/** Get a static info value */
+static int get(struct copybit_device_t *dev, int name)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    int value;
+
+    if (!ctx) {
+        ALOGE("%s: null context error", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    switch(name) {
+        case COPYBIT_MINIFICATION_LIMIT:
+            value = MAX_SCALE_FACTOR;
+            break;
+        case COPYBIT_MAGNIFICATION_LIMIT:
+            value = MAX_SCALE_FACTOR;
+            break;
+        case COPYBIT_SCALING_FRAC_BITS:
+            value = 16;
+            break;
+        case COPYBIT_ROTATION_STEP_DEG:
+            value = 90;
+            break;
+        default:
+            ALOGE("%s: default case param=0x%x", __FUNCTION__, name);
+            value = -EINVAL;
+    }
+    return value;
+}
+
+/** do a stretch blit type operation */
+static int stretch_copybit(
+    struct copybit_device_t *dev,
+    struct copybit_image_t const *dst,
+    struct copybit_image_t const *src,
+    struct copybit_rect_t const *dst_rect,
+    struct copybit_rect_t const *src_rect,
+    struct copybit_region_t const *region)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    int status = 0;
+
+    if (!ctx) {
+        ALOGE("%s: null context error", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    if (!get_bpp(src->format) || !get_bpp(dst->format)) {
+        ALOGE("%s: unsupported format src=0x%x dst=0x%x", __FUNCTION__,
+              src->format, dst->format);
+        return -EINVAL;
+    }
+
+    if (src->w > MAX_DIMENSION || src->h > MAX_DIMENSION ||
+        dst->w > MAX_DIMENSION || dst->h > MAX_DIMENSION) {
+        ALOGE("%s: dimension error src %dx%d dst %dx%d", __FUNCTION__,
+              src->w, src->h, dst->w, dst->h);
+        return -EINVAL;
+    }
+
+    if (src_rect->l < 0 || (uint32_t)src_rect->r > src->w ||
+        src_rect->t < 0 || (uint32_t)src_rect->b > src->h ||
+        src_rect->l >= src_rect->r || src_rect->t >= src_rect->b ||
+        dst_rect->l >= dst_rect->r || dst_rect->t >= dst_rect->b) {
+        ALOGE("%s: Invalid rectangles src l %d t %d r %d b %d "
+              "dst l %d t %d r %d b %d", __FUNCTION__,
+              src_rect->l, src_rect->t, src_rect->r, src_rect->b,
+              dst_rect->l, dst_rect->t, dst_rect->r, dst_rect->b);
+        return -EINVAL;
+    }
+
+    private_handle_t *src_hnd = (private_handle_t *)src->handle;
+    private_handle_t *dst_hnd = (private_handle_t *)dst->handle;
+    if (!src_hnd || !dst_hnd || !src_hnd->base || !dst_hnd->base) {
+        ALOGE("%s: buffers are not mapped", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->mDirtyDst && ctx->mDirtyDst != dst_hnd)
+        flush_dst(ctx);
+    if (src_hnd != dst_hnd) {
+        // Bilinear taps stay inside the source crop
+        int sbpp = get_bpp(src->format);
+        clean_src_rows(ctx, src_hnd, src->w * sbpp, src_rect->t, src_rect->b);
+    }
+
+    cpu_blit_t *blit = &ctx->mBlit;
+    blit->ctx = ctx;
+    blit->src = (const uint8_t *)src_hnd->base;
+    blit->dst = (uint8_t *)dst_hnd->base;
+    blit->src_format = src->format;
+    blit->dst_format = dst->format;
+    blit->src_stride = src->w;
+    blit->dst_stride = dst->w;
+    blit->src_rect = *src_rect;
+    blit->dst_rect = *dst_rect;
+    blit->num_rects = 0;
+    blit->tiles[0] = 0;
+    set_mapping(ctx, blit);
+
+    const struct copybit_rect_t bounds = { 0, 0, (int)dst->w, (int)dst->h };
+    struct copybit_rect_t clip;
+    while ((status == 0) && region->next(region, &clip)) {
+        intersect(&clip, &bounds, &clip);
+        intersect(&clip, dst_rect, &clip);
+        if (clip.r <= clip.l || clip.b <= clip.t)
+            continue;
+        int n = blit->num_rects++;
+        blit->rects[n] = clip;
+        blit->tiles[n + 1] = blit->tiles[n] +
+                (clip.b - clip.t + TILE_ROWS - 1) / TILE_ROWS;
+        if (blit->num_rects == MAX_CLIP_RECTS)
+            status = run_blit(blit);
+    }
+    if (status == 0)
+        status = run_blit(blit);
+
+    ctx->mDirtyDst = dst_hnd;
+    pthread_mutex_unlock(&ctx->lock);
+    return status;
+}
+
+/** Perform a blit type operation */
+static int blit_copybit(
+    struct copybit_device_t *dev,
+    struct copybit_image_t const *dst,
+    struct copybit_image_t const *src,
+    struct copybit_region_t const *region)
+{
+    struct copybit_rect_t dr = { 0, 0, (int)dst->w, (int)dst->h };
+    struct copybit_rect_t sr = { 0, 0, (int)src->w, (int)src->h };
+    return stretch_copybit(dev, dst, src, &dr, &sr, region);
+}
+
+/* Every blit has completed on return, there is no fence to wait for */
+static int flush_get_fence_copybit(struct copybit_device_t *dev, int* fd)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    if (!ctx || !fd)
+        return -EINVAL;
+    pthread_mutex_lock(&ctx->lock);
+    flush_dst(ctx);
+    // The next frame's sources may have been rewritten
+    ctx->mNumCleanSrc = 0;
+    pthread_mutex_unlock(&ctx->lock);
+    *fd = -1;
+    return 0;
+}
+
+static int finish_copybit(struct copybit_device_t *dev)
+{
+    int fd;
+    return flush_get_fence_copybit(dev, &fd);
+}
+
+/*****************************************************************************/
+
+/** Close the copybit device */
+static int close_copybit(struct hw_device_t *dev)
+{
+    struct copybit_context_t* ctx = (struct copybit_context_t*)dev;
+    if (ctx) {
+        pthread_mutex_destroy(&ctx->lock);
+        free(ctx);
+    }
+    return 0;
+}
+
+/** Open a new instance of a copybit device using name */
+static int open_copybit(const struct hw_module_t* module, const char* name,
+                        struct hw_device_t** device)
+{
+    copybit_context_t *ctx;
+    ctx = (copybit_context_t *)malloc(sizeof(copybit_context_t));
+    if (!ctx) {
+        ALOGE("%s: malloc failed", __FUNCTION__);
+        return -ENOMEM;
+    }
+    memset(ctx, 0, sizeof(*ctx));
+
+    ctx->device.common.tag = HARDWARE_DEVICE_TAG;
+    ctx->device.common.version = COPYBIT_DEVICE_API_VERSION_2;
+    ctx->device.common.module = const_cast<hw_module_t*>(module);
+    ctx->device.common.close = close_copybit;
+    ctx->device.set_parameter = set_parameter_copybit;
+    ctx->device.set_parameters = set_parameters_copybit;
+    ctx->device.get = get;
+    ctx->device.blit = blit_copybit;
+    ctx->device.stretch = stretch_copybit;
+    ctx->device.finish = finish_copybit;
+    ctx->device.flush_get_fence = flush_get_fence_copybit;
+    ctx->mAlpha = 255;
+    ctx->mBlend = COPYBIT_BLENDING_NONE;
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    *device = &ctx->device.common;
+    return 0;
+}
@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Host throughput benchmark of the NV12 macrotile converter. Detiles and
+ * tiles a frame with convert_yuv() and with a naive per-pixel reference,
+ * checks that both agree and prints the rate of each in frame bytes per
+ * second.
+ *
+ * usage: copybit_detile_bench [width height [iterations]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "software_converter.h"
+
+#define TILE_WIDTH  64
+#define TILE_HEIGHT 32
+#define TILE_SIZE   (TILE_WIDTH * TILE_HEIGHT)
+
+#define TILED_FORMAT  HAL_PIXEL_FORMAT_YCbCr_420_SP_TILED
+#define LINEAR_FORMAT HAL_PIXEL_FORMAT_YCbCr_420_SP
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Byte offset of pixel (x, y) of a tiled plane of tiles_w x tiles_h tiles */
+static size_t naive_offset(unsigned int x, unsigned int y,
+                           unsigned int tiles_w, unsigned int tiles_h)
+{
+    unsigned int tx = x / TILE_WIDTH;
+    unsigned int ty = y / TILE_HEIGHT;
+    unsigned int index = tx + (ty & ~1) * tiles_w;
+    if (ty & 1)
+        index += (tx & ~3) + 2;
+    else if ((tiles_h & 1) == 0 || ty != tiles_h - 1)
+        index += (tx + 2) & ~3;
+    return (size_t)index * TILE_SIZE +
+            (y % TILE_HEIGHT) * TILE_WIDTH + x % TILE_WIDTH;
+}
+
+/* Reference conversion of one plane, one pixel at a time */
+static void naive_plane(unsigned char *tiled, unsigned int tiles_w,
+                        unsigned char *linear, unsigned int stride,
+                        unsigned int width, unsigned int rows, bool to_linear)
+{
+    unsigned int tiles_h = (rows + TILE_HEIGHT - 1) / TILE_HEIGHT;
+    for (unsigned int y = 0; y < rows; y++) {
+        for (unsigned int x = 0; x < width; x++) {
+            unsigned char *t = tiled + naive_offset(x, y, tiles_w, tiles_h);
+            unsigned char *l = linear + y * stride + x;
+            if (to_linear)
+                *l = *t;
+            else
+                *t = *l;
+        }
+    }
+}
+
+static void naive_convert(private_handle_t *tiled, const yuv_plane_layout& tp,
+                          private_handle_t *linear,
+                          const yuv_plane_layout& lp,
+                          int width, int height, bool to_linear)
+{
+    unsigned char *t = (unsigned char *)tiled->base;
+    unsigned char *l = (unsigned char *)linear->base;
+    unsigned int tiles_w = tp.stride[0] / TILE_WIDTH;
+    naive_plane(t, tiles_w, l, lp.stride[0], width, height, to_linear);
+    naive_plane(t + tp.offset[1], tiles_w, l + lp.offset[1], lp.stride[1],
+                ALIGN(width, 2), height / 2, to_linear);
+}
+
+static private_handle_t* alloc_handle(int format, int width, int height,
+                                      size_t size)
+{
+    void *base = malloc(size);
+    if (!base)
+        return NULL;
+    memset(base, 0, size);
+    private_handle_t *hnd = new private_handle_t(-1, size, 0, 0, format,
+                                                 width, height);
+    hnd->base = (int)(intptr_t)base;
+    return hnd;
+}
+
+static void free_handle(private_handle_t *hnd)
+{
+    if (hnd) {
+        free((void *)(intptr_t)hnd->base);
+        delete hnd;
+    }
+}
+
+/* Compare the visible bytes of two linear NV12 buffers */
+static bool same_linear(private_handle_t *a, private_handle_t *b,
+                        const yuv_plane_layout& lp, int width, int height)
+{
+    const unsigned char *pa = (const unsigned char *)a->base;
+    const unsigned char *pb = (const unsigned char *)b->base;
+    for (int y = 0; y < height; y++) {
+        if (memcmp(pa + y * lp.stride[0], pb + y * lp.stride[0], width))
+            return false;
+    }
+    for (int y = 0; y < height / 2; y++) {
+        size_t off = lp.offset[1] + y * lp.stride[1];
+        if (memcmp(pa + off, pb + off, ALIGN(width, 2)))
+            return false;
+    }
+    return true;
+}
+
+static void report(const char *name, double secs, int iterations,
+                   size_t frame_bytes)
+{
+    double rate = (double)frame_bytes * iterations / secs / 1e9;
+    printf("%-24s %8.3f ms/frame %8.3f GB/s\n", name,
+           secs * 1000 / iterations, rate);
+}
+
+int main(int argc, char **argv)
+{
+    int width = 1920;
+    int height = 1080;
+    int iterations = 50;
+    if (argc >= 3) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+    if (argc >= 4)
+        iterations = atoi(argv[3]);
+    if (width <= 0 || height <= 0 || iterations <= 0) {
+        fprintf(stderr, "usage: %s [width height [iterations]]\n", argv[0]);
+        return 1;
+    }
+
+    // Tiled buffers are laid out from the frame size, linear ones from
+    // the aligned size gralloc stores in the handle
+    int lw = ALIGN(width, 16);
+    yuv_plane_layout tp, lp;
+    if (get_yuv_plane_layout(TILED_FORMAT, width, height,
+                             YUV_LAYOUT_ANDROID, tp) ||
+        get_yuv_plane_layout(LINEAR_FORMAT, lw, height,
+                             YUV_LAYOUT_ANDROID, lp)) {
+        fprintf(stderr, "unsupported size %dx%d\n", width, height);
+        return 1;
+    }
+
+    private_handle_t *tiled = alloc_handle(TILED_FORMAT, width, height,
+                                           tp.size);
+    private_handle_t *fast = alloc_handle(LINEAR_FORMAT, lw, height, lp.size);
+    private_handle_t *ref = alloc_handle(LINEAR_FORMAT, lw, height, lp.size);
+    if (!tiled || !fast || !ref) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    unsigned char *t = (unsigned char *)tiled->base;
+    for (size_t i = 0; i < tp.size; i++)
+        t[i] = (unsigned char)(i * 131 + (i >> 11));
+
+    size_t frame_bytes = (size_t)width * height * 3 / 2;
+    printf("%dx%d NV12, %d iterations, %d threads\n", width, height,
+           iterations, copybit_job_concurrency());
+
+    double start = now_sec();
+    for (int i = 0; i < iterations; i++)
+        naive_convert(tiled, tp, ref, lp, width, height, true);
+    report("naive tile->linear", now_sec() - start, iterations, frame_bytes);
+
+    start = now_sec();
+    for (int i = 0; i < iterations; i++) {
+        if (convert_yuv(tiled, TILED_FORMAT, YUV_LAYOUT_ANDROID, fast,
+                        LINEAR_FORMAT, YUV_LAYOUT_ANDROID, width, height)) {
+            fprintf(stderr, "convert_yuv failed\n");
+            return 1;
+        }
+    }
+    report("convert tile->linear", now_sec() - start, iterations,
+           frame_bytes);
+
+    int status = 0;
+    if (!same_linear(fast, ref, lp, width, height)) {
+        fprintf(stderr, "tile->linear output differs from the reference\n");
+        status = 1;
+    }
+
+    // Tile the linear frame back and expect the visible pixels to survive
+    memset(t, 0, tp.size);
+    start = now_sec();
+    for (int i = 0; i < iterations; i++)
+        naive_convert(tiled, tp, ref, lp, width, height, false);
+    report("naive linear->tile", now_sec() - start, iterations, frame_bytes);
+
+    memset(t, 0, tp.size);
+    start = now_sec();
+    for (int i = 0; i < iterations; i++) {
+        if (convert_yuv(fast, LINEAR_FORMAT, YUV_LAYOUT_ANDROID, tiled,
+                        TILED_FORMAT, YUV_LAYOUT_ANDROID, width, height)) {
+            fprintf(stderr, "convert_yuv failed\n");
+            return 1;
+        }
+    }
+    report("convert linear->tile", now_sec() - start, iterations,
+           frame_bytes);
+
+    memset((void *)(intptr_t)ref->base, 0, lp.size);
+    naive_convert(tiled, tp, ref, lp, width, height, true);
+    if (!same_linear(fast, ref, lp, width, height)) {
+        fprintf(stderr, "linear->tile output differs from the reference\n");
+        status = 1;
+    }
+
+    free_handle(tiled);
+    free_handle(fast);
+    free_handle(ref);
+    return status;
+}
@@ -29,11 +29,190 @@
 
 #include <cutils/log.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include "software_converter.h"
 
+#ifdef VENUS_COLOR_FORMAT
+#include <media/msm_media_info.h>
+#endif
+
+#ifdef __ARM_HAVE_NEON
+#include <arm_neon.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define COPYBIT_HAVE_AVX2_KERNEL 1
+#endif
+
+/*
+ * Chroma interleave kernels: write count {V, U} byte pairs into dst.
+ * The vector variants handle whole blocks and leave the remainder of
+ * the row to the scalar reference, so any width and any chroma stride
+ * can be fed to them row by row.
+ */
+typedef void (*interleave_fn)(unsigned char *dst, const unsigned char *v,
+                              const unsigned char *u, unsigned int count);
+
+static void interleave_chroma_c(unsigned char *dst, const unsigned char *v,
+                                const unsigned char *u, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++) {
+        dst[i*2]   = v[i];
+        dst[i*2+1] = u[i];
+    }
+}
+
+#ifdef __ARM_HAVE_NEON
+static void interleave_chroma_neon(unsigned char *dst, const unsigned char *v,
+                                   const unsigned char *u, unsigned int count)
+{
+    unsigned int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x2_t vu;
+        vu.val[0] = vld1q_u8(v + i);
+        vu.val[1] = vld1q_u8(u + i);
+        vst2q_u8(dst + i*2, vu);
+    }
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x2_t vu;
+        vu.val[0] = vld1_u8(v + i);
+        vu.val[1] = vld1_u8(u + i);
+        vst2_u8(dst + i*2, vu);
+    }
+    interleave_chroma_c(dst + i*2, v + i, u + i, count - i);
+}
+#endif
+
+#if defined(__SSE2__)
+static void interleave_chroma_sse2(unsigned char *dst, const unsigned char *v,
+                                   const unsigned char *u, unsigned int count)
+{
+    unsigned int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i vv = _mm_loadu_si128((const __m128i *)(v + i));
+        __m128i uu = _mm_loadu_si128((const __m128i *)(u + i));
+        _mm_storeu_si128((__m128i *)(dst + i*2), _mm_unpacklo_epi8(vv, uu));
+        _mm_storeu_si128((__m128i *)(dst + i*2 + 16),
+                         _mm_unpackhi_epi8(vv, uu));
+    }
+    interleave_chroma_c(dst + i*2, v + i, u + i, count - i);
+}
+#endif
+
+#ifdef COPYBIT_HAVE_AVX2_KERNEL
+__attribute__((target("avx2")))
+static void interleave_chroma_avx2(unsigned char *dst, const unsigned char *v,
+                                   const unsigned char *u, unsigned int count)
+{
+    unsigned int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i vv = _mm256_loadu_si256((const __m256i *)(v + i));
+        __m256i uu = _mm256_loadu_si256((const __m256i *)(u + i));
+        // unpack works within 128 bit lanes, so fix up the lane order
+        __m256i lo = _mm256_unpacklo_epi8(vv, uu);
+        __m256i hi = _mm256_unpackhi_epi8(vv, uu);
+        _mm256_storeu_si256((__m256i *)(dst + i*2),
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + i*2 + 32),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    interleave_chroma_c(dst + i*2, v + i, u + i, count - i);
+}
+#endif
+
+static interleave_fn sInterleave = interleave_chroma_c;
+static pthread_once_t sInterleaveOnce = PTHREAD_ONCE_INIT;
+
+static void select_interleave_kernel()
+{
+#ifdef __ARM_HAVE_NEON
+    sInterleave = interleave_chroma_neon;
+#endif
+#if defined(__SSE2__)
+    sInterleave = interleave_chroma_sse2;
+#endif
+#ifdef COPYBIT_HAVE_AVX2_KERNEL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        sInterleave = interleave_chroma_avx2;
+#endif
+}
+
+// Macrotile geometry of HAL_PIXEL_FORMAT_YCbCr_420_SP_TILED
+#define TILE_WIDTH  64
+#define TILE_HEIGHT 32
+#define TILE_SIZE   (TILE_WIDTH * TILE_HEIGHT)
+
+// Frames smaller than this are converted on the calling thread
+#define STRIPE_MIN_BYTES (1280 * 720)
+
+/* Split total rows into num_bands nearly equal bands */
+static void band_range(unsigned int total, int band, int num_bands,
+                       unsigned int& start, unsigned int& end)
+{
+    start = (unsigned int)(((unsigned long long)total * band) / num_bands);
+    end = (unsigned int)(((unsigned long long)total * (band + 1)) / num_bands);
+}
+
+/* Row band of the YV12 to YCrCb_420_SP conversion */
+static int yv12_band(void *arg, int band, int num_bands)
+{
+    convert_fence_t *f = (convert_fence_t *)arg;
+    unsigned int start, end;
+
+    band_range(f->y_size, band, num_bands, start, end);
+    memcpy(f->dst + start, f->src + start, end - start);
+
+    const unsigned char* crPlane = f->src + f->y_size;
+    const unsigned char* cbPlane = crPlane + f->c_size;
+    unsigned char* newChroma = f->dst + f->y_size;
+    band_range(f->c_rows, band, num_bands, start, end);
+    if (f->c_pairs == f->c_width) {
+        // Planes are contiguous, interleave the band in one pass
+        sInterleave(newChroma + start*f->c_pairs*2, crPlane + start*f->c_width,
+                    cbPlane + start*f->c_width, (end - start)*f->c_pairs);
+        return 0;
+    }
+
+    // The source rows carry c_width - width/2 bytes of padding that must
+    // not reach the destination, which is packed at width/2 pairs per row.
+    for (unsigned int r = start; r < end; r++) {
+        sInterleave(newChroma + r*f->c_pairs*2, crPlane + r*f->c_width,
+                    cbPlane + r*f->c_width, f->c_pairs);
+    }
+    return 0;
+}
+
+/* Queue a conversion described by the fence. Without an asynchronous
+ * caller the conversion is waited for before returning.
+ */
+static int run_conversion(convert_fence_t *f, bool async, unsigned int bytes,
+                          int (*run)(void *, int, int))
+{
+    f->job.run = run;
+    f->job.arg = f;
+    f->job.num_bands = (bytes >= STRIPE_MIN_BYTES) ? copybit_job_concurrency() : 1;
+    copybit_job_submit(&f->job);
+    if (async)
+        return COPYBIT_SUCCESS;
+    return wait_for_conversion(f);
+}
+
+int wait_for_conversion(convert_fence_t *fence)
+{
+    if (fence == NULL)
+        return COPYBIT_SUCCESS;
+    return copybit_job_wait(&fence->job) ? COPYBIT_FAILURE : COPYBIT_SUCCESS;
+}
+
 /** Convert YV12 to YCrCb_420_SP */
-int convertYV12toYCrCb420SP(const copybit_image_t *src, private_handle_t *yv12_handle)
+int convertYV12toYCrCb420SP(const copybit_image_t *src, private_handle_t *yv12_handle,
+                            convert_fence_t *fence)
 {
     private_handle_t* hnd = (private_handle_t*)src->handle;
 
@@ -42,6 +221,8 @@ int convertYV12toYCrCb420SP(const copybit_image_t *src, private_handle_t *yv12_h
         return -1;
     }
 
+    pthread_once(&sInterleaveOnce, select_interleave_kernel);
+
     // Please refer to the description of YV12 in hardware.h
     // for the formulae used to calculate buffer sizes and offsets
 
@@ -50,125 +231,506 @@ int convertYV12toYCrCb420SP(const copybit_image_t *src, private_handle_t *yv12_h
     // vertical stride is the same as height, so not considered
     unsigned int   stride  = src->w;
     unsigned int   width   = src->w - src->horiz_padding;
-    unsigned int   height  = src->h;
-    unsigned int   y_size  = stride * src->h;
     unsigned int   c_width = ALIGN(stride/2, 16);
-    unsigned int   c_size  = c_width * src->h/2;
-    unsigned int   chromaPadding = c_width - width/2;
-    unsigned int   chromaSize = c_size * 2;
-    unsigned char* newChroma = (unsigned char *)(yv12_handle->base + y_size);
-    unsigned char* oldChroma = (unsigned char*)(hnd->base + y_size);
-    memcpy((char *)yv12_handle->base,(char *)hnd->base,y_size);
 
-#ifdef __ARM_HAVE_NEON
-   /* interleave */
-    if(!chromaPadding) {
-        unsigned char * t1 = newChroma;
-        unsigned char * t2 = oldChroma;
-        unsigned char * t3 = t2 + chromaSize/2;
-        for(unsigned int i=0; i < (chromaSize/2)>>3; i++) {
-            __asm__ __volatile__ (
-                                    "vld1.u8 d0, [%0]! \n"
-                                    "vld1.u8 d1, [%1]! \n"
-                                    "vst2.u8 {d0, d1}, [%2]! \n"
-                                    :"+r"(t2), "+r"(t3), "+r"(t1)
-                                    :
-                                    :"memory","d0","d1"
-                                 );
+    convert_fence_t local;
+    convert_fence_t *f = fence ? fence : &local;
+    f->src     = (unsigned char *)hnd->base;
+    f->dst     = (unsigned char *)yv12_handle->base;
+    f->y_size  = stride * src->h;
+    f->c_width = c_width;
+    f->c_size  = c_width * src->h/2;
+    f->c_pairs = width/2;
+    f->c_rows  = src->h/2;
 
-        }
+    return run_conversion(f, fence != NULL, f->y_size, yv12_band);
+}
+
+/*
+ * Format descriptions used by the conversion engine. Alignments follow
+ * AdrenoMemInfo::getStride and getBufferSizeAndDimensions.
+ */
+static const yuv_format_desc sYUVFormats[] = {
+    // format                               planes hsub vsub cr_first stride chroma tiled
+    { HAL_PIXEL_FORMAT_YV12,                  3,   1,   1,   true,    16,    0,     false },
+    { HAL_PIXEL_FORMAT_YCbCr_420_P,           3,   1,   1,   false,   16,    0,     false },
+    { HAL_PIXEL_FORMAT_YCbCr_420_SP,          2,   1,   1,   false,   16,    0,     false },
+    { HAL_PIXEL_FORMAT_YCrCb_420_SP,          2,   1,   1,   true,    16,    0,     false },
+    { HAL_PIXEL_FORMAT_NV12_ENCODEABLE,       2,   1,   1,   false,   16,    2048,  false },
+    { HAL_PIXEL_FORMAT_YCbCr_420_SP_TILED,    2,   1,   1,   false,   128,   8192,  true },
+    { HAL_PIXEL_FORMAT_YCbCr_422_SP,          2,   1,   0,   false,   16,    0,     false },
+    { HAL_PIXEL_FORMAT_YCrCb_422_SP,          2,   1,   0,   true,    16,    0,     false },
+    { HAL_PIXEL_FORMAT_YCbCr_444_SP,          2,   0,   0,   false,   32,    0,     false },
+    { HAL_PIXEL_FORMAT_YCrCb_444_SP,          2,   0,   0,   true,    32,    0,     false },
+#ifdef VENUS_COLOR_FORMAT
+    { HAL_PIXEL_FORMAT_YCbCr_420_SP_VENUS,    2,   1,   1,   false,   128,   4096,  false },
+#endif
+};
+
+const yuv_format_desc* get_yuv_format_desc(int format)
+{
+    for (size_t i = 0; i < sizeof(sYUVFormats)/sizeof(sYUVFormats[0]); i++) {
+        if (sYUVFormats[i].format == format)
+            return &sYUVFormats[i];
     }
-#else  //__ARM_HAVE_NEON
-    if(!chromaPadding) {
-        for(unsigned int i = 0; i< chromaSize/2; i++) {
-            newChroma[i*2]   = oldChroma[i];
-            newChroma[i*2+1] = oldChroma[i+chromaSize/2];
-        }
+    return NULL;
+}
+
+int get_yuv_plane_layout(int format, int width, int height,
+                         eYUVLayout layout, yuv_plane_layout& planes)
+{
+    const yuv_format_desc *desc = get_yuv_format_desc(format);
+    if (!desc) {
+        ALOGE("%s: unsupported format 0x%x", __FUNCTION__, format);
+        return COPYBIT_FAILURE;
+    }
+
+    memset(&planes, 0, sizeof(planes));
+    // gralloc does not allocate a chroma row for an odd last luma row
+    int c_height = height >> desc->vsub;
+    int align = (layout == YUV_LAYOUT_C2D) ? 32 : desc->stride_align;
+    int y_stride = ALIGN(width, align);
+    int y_height = height;
 
+    if (desc->tiled) {
+        // Both planes are made of whole 64x32 tiles in rows of an even
+        // number of tiles, each plane starting on an 8K boundary
+        y_stride = ALIGN(width, 2 * TILE_WIDTH);
+        y_height = ALIGN(height, TILE_HEIGHT);
+        c_height = ALIGN(height / 2, TILE_HEIGHT);
+    }
+
+#ifdef VENUS_COLOR_FORMAT
+    if (format == HAL_PIXEL_FORMAT_YCbCr_420_SP_VENUS) {
+        y_stride = VENUS_Y_STRIDE(COLOR_FMT_NV12, width);
+        y_height = VENUS_Y_SCANLINES(COLOR_FMT_NV12, height);
+        c_height = VENUS_UV_SCANLINES(COLOR_FMT_NV12, height);
     }
 #endif
-    // If the image is not aligned to 16 pixels,
-    // convert using the C routine below
-    // r1 tracks the row of the source buffer
-    // r2 tracks the row of the destination buffer
-    // The width/2 checks are to avoid copying
-    // from the padding
-
-    if(chromaPadding) {
-        unsigned int r1 = 0, r2 = 0, i = 0, j = 0;
-        while(r1 < height/2) {
-            if(j == width) {
-                j = 0;
-                r2++;
-                continue;
-            }
-            if (j+1 == width) {
-                newChroma[r2*width + j] = oldChroma[r1*c_width+i];
-                r2++;
-                newChroma[r2*width] = oldChroma[r1*c_width+i+c_size];
-                j = 1;
-            } else {
-                newChroma[r2*width + j] = oldChroma[r1*c_width+i];
-                newChroma[r2*width + j + 1] = oldChroma[r1*c_width+i+c_size];
-                j+=2;
-            }
-            i++;
-            if (i == width/2 ) {
-                i = 0;
-                r1++;
-            }
+
+    planes.stride[0] = y_stride;
+    planes.offset[0] = 0;
+    planes.offset[1] = y_stride * y_height;
+    if (desc->chroma_align)
+        planes.offset[1] = ALIGN(planes.offset[1], desc->chroma_align);
+
+    if (desc->num_planes == 3) {
+        // Planar chroma strides are aligned on their own
+        int c_align = (layout == YUV_LAYOUT_C2D) ? 32 : 16;
+        planes.stride[1] = ALIGN(y_stride >> desc->hsub, c_align);
+        planes.stride[2] = planes.stride[1];
+        planes.offset[2] = planes.offset[1] + planes.stride[1] * c_height;
+        planes.size = planes.offset[2] + planes.stride[2] * c_height;
+    } else {
+        // Interleaved chroma: two bytes per chroma sample
+        planes.stride[1] = (y_stride >> desc->hsub) * 2;
+        planes.size = planes.offset[1] + planes.stride[1] * c_height;
+        if (desc->tiled)
+            planes.size = ALIGN(planes.size, desc->chroma_align);
+    }
+    return COPYBIT_SUCCESS;
+}
+
+bool is_yuv_conversion_supported(int src_format, int dst_format)
+{
+    const yuv_format_desc *src = get_yuv_format_desc(src_format);
+    const yuv_format_desc *dst = get_yuv_format_desc(dst_format);
+    if (!src || !dst)
+        return false;
+    if (src->tiled || dst->tiled) {
+        // Tiles are moved as is, the other side must be linear NV12
+        const yuv_format_desc *linear = src->tiled ? dst : src;
+        return !linear->tiled && linear->num_planes == 2 &&
+               linear->hsub == 1 && linear->vsub == 1 && !linear->cr_first;
+    }
+    // Chroma is resampled by at most a factor of two in each direction
+    return (abs(src->hsub - dst->hsub) <= 1) && (abs(src->vsub - dst->vsub) <= 1);
+}
+
+/*
+ * Chroma row kernels. Each one produces count chroma samples of the
+ * destination row from the matching source row. The generic version
+ * is specialized at compile time on the distance between consecutive
+ * samples of a plane (1 for planar, 2 for semiplanar) and on the
+ * horizontal resampling: 0 keeps the sample rate, 1 doubles it by
+ * replicating samples and -1 halves it by averaging pairs.
+ */
+template <int SRC_STEP, int DST_STEP, int HRATIO>
+static void chroma_row_resample(const unsigned char *src_cb,
+                                const unsigned char *src_cr,
+                                unsigned char *dst_cb, unsigned char *dst_cr,
+                                unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int cb, cr;
+        if (HRATIO > 0) {
+            cb = src_cb[(i >> 1) * SRC_STEP];
+            cr = src_cr[(i >> 1) * SRC_STEP];
+        } else if (HRATIO < 0) {
+            cb = (src_cb[2*i*SRC_STEP] + src_cb[(2*i + 1)*SRC_STEP] + 1) >> 1;
+            cr = (src_cr[2*i*SRC_STEP] + src_cr[(2*i + 1)*SRC_STEP] + 1) >> 1;
+        } else {
+            cb = src_cb[i * SRC_STEP];
+            cr = src_cr[i * SRC_STEP];
         }
+        dst_cb[i * DST_STEP] = (unsigned char)cb;
+        dst_cr[i * DST_STEP] = (unsigned char)cr;
     }
+}
 
-  return 0;
+/* Semiplanar to semiplanar, same order: plain row copy */
+static void chroma_row_copy_sp(const unsigned char *src_cb,
+                               const unsigned char *src_cr,
+                               unsigned char *dst_cb, unsigned char *dst_cr,
+                               unsigned int count)
+{
+    const unsigned char *src = (src_cb < src_cr) ? src_cb : src_cr;
+    unsigned char *dst = (dst_cb < dst_cr) ? dst_cb : dst_cr;
+    memcpy(dst, src, count * 2);
 }
 
-struct copyInfo{
-    int width;
-    int height;
-    int src_stride;
-    int dst_stride;
-    int src_plane1_offset;
-    int src_plane2_offset;
-    int dst_plane1_offset;
-    int dst_plane2_offset;
-};
+/* Semiplanar to semiplanar with Cb and Cr swapped (NV12 <-> NV21) */
+static void chroma_row_swap_sp(const unsigned char *src_cb,
+                               const unsigned char *src_cr,
+                               unsigned char *dst_cb, unsigned char *dst_cr,
+                               unsigned int count)
+{
+    const unsigned char *src = (src_cb < src_cr) ? src_cb : src_cr;
+    unsigned char *dst = (dst_cb < dst_cr) ? dst_cb : dst_cr;
+    // Both rows start on an even address, swap the bytes of every pair
+    unsigned int i = 0;
+    if (!(((uintptr_t)src | (uintptr_t)dst) & 1)) {
+        for (; i < count; i++) {
+            uint16_t pair = ((const uint16_t *)src)[i];
+            ((uint16_t *)dst)[i] = (uint16_t)((pair >> 8) | (pair << 8));
+        }
+        return;
+    }
+    for (; i < count; i++) {
+        dst[i*2]   = src[i*2 + 1];
+        dst[i*2+1] = src[i*2];
+    }
+}
+
+/* Planar to planar: copy both planes */
+static void chroma_row_copy_planar(const unsigned char *src_cb,
+                                   const unsigned char *src_cr,
+                                   unsigned char *dst_cb, unsigned char *dst_cr,
+                                   unsigned int count)
+{
+    memcpy(dst_cb, src_cb, count);
+    memcpy(dst_cr, src_cr, count);
+}
+
+/* Planar to semiplanar: interleave with the vector kernels */
+static void chroma_row_interleave(const unsigned char *src_cb,
+                                  const unsigned char *src_cr,
+                                  unsigned char *dst_cb, unsigned char *dst_cr,
+                                  unsigned int count)
+{
+    if (dst_cr < dst_cb)
+        sInterleave(dst_cr, src_cr, src_cb, count);
+    else
+        sInterleave(dst_cb, src_cb, src_cr, count);
+}
+
+/* Semiplanar to planar */
+static void chroma_row_deinterleave(const unsigned char *src_cb,
+                                    const unsigned char *src_cr,
+                                    unsigned char *dst_cb, unsigned char *dst_cr,
+                                    unsigned int count)
+{
+    chroma_row_resample<2, 1, 0>(src_cb, src_cr, dst_cb, dst_cr, count);
+}
 
-/* Internal function to do the actual copy of source to destination */
-static int copy_source_to_destination(const int src_base, const int dst_base,
-                                      copyInfo& info)
+/* Pick the chroma row kernel for a source/destination pair */
+static chroma_row_fn get_chroma_row_fn(const yuv_format_desc *src,
+                                       const yuv_format_desc *dst)
 {
-    if (!src_base || !dst_base) {
-        ALOGE("%s: invalid memory src_base = 0x%x dst_base=0x%x",
-             __FUNCTION__, src_base, dst_base);
-         return COPYBIT_FAILURE;
+    bool src_sp = (src->num_planes == 2);
+    bool dst_sp = (dst->num_planes == 2);
+    int hratio = src->hsub - dst->hsub;
+
+    if (hratio == 0) {
+        if (src_sp && dst_sp)
+            return (src->cr_first == dst->cr_first) ? chroma_row_copy_sp
+                                                    : chroma_row_swap_sp;
+        if (!src_sp && !dst_sp)
+            return chroma_row_copy_planar;
+        return src_sp ? chroma_row_deinterleave : chroma_row_interleave;
     }
 
-    int width = info.width;
-    int height = info.height;
-    unsigned char *src = (unsigned char*)src_base;
-    unsigned char *dst = (unsigned char*)dst_base;
+#define RESAMPLE_FN(r) \
+    (src_sp ? (dst_sp ? chroma_row_resample<2, 2, r> : chroma_row_resample<2, 1, r>) \
+            : (dst_sp ? chroma_row_resample<1, 2, r> : chroma_row_resample<1, 1, r>))
+    if (hratio > 0)
+        return RESAMPLE_FN(1);
+    return RESAMPLE_FN(-1);
+#undef RESAMPLE_FN
+}
+
+/* Row band of a convert_yuv() conversion */
+static int convert_yuv_band(void *arg, int band, int num_bands)
+{
+    convert_fence_t *f = (convert_fence_t *)arg;
+    const yuv_format_desc *sd = f->src_desc;
+    const yuv_format_desc *dd = f->dst_desc;
+    const yuv_plane_layout& sp = f->src_planes;
+    const yuv_plane_layout& dp = f->dst_planes;
+    unsigned int start, end;
 
     // Copy the luma
-    for (int i = 0; i < height; i++) {
-        memcpy(dst, src, width);
-        src += info.src_stride;
-        dst += info.dst_stride;
+    band_range(f->height, band, num_bands, start, end);
+    const unsigned char *src = f->src + start * sp.stride[0];
+    unsigned char *dst = f->dst + start * dp.stride[0];
+    for (unsigned int i = start; i < end; i++) {
+        memcpy(dst, src, f->width);
+        src += sp.stride[0];
+        dst += dp.stride[0];
     }
 
-    // Copy plane 1
-    src = (unsigned char*)(src_base + info.src_plane1_offset);
-    dst = (unsigned char*)(dst_base + info.dst_plane1_offset);
-    width = width/2;
-    height = height/2;
-    for (int i = 0; i < height; i++) {
-        memcpy(dst, src, info.src_stride);
-        src += info.src_stride;
-        dst += info.dst_stride;
+    // Convert the chroma rows of the destination, picking the source row
+    // by nearest neighbour when the vertical subsampling differs
+    unsigned int c_rows = f->height >> dd->vsub;
+    unsigned int c_count = (f->width + (1 << dd->hsub) - 1) >> dd->hsub;
+    band_range(c_rows, band, num_bands, start, end);
+    for (unsigned int r = start; r < end; r++) {
+        unsigned int sr = (r << dd->vsub) >> sd->vsub;
+        const unsigned char *s_cb, *s_cr;
+        unsigned char *d_cb, *d_cr;
+        if (sd->num_planes == 3) {
+            const unsigned char *p1 = f->src + sp.offset[1] + sr * sp.stride[1];
+            const unsigned char *p2 = f->src + sp.offset[2] + sr * sp.stride[2];
+            s_cb = sd->cr_first ? p2 : p1;
+            s_cr = sd->cr_first ? p1 : p2;
+        } else {
+            const unsigned char *p1 = f->src + sp.offset[1] + sr * sp.stride[1];
+            s_cb = p1 + (sd->cr_first ? 1 : 0);
+            s_cr = p1 + (sd->cr_first ? 0 : 1);
+        }
+        if (dd->num_planes == 3) {
+            unsigned char *p1 = f->dst + dp.offset[1] + r * dp.stride[1];
+            unsigned char *p2 = f->dst + dp.offset[2] + r * dp.stride[2];
+            d_cb = dd->cr_first ? p2 : p1;
+            d_cr = dd->cr_first ? p1 : p2;
+        } else {
+            unsigned char *p1 = f->dst + dp.offset[1] + r * dp.stride[1];
+            d_cb = p1 + (dd->cr_first ? 1 : 0);
+            d_cr = p1 + (dd->cr_first ? 0 : 1);
+        }
+        f->chroma_row(s_cb, s_cr, d_cb, d_cr, c_count);
     }
     return 0;
 }
 
+/*
+ * Macrotile conversion. HAL_PIXEL_FORMAT_YCbCr_420_SP_TILED stores each
+ * plane as 64x32 byte tiles of 2K. Tiles are grouped by pairs of tile rows
+ * and walked in a Z pattern inside 2x2 groups of 8K, except for the last
+ * tile row of a plane with an odd number of tile rows which is linear:
+ *
+ *   tile row 2n     0  1  6  7  8  9 14 15 ...
+ *   tile row 2n+1   2  3  4  5 10 11 12 13 ...
+ *
+ * The conversion goes over the pairs of tile rows, reading or writing the
+ * tiled side sequentially and touching 64 linear rows at a time.
+ */
+
+/* Index of tile (x, y) in a plane of tiles_w x tiles_h tiles */
+static inline unsigned int tile_index(unsigned int x, unsigned int y,
+                                      unsigned int tiles_w,
+                                      unsigned int tiles_h)
+{
+    unsigned int index = x + (y & ~1) * tiles_w;
+    if (y & 1)
+        index += (x & ~3) + 2;
+    else if ((tiles_h & 1) == 0 || y != tiles_h - 1)
+        index += (x + 2) & ~3;
+    return index;
+}
+
+/* Copy a full 64x32 tile between buffers of the given strides */
+typedef void (*tile_copy_fn)(const unsigned char *src, unsigned int src_stride,
+                             unsigned char *dst, unsigned int dst_stride);
+
+static void tile_copy_c(const unsigned char *src, unsigned int src_stride,
+                        unsigned char *dst, unsigned int dst_stride)
+{
+    for (int r = 0; r < TILE_HEIGHT; r++) {
+        memcpy(dst, src, TILE_WIDTH);
+        src += src_stride;
+        dst += dst_stride;
+    }
+}
+
+#ifdef __ARM_HAVE_NEON
+static void tile_copy_neon(const unsigned char *src, unsigned int src_stride,
+                           unsigned char *dst, unsigned int dst_stride)
+{
+    for (int r = 0; r < TILE_HEIGHT; r++) {
+        uint8x16_t a = vld1q_u8(src);
+        uint8x16_t b = vld1q_u8(src + 16);
+        uint8x16_t c = vld1q_u8(src + 32);
+        uint8x16_t d = vld1q_u8(src + 48);
+        vst1q_u8(dst, a);
+        vst1q_u8(dst + 16, b);
+        vst1q_u8(dst + 32, c);
+        vst1q_u8(dst + 48, d);
+        src += src_stride;
+        dst += dst_stride;
+    }
+}
+#endif
+
+#if defined(__SSE2__)
+static void tile_copy_sse2(const unsigned char *src, unsigned int src_stride,
+                           unsigned char *dst, unsigned int dst_stride)
+{
+    for (int r = 0; r < TILE_HEIGHT; r++) {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_storeu_si128((__m128i *)dst, a);
+        _mm_storeu_si128((__m128i *)(dst + 16), b);
+        _mm_storeu_si128((__m128i *)(dst + 32), c);
+        _mm_storeu_si128((__m128i *)(dst + 48), d);
+        src += src_stride;
+        dst += dst_stride;
+    }
+}
+#endif
+
+#if defined(__ARM_HAVE_NEON)
+static const tile_copy_fn sTileCopy = tile_copy_neon;
+#elif defined(__SSE2__)
+static const tile_copy_fn sTileCopy = tile_copy_sse2;
+#else
+static const tile_copy_fn sTileCopy = tile_copy_c;
+#endif
+
+/*
+ * Convert the tile row pairs [start, end) of one plane. The linear side
+ * covers width bytes by rows lines, partial tiles on the right and
+ * bottom edges only move the bytes inside that area.
+ */
+static void convert_tiled_plane(unsigned char *tiled, unsigned int tiles_w,
+                                unsigned int tiles_h, unsigned char *linear,
+                                unsigned int stride, unsigned int width,
+                                unsigned int rows, unsigned int start,
+                                unsigned int end, bool to_linear)
+{
+    unsigned int cols = (width + TILE_WIDTH - 1) / TILE_WIDTH;
+    for (unsigned int pair = start; pair < end; pair++) {
+        for (unsigned int x = 0; x < cols; x++) {
+            for (unsigned int y = pair * 2; y < pair * 2 + 2; y++) {
+                if (y >= tiles_h || y * TILE_HEIGHT >= rows)
+                    break;
+                unsigned char *t = tiled +
+                        tile_index(x, y, tiles_w, tiles_h) * TILE_SIZE;
+                unsigned char *l = linear + y * TILE_HEIGHT * stride +
+                        x * TILE_WIDTH;
+                unsigned int w = width - x * TILE_WIDTH;
+                unsigned int h = rows - y * TILE_HEIGHT;
+                if (w >= TILE_WIDTH && h >= TILE_HEIGHT) {
+                    if (to_linear)
+                        sTileCopy(t, TILE_WIDTH, l, stride);
+                    else
+                        sTileCopy(l, stride, t, TILE_WIDTH);
+                    continue;
+                }
+                if (w > TILE_WIDTH) w = TILE_WIDTH;
+                if (h > TILE_HEIGHT) h = TILE_HEIGHT;
+                for (unsigned int r = 0; r < h; r++) {
+                    if (to_linear)
+                        memcpy(l + r * stride, t + r * TILE_WIDTH, w);
+                    else
+                        memcpy(t + r * TILE_WIDTH, l + r * stride, w);
+                }
+            }
+        }
+    }
+}
+
+/* Row band of a convert_yuv() conversion to or from a tiled format */
+static int convert_tiled_band(void *arg, int band, int num_bands)
+{
+    convert_fence_t *f = (convert_fence_t *)arg;
+    bool to_linear = f->src_desc->tiled;
+    const yuv_plane_layout& tp = to_linear ? f->src_planes : f->dst_planes;
+    const yuv_plane_layout& lp = to_linear ? f->dst_planes : f->src_planes;
+    unsigned char *tiled = to_linear ? f->src : f->dst;
+    unsigned char *linear = to_linear ? f->dst : f->src;
+    unsigned int tiles_w = tp.stride[0] / TILE_WIDTH;
+    unsigned int luma_tiles_h = (f->height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+    unsigned int chroma_tiles_h = (f->height / 2 + TILE_HEIGHT - 1) / TILE_HEIGHT;
+    unsigned int start, end;
+
+    // The chroma tiles hold 4:2:0 interleaved samples, so a chroma
+    // row is as many bytes wide as a luma row
+    band_range((luma_tiles_h + 1) / 2, band, num_bands, start, end);
+    convert_tiled_plane(tiled, tiles_w, luma_tiles_h, linear, lp.stride[0],
+                        f->width, f->height, start, end, to_linear);
+    band_range((chroma_tiles_h + 1) / 2, band, num_bands, start, end);
+    convert_tiled_plane(tiled + tp.offset[1], tiles_w, chroma_tiles_h,
+                        linear + lp.offset[1], lp.stride[1],
+                        ALIGN(f->width, 2), f->height / 2, start, end,
+                        to_linear);
+    return 0;
+}
+
+int convert_yuv(private_handle_t *src, int src_format, eYUVLayout src_layout,
+                private_handle_t *dst, int dst_format, eYUVLayout dst_layout,
+                int width, int height, convert_fence_t *fence)
+{
+    if (!src || !dst || !src->base || !dst->base) {
+        ALOGE("%s: invalid inputs src=%p dst=%p", __FUNCTION__, src, dst);
+        return COPYBIT_FAILURE;
+    }
+
+    if (!is_yuv_conversion_supported(src_format, dst_format)) {
+        ALOGE("%s: unsupported conversion 0x%x -> 0x%x", __FUNCTION__,
+              src_format, dst_format);
+        return COPYBIT_FAILURE;
+    }
+
+    pthread_once(&sInterleaveOnce, select_interleave_kernel);
+
+    convert_fence_t local;
+    convert_fence_t *f = fence ? fence : &local;
+    f->src_desc = get_yuv_format_desc(src_format);
+    f->dst_desc = get_yuv_format_desc(dst_format);
+    // Gralloc buffers are described by the aligned size in their handle.
+    // Tiled buffers are laid out from the frame size, as the decoder does.
+    bool src_aligned = (src_layout == YUV_LAYOUT_ANDROID) && !f->src_desc->tiled;
+    bool dst_aligned = (dst_layout == YUV_LAYOUT_ANDROID) && !f->dst_desc->tiled;
+    int sw = src_aligned ? src->width : width;
+    int sh = src_aligned ? src->height : height;
+    int dw = dst_aligned ? dst->width : width;
+    int dh = dst_aligned ? dst->height : height;
+    if (get_yuv_plane_layout(src_format, sw, sh, src_layout, f->src_planes) ||
+        get_yuv_plane_layout(dst_format, dw, dh, dst_layout, f->dst_planes)) {
+        return COPYBIT_FAILURE;
+    }
+    if (f->src_planes.size > (size_t)src->size ||
+        f->dst_planes.size > (size_t)dst->size) {
+        ALOGE("%s: buffer too small for %dx%d (src %zu/%d, dst %zu/%d)",
+              __FUNCTION__, width, height, f->src_planes.size, src->size,
+              f->dst_planes.size, dst->size);
+        return COPYBIT_FAILURE;
+    }
+
+    f->src = (unsigned char *)src->base;
+    f->dst = (unsigned char *)dst->base;
+    f->width = width;
+    f->height = height;
+    if (f->src_desc->tiled || f->dst_desc->tiled) {
+        return run_conversion(f, fence != NULL, width * height,
+                              convert_tiled_band);
+    }
+    f->chroma_row = get_chroma_row_fn(f->src_desc, f->dst_desc);
+    return run_conversion(f, fence != NULL, width * height, convert_yuv_band);
+}
 
 /*
  * Function to convert the c2d format into an equivalent Android format
@@ -179,7 +741,8 @@ static int copy_source_to_destination(const int src_base, const int dst_base,
  * @return: return status
  */
 int convert_yuv_c2d_to_yuv_android(private_handle_t *hnd,
-                                   struct copybit_image_t const *rhs)
+                                   struct copybit_image_t const *rhs,
+                                   convert_fence_t *fence)
 {
     ALOGD("Enter %s", __FUNCTION__);
     if (!hnd || !rhs) {
@@ -187,33 +750,10 @@ int convert_yuv_c2d_to_yuv_android(private_handle_t *hnd,
         return COPYBIT_FAILURE;
     }
 
-    int ret = COPYBIT_SUCCESS;
     private_handle_t *dst_hnd = (private_handle_t *)rhs->handle;
-
-    copyInfo info;
-    info.width = rhs->w;
-    info.height = rhs->h;
-    info.src_stride = ALIGN(info.width, 32);
-    info.dst_stride = ALIGN(info.width, 16);
-    switch(rhs->format) {
-        case HAL_PIXEL_FORMAT_YCbCr_420_SP:
-        case HAL_PIXEL_FORMAT_YCrCb_420_SP: {
-            info.src_plane1_offset = info.src_stride*info.height;
-            info.dst_plane1_offset = info.dst_stride*info.height;
-        } break;
-        case HAL_PIXEL_FORMAT_NV12_ENCODEABLE: {
-            // Chroma is 2K aligned for the NV12 encodeable format.
-            info.src_plane1_offset = ALIGN(info.src_stride*info.height, 2048);
-            info.dst_plane1_offset = ALIGN(info.dst_stride*info.height, 2048);
-        } break;
-        default:
-            ALOGE("%s: unsupported format (format=0x%x)", __FUNCTION__,
-                 rhs->format);
-            return COPYBIT_FAILURE;
-    }
-
-    ret = copy_source_to_destination(hnd->base, dst_hnd->base, info);
-    return ret;
+    return convert_yuv(hnd, rhs->format, YUV_LAYOUT_C2D,
+                       dst_hnd, rhs->format, YUV_LAYOUT_ANDROID,
+                       rhs->w, rhs->h, fence);
 }
 
 /*
@@ -225,38 +765,16 @@ int convert_yuv_c2d_to_yuv_android(private_handle_t *hnd,
  * @return: return status
  */
 int convert_yuv_android_to_yuv_c2d(private_handle_t *hnd,
-                                   struct copybit_image_t const *rhs)
+                                   struct copybit_image_t const *rhs,
+                                   convert_fence_t *fence)
 {
     if (!hnd || !rhs) {
         ALOGE("%s: invalid inputs hnd=%p rhs=%p", __FUNCTION__, hnd, rhs);
         return COPYBIT_FAILURE;
     }
 
-    int ret = COPYBIT_SUCCESS;
     private_handle_t *dst_hnd = (private_handle_t *)rhs->handle;
-
-    copyInfo info;
-    info.width = rhs->w;
-    info.height = rhs->h;
-    info.src_stride = ALIGN(hnd->width, 16);
-    info.dst_stride = ALIGN(info.width, 32);
-    switch(rhs->format) {
-        case HAL_PIXEL_FORMAT_YCbCr_420_SP:
-        case HAL_PIXEL_FORMAT_YCrCb_420_SP: {
-            info.src_plane1_offset = info.src_stride*info.height;
-            info.dst_plane1_offset = info.dst_stride*info.height;
-        } break;
-        case HAL_PIXEL_FORMAT_NV12_ENCODEABLE: {
-            // Chroma is 2K aligned for the NV12 encodeable format.
-            info.src_plane1_offset = ALIGN(info.src_stride*info.height, 2048);
-            info.dst_plane1_offset = ALIGN(info.dst_stride*info.height, 2048);
-        } break;
-        default:
-            ALOGE("%s: unsupported format (format=0x%x)", __FUNCTION__,
-                 rhs->format);
-            return -1;
-    }
-
-    ret = copy_source_to_destination(hnd->base, dst_hnd->base, info);
-    return ret;
+    return convert_yuv(hnd, hnd->format, YUV_LAYOUT_ANDROID,
+                       dst_hnd, rhs->format, YUV_LAYOUT_C2D,
+                       rhs->w, rhs->h, fence);
 }
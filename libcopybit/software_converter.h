@@ -32,11 +32,102 @@
 #include <copybit.h>
 #include "gralloc_priv.h"
 #include "gr.h"
+#include "worker_pool.h"
 
 #define COPYBIT_SUCCESS 0
 #define COPYBIT_FAILURE -1
 
-int convertYV12toYCrCb420SP(const copybit_image_t *src,private_handle_t *yv12_handle);
+/* Memory layout rules a YUV buffer follows */
+enum eYUVLayout {
+    YUV_LAYOUT_ANDROID, // gralloc allocation, see getBufferSizeAndDimensions
+    YUV_LAYOUT_C2D      // strides aligned to 32 as required by C2D
+};
+
+/* Static description of a planar or semiplanar YUV format */
+struct yuv_format_desc {
+    int format;
+    int num_planes;     // 2 for semiplanar, 3 for planar
+    int hsub;           // log2 of the horizontal chroma subsampling
+    int vsub;           // log2 of the vertical chroma subsampling
+    bool cr_first;      // Cr precedes Cb in the chroma plane(s)
+    int stride_align;   // luma stride alignment of gralloc buffers
+    int chroma_align;   // alignment of the first chroma plane offset
+    bool tiled;         // planes are stored in 64x32 macrotiles
+};
+
+/* Plane geometry of a YUV buffer in a given layout */
+struct yuv_plane_layout {
+    int stride[3];
+    int offset[3];
+    size_t size;
+};
+
+/* Returns the description of a YUV format, or NULL if it is unknown */
+const yuv_format_desc* get_yuv_format_desc(int format);
+
+/*
+ * Compute the plane strides and offsets of a width x height buffer.
+ * For YUV_LAYOUT_ANDROID the dimensions are the aligned ones stored in
+ * the gralloc handle.
+ */
+int get_yuv_plane_layout(int format, int width, int height,
+                         eYUVLayout layout, yuv_plane_layout& planes);
+
+/*
+ * Returns true if convert_yuv() can convert between the two formats.
+ * Tiled formats only convert to and from linear NV12 formats.
+ */
+bool is_yuv_conversion_supported(int src_format, int dst_format);
+
+/* Function type of a chroma row conversion used by the engine */
+typedef void (*chroma_row_fn)(const unsigned char *src_cb,
+                              const unsigned char *src_cr,
+                              unsigned char *dst_cb, unsigned char *dst_cr,
+                              unsigned int count);
+
+/*
+ * Completion handle for the conversions below. When one is passed in, large
+ * frames are split into row bands that run on the copybit worker pool and
+ * the call returns as soon as the work is queued; the destination must not
+ * be used before wait_for_conversion() returns. The caller owns the storage,
+ * which must be zero initialized before first use.
+ */
+struct convert_fence_t {
+    copybit_job_t job;
+    unsigned char *src;
+    unsigned char *dst;
+    // convertYV12toYCrCb420SP
+    unsigned int y_size;
+    unsigned int c_width;
+    unsigned int c_size;
+    unsigned int c_pairs;
+    unsigned int c_rows;
+    // convert_yuv
+    const yuv_format_desc *src_desc;
+    const yuv_format_desc *dst_desc;
+    yuv_plane_layout src_planes;
+    yuv_plane_layout dst_planes;
+    int width;
+    int height;
+    chroma_row_fn chroma_row;
+};
+
+/* Wait for a conversion started with a fence. Returns the conversion status */
+int wait_for_conversion(convert_fence_t *fence);
+
+int convertYV12toYCrCb420SP(const copybit_image_t *src,private_handle_t *yv12_handle,
+                            convert_fence_t *fence = NULL);
+
+/*
+ * Convert a width x height region between any two formats for which
+ * is_yuv_conversion_supported() holds, laying out each side according to
+ * its eYUVLayout. Chroma is resampled when the subsampling differs.
+ *
+ * @return: return status
+ */
+int convert_yuv(private_handle_t *src, int src_format, eYUVLayout src_layout,
+                private_handle_t *dst, int dst_format, eYUVLayout dst_layout,
+                int width, int height, convert_fence_t *fence = NULL);
 
 /*
  * Function to convert the c2d format into an equivalent Android format
@@ -47,7 +138,8 @@ int convertYV12toYCrCb420SP(const copybit_image_t *src,private_handle_t *yv12_ha
  * @return: return status
  */
 int convert_yuv_c2d_to_yuv_android(private_handle_t *hnd,
-                                   struct copybit_image_t const *rhs);
+                                   struct copybit_image_t const *rhs,
+                                   convert_fence_t *fence = NULL);
 
 
 /*
@@ -59,4 +151,5 @@ int convert_yuv_c2d_to_yuv_android(private_handle_t *hnd,
  * @return: return status
  */
 int convert_yuv_android_to_yuv_c2d(private_handle_t *hnd,
-                                   struct copybit_image_t const *rhs);
+                                   struct copybit_image_t const *rhs,
+                                   convert_fence_t *fence = NULL);
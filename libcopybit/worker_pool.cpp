@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cutils/log.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <hardware/hardware.h>
+#include "worker_pool.h"
+
+#define MAX_WORKERS 3
+
+static pthread_once_t sPoolOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t sPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sWorkCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sDoneCond = PTHREAD_COND_INITIALIZER;
+static copybit_job_t *sHead = NULL;
+static copybit_job_t *sTail = NULL;
+static int sNumWorkers = 0;
+
+/* Remove a job whose bands have all been handed out. Called with the
+ * pool lock held.
+ */
+static void unlink_job(copybit_job_t *job)
+{
+    copybit_job_t *prev = NULL;
+    for (copybit_job_t *cur = sHead; cur; prev = cur, cur = cur->next) {
+        if (cur != job)
+            continue;
+        if (prev)
+            prev->next = cur->next;
+        else
+            sHead = cur->next;
+        if (sTail == cur)
+            sTail = prev;
+        cur->next = NULL;
+        return;
+    }
+}
+
+/* Hand out the next band of a job. Called with the pool lock held. */
+static int take_band(copybit_job_t *job)
+{
+    int band = job->next_band++;
+    if (job->next_band == job->num_bands)
+        unlink_job(job);
+    return band;
+}
+
+/* Run one band with the pool lock dropped */
+static void run_band(copybit_job_t *job, int band)
+{
+    pthread_mutex_unlock(&sPoolLock);
+    int err = job->run(job->arg, band, job->num_bands);
+    pthread_mutex_lock(&sPoolLock);
+    if (err)
+        job->status = err;
+    if (--job->pending == 0)
+        pthread_cond_broadcast(&sDoneCond);
+}
+
+static void* worker_loop(void* ptr)
+{
+    char thread_name[64];
+    snprintf(thread_name, sizeof(thread_name), "copybitWorker%d",
+             (int)(intptr_t)ptr);
+    prctl(PR_SET_NAME, (unsigned long) &thread_name, 0, 0, 0);
+    setpriority(PRIO_PROCESS, 0, HAL_PRIORITY_URGENT_DISPLAY);
+
+    pthread_mutex_lock(&sPoolLock);
+    while (true) {
+        if (sHead == NULL) {
+            pthread_cond_wait(&sWorkCond, &sPoolLock);
+            continue;
+        }
+        copybit_job_t *job = sHead;
+        run_band(job, take_band(job));
+    }
+    pthread_mutex_unlock(&sPoolLock);
+    return NULL;
+}
+
+static void start_workers()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    int wanted = (cpus > 1) ? (int)(cpus - 1) : 0;
+    if (wanted > MAX_WORKERS)
+        wanted = MAX_WORKERS;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < wanted; i++) {
+        pthread_t id;
+        if (pthread_create(&id, &attr, worker_loop, (void*)(intptr_t)i)) {
+            ALOGE("%s: failed to create worker %d", __FUNCTION__, i);
+            break;
+        }
+        sNumWorkers++;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+int copybit_job_concurrency()
+{
+    pthread_once(&sPoolOnce, start_workers);
+    return sNumWorkers + 1;
+}
+
+void copybit_job_submit(copybit_job_t *job)
+{
+    pthread_once(&sPoolOnce, start_workers);
+
+    job->next_band = 0;
+    job->pending = job->num_bands;
+    job->status = 0;
+    job->next = NULL;
+
+    pthread_mutex_lock(&sPoolLock);
+    if (job->num_bands <= 1 || sNumWorkers == 0) {
+        // Nothing to gain from the pool, just run it here
+        while (job->next_band < job->num_bands)
+            run_band(job, job->next_band++);
+        pthread_mutex_unlock(&sPoolLock);
+        return;
+    }
+    if (sTail)
+        sTail->next = job;
+    else
+        sHead = job;
+    sTail = job;
+    pthread_cond_broadcast(&sWorkCond);
+    pthread_mutex_unlock(&sPoolLock);
+}
+
+bool copybit_job_done(copybit_job_t *job)
+{
+    pthread_mutex_lock(&sPoolLock);
+    bool done = (job->pending == 0);
+    pthread_mutex_unlock(&sPoolLock);
+    return done;
+}
+
+int copybit_job_wait(copybit_job_t *job)
+{
+    pthread_mutex_lock(&sPoolLock);
+    // Help out with whatever has not been picked up yet
+    while (job->next_band < job->num_bands)
+        run_band(job, take_band(job));
+    while (job->pending > 0)
+        pthread_cond_wait(&sDoneCond, &sPoolLock);
+    int status = job->status;
+    pthread_mutex_unlock(&sPoolLock);
+    return status;
+}
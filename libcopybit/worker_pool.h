@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef COPYBIT_WORKER_POOL_H
+#define COPYBIT_WORKER_POOL_H
+
+/*
+ * Striped job executed on the copybit worker pool. The submitter owns the
+ * storage and fills in run/arg/num_bands; run() is invoked once for every
+ * band in [0, num_bands), possibly concurrently. The job doubles as the
+ * completion handle: copybit_job_wait() returns once every band has run.
+ */
+struct copybit_job_t {
+    int (*run)(void *arg, int band, int num_bands);
+    void *arg;
+    int num_bands;
+
+    // Owned by the pool
+    int next_band;
+    int pending;
+    int status;
+    copybit_job_t *next;
+};
+
+/* Number of threads that can work on a job, including the caller */
+int copybit_job_concurrency();
+
+/* Queue a job. Single band jobs, or jobs submitted while the pool is
+ * unavailable, run to completion on the calling thread.
+ */
+void copybit_job_submit(copybit_job_t *job);
+
+/* Returns true once every band of the job has finished */
+bool copybit_job_done(copybit_job_t *job);
+
+/* Wait for a job to complete, running its remaining bands on the calling
+ * thread. Returns 0 if every band succeeded. Safe to call on a job that
+ * has already completed or was zero initialized and never submitted.
+ */
+int copybit_job_wait(copybit_job_t *job);
+
+#endif // COPYBIT_WORKER_POOL_H
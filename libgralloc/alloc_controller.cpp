@@ -145,10 +145,15 @@ int AdrenoMemInfo::getStride(int width, int format)
             case HAL_PIXEL_FORMAT_YCbCr_420_SP:
             case HAL_PIXEL_FORMAT_YCrCb_420_SP:
             case HAL_PIXEL_FORMAT_YV12:
+            case HAL_PIXEL_FORMAT_YCbCr_420_P:
             case HAL_PIXEL_FORMAT_YCbCr_422_SP:
             case HAL_PIXEL_FORMAT_YCrCb_422_SP:
                 stride = ALIGN(width, 16);
                 break;
+            case HAL_PIXEL_FORMAT_YCbCr_444_SP:
+            case HAL_PIXEL_FORMAT_YCrCb_444_SP:
+                stride = ALIGN(width, 32);
+                break;
             case HAL_PIXEL_FORMAT_YCbCr_420_SP_VENUS:
                 stride = VENUS_Y_STRIDE(COLOR_FMT_NV12, width);
                 break;
@@ -169,6 +174,51 @@ IAllocController* IAllocController::getInstance(void)
 }
 
 
+//-------------- Unmap listeners-----------------------//
+#define MAX_UNMAP_LISTENERS 4
+
+static struct {
+    unmap_listener_t listener;
+    void *cookie;
+} sUnmapListeners[MAX_UNMAP_LISTENERS];
+static Locker sUnmapListenerLock;
+
+int gralloc::addUnmapListener(unmap_listener_t listener, void *cookie)
+{
+    Locker::Autolock _l(sUnmapListenerLock);
+    for (int i = 0; i < MAX_UNMAP_LISTENERS; i++) {
+        if (sUnmapListeners[i].listener == NULL) {
+            sUnmapListeners[i].listener = listener;
+            sUnmapListeners[i].cookie = cookie;
+            return 0;
+        }
+    }
+    ALOGE("%s: no free listener slot", __FUNCTION__);
+    return -ENOMEM;
+}
+
+void gralloc::removeUnmapListener(unmap_listener_t listener, void *cookie)
+{
+    Locker::Autolock _l(sUnmapListenerLock);
+    for (int i = 0; i < MAX_UNMAP_LISTENERS; i++) {
+        if (sUnmapListeners[i].listener == listener &&
+            sUnmapListeners[i].cookie == cookie) {
+            sUnmapListeners[i].listener = NULL;
+            sUnmapListeners[i].cookie = NULL;
+        }
+    }
+}
+
+void gralloc::notifyUnmapListeners(void *base, size_t size)
+{
+    Locker::Autolock _l(sUnmapListenerLock);
+    for (int i = 0; i < MAX_UNMAP_LISTENERS; i++) {
+        if (sUnmapListeners[i].listener)
+            sUnmapListeners[i].listener(sUnmapListeners[i].cookie,
+                                        base, size);
+    }
+}
+
 //-------------- IonController-----------------------//
 IonController::IonController()
 {
@@ -290,8 +340,11 @@ size_t getBufferSizeAndDimensions(int width, int height, int format,
         case HAL_PIXEL_FORMAT_YCbCr_420_SP:
         case HAL_PIXEL_FORMAT_YCrCb_420_SP:
         case HAL_PIXEL_FORMAT_YV12:
-            if ((format == HAL_PIXEL_FORMAT_YV12) && ((width&1) || (height&1))) {
-                ALOGE("w or h is odd for the YV12 format");
+        case HAL_PIXEL_FORMAT_YCbCr_420_P:
+            if ((format == HAL_PIXEL_FORMAT_YV12 ||
+                 format == HAL_PIXEL_FORMAT_YCbCr_420_P) &&
+                ((width&1) || (height&1))) {
+                ALOGE("w or h is odd for the planar YUV420 formats");
                 return -EINVAL;
             }
             alignedh = height;
@@ -314,6 +367,12 @@ size_t getBufferSizeAndDimensions(int width, int height, int format,
             alignedh = height;
             size = ALIGN(alignedw * alignedh * 2, 4096);
             break;
+        case HAL_PIXEL_FORMAT_YCbCr_444_SP:
+        case HAL_PIXEL_FORMAT_YCrCb_444_SP:
+            // Full resolution interleaved chroma follows the luma plane
+            alignedh = height;
+            size = ALIGN(alignedw * alignedh * 3, 4096);
+            break;
         case HAL_PIXEL_FORMAT_YCbCr_420_SP_VENUS:
             alignedh = VENUS_Y_SCANLINES(COLOR_FMT_NV12, height);
             size = VENUS_BUFFER_SIZE(COLOR_FMT_NV12, width, height);
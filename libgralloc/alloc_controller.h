@@ -29,6 +29,8 @@
 #ifndef GRALLOC_ALLOCCONTROLLER_H
 #define GRALLOC_ALLOCCONTROLLER_H
 
+#include <stddef.h>
+
 namespace gralloc {
 
 struct alloc_data;
@@ -67,5 +69,17 @@ class IonController : public IAllocController {
     IonAlloc* mIonAlloc;
 
 };
+
+/* Unmap listeners are called before a buffer mapping goes away in this
+ * process, on unmap or free. Clients caching per buffer state, such as
+ * GPU mappings, drop it there before the address can be reused.
+ * Listeners must not call back into the allocator.
+ */
+typedef void (*unmap_listener_t)(void *cookie, void *base, size_t size);
+
+int addUnmapListener(unmap_listener_t listener, void *cookie);
+void removeUnmapListener(unmap_listener_t listener, void *cookie);
+void notifyUnmapListeners(void *base, size_t size);
+
 } //end namespace gralloc
 #endif // GRALLOC_ALLOCCONTROLLER_H
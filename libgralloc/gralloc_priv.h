@@ -92,6 +92,9 @@ enum {
     HAL_PIXEL_FORMAT_YCbCr_420_SP_TILED     = 0x7FA30C03,
     HAL_PIXEL_FORMAT_YCbCr_420_SP           = 0x109,
     HAL_PIXEL_FORMAT_YCrCb_420_SP_ADRENO    = 0x7FA30C01,
+    /* I420 (Cb plane before Cr). Allocated from the QCOM vendor block
+     * 0x7FA30Cxx above, next free value after _SP_VENUS */
+    HAL_PIXEL_FORMAT_YCbCr_420_P            = 0x7FA30C05,
     HAL_PIXEL_FORMAT_YCrCb_422_SP           = 0x10B,
     HAL_PIXEL_FORMAT_R_8                    = 0x10D,
     HAL_PIXEL_FORMAT_RG_88                  = 0x10E,
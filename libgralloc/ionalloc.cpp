@@ -36,8 +36,10 @@
 #include <errno.h>
 #include "gralloc_priv.h"
 #include "ionalloc.h"
+#include "alloc_controller.h"
 
 using gralloc::IonAlloc;
+using gralloc::notifyUnmapListeners;
 
 #define ION_DEVICE "/dev/ion"
 #ifdef QCOM_BSP
@@ -201,6 +203,8 @@ int IonAlloc::unmap_buffer(void *base, size_t size, int offset)
 {
     ALOGD_IF(DEBUG, "ion: Unmapping buffer  base:%p size:%d", base, size);
     int err = 0;
+    // Let caches keyed on this mapping drop it before the range is reused
+    notifyUnmapListeners(base, size);
     if(munmap(base, size)) {
         err = -errno;
         ALOGE("ion: Failed to unmap memory at %p : %s",
@@ -20,6 +20,7 @@ LOCAL_SRC_FILES               := hwc.cpp          \
                                  hwc_fbupdate.cpp \
                                  hwc_mdpcomp.cpp  \
                                  hwc_copybit.cpp  \
+                                 hwc_costmodel.cpp \
                                  hwc_qclient.cpp
 
 include $(BUILD_SHARED_LIBRARY)
@@ -20,6 +20,7 @@
 #define ATRACE_TAG ATRACE_TAG_GRAPHICS
 #include <fcntl.h>
 #include <errno.h>
+#include <new>
 
 #include <cutils/log.h>
 #include <cutils/atomic.h>
@@ -86,6 +87,7 @@ static void reset(hwc_context_t *ctx, int numDisplays,
                   hwc_display_contents_1_t** displays) {
     memset(ctx->listStats, 0, sizeof(ctx->listStats));
     for(int i = 0; i < MAX_DISPLAYS; i++) {
+        ctx->mFrameDamage[i].reset();
         hwc_display_contents_1_t *list = displays[i];
         // XXX:SurfaceFlinger no longer guarantees that this
         // value is reset on every prepare. However, for the layer
@@ -107,17 +109,19 @@ static void reset(hwc_context_t *ctx, int numDisplays,
     }
 }
 
-//clear prev layer prop flags and realloc for current frame
+//clear prev layer prop flags and realloc for current frame. Starts the
+//frame arena of the display, so it has to come first in prepare
 static void reset_layer_prop(hwc_context_t* ctx, int dpy) {
     int layer_count = ctx->listStats[dpy].numAppLayers;
 
-    if(ctx->layerProp[dpy]) {
-       delete[] ctx->layerProp[dpy];
-       ctx->layerProp[dpy] = NULL;
-    }
+    ctx->mFrameArena[dpy].reset();
+    ctx->layerProp[dpy] = NULL;
 
     if(layer_count) {
-       ctx->layerProp[dpy] = new LayerProp[layer_count];
+       void *mem = ctx->mFrameArena[dpy].alloc(sizeof(LayerProp) *
+                                               layer_count);
+       if(mem)
+           ctx->layerProp[dpy] = new (mem) LayerProp[layer_count];
     }
 }
 
@@ -125,6 +129,15 @@ static int display_commit(hwc_context_t *ctx, int dpy) {
     struct mdp_display_commit commit_info;
     memset(&commit_info, 0, sizeof(struct mdp_display_commit));
     commit_info.flags = MDP_DISPLAY_COMMIT_OVERLAY;
+#ifdef PARTIAL_UPDATE
+    if(ctx->mFrameDamage[dpy].isPartial()) {
+        const hwc_rect_t& roi = ctx->mFrameDamage[dpy].getDirtyRect();
+        commit_info.roi.x = roi.left;
+        commit_info.roi.y = roi.top;
+        commit_info.roi.w = roi.right - roi.left;
+        commit_info.roi.h = roi.bottom - roi.top;
+    }
+#endif
     if(ioctl(ctx->dpyAttr[dpy].fd, MSMFB_DISPLAY_COMMIT, &commit_info) == -1) {
        ALOGE("%s: MSMFB_DISPLAY_COMMIT for primary failed", __FUNCTION__);
        return -errno;
@@ -136,6 +149,7 @@ static int hwc_prepare_primary(hwc_composer_device_1 *dev,
         hwc_display_contents_1_t *list) {
     hwc_context_t* ctx = (hwc_context_t*)(dev);
     const int dpy = HWC_DISPLAY_PRIMARY;
+    bool damageTracked = false;
     if (LIKELY(list && list->numHwLayers > 1 &&
         list->numHwLayers <= MAX_NUM_LAYERS) && ctx->dpyAttr[dpy].isActive) {
         uint32_t last = list->numHwLayers - 1;
@@ -143,10 +157,16 @@ static int hwc_prepare_primary(hwc_composer_device_1 *dev,
         if(fbLayer->handle) {
             setListStats(ctx, list, dpy);
             reset_layer_prop(ctx, dpy);
+            ctx->mCostModel->estimate(ctx, list, dpy);
+            ctx->mFrameDamage[dpy].update(ctx, list, dpy);
+            damageTracked = true;
             int ret = ctx->mMDPComp->prepare(ctx, list);
             if(!ret) {
                 // IF MDPcomp fails use this route
-                ctx->mVidOv[dpy]->prepare(ctx, list);
+                bool videoOn = ctx->mVidOv[dpy]->prepare(ctx, list);
+                //With the FB target alone, only what changed is sent
+                if(!videoOn)
+                    ctx->mFrameDamage[dpy].enablePartial(ctx, dpy);
                 ctx->mFBUpdate[dpy]->prepare(ctx, list);
             }
             ctx->mLayerCache[dpy]->updateLayerCache(list);
@@ -155,6 +175,9 @@ static int hwc_prepare_primary(hwc_composer_device_1 *dev,
                 ctx->mCopyBit[dpy]->prepare(ctx, list, dpy);
         }
     }
+    //The next frame cannot be diffed against one update did not see
+    if(!damageTracked)
+        ctx->mFrameDamage[dpy].invalidate();
     return 0;
 }
 
@@ -172,6 +195,7 @@ static int hwc_prepare_external(hwc_composer_device_1 *dev,
             if(fbLayer->handle) {
                 setListStats(ctx, list, dpy);
                 reset_layer_prop(ctx, dpy);
+                ctx->mCostModel->estimate(ctx, list, dpy);
                 ctx->mVidOv[dpy]->prepare(ctx, list);
                 ctx->mFBUpdate[dpy]->prepare(ctx, list);
                 ctx->mLayerCache[dpy]->updateLayerCache(list);
@@ -262,6 +286,9 @@ static int hwc_blank(struct hwc_composer_device_1* dev, int dpy, int blank)
                 ctx->mOverlay->configBegin();
                 ctx->mOverlay->configDone();
                 ctx->mRotMgr->clear();
+                for(int i = 0; i < MAX_DISPLAYS; i++)
+                    memset(ctx->listStats[i].swRot, 0,
+                            sizeof(ctx->listStats[i].swRot));
                 ret = ioctl(ctx->dpyAttr[dpy].fd, FBIOBLANK,FB_BLANK_POWERDOWN);
 
                 if(ctx->dpyAttr[HWC_DISPLAY_VIRTUAL].connected == true) {
@@ -278,6 +305,8 @@ static int hwc_blank(struct hwc_composer_device_1* dev, int dpy, int blank)
                 }
             } else {
                 ret = ioctl(ctx->dpyAttr[dpy].fd, FBIOBLANK, FB_BLANK_UNBLANK);
+                //The panel lost its frame, the first one back goes out whole
+                ctx->mFrameDamage[dpy].invalidate();
                 if(ctx->dpyAttr[HWC_DISPLAY_VIRTUAL].connected == true) {
                     ctx->dpyAttr[HWC_DISPLAY_VIRTUAL].isActive = !blank;
                 }
@@ -348,8 +377,10 @@ static int hwc_set_primary(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
         bool copybitDone = false;
         if(ctx->mCopyBit[dpy])
             copybitDone = ctx->mCopyBit[dpy]->draw(ctx, list, dpy, &fd);
-        if(list->numHwLayers > 1)
+        if(list->numHwLayers > 1) {
+            queueSwRotations(ctx, list, dpy);
             hwc_sync(ctx, list, dpy, fd);
+        }
         if (!ctx->mVidOv[dpy]->draw(ctx, list)) {
             ALOGE("%s: VideoOverlay draw failed", __FUNCTION__);
             ret = -1;
@@ -404,8 +435,10 @@ static int hwc_set_external(hwc_context_t *ctx,
         if(ctx->mCopyBit[dpy])
             copybitDone = ctx->mCopyBit[dpy]->draw(ctx, list, dpy, &fd);
 
-        if(list->numHwLayers > 1)
+        if(list->numHwLayers > 1) {
+            queueSwRotations(ctx, list, dpy);
             hwc_sync(ctx, list, dpy, fd);
+        }
 
         if (!ctx->mVidOv[dpy]->draw(ctx, list)) {
             ALOGE("%s: VideoOverlay::draw fail!", __FUNCTION__);
@@ -554,6 +587,11 @@ void hwc_dump(struct hwc_composer_device_1* dev, char *buff, int buff_len)
     dumpsys_log(aBuf, "  MDPVersion=%d\n", ctx->mMDP.version);
     dumpsys_log(aBuf, "  DisplayPanel=%c\n", ctx->mMDP.panel);
     ctx->mMDPComp->dump(aBuf);
+    ctx->mCostModel->dump(aBuf);
+    for(int dpy = 0; dpy < MAX_DISPLAYS; dpy++) {
+        if(ctx->mCopyBit[dpy])
+            ctx->mCopyBit[dpy]->dump(aBuf);
+    }
     char ovDump[2048] = {'\0'};
     ctx->mOverlay->getDump(ovDump, 2048);
     dumpsys_log(aBuf, ovDump);
@@ -19,9 +19,11 @@
  */
 
 #define DEBUG_COPYBIT 0
+#include <math.h>
 #include <copybit.h>
 #include <utils/Timers.h>
 #include "hwc_copybit.h"
+#include "hwc_costmodel.h"
 #include "comptype.h"
 #include "gr.h"
 
@@ -64,12 +66,31 @@ private:
     mutable range r;
 };
 
+//Formats the CPU copybit backend reads and writes, see get_bpp there
+static bool isCpuCopybitFormat(int format) {
+    switch(format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+        case HAL_PIXEL_FORMAT_RGB_565:
+            return true;
+        default:
+            return false;
+    }
+}
+
 void CopyBit::reset() {
     mIsModeOn = false;
     mCopyBitDraw = false;
 }
 
 bool CopyBit::canUseCopybitForYUV(hwc_context_t *ctx) {
+    int compositionType = qdutils::QCCompositionType::
+                                    getInstance().getCompositionType();
+    // The CPU copybit backend only handles RGB sources
+    if (compositionType & qdutils::COMPOSITION_TYPE_CPU) {
+        return false;
+    }
     // return true for non-overlay targets
     if(ctx->mMDP.hasOverlay) {
        return false;
@@ -93,16 +114,9 @@ bool CopyBit::canUseCopybitForRGB(hwc_context_t *ctx,
 
     if (compositionType & qdutils::COMPOSITION_TYPE_DYN) {
         // DYN Composition:
-        // use copybit, if (TotalRGBRenderArea < 2 * FB Area)
-        // this is done based on perf inputs in ICS
-        // TODO: Above condition needs to be re-evaluated in JB
-        int fbWidth =  ctx->dpyAttr[dpy].xres;
-        int fbHeight =  ctx->dpyAttr[dpy].yres;
-        unsigned int fbArea = (fbWidth * fbHeight);
-        unsigned int renderArea = getRGBRenderingArea(list);
-            ALOGD_IF (DEBUG_COPYBIT, "%s:renderArea %u, fbArea %u",
-                                  __FUNCTION__, renderArea, fbArea);
-        if (renderArea <= (2 * fbArea)) {
+        // use copybit, if the cost model rates it below the GPU
+        if (ctx->mCostModel->isCheaper(ctx, dpy, CostModel::STRATEGY_COPYBIT,
+                                       CostModel::STRATEGY_GPU)) {
             return true;
         }
     } else if ((compositionType & qdutils::COMPOSITION_TYPE_MDP)) {
@@ -111,27 +125,28 @@ bool CopyBit::canUseCopybitForRGB(hwc_context_t *ctx,
     } else if ((compositionType & qdutils::COMPOSITION_TYPE_C2D)) {
       // C2D composition, use COPYBIT
       return true;
+    } else if ((compositionType & qdutils::COMPOSITION_TYPE_CPU)) {
+      // CPU composition, the software copybit takes the RGB layers if it
+      // handles all of their formats and the FB target's, else the GPU
+      // composes the frame
+      hwc_layer_1_t *fbLayer =
+              &list->hwLayers[ctx->listStats[dpy].fbLayerIndex];
+      private_handle_t *fbHnd = (private_handle_t *)fbLayer->handle;
+      if (!fbHnd || !isCpuCopybitFormat(fbHnd->format))
+          return false;
+      for (int i = 0; i < ctx->listStats[dpy].numAppLayers; i++) {
+          private_handle_t *hnd = (private_handle_t *)list->hwLayers[i].handle;
+          if (hnd && !isHiddenLayer(ctx, dpy, i) &&
+              hnd->bufferType == BUFFER_TYPE_UI &&
+              !isCpuCopybitFormat(hnd->format)) {
+              return false;
+          }
+      }
+      return true;
     }
     return false;
 }
 
-unsigned int CopyBit::getRGBRenderingArea
-                                    (const hwc_display_contents_1_t *list) {
-    //Calculates total rendering area for RGB layers
-    unsigned int renderArea = 0;
-    unsigned int w=0, h=0;
-    for (unsigned int i=0; i<list->numHwLayers; i++) {
-         private_handle_t *hnd = (private_handle_t *)list->hwLayers[i].handle;
-         if (hnd) {
-             if (BUFFER_TYPE_UI == hnd->bufferType) {
-                 getLayerResolution(&list->hwLayers[i], w, h);
-                 renderArea += (w*h);
-             }
-         }
-    }
-    return renderArea;
-}
-
 bool CopyBit::prepare(hwc_context_t *ctx, hwc_display_contents_1_t *list,
                                                             int dpy) {
 
@@ -142,9 +157,8 @@ bool CopyBit::prepare(hwc_context_t *ctx, hwc_display_contents_1_t *list,
     int compositionType = qdutils::QCCompositionType::
                                     getInstance().getCompositionType();
 
-    if ((compositionType == qdutils::COMPOSITION_TYPE_GPU) ||
-        (compositionType == qdutils::COMPOSITION_TYPE_CPU))   {
-        //GPU/CPU composition, don't change layer composition type
+    if (compositionType == qdutils::COMPOSITION_TYPE_GPU) {
+        //GPU composition, don't change layer composition type
         return true;
     }
 
@@ -185,6 +199,10 @@ bool CopyBit::prepare(hwc_context_t *ctx, hwc_display_contents_1_t *list,
     for (int i = ctx->listStats[dpy].numAppLayers-1; i >= 0 ; i--) {
         private_handle_t *hnd = (private_handle_t *)list->hwLayers[i].handle;
 
+        //Covered by opaque layers, nothing to blit
+        if (isHiddenLayer(ctx, dpy, i))
+            continue;
+
         if ((hnd->bufferType == BUFFER_TYPE_VIDEO && useCopybitForYUV) ||
             (hnd->bufferType == BUFFER_TYPE_UI && useCopybitForRGB)) {
             layerProp[i].mFlags |= HWC_COPYBIT;
@@ -293,14 +311,13 @@ int  CopyBit::drawLayerUsingCopybit(hwc_context_t *dev, hwc_layer_1_t *layer,
     // if needed in the future
     src.vert_padding = 0;
 
-    // Copybit source rect
-    hwc_rect_t sourceCrop = layer->sourceCrop;
+    // Copybit source and destination rects
+    hwc_rect_t sourceCrop, displayFrame;
+    getLayerRects(ctx, dpy, layer, sourceCrop, displayFrame);
     copybit_rect_t srcRect = {sourceCrop.left, sourceCrop.top,
                               sourceCrop.right,
                               sourceCrop.bottom};
 
-    // Copybit destination rect
-    hwc_rect_t displayFrame = layer->displayFrame;
     copybit_rect_t dstRect = {displayFrame.left, displayFrame.top,
                               displayFrame.right,
                               displayFrame.bottom};
@@ -333,7 +350,6 @@ int  CopyBit::drawLayerUsingCopybit(hwc_context_t *dev, hwc_layer_1_t *layer,
         screen_w  = screen_h;
         screen_h = tmp;
     }
-    private_handle_t *tmpHnd = NULL;
 
     if(screen_w <=0 || screen_h<=0 ||src_crop_width<=0 || src_crop_height<=0 ) {
         ALOGE("%s: wrong params for display screen_w=%d src_crop_width=%d \
@@ -345,125 +361,299 @@ int  CopyBit::drawLayerUsingCopybit(hwc_context_t *dev, hwc_layer_1_t *layer,
     float dsdx = (float)screen_w/src_crop_width;
     float dtdy = (float)screen_h/src_crop_height;
 
-    float scaleLimitMax = copybitsMaxScale * copybitsMaxScale;
-    float scaleLimitMin = copybitsMinScale * copybitsMinScale;
-    if(dsdx > scaleLimitMax ||
-        dtdy > scaleLimitMax ||
-        dsdx < 1/scaleLimitMin ||
-        dtdy < 1/scaleLimitMin) {
+    int passesX = getScalePassCount(dsdx, copybitsMaxScale,
+                                    copybitsMinScale);
+    int passesY = getScalePassCount(dtdy, copybitsMaxScale,
+                                    copybitsMinScale);
+    int passes = (passesX > passesY) ? passesX : passesY;
+    if(passes > MAX_SCALE_PASSES) {
         ALOGE("%s: greater than max supported size dsdx=%f dtdy=%f \
               scaleLimitMax=%f scaleLimitMin=%f", __FUNCTION__,dsdx,dtdy,
-                                          scaleLimitMax,1/scaleLimitMin);
+              copybitsMaxScale,1/copybitsMinScale);
         return -1;
     }
-    if(dsdx > copybitsMaxScale ||
-        dtdy > copybitsMaxScale ||
-        dsdx < 1/copybitsMinScale ||
-        dtdy < 1/copybitsMinScale){
+    if(passes > 1) {
         // The requested scale is out of the range the hardware
-        // can support.
-       ALOGE("%s:%d::Need to scale twice dsdx=%f, dtdy=%f,copybitsMaxScale=%f,\
-                                 copybitsMinScale=%f,screen_w=%d,screen_h=%d \
-                  src_crop_width=%d src_crop_height=%d",__FUNCTION__,__LINE__,
-              dsdx,dtdy,copybitsMaxScale,1/copybitsMinScale,screen_w,screen_h,
-                                              src_crop_width,src_crop_height);
-
-       //Driver makes width and height as even
-       //that may cause wrong calculation of the ratio
-       //in display and crop.Hence we make
-       //crop width and height as even.
-       src_crop_width  = (src_crop_width/2)*2;
-       src_crop_height = (src_crop_height/2)*2;
-
-       int tmp_w =  src_crop_width;
-       int tmp_h =  src_crop_height;
-
-       if (dsdx > copybitsMaxScale || dtdy > copybitsMaxScale ){
-         tmp_w = src_crop_width*copybitsMaxScale;
-         tmp_h = src_crop_height*copybitsMaxScale;
-       }else if (dsdx < 1/copybitsMinScale ||dtdy < 1/copybitsMinScale ){
-         tmp_w = src_crop_width/copybitsMinScale;
-         tmp_h = src_crop_height/copybitsMinScale;
-         tmp_w  = (tmp_w/2)*2;
-         tmp_h = (tmp_h/2)*2;
-       }
-       ALOGE("%s:%d::tmp_w = %d,tmp_h = %d",__FUNCTION__,__LINE__,tmp_w,tmp_h);
-
-       int usage = GRALLOC_USAGE_PRIVATE_IOMMU_HEAP;
-
-       if (0 == alloc_buffer(&tmpHnd, tmp_w, tmp_h, fbHandle->format, usage)){
+        // can support in one blit, chain it through intermediates.
+        ALOGD_IF(DEBUG_COPYBIT, "%s: %d scale passes dsdx=%f, dtdy=%f",
+                 __FUNCTION__, passes, dsdx, dtdy);
+
+        //Driver makes width and height as even
+        //that may cause wrong calculation of the ratio
+        //in display and crop.Hence we make
+        //crop width and height as even.
+        src_crop_width  = (src_crop_width/2)*2;
+        src_crop_height = (src_crop_height/2)*2;
+
+        // Intermediates are plain copies in the source orientation
+        copybit_params_t tmpParams;
+        copybit_params_init(&tmpParams);
+        copybit_params_set(&tmpParams, COPYBIT_TRANSFORM, 0);
+        //TODO: once, we are able to read layer alpha, update this
+        copybit_params_set(&tmpParams, COPYBIT_PLANE_ALPHA, 255);
+        copybit_params_set(&tmpParams, COPYBIT_BLEND_MODE, HWC_BLENDING_NONE);
+        for(int pass = 0; pass < passes - 1; pass++) {
+            // The engine may reset the blit state after each stretch
+            setParameters(copybit, tmpParams);
+            int tmp_w = getScalePassSize(src_crop_width, screen_w, pass,
+                            passes, copybitsMaxScale, copybitsMinScale);
+            int tmp_h = getScalePassSize(src_crop_height, screen_h, pass,
+                            passes, copybitsMaxScale, copybitsMinScale);
+            private_handle_t *tmpHnd = getScaleBuffer(pass, tmp_w, tmp_h,
+                                                      fbHandle->format);
+            if(!tmpHnd) {
+                ALOGE("%s: no intermediate buffer %dx%d", __FUNCTION__,
+                      tmp_w, tmp_h);
+                return -1;
+            }
             copybit_image_t tmp_dst;
             copybit_rect_t tmp_rect;
-            tmp_dst.w = tmp_w;
-            tmp_dst.h = tmp_h;
+            tmp_dst.w = tmpHnd->width;
+            tmp_dst.h = tmpHnd->height;
             tmp_dst.format = tmpHnd->format;
+            tmp_dst.base = (void *)tmpHnd->base;
             tmp_dst.handle = tmpHnd;
-            tmp_dst.horiz_padding = src.horiz_padding;
-            tmp_dst.vert_padding = src.vert_padding;
+            tmp_dst.horiz_padding = 0;
+            tmp_dst.vert_padding = 0;
             tmp_rect.l = 0;
             tmp_rect.t = 0;
-            tmp_rect.r = tmp_dst.w;
-            tmp_rect.b = tmp_dst.h;
+            tmp_rect.r = tmp_w;
+            tmp_rect.b = tmp_h;
             //create one clip region
             hwc_rect tmp_hwc_rect = {0,0,tmp_rect.r,tmp_rect.b};
             hwc_region_t tmp_hwc_reg = {1,(hwc_rect_t const*)&tmp_hwc_rect};
             region_iterator tmp_it(tmp_hwc_reg);
-            copybit->set_parameter(copybit,COPYBIT_TRANSFORM,0);
-            //TODO: once, we are able to read layer alpha, update this
-            copybit->set_parameter(copybit, COPYBIT_PLANE_ALPHA, 255);
             err = copybit->stretch(copybit,&tmp_dst, &src, &tmp_rect,
                                                            &srcRect, &tmp_it);
             if(err < 0){
                 ALOGE("%s:%d::tmp copybit stretch failed",__FUNCTION__,
                                                              __LINE__);
-                if(tmpHnd)
-                    free_buffer(tmpHnd);
                 return err;
             }
             // copy new src and src rect crop
             src = tmp_dst;
             srcRect = tmp_rect;
-      }
+        }
     }
-    // Copybit region
+    // Copybit region, fragmented visible regions would otherwise cost
+    // one blit per rect
     hwc_region_t region = layer->visibleRegionScreen;
+    int clipCount = coalesceRegion(region, displayFrame,
+                                   layer->blending == HWC_BLENDING_NONE);
+    if(clipCount >= 0) {
+        ALOGD_IF(DEBUG_COPYBIT, "%s: %d clip rects coalesced into %d",
+                 __FUNCTION__, region.numRects, clipCount);
+        region.numRects = clipCount;
+        region.rects = mClipRects;
+    }
     region_iterator copybitRegion(region);
 
-    copybit->set_parameter(copybit, COPYBIT_FRAMEBUFFER_WIDTH,
+    copybit_params_t params;
+    copybit_params_init(&params);
+    copybit_params_set(&params, COPYBIT_FRAMEBUFFER_WIDTH,
                                           renderBuffer->width);
-    copybit->set_parameter(copybit, COPYBIT_FRAMEBUFFER_HEIGHT,
+    copybit_params_set(&params, COPYBIT_FRAMEBUFFER_HEIGHT,
                                           renderBuffer->height);
-    copybit->set_parameter(copybit, COPYBIT_TRANSFORM,
-                                              layer->transform);
+    copybit_params_set(&params, COPYBIT_TRANSFORM, layer->transform);
     //TODO: once, we are able to read layer alpha, update this
-    copybit->set_parameter(copybit, COPYBIT_PLANE_ALPHA, 255);
-    copybit->set_parameter(copybit, COPYBIT_BLEND_MODE,
-                                              layer->blending);
-    copybit->set_parameter(copybit, COPYBIT_DITHER,
+    copybit_params_set(&params, COPYBIT_PLANE_ALPHA, 255);
+    copybit_params_set(&params, COPYBIT_BLEND_MODE, layer->blending);
+    copybit_params_set(&params, COPYBIT_DITHER,
                              (dst.format == HAL_PIXEL_FORMAT_RGB_565)?
                                              COPYBIT_ENABLE : COPYBIT_DISABLE);
-    copybit->set_parameter(copybit, COPYBIT_BLIT_TO_FRAMEBUFFER,
-                                                COPYBIT_ENABLE);
+    copybit_params_set(&params, COPYBIT_BLIT_TO_FRAMEBUFFER, COPYBIT_ENABLE);
+    setParameters(copybit, params);
     err = copybit->stretch(copybit, &dst, &src, &dstRect, &srcRect,
                                                    &copybitRegion);
     copybit->set_parameter(copybit, COPYBIT_BLIT_TO_FRAMEBUFFER,
                                                COPYBIT_DISABLE);
 
-    if(tmpHnd)
-        free_buffer(tmpHnd);
-
     if(err < 0)
         ALOGE("%s: copybit stretch failed",__FUNCTION__);
     return err;
 }
 
-void CopyBit::getLayerResolution(const hwc_layer_1_t* layer,
-                                 unsigned int& width, unsigned int& height)
+static inline int rectArea(const hwc_rect_t& r)
+{
+    return (r.right - r.left) * (r.bottom - r.top);
+}
+
+static inline bool isSliver(const hwc_rect_t& r)
+{
+    return (r.right - r.left) < CLIP_SLIVER_SIZE ||
+           (r.bottom - r.top) < CLIP_SLIVER_SIZE;
+}
+
+//Pixels the bounding rect of a and b covers that neither of them does
+static int mergeWaste(const hwc_rect_t& a, const hwc_rect_t& b,
+                      hwc_rect_t& bound)
+{
+    bound.left = min(a.left, b.left);
+    bound.top = min(a.top, b.top);
+    bound.right = max(a.right, b.right);
+    bound.bottom = max(a.bottom, b.bottom);
+    int overlapW = min(a.right, b.right) - max(a.left, b.left);
+    int overlapH = min(a.bottom, b.bottom) - max(a.top, b.top);
+    int overlap = (overlapW > 0 && overlapH > 0) ? overlapW * overlapH : 0;
+    return rectArea(bound) - rectArea(a) - rectArea(b) + overlap;
+}
+
+//Grows a to cover b if that draws nothing outside the two, or for opaque
+//layers, little enough outside them to be worth a blit
+static bool mergeRects(hwc_rect_t& a, const hwc_rect_t& b, bool opaque)
+{
+    hwc_rect_t bound;
+    int waste = mergeWaste(a, b, bound);
+    if(waste > 0) {
+        if(!opaque)
+            return false;
+        const hwc_rect_t& small = (rectArea(a) < rectArea(b)) ? a : b;
+        if(waste * 8 > rectArea(bound) &&
+           !(isSliver(small) && waste <= rectArea(small)))
+            return false;
+    }
+    a = bound;
+    return true;
+}
+
+int CopyBit::coalesceRegion(const hwc_region_t& region,
+                            const hwc_rect_t& frame, bool opaque)
+{
+    int count = 0;
+    for(size_t i = 0; i < region.numRects; i++) {
+        hwc_rect_t r = region.rects[i];
+        r.left = max(r.left, frame.left);
+        r.top = max(r.top, frame.top);
+        r.right = min(r.right, frame.right);
+        r.bottom = min(r.bottom, frame.bottom);
+        if(r.left >= r.right || r.top >= r.bottom)
+            continue;
+        //Regions are sorted in y-x bands, so a horizontal neighbour is
+        //always the previous rect
+        if(count && mergeRects(mClipRects[count - 1], r, opaque))
+            continue;
+        if(count == MAX_CLIP_RECTS) {
+            if(!opaque)
+                return -1;
+            //Out of rects, overdraw into the cheapest one
+            int best = 0, bestWaste = 0;
+            for(int j = 0; j < count; j++) {
+                hwc_rect_t bound;
+                int waste = mergeWaste(mClipRects[j], r, bound);
+                if(j == 0 || waste < bestWaste) {
+                    best = j;
+                    bestWaste = waste;
+                }
+            }
+            hwc_rect_t bound;
+            mergeWaste(mClipRects[best], r, bound);
+            mClipRects[best] = bound;
+            continue;
+        }
+        mClipRects[count++] = r;
+    }
+
+    //Merge across bands until nothing changes
+    bool merged = true;
+    while(merged) {
+        merged = false;
+        for(int i = 0; i < count; i++) {
+            for(int j = i + 1; j < count; j++) {
+                if(mergeRects(mClipRects[i], mClipRects[j], opaque)) {
+                    mClipRects[j--] = mClipRects[--count];
+                    merged = true;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+int CopyBit::setParameters(struct copybit_device_t *copybit,
+                           const copybit_params_t& params)
+{
+    //Older devices end before set_parameters
+    if(copybit->common.version >= COPYBIT_DEVICE_API_VERSION_2)
+        return copybit->set_parameters(copybit, &params);
+    int err = 0;
+    for(int name = 0; name < COPYBIT_PARAMETER_COUNT; name++) {
+        if((params.mask & (1 << name)) &&
+           copybit->set_parameter(copybit, name, params.value[name]) < 0)
+            err = -1;
+    }
+    return err;
+}
+
+int CopyBit::getScalePassCount(float ratio, float maxScale, float minScale)
+{
+    // Each pass covers up to maxScale magnification or 1/minScale
+    // minification, keep adding passes until the ratio is reached
+    int passes = 1;
+    float reach = (ratio > 1.0f) ? maxScale : minScale;
+    float limit = reach;
+    while(passes <= MAX_SCALE_PASSES &&
+          ((ratio > 1.0f) ? (ratio > limit) : (ratio < 1/limit))) {
+        limit *= reach;
+        passes++;
+    }
+    return passes;
+}
+
+int CopyBit::getScalePassSize(int src, int dst, int pass, int passes,
+                              float maxScale, float minScale)
+{
+    // Shrink as early and grow as late as the limits allow, which keeps
+    // the intermediates and so the memory traffic as small as possible
+    float size;
+    if(dst < src) {
+        size = (float)src;
+        for(int i = 0; i <= pass; i++)
+            size /= minScale;
+        if(size < dst)
+            size = (float)dst;
+    } else {
+        size = (float)dst;
+        for(int i = pass + 1; i < passes; i++)
+            size /= maxScale;
+        if(size < src)
+            size = (float)src;
+    }
+    //Driver makes width and height as even
+    return ((int)ceilf(size) + 1) & ~1;
+}
+
+private_handle_t * CopyBit::getScaleBuffer(int index, int w, int h,
+                                           int format)
 {
-    hwc_rect_t displayFrame  = layer->displayFrame;
+    // Kept across frames and only grown, so steady state downscaling or
+    // upscaling does no allocation at all
+    private_handle_t *hnd = mScaleBuffer[index];
+    if(hnd && hnd->format == format &&
+       hnd->width >= w && hnd->height >= h)
+        return hnd;
+    if(hnd) {
+        if(hnd->format == format) {
+            if(w < hnd->width) w = hnd->width;
+            if(h < hnd->height) h = hnd->height;
+        }
+        free_buffer(hnd);
+        mScaleBuffer[index] = NULL;
+    }
+    if(alloc_buffer(&mScaleBuffer[index], ALIGN(w, 32), h, format,
+                    GRALLOC_USAGE_PRIVATE_IOMMU_HEAP) < 0) {
+        mScaleBuffer[index] = NULL;
+    }
+    return mScaleBuffer[index];
+}
 
-    width = displayFrame.right - displayFrame.left;
-    height = displayFrame.bottom - displayFrame.top;
+void CopyBit::freeScaleBuffers()
+{
+    for (int i = 0; i < MAX_SCALE_PASSES - 1; i++) {
+        if(mScaleBuffer[i]) {
+            free_buffer(mScaleBuffer[i]);
+            mScaleBuffer[i] = NULL;
+        }
+    }
 }
 
 bool CopyBit::validateParams(hwc_context_t *ctx,
@@ -518,6 +708,15 @@ void CopyBit::setReleaseFd(int fd) {
     mRelFd[1] = dup(fd);
 }
 
+void CopyBit::dump(android::String8& buf) {
+    if(!mEngine || mEngine->common.version < COPYBIT_DEVICE_API_VERSION_3 ||
+       !mEngine->dump)
+        return;
+    char engineDump[512] = {'\0'};
+    mEngine->dump(mEngine, engineDump, sizeof(engineDump));
+    dumpsys_log(buf, "%s", engineDump);
+}
+
 struct copybit_device_t* CopyBit::getCopyBitDevice() {
     return mEngine;
 }
@@ -527,9 +726,21 @@ CopyBit::CopyBit():mIsModeOn(false), mCopyBitDraw(false),
     hw_module_t const *module;
     for (int i = 0; i < NUM_RENDER_BUFFERS; i++)
         mRenderBuffer[i] = NULL;
+    for (int i = 0; i < MAX_SCALE_PASSES - 1; i++)
+        mScaleBuffer[i] = NULL;
     mRelFd[0] = -1;
     mRelFd[1] = -1;
-    if (hw_get_module(COPYBIT_HARDWARE_MODULE_ID, &module) == 0) {
+    int compositionType = qdutils::QCCompositionType::
+                                    getInstance().getCompositionType();
+    int err;
+    if (compositionType & qdutils::COMPOSITION_TYPE_CPU) {
+        // Software backend, installed as copybit.cpu.<platform>
+        err = hw_get_module_by_class(COPYBIT_HARDWARE_MODULE_ID, "cpu",
+                                     &module);
+    } else {
+        err = hw_get_module(COPYBIT_HARDWARE_MODULE_ID, &module);
+    }
+    if (err == 0) {
         if(copybit_open(module, &mEngine) < 0) {
             ALOGE("FATAL ERROR: copybit open failed.");
         }
@@ -541,6 +752,7 @@ CopyBit::CopyBit():mIsModeOn(false), mCopyBitDraw(false),
 CopyBit::~CopyBit()
 {
     freeRenderBuffers();
+    freeScaleBuffers();
     if(mRelFd[0] >=0)
         close(mRelFd[0]);
     if(mRelFd[1] >=0)
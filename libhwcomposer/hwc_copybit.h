@@ -22,6 +22,12 @@
 #include "hwc_utils.h"
 
 #define NUM_RENDER_BUFFERS 2
+//Max blits a layer scale is split into when beyond the engine's limits
+#define MAX_SCALE_PASSES 3
+//Max clip rects a layer's visible region is coalesced into
+#define MAX_CLIP_RECTS 16
+//Rects thinner than this are slivers, opaque layers may overdraw to drop them
+#define CLIP_SLIVER_SIZE 8
 
 namespace qhwc {
 
@@ -44,6 +50,9 @@ public:
 
     void setReleaseFd(int fd);
 
+    //Appends the copybit engine state to the dumpsys output
+    void dump(android::String8& buf);
+
 private:
     // holds the copybit device
     struct copybit_device_t *mEngine;
@@ -60,18 +69,38 @@ private:
     // flag that indicates whether CopyBit composition is enabled for this cycle
     bool mCopyBitDraw;
 
-    unsigned int getRGBRenderingArea
-                            (const hwc_display_contents_1_t *list);
-
-    void getLayerResolution(const hwc_layer_1_t* layer,
-                                   unsigned int &width, unsigned int& height);
-
     int allocRenderBuffers(int w, int h, int f);
 
     void freeRenderBuffers();
 
+    //Number of blits needed to scale by ratio within the engine limits
+    static int getScalePassCount(float ratio, float maxScale,
+                                 float minScale);
+    //Size along one axis after the given pass of a chained scale
+    static int getScalePassSize(int src, int dst, int pass, int passes,
+                                float maxScale, float minScale);
+    //Applies a parameter block, one set_parameter per entry on engines
+    //older than COPYBIT_DEVICE_API_VERSION_2
+    static int setParameters(struct copybit_device_t *copybit,
+                             const copybit_params_t& params);
+    //Merges the visible region of a layer into at most MAX_CLIP_RECTS
+    //rects in mClipRects. Opaque layers may be overdrawn within frame.
+    //Returns the rect count or -1 if the region should be used as is.
+    int coalesceRegion(const hwc_region_t& region, const hwc_rect_t& frame,
+                       bool opaque);
+    //Returns an intermediate of at least w x h, reusing the cached one
+    private_handle_t* getScaleBuffer(int index, int w, int h, int format);
+
+    void freeScaleBuffers();
+
+    //Intermediates of chained scale blits, reused across frames
+    private_handle_t* mScaleBuffer[MAX_SCALE_PASSES - 1];
+
     private_handle_t* mRenderBuffer[NUM_RENDER_BUFFERS];
 
+    //Coalesced clip rects of the layer being drawn
+    hwc_rect_t mClipRects[MAX_CLIP_RECTS];
+
     // Index of the current intermediate render buffer
     int mCurRenderBufferIndex;
 
@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "hwc_costmodel.h"
+#include "mdp_version.h"
+
+#define DEBUG_COSTMODEL 0
+
+namespace qhwc {
+
+/*
+ * Estimates per MDP revision. Entries are sorted by version, a revision
+ * takes the last entry not newer than itself. The rates are what the
+ * engines sustain on typical content, tune them per target as needed.
+ */
+static const CostCoeffs sCoeffs[] = {
+    //version            mdp mdpbw rot blit  gpu blend blit  gpu
+    { qdutils::MDP_V_UNKNOWN, 100,  400,   0,  50, 150,  0,  100, 2000 },
+    { qdutils::MDP_V3_0,      100,  400,   0,  60, 150,  0,   80, 2000 },
+    { qdutils::MDP_V4_0,      200, 1600,  75, 150, 250, 30,   60, 1500 },
+    { qdutils::MDSS_V5,       320, 3200, 150, 250, 400, 20,   50, 1000 },
+};
+
+static uint32_t toUs(uint64_t amount, uint32_t rate) {
+    if(!rate)
+        return UINT32_MAX;
+    uint64_t us = amount / rate;
+    return (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+}
+
+static uint32_t addUs(uint32_t a, uint32_t b) {
+    return (a > UINT32_MAX - b) ? UINT32_MAX : a + b;
+}
+
+static uint32_t maxUs(uint32_t a, uint32_t b) {
+    return (a > b) ? a : b;
+}
+
+static void addLoad(LayerLoad& sum, const LayerLoad& load) {
+    sum.fetchBytes += load.fetchBytes;
+    sum.rotBytes += load.rotBytes;
+    sum.targetBytes += load.targetBytes;
+    sum.pixels += load.pixels;
+    if(load.maxPixels > sum.maxPixels)
+        sum.maxPixels = load.maxPixels;
+    sum.rotPixels += load.rotPixels;
+    sum.count += load.count;
+}
+
+static int getBitsPerPixel(private_handle_t *hnd) {
+    if(isYuvBuffer(hnd))
+        return 12;
+    switch(hnd->format) {
+        case HAL_PIXEL_FORMAT_RGB_888:
+            return 24;
+        case HAL_PIXEL_FORMAT_RGB_565:
+        case HAL_PIXEL_FORMAT_RGBA_5551:
+        case HAL_PIXEL_FORMAT_RGBA_4444:
+            return 16;
+        default:
+            return 32;
+    }
+}
+
+static uint64_t rectArea(const hwc_rect_t& rect) {
+    if(rect.right <= rect.left || rect.bottom <= rect.top)
+        return 0;
+    return (uint64_t)(rect.right - rect.left) * (rect.bottom - rect.top);
+}
+
+CostModel::CostModel(int mdpVersion) {
+    mCoeffs = &sCoeffs[0];
+    for(size_t i = 0; i < sizeof(sCoeffs) / sizeof(sCoeffs[0]); i++) {
+        if(sCoeffs[i].mdpVersion <= mdpVersion)
+            mCoeffs = &sCoeffs[i];
+    }
+    memset(mCost, 0, sizeof(mCost));
+    memset(mLayerLoad, 0, sizeof(mLayerLoad));
+    memset(mNumLayers, 0, sizeof(mNumLayers));
+    memset(mFbBytes, 0, sizeof(mFbBytes));
+    memset(mFbPixels, 0, sizeof(mFbPixels));
+}
+
+/*
+ * MDP pipes fetch their layers side by side, so a frame takes as long as
+ * its largest layer, or as the bus takes to carry all of them if that is
+ * longer, plus the blend stages. The rotator turns layers one after the
+ * other ahead of the pipes.
+ */
+CompCost CostModel::mdpCost(const LayerLoad& load) const {
+    CompCost cost;
+    cost.busBytes = load.fetchBytes + load.rotBytes;
+    cost.engineUs = addUs(maxUs(toUs(load.maxPixels, mCoeffs->mdpRate),
+            toUs(cost.busBytes, mCoeffs->mdpBw)),
+            (load.count > 1) ? (load.count - 1) * mCoeffs->blendUs : 0);
+    if(load.rotPixels)
+        cost.engineUs = maxUs(cost.engineUs,
+                toUs(load.rotPixels, mCoeffs->rotRate));
+    return cost;
+}
+
+/* The GPU renders the layers into the FB target, its scanout not included */
+CompCost CostModel::gpuCost(const LayerLoad& load) const {
+    CompCost cost;
+    cost.busBytes = load.fetchBytes + load.targetBytes;
+    cost.engineUs = addUs(toUs(load.pixels, mCoeffs->gpuRate),
+            mCoeffs->gpuSetupUs);
+    return cost;
+}
+
+/*
+ * Every layer is fetched once whichever way it is composed, scaled by
+ * whichever of source and destination is larger. On top of that:
+ * MDP:     a rotator pass (read and write) per layer turned by 90, and the
+ *          blend stages.
+ * COPYBIT: a write of each layer into the FB target, a read of what is
+ *          underneath for blended layers, and the scanout of the target.
+ * GPU:     same traffic as copybit, on a faster engine with a larger fixed
+ *          cost per frame.
+ */
+void CostModel::estimate(hwc_context_t *ctx, hwc_display_contents_1_t *list,
+        int dpy) {
+    const int numAppLayers = ctx->listStats[dpy].numAppLayers;
+    hwc_layer_1_t *fbLayer = &list->hwLayers[ctx->listStats[dpy].fbLayerIndex];
+    private_handle_t *fbHnd = (private_handle_t *)fbLayer->handle;
+    const int fbBpp = fbHnd ? getBitsPerPixel(fbHnd) : 32;
+    mFbPixels[dpy] = (uint64_t)ctx->dpyAttr[dpy].xres *
+            ctx->dpyAttr[dpy].yres;
+    mFbBytes[dpy] = mFbPixels[dpy] * fbBpp / 8;
+    mNumLayers[dpy] = min(numAppLayers, MAX_NUM_LAYERS);
+
+    LayerLoad total;
+    memset(&total, 0, sizeof(total));
+    for(int i = 0; i < numAppLayers; i++) {
+        hwc_layer_1_t *layer = &list->hwLayers[i];
+        private_handle_t *hnd = (private_handle_t *)layer->handle;
+        LayerLoad load;
+        memset(&load, 0, sizeof(load));
+        if(hnd && !isHiddenLayer(ctx, dpy, i)) {
+            hwc_rect_t crop, frame;
+            getLayerRects(ctx, dpy, layer, crop, frame);
+            const uint64_t srcArea = rectArea(crop);
+            const uint64_t dstArea = rectArea(frame);
+            const uint64_t layerBytes = srcArea * getBitsPerPixel(hnd) / 8;
+
+            load.fetchBytes = layerBytes;
+            load.pixels = (srcArea > dstArea) ? srcArea : dstArea;
+            load.maxPixels = load.pixels;
+            if(layer->transform & HWC_TRANSFORM_ROT_90) {
+                load.rotBytes = 2 * layerBytes;
+                load.rotPixels = srcArea;
+            }
+            load.targetBytes = dstArea * fbBpp / 8;
+            if(layer->blending != HWC_BLENDING_NONE)
+                load.targetBytes += dstArea * fbBpp / 8;
+            load.count = 1;
+        }
+        if(i < MAX_NUM_LAYERS)
+            mLayerLoad[dpy][i] = load;
+        addLoad(total, load);
+    }
+
+    CompCost& mdp = mCost[dpy][STRATEGY_MDP];
+    mdp = mdpCost(total);
+
+    CompCost& copybit = mCost[dpy][STRATEGY_COPYBIT];
+    copybit.busBytes = total.fetchBytes + total.targetBytes + mFbBytes[dpy];
+    copybit.engineUs = addUs(toUs(total.pixels, mCoeffs->blitRate),
+            total.count * mCoeffs->blitSetupUs);
+
+    CompCost& gpu = mCost[dpy][STRATEGY_GPU];
+    gpu = gpuCost(total);
+    gpu.busBytes += mFbBytes[dpy];
+
+    ALOGD_IF(DEBUG_COSTMODEL, "%s: dpy %d mdp %llu/%u copybit %llu/%u "
+            "gpu %llu/%u (bytes/us)", __FUNCTION__, dpy,
+            (unsigned long long)mdp.busBytes, mdp.engineUs,
+            (unsigned long long)copybit.busBytes, copybit.engineUs,
+            (unsigned long long)gpu.busBytes, gpu.engineUs);
+}
+
+/*
+ * The GPU fills the FB target with its layers while MDP scans out the last
+ * one, so the frame takes as long as the busier of the two. The FB target is
+ * one more layer on a pipe of its own.
+ */
+CompCost CostModel::estimateMixed(int dpy, int fbStart, int fbEnd) const {
+    LayerLoad gpuLoad, mdpLoad;
+    memset(&gpuLoad, 0, sizeof(gpuLoad));
+    memset(&mdpLoad, 0, sizeof(mdpLoad));
+    for(int i = 0; i < mNumLayers[dpy]; i++) {
+        if(i >= fbStart && i <= fbEnd)
+            addLoad(gpuLoad, mLayerLoad[dpy][i]);
+        else
+            addLoad(mdpLoad, mLayerLoad[dpy][i]);
+    }
+    LayerLoad fbLoad;
+    memset(&fbLoad, 0, sizeof(fbLoad));
+    fbLoad.fetchBytes = mFbBytes[dpy];
+    fbLoad.pixels = mFbPixels[dpy];
+    fbLoad.maxPixels = mFbPixels[dpy];
+    fbLoad.count = 1;
+    addLoad(mdpLoad, fbLoad);
+
+    const CompCost gpu = gpuCost(gpuLoad);
+    CompCost cost = mdpCost(mdpLoad);
+    cost.busBytes += gpu.busBytes;
+    cost.engineUs = maxUs(cost.engineUs, gpu.engineUs);
+    ALOGD_IF(DEBUG_COSTMODEL, "%s: dpy %d gpu %d-%d %llu/%u (bytes/us)",
+            __FUNCTION__, dpy, fbStart, fbEnd,
+            (unsigned long long)cost.busBytes, cost.engineUs);
+    return cost;
+}
+
+bool CostModel::fits(hwc_context_t *ctx, int dpy, const CompCost& cost) const {
+    return (uint64_t)cost.engineUs * 1000 <= ctx->dpyAttr[dpy].vsync_period;
+}
+
+bool CostModel::isCheaper(hwc_context_t *ctx, int dpy, const CompCost& a,
+        const CompCost& b) const {
+    const bool aFits = fits(ctx, dpy, a);
+    if(aFits != fits(ctx, dpy, b))
+        return aFits;
+    if(a.busBytes != b.busBytes)
+        return a.busBytes < b.busBytes;
+    return a.engineUs < b.engineUs;
+}
+
+void CostModel::dump(android::String8& buf) {
+    static const char* const names[STRATEGY_MAX] = { "MDP", "COPYBIT", "GPU" };
+    dumpsys_log(buf, "  Cost model (MDP %d coefficients):\n",
+            mCoeffs->mdpVersion);
+    for(int dpy = 0; dpy < MAX_DISPLAYS; dpy++) {
+        for(int s = 0; s < STRATEGY_MAX; s++) {
+            if(!mCost[dpy][s].busBytes)
+                continue;
+            dumpsys_log(buf, "    dpy=%d %s: %llu KB %u us\n", dpy, names[s],
+                    (unsigned long long)(mCost[dpy][s].busBytes >> 10),
+                    mCost[dpy][s].engineUs);
+        }
+    }
+}
+
+}; //namespace qhwc
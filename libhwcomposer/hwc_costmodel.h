@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HWC_COSTMODEL_H
+#define HWC_COSTMODEL_H
+#include "hwc_utils.h"
+
+namespace qhwc {
+
+/* Estimated price of composing a frame one particular way */
+struct CompCost {
+    uint64_t busBytes; //read and written over the bus
+    uint32_t engineUs; //spent by the busiest engine involved
+};
+
+/* Cost model coefficients of an MDP revision, rates are in pixels per us */
+struct CostCoeffs {
+    int mdpVersion;       //lowest MDP revision the entry applies to
+    uint32_t mdpRate;     //each MDP pipe fetch, the pipes run side by side
+    uint32_t mdpBw;       //MDP fetch of all pipes together, in bytes per us
+    uint32_t rotRate;     //MDP rotator, 0 if there is none
+    uint32_t blitRate;    //copybit engine
+    uint32_t gpuRate;     //GPU composition
+    uint32_t blendUs;     //each MDP blend stage past the base one
+    uint32_t blitSetupUs; //each copybit blit
+    uint32_t gpuSetupUs;  //each GPU composed frame
+};
+
+/* What a set of layers puts on the engines */
+struct LayerLoad {
+    uint64_t fetchBytes;  //layer fetch, same for all strategies
+    uint64_t rotBytes;    //MDP rotator passes
+    uint64_t targetBytes; //writes and blend reads of the FB target
+    uint64_t pixels;      //scaled pixels through the engine
+    uint64_t maxPixels;   //scaled pixels of the largest layer
+    uint64_t rotPixels;
+    int count;            //visible layers
+};
+
+class CostModel {
+public:
+    enum eStrategy {
+        STRATEGY_MDP,     //every layer on an MDP pipe
+        STRATEGY_COPYBIT, //copybit blits the layers into the FB target
+        STRATEGY_GPU,     //the GPU renders the FB target
+        STRATEGY_MAX,
+    };
+
+    explicit CostModel(int mdpVersion);
+    /* estimates every strategy for the frame on dpy */
+    void estimate(hwc_context_t *ctx, hwc_display_contents_1_t *list,
+            int dpy);
+    /* Estimates mixed composition on dpy, with the GPU composing layers
+     * fbStart to fbEnd into the FB target and MDP taking the others and the
+     * FB target. Uses the layers of the last estimate(). */
+    CompCost estimateMixed(int dpy, int fbStart, int fbEnd) const;
+    /* last estimate of a strategy on dpy */
+    const CompCost& getCost(int dpy, eStrategy strategy) const {
+        return mCost[dpy][strategy];
+    }
+    /* true if the strategy is done within a refresh of dpy */
+    bool fits(hwc_context_t *ctx, int dpy, eStrategy strategy) const {
+        return fits(ctx, dpy, mCost[dpy][strategy]);
+    }
+    bool fits(hwc_context_t *ctx, int dpy, const CompCost& cost) const;
+    /* true if "a" is cheaper than "b" on dpy. A strategy that fits in a
+     * refresh beats one that does not, then the bus traffic decides. */
+    bool isCheaper(hwc_context_t *ctx, int dpy, eStrategy a,
+            eStrategy b) const {
+        return isCheaper(ctx, dpy, mCost[dpy][a], mCost[dpy][b]);
+    }
+    bool isCheaper(hwc_context_t *ctx, int dpy, const CompCost& a,
+            const CompCost& b) const;
+    /* Appends the last estimates to the dumpsys output */
+    void dump(android::String8& buf);
+
+private:
+    CompCost mdpCost(const LayerLoad& load) const;
+    CompCost gpuCost(const LayerLoad& load) const;
+
+    const CostCoeffs *mCoeffs;
+    CompCost mCost[MAX_DISPLAYS][STRATEGY_MAX];
+    /* per layer load of the last estimate, and the FB target's */
+    LayerLoad mLayerLoad[MAX_DISPLAYS][MAX_NUM_LAYERS];
+    int mNumLayers[MAX_DISPLAYS];
+    uint64_t mFbBytes[MAX_DISPLAYS];
+    uint64_t mFbPixels[MAX_DISPLAYS];
+};
+
+}; //namespace qhwc
+
+#endif //HWC_COSTMODEL_H
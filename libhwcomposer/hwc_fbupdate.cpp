@@ -45,21 +45,23 @@ inline void FBUpdateLowRes::reset() {
     mDest = ovutils::OV_INVALID;
 }
 
-bool FBUpdateLowRes::prepare(hwc_context_t *ctx, hwc_display_contents_1 *list)
+bool FBUpdateLowRes::prepare(hwc_context_t *ctx, hwc_display_contents_1 *list,
+        ovutils::eZorder fbZorder)
 {
     if(!ctx->mMDP.hasOverlay) {
         ALOGD_IF(DEBUG_FBUPDATE, "%s, this hw doesnt support overlays",
                 __FUNCTION__);
        return false;
     }
-    mModeOn = configure(ctx, list);
+    mModeOn = configure(ctx, list, fbZorder);
     ALOGD_IF(DEBUG_FBUPDATE, "%s, mModeOn = %d", __FUNCTION__, mModeOn);
     return mModeOn;
 }
 
 // Configure
 bool FBUpdateLowRes::configure(hwc_context_t *ctx,
-                               hwc_display_contents_1 *list)
+                               hwc_display_contents_1 *list,
+                               ovutils::eZorder fbZorder)
 {
     bool ret = false;
     hwc_layer_1_t *layer = &list->hwLayers[list->numHwLayers - 1];
@@ -82,16 +84,30 @@ bool FBUpdateLowRes::configure(hwc_context_t *ctx,
         mDest = dest;
 
         ovutils::eMdpFlags mdpFlags = ovutils::OV_MDP_FLAGS_NONE;
+        ovutils::eIsFg isFg = ovutils::IS_FG_SET;
+        if(fbZorder != ovutils::ZORDER_0) {
+            //FB target is cleared to transparent around the GPU layers
+            ovutils::setMdpFlags(mdpFlags, ovutils::OV_MDP_BLEND_FG_PREMULT);
+            isFg = ovutils::IS_FG_OFF;
+        }
 
         ovutils::PipeArgs parg(mdpFlags,
                 info,
-                ovutils::ZORDER_0,
-                ovutils::IS_FG_SET,
+                fbZorder,
+                isFg,
                 ovutils::ROT_FLAGS_NONE);
         ov.setSource(parg, dest);
 
         hwc_rect_t sourceCrop;
         getNonWormholeRegion(list, sourceCrop);
+        //Fetch only what goes to the panel
+        if(ctx->mFrameDamage[mDpy].isPartial()) {
+            const hwc_rect_t& dirty = ctx->mFrameDamage[mDpy].getDirtyRect();
+            sourceCrop.left = max(sourceCrop.left, dirty.left);
+            sourceCrop.top = max(sourceCrop.top, dirty.top);
+            sourceCrop.right = min(sourceCrop.right, dirty.right);
+            sourceCrop.bottom = min(sourceCrop.bottom, dirty.bottom);
+        }
         // x,y,w,h
         ovutils::Dim dcrop(sourceCrop.left, sourceCrop.top,
                 sourceCrop.right - sourceCrop.left,
@@ -146,7 +162,8 @@ inline void FBUpdateHighRes::reset() {
     mDestRight = ovutils::OV_INVALID;
 }
 
-bool FBUpdateHighRes::prepare(hwc_context_t *ctx, hwc_display_contents_1 *list)
+bool FBUpdateHighRes::prepare(hwc_context_t *ctx, hwc_display_contents_1 *list,
+        ovutils::eZorder fbZorder)
 {
     if(!ctx->mMDP.hasOverlay) {
         ALOGD_IF(DEBUG_FBUPDATE, "%s, this hw doesnt support overlays",
@@ -154,13 +171,14 @@ bool FBUpdateHighRes::prepare(hwc_context_t *ctx, hwc_display_contents_1 *list)
        return false;
     }
     ALOGD_IF(DEBUG_FBUPDATE, "%s, mModeOn = %d", __FUNCTION__, mModeOn);
-    mModeOn = configure(ctx, list);
+    mModeOn = configure(ctx, list, fbZorder);
     return mModeOn;
 }
 
 // Configure
 bool FBUpdateHighRes::configure(hwc_context_t *ctx,
-                                hwc_display_contents_1 *list)
+                                hwc_display_contents_1 *list,
+                                ovutils::eZorder fbZorder)
 {
     bool ret = false;
     hwc_layer_1_t *layer = &list->hwLayers[list->numHwLayers - 1];
@@ -189,11 +207,17 @@ bool FBUpdateHighRes::configure(hwc_context_t *ctx,
         mDestRight = destR;
 
         ovutils::eMdpFlags mdpFlagsL = ovutils::OV_MDP_FLAGS_NONE;
+        ovutils::eIsFg isFg = ovutils::IS_FG_SET;
+        if(fbZorder != ovutils::ZORDER_0) {
+            //FB target is cleared to transparent around the GPU layers
+            ovutils::setMdpFlags(mdpFlagsL, ovutils::OV_MDP_BLEND_FG_PREMULT);
+            isFg = ovutils::IS_FG_OFF;
+        }
 
         ovutils::PipeArgs pargL(mdpFlagsL,
                 info,
-                ovutils::ZORDER_0,
-                ovutils::IS_FG_SET,
+                fbZorder,
+                isFg,
                 ovutils::ROT_FLAGS_NONE);
         ov.setSource(pargL, destL);
 
@@ -201,8 +225,8 @@ bool FBUpdateHighRes::configure(hwc_context_t *ctx,
         ovutils::setMdpFlags(mdpFlagsR, ovutils::OV_MDSS_MDP_RIGHT_MIXER);
         ovutils::PipeArgs pargR(mdpFlagsR,
                 info,
-                ovutils::ZORDER_0,
-                ovutils::IS_FG_SET,
+                fbZorder,
+                isFg,
                 ovutils::ROT_FLAGS_NONE);
         ov.setSource(pargR, destR);
 
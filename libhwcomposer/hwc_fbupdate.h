@@ -33,8 +33,11 @@ class IFBUpdate {
 public:
     explicit IFBUpdate(const int& dpy) : mDpy(dpy) {}
     virtual ~IFBUpdate() {};
-    // Sets up members and prepares overlay if conditions are met
-    virtual bool prepare(hwc_context_t *ctx, hwc_display_contents_1 *list) = 0;
+    // Sets up members and prepares overlay if conditions are met. Above
+    // ZORDER_0 the FB target is blended over the MDP composed layers
+    // beneath it.
+    virtual bool prepare(hwc_context_t *ctx, hwc_display_contents_1 *list,
+            ovutils::eZorder fbZorder = ovutils::ZORDER_0) = 0;
     // Draws layer
     virtual bool draw(hwc_context_t *ctx, private_handle_t *hnd) = 0;
     //Reset values
@@ -52,12 +55,14 @@ class FBUpdateLowRes : public IFBUpdate {
 public:
     explicit FBUpdateLowRes(const int& dpy);
     virtual ~FBUpdateLowRes() {};
-    bool prepare(hwc_context_t *ctx, hwc_display_contents_1 *list);
+    bool prepare(hwc_context_t *ctx, hwc_display_contents_1 *list,
+            ovutils::eZorder fbZorder = ovutils::ZORDER_0);
 
     bool draw(hwc_context_t *ctx, private_handle_t *hnd);
     void reset();
 private:
-    bool configure(hwc_context_t *ctx, hwc_display_contents_1 *list);
+    bool configure(hwc_context_t *ctx, hwc_display_contents_1 *list,
+            ovutils::eZorder fbZorder);
     ovutils::eDest mDest; //pipe to draw on
 };
 
@@ -66,11 +71,13 @@ class FBUpdateHighRes : public IFBUpdate {
 public:
     explicit FBUpdateHighRes(const int& dpy);
     virtual ~FBUpdateHighRes() {};
-    bool prepare(hwc_context_t *ctx, hwc_display_contents_1 *list);
+    bool prepare(hwc_context_t *ctx, hwc_display_contents_1 *list,
+            ovutils::eZorder fbZorder = ovutils::ZORDER_0);
     bool draw(hwc_context_t *ctx, private_handle_t *hnd);
     void reset();
 private:
-    bool configure(hwc_context_t *ctx, hwc_display_contents_1 *list);
+    bool configure(hwc_context_t *ctx, hwc_display_contents_1 *list,
+            ovutils::eZorder fbZorder);
     ovutils::eDest mDestLeft; //left pipe to draw on
     ovutils::eDest mDestRight; //right pipe to draw on
 };
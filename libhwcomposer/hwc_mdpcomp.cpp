@@ -17,7 +17,10 @@
  */
 
 #include "hwc_mdpcomp.h"
+#include "hwc_fbupdate.h"
+#include "hwc_costmodel.h"
 #include <sys/ioctl.h>
+#include <limits.h>
 #include "external.h"
 #include "qdMetaData.h"
 #include "mdp_version.h"
@@ -33,8 +36,10 @@ namespace qhwc {
 
 IdleInvalidator *MDPComp::idleInvalidator = NULL;
 bool MDPComp::sIdleFallBack = false;
+unsigned long MDPComp::sIdleTimeout = DEFAULT_IDLE_TIME;
 bool MDPComp::sDebugLogs = false;
 bool MDPComp::sEnabled = false;
+bool MDPComp::sMixedMode = true;
 
 MDPComp* MDPComp::getObject(const int& width) {
     if(width <= MAX_DISPLAY_DIM) {
@@ -48,6 +53,10 @@ void MDPComp::dump(android::String8& buf)
 {
     dumpsys_log(buf, "  MDP Composition: ");
     dumpsys_log(buf, "MDPCompState=%d\n", mState);
+    if(mState == MDPCOMP_ON && mCurrentFrame.fbStart >= 0)
+        dumpsys_log(buf, "  Mixed mode: GPU layers %d-%d at stage %d\n",
+                mCurrentFrame.fbStart, mCurrentFrame.fbEnd,
+                mCurrentFrame.zOrder(mCurrentFrame.fbStart));
     //XXX: Log more info
 }
 
@@ -78,11 +87,19 @@ bool MDPComp::init(hwc_context_t *ctx) {
             sDebugLogs = true;
     }
 
+    //Mixed mode composes part of the frame on the GPU
+    sMixedMode = true;
+    if(property_get("debug.mdpcomp.mixedmode", property, NULL) > 0) {
+        if(atoi(property) == 0)
+            sMixedMode = false;
+    }
+
     unsigned long idle_timeout = DEFAULT_IDLE_TIME;
     if(property_get("debug.mdpcomp.idletime", property, NULL) > 0) {
         if(atoi(property) != 0)
             idle_timeout = atoi(property);
     }
+    sIdleTimeout = idle_timeout;
 
     //create Idle Invalidator
     idleInvalidator = IdleInvalidator::getInstance();
@@ -118,6 +135,9 @@ void MDPComp::setMDPCompLayerFlags(hwc_context_t *ctx,
     LayerProp *layerProp = ctx->layerProp[dpy];
 
     for(int index = 0; index < ctx->listStats[dpy].numAppLayers; index++ ) {
+        //Left for the GPU in mixed mode, or hidden
+        if(!mCurrentFrame.needsPipe(index))
+            continue;
         hwc_layer_1_t* layer = &(list->hwLayers[index]);
         layerProp[index].mFlags |= HWC_MDPCOMP;
         layer->compositionType = HWC_OVERLAY;
@@ -136,7 +156,8 @@ void MDPComp::unsetMDPCompLayerFlags(hwc_context_t* ctx,
             layerProp[index].mFlags &= ~HWC_MDPCOMP;
         }
 
-        if(list->hwLayers[index].compositionType == HWC_OVERLAY) {
+        if(list->hwLayers[index].compositionType == HWC_OVERLAY &&
+                !isHiddenLayer(ctx, dpy, index)) {
             list->hwLayers[index].compositionType = HWC_FRAMEBUFFER;
         }
     }
@@ -182,23 +203,123 @@ bool MDPComp::setupBasePipe(hwc_context_t *ctx) {
     return true;
 }
 
+void MDPComp::releaseFrame(FrameInfo& frame) {
+    if(frame.pipeLayer) {
+        for(int i = 0 ; i < frame.count; i++ ) {
+            if(frame.pipeLayer[i].pipeInfo) {
+                frame.pipeLayer[i].pipeInfo->~MdpPipeInfo();
+                frame.pipeLayer[i].pipeInfo = NULL;
+                //We dont own the rotator
+                frame.pipeLayer[i].rot = NULL;
+            }
+        }
+        frame.pipeLayer = NULL;
+    }
+    frame.count = 0;
+    frame.fbStart = -1;
+    frame.fbEnd = -1;
+    frame.droppedMask = 0;
+}
+
 void MDPComp::reset(hwc_context_t *ctx,
         hwc_display_contents_1_t* list ) {
     //Reset flags and states
     unsetMDPCompLayerFlags(ctx, list);
-    if(mCurrentFrame.pipeLayer) {
-        for(int i = 0 ; i < mCurrentFrame.count; i++ ) {
-            if(mCurrentFrame.pipeLayer[i].pipeInfo) {
-                delete mCurrentFrame.pipeLayer[i].pipeInfo;
-                mCurrentFrame.pipeLayer[i].pipeInfo = NULL;
-                //We dont own the rotator
-                mCurrentFrame.pipeLayer[i].rot = NULL;
-            }
+    releaseFrame(mCurrentFrame);
+}
+
+void MDPComp::BufferProps::set(private_handle_t *hnd) {
+    MetaData_t *metadata = (MetaData_t *)hnd->base_metadata;
+    width = hnd->width;
+    height = hnd->height;
+    format = hnd->format;
+    secure = isSecureBuffer(hnd);
+    interlaced = metadata && (metadata->operation & PP_PARAM_INTERLACED) &&
+            metadata->interlaced;
+}
+
+/*
+ * Without a geometry change only the buffers of the layers change. If they
+ * match the ones the pipes were configured for, the pipes are kept as they
+ * are and draw just queues the new buffers.
+ */
+bool MDPComp::isReusable(hwc_context_t *ctx,
+        hwc_display_contents_1_t* list) {
+    const int dpy = HWC_DISPLAY_PRIMARY;
+    if(!mReusable || mState != MDPCOMP_ON ||
+            (list->flags & HWC_GEOMETRY_CHANGED) ||
+            ctx->listStats[dpy].numAppLayers != mCachedCount ||
+            sIdleFallBack || ctx->mExtDispConfiguring ||
+            isSecuring(ctx) || ctx->mSecureMode)
+        return false;
+
+    for(int index = 0; index < mCachedCount; index++) {
+        private_handle_t *hnd =
+                (private_handle_t *)list->hwLayers[index].handle;
+        if(!hnd)
+            return false;
+        BufferProps props;
+        props.set(hnd);
+        if(!(props == mCachedProps[index]))
+            return false;
+    }
+    return true;
+}
+
+bool MDPComp::keepFramePipes(hwc_context_t *ctx,
+        hwc_display_contents_1_t* list, FrameInfo& prev) {
+    const int dpy = HWC_DISPLAY_PRIMARY;
+    mCurrentFrame.count = prev.count;
+    mCurrentFrame.fbStart = prev.fbStart;
+    mCurrentFrame.fbEnd = prev.fbEnd;
+    mCurrentFrame.droppedMask = prev.droppedMask;
+    mCurrentFrame.pipeLayer = (PipeLayerPair*)ctx->mFrameArena[dpy].alloc(
+            sizeof(PipeLayerPair) * prev.count);
+    if(!mCurrentFrame.pipeLayer)
+        return false;
+
+    //Kept pipes count as used only once every pipe of the frame is in
+    //place, otherwise they go back for the fallback to allocate
+    for(int index = 0; index < prev.count; index++) {
+        if(!prev.needsPipe(index))
+            continue;
+        PipeLayerPair& info = mCurrentFrame.pipeLayer[index];
+        info.rot = NULL;
+        info.pipeInfo = keepPipeInfo(ctx, *prev.pipeLayer[index].pipeInfo);
+        if(!info.pipeInfo) {
+            ALOGD_IF(isDebug(), "%s: pipe of layer %d is gone",
+                    __FUNCTION__, index);
+            ctx->mOverlay->dropKeptPipes(dpy);
+            return false;
         }
-        free(mCurrentFrame.pipeLayer);
-        mCurrentFrame.pipeLayer = NULL;
     }
-    mCurrentFrame.count = 0;
+
+    //The FB target takes whichever RGB pipe is left
+    if(prev.fbStart >= 0 && !ctx->mFBUpdate[dpy]->prepare(ctx, list,
+            static_cast<eZorder>(prev.zOrder(prev.fbStart)))) {
+        ctx->mOverlay->dropKeptPipes(dpy);
+        return false;
+    }
+    ctx->mOverlay->useKeptPipes(dpy);
+    return true;
+}
+
+void MDPComp::cacheFrame(hwc_context_t *ctx,
+        hwc_display_contents_1_t* list) {
+    const int dpy = HWC_DISPLAY_PRIMARY;
+    //Rotator sessions are handed out anew every frame, so pipes fed by a
+    //rotator cannot be kept
+    mReusable = true;
+    for(int index = 0; index < mCurrentFrame.count; index++) {
+        if(mCurrentFrame.needsPipe(index) &&
+                mCurrentFrame.pipeLayer[index].rot)
+            mReusable = false;
+    }
+    mCachedCount = ctx->listStats[dpy].numAppLayers;
+    for(int index = 0; index < mCachedCount; index++) {
+        mCachedProps[index].set(
+                (private_handle_t *)list->hwLayers[index].handle);
+    }
 }
 
 bool MDPComp::isWidthValid(hwc_context_t *ctx, hwc_layer_1_t *layer) {
@@ -214,8 +335,8 @@ bool MDPComp::isWidthValid(hwc_context_t *ctx, hwc_layer_1_t *layer) {
     int hw_w = ctx->dpyAttr[dpy].xres;
     int hw_h = ctx->dpyAttr[dpy].yres;
 
-    hwc_rect_t sourceCrop = layer->sourceCrop;
-    hwc_rect_t displayFrame = layer->displayFrame;
+    hwc_rect_t sourceCrop, displayFrame;
+    getLayerRects(ctx, dpy, layer, sourceCrop, displayFrame);
 
     hwc_rect_t crop =  sourceCrop;
     int crop_w = crop.right - crop.left;
@@ -235,7 +356,7 @@ bool MDPComp::isWidthValid(hwc_context_t *ctx, hwc_layer_1_t *layer) {
     //Workaround for MDP HW limitation in DSI command mode panels where
     //FPS will not go beyond 30 if buffers on RGB pipes are of width < 5
 
-    if(crop_w < 5)
+    if(crop_w < MIN_RGB_CROP_W)
         return false;
 
     return true;
@@ -272,6 +393,151 @@ ovutils::eDest MDPComp::getMdpPipe(hwc_context_t *ctx, ePipeType type) {
     return ovutils::OV_INVALID;
 }
 
+/* Pipe types the assignment picks from, cheapest first */
+enum { SOLVER_DMA, SOLVER_RGB, SOLVER_VG, SOLVER_TYPES };
+
+static const eMdpPipeType sSolverPipeType[SOLVER_TYPES] = {
+    OV_MDP_PIPE_DMA, OV_MDP_PIPE_RGB, OV_MDP_PIPE_VG
+};
+
+/* Cost of a fetched kilobyte on each pipe type. DMA pipes cannot scale and
+ * only VG pipes take YUV, so the more capable a pipe the more it costs to
+ * spend it on a layer that does not need it. */
+static const int sSolverPipeWeight[SOLVER_TYPES] = { 1, 2, 3 };
+
+struct PipeRequest {
+    int layer;   //index in the list
+    int pipes;   //pipes of one type the layer needs
+    int allowed; //bitmask of the pipe types that can take the layer
+    int choices; //number of bits set in allowed
+    int kbytes;  //estimated fetch per frame
+};
+
+/*
+ * Branch and bound over the pipe type of each layer. Requests are sorted
+ * most constrained first, so dead ends are cut early; with at most
+ * MAX_PIPES_PER_MIXER layers and 3 types the search stays tiny.
+ */
+struct PipeSolver {
+    int count;
+    PipeRequest req[MAX_NUM_LAYERS];
+    int avail[SOLVER_TYPES];
+    int minCostLeft[MAX_NUM_LAYERS + 1];
+    int choice[MAX_NUM_LAYERS];
+    int best[MAX_NUM_LAYERS];
+    int bestCost;
+
+    void add(const PipeRequest& r);
+    bool solve();
+    void search(int i, int cost);
+};
+
+void PipeSolver::add(const PipeRequest& r) {
+    int i = count++;
+    while(i > 0 && (req[i - 1].choices > r.choices ||
+            (req[i - 1].choices == r.choices &&
+            req[i - 1].kbytes < r.kbytes))) {
+        req[i] = req[i - 1];
+        i--;
+    }
+    req[i] = r;
+}
+
+bool PipeSolver::solve() {
+    minCostLeft[count] = 0;
+    for(int i = count - 1; i >= 0; i--) {
+        int type = 0;
+        while(!(req[i].allowed & (1 << type)))
+            type++;
+        minCostLeft[i] = minCostLeft[i + 1] +
+                sSolverPipeWeight[type] * req[i].kbytes;
+    }
+    bestCost = INT_MAX;
+    search(0, 0);
+    return bestCost != INT_MAX;
+}
+
+void PipeSolver::search(int i, int cost) {
+    if(cost + minCostLeft[i] >= bestCost)
+        return;
+    if(i == count) {
+        bestCost = cost;
+        memcpy(best, choice, sizeof(int) * count);
+        return;
+    }
+    for(int type = 0; type < SOLVER_TYPES; type++) {
+        if(!(req[i].allowed & (1 << type)) || avail[type] < req[i].pipes)
+            continue;
+        avail[type] -= req[i].pipes;
+        choice[i] = type;
+        search(i + 1, cost + sSolverPipeWeight[type] * req[i].kbytes);
+        avail[type] += req[i].pipes;
+    }
+}
+
+/*
+ * Taking the first free pipe for each layer in list order can hand the last
+ * VG pipe to an RGB layer and leave a later video layer without one. Picking
+ * the types for all layers at once finds an assignment whenever there is
+ * one, and among those the one that fetches the most through the simplest
+ * pipes.
+ */
+bool MDPComp::assignPipeTypes(hwc_context_t *ctx,
+        hwc_display_contents_1_t* list, FrameInfo& currentFrame,
+        ePipeType types[]) {
+    const int dpy = HWC_DISPLAY_PRIMARY;
+    overlay::Overlay& ov = *ctx->mOverlay;
+    const bool dmaUsable = !ctx->mDMAInUse &&
+            ctx->mMDP.version >= qdutils::MDSS_V5;
+
+    PipeSolver solver;
+    solver.count = 0;
+    for(int type = 0; type < SOLVER_TYPES; type++)
+        solver.avail[type] = ov.availablePipes(dpy, sSolverPipeType[type]);
+    //The FB target is set up after the layers, leave its RGB pipes to it
+    if(currentFrame.fbStart >= 0)
+        solver.avail[SOLVER_RGB] = max(0,
+                solver.avail[SOLVER_RGB] - fbPipesNeeded());
+
+    for(int index = 0; index < currentFrame.count; index++) {
+        if(!currentFrame.needsPipe(index))
+            continue;
+        hwc_layer_1_t* layer = &list->hwLayers[index];
+        private_handle_t *hnd = (private_handle_t *)layer->handle;
+        hwc_rect_t crop, dst;
+        getLayerRects(ctx, dpy, layer, crop, dst);
+
+        PipeRequest r;
+        r.layer = index;
+        r.pipes = pipesNeeded(ctx, layer);
+        r.allowed = 1 << SOLVER_VG;
+        r.choices = 1;
+        if(!isYuvBuffer(hnd)) {
+            r.allowed |= 1 << SOLVER_RGB;
+            r.choices++;
+            if(dmaUsable && !needsScaling(layer)) {
+                r.allowed |= 1 << SOLVER_DMA;
+                r.choices++;
+            }
+        }
+        r.kbytes = ((crop.right - crop.left) * (crop.bottom - crop.top) *
+                (isYuvBuffer(hnd) ? 2 : 4) >> 10) + 1;
+        solver.add(r);
+    }
+
+    if(!solver.solve())
+        return false;
+
+    for(int i = 0; i < solver.count; i++) {
+        types[solver.req[i].layer] =
+                static_cast<ePipeType>(sSolverPipeType[solver.best[i]]);
+        ALOGD_IF(isDebug(), "%s: layer %d on %s pipe", __FUNCTION__,
+                solver.req[i].layer, solver.best[i] == SOLVER_VG ? "VG" :
+                (solver.best[i] == SOLVER_RGB ? "RGB" : "DMA"));
+    }
+    return true;
+}
+
 bool MDPComp::isDoable(hwc_context_t *ctx,
         hwc_display_contents_1_t* list) {
     //Number of layers
@@ -281,8 +547,7 @@ bool MDPComp::isDoable(hwc_context_t *ctx,
     overlay::Overlay& ov = *ctx->mOverlay;
     int availablePipes = ov.availablePipes(dpy);
 
-    if(numAppLayers < 1 || numAppLayers > MAX_PIPES_PER_MIXER ||
-                           pipesNeeded(ctx, list) > availablePipes) {
+    if(numAppLayers < 1) {
         ALOGD_IF(isDebug(), "%s: Unsupported number of layers",__FUNCTION__);
         return false;
     }
@@ -301,42 +566,162 @@ bool MDPComp::isDoable(hwc_context_t *ctx,
     if(ctx->mSecureMode)
         return false;
 
-    //Check for skip layers
-    if(isSkipPresent(ctx, dpy)) {
-        ALOGD_IF(isDebug(), "%s: Skip layers are present",__FUNCTION__);
-        return false;
-    }
-
     if(ctx->listStats[dpy].needsAlphaScale
                      && ctx->mMDP.version < qdutils::MDSS_V5) {
         ALOGD_IF(isDebug(), "%s: frame needs alpha downscaling",__FUNCTION__);
         return false;
     }
 
-    //FB composition on idle timeout
+    //FB composition on idle timeout. Content that declared a frame rate
+    //slower than the timeout is not idle, just between frames.
     if(sIdleFallBack) {
         sIdleFallBack = false;
-        ALOGD_IF(isDebug(), "%s: idle fallback",__FUNCTION__);
+        int refreshRate = ctx->listStats[dpy].refreshRate;
+        if(!refreshRate || (unsigned long)(1000 / refreshRate) <=
+                sIdleTimeout) {
+            ALOGD_IF(isDebug(), "%s: idle fallback",__FUNCTION__);
+            return false;
+        }
+    }
+
+    //Every visible layer on a pipe of its own
+    mCurrentFrame.fbStart = -1;
+    mCurrentFrame.fbEnd = -1;
+    mCurrentFrame.droppedMask = ctx->listStats[dpy].hiddenMask;
+    bool allDoable = (numAppLayers - ctx->listStats[dpy].hiddenCount <=
+            MAX_PIPES_PER_MIXER);
+    int pipes = 0;
+    for(int i = 0; i < numAppLayers && allDoable; ++i) {
+        if(mCurrentFrame.isDropped(i))
+            continue;
+        hwc_layer_1_t* layer = &list->hwLayers[i];
+        allDoable = isLayerDoable(ctx, layer);
+        pipes += pipesNeeded(ctx, layer);
+    }
+    if(allDoable && pipes <= availablePipes) {
+        if(ctx->mCostModel->isCheaper(ctx, dpy, CostModel::STRATEGY_MDP,
+                CostModel::STRATEGY_GPU))
+            return true;
+        ALOGD_IF(isDebug(), "%s: GPU composition is cheaper than MDP",
+                __FUNCTION__);
+    }
+
+    //Otherwise the GPU takes the layers MDP cannot, or those that cost
+    //MDP the most
+    if(!sMixedMode) {
+        ALOGD_IF(isDebug(), "%s: Unsupported layers, pipes or cost",
+                __FUNCTION__);
+        return false;
+    }
+    return findFBBatch(ctx, list);
+}
+
+bool MDPComp::isLayerDoable(hwc_context_t *ctx, hwc_layer_1_t* layer) {
+    private_handle_t *hnd = (private_handle_t *)layer->handle;
+
+    //Skip layers are for the GPU
+    if(isSkipLayer(layer)) {
+        ALOGD_IF(isDebug(), "%s: Skip layer",__FUNCTION__);
         return false;
     }
 
     //MDP composition is not efficient if layer needs rotator.
+    // As MDP h/w supports flip operation, use MDP comp only for
+    // 180 transforms. Fail for any transform involving 90 (90, 270).
+    if((layer->transform & HWC_TRANSFORM_ROT_90)  && (!isYuvBuffer(hnd)
+                                                        || !canRotate())) {
+        ALOGD_IF(isDebug(), "%s: orientation involved",__FUNCTION__);
+        return false;
+    }
+
+    if(!isYuvBuffer(hnd) && !isWidthValid(ctx,layer)) {
+        ALOGD_IF(isDebug(), "%s: Buffer is of invalid width",__FUNCTION__);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Picks the contiguous z-range of layers the GPU composes into the FB target
+ * in mixed mode. It has to hold every layer MDP cannot take, and leave the
+ * others few enough for the pipes and mixer stages left after the FB pipe.
+ * Of the ranges that fit, the cheapest split by the cost model wins, and
+ * only if it beats composing everything on the GPU.
+ */
+bool MDPComp::findFBBatch(hwc_context_t *ctx,
+        hwc_display_contents_1_t* list) {
+    const int dpy = HWC_DISPLAY_PRIMARY;
+    int numAppLayers = ctx->listStats[dpy].numAppLayers;
+    int availablePipes = ctx->mOverlay->availablePipes(dpy);
+
+    if(numAppLayers > MAX_NUM_LAYERS) {
+        ALOGD_IF(isDebug(), "%s: Too many layers",__FUNCTION__);
+        return false;
+    }
+
+    //Prefix sums of visible layers and pipes, entry i covers layers below
+    //i. Hidden layers count for nothing.
+    int visible[MAX_NUM_LAYERS + 1];
+    int pipes[MAX_NUM_LAYERS + 1];
+    int firstGpu = numAppLayers;
+    int lastGpu = -1;
+    visible[0] = 0;
+    pipes[0] = 0;
     for(int i = 0; i < numAppLayers; ++i) {
-        // As MDP h/w supports flip operation, use MDP comp only for
-        // 180 transforms. Fail for any transform involving 90 (90, 270).
         hwc_layer_1_t* layer = &list->hwLayers[i];
-        private_handle_t *hnd = (private_handle_t *)layer->handle;
-        if((layer->transform & HWC_TRANSFORM_ROT_90)  && (!isYuvBuffer(hnd)
-                                                            || !canRotate())) {
-            ALOGD_IF(isDebug(), "%s: orientation involved",__FUNCTION__);
-            return false;
+        if(mCurrentFrame.isDropped(i)) {
+            visible[i + 1] = visible[i];
+            pipes[i + 1] = pipes[i];
+            continue;
+        }
+        if(!isLayerDoable(ctx, layer)) {
+            firstGpu = min(firstGpu, i);
+            lastGpu = max(lastGpu, i);
         }
+        visible[i + 1] = visible[i] + 1;
+        pipes[i + 1] = pipes[i] + pipesNeeded(ctx, layer);
+    }
 
-        if(!isYuvBuffer(hnd) && !isWidthValid(ctx,layer)) {
-            ALOGD_IF(isDebug(), "%s: Buffer is of invalid width",__FUNCTION__);
-            return false;
+    int bestStart = -1;
+    int bestEnd = -1;
+    CompCost bestCost = { 0, 0 };
+    for(int start = 0; start <= min(firstGpu, numAppLayers - 1); ++start) {
+        for(int end = max(start, lastGpu); end < numAppLayers; ++end) {
+            //All of them on the GPU is plain FB composition
+            if(start == 0 && end == numAppLayers - 1)
+                continue;
+            int mdpLayers = visible[numAppLayers] -
+                    (visible[end + 1] - visible[start]);
+            int mdpPipes = pipes[numAppLayers] - pipes[end + 1] +
+                    pipes[start] + fbPipesNeeded();
+            if(mdpLayers + 1 > MAX_PIPES_PER_MIXER ||
+                    mdpPipes > availablePipes)
+                continue;
+            CompCost cost = ctx->mCostModel->estimateMixed(dpy, start, end);
+            if(bestStart < 0 ||
+                    ctx->mCostModel->isCheaper(ctx, dpy, cost, bestCost)) {
+                bestStart = start;
+                bestEnd = end;
+                bestCost = cost;
+            }
         }
     }
+
+    if(bestStart < 0) {
+        ALOGD_IF(isDebug(), "%s: No GPU batch fits the pipes",__FUNCTION__);
+        return false;
+    }
+    if(!ctx->mCostModel->isCheaper(ctx, dpy, bestCost,
+            ctx->mCostModel->getCost(dpy, CostModel::STRATEGY_GPU))) {
+        ALOGD_IF(isDebug(), "%s: GPU composition is cheaper than mixed",
+                __FUNCTION__);
+        return false;
+    }
+    ALOGD_IF(isDebug(), "%s: GPU composes layers %d-%d, %llu bytes %u us",
+            __FUNCTION__, bestStart, bestEnd,
+            (unsigned long long)bestCost.busBytes, bestCost.engineUs);
+    mCurrentFrame.fbStart = bestStart;
+    mCurrentFrame.fbEnd = bestEnd;
     return true;
 }
 
@@ -353,6 +738,8 @@ bool MDPComp::setup(hwc_context_t* ctx, hwc_display_contents_1_t* list) {
     }
 
     for (int index = 0 ; index < mCurrentFrame.count; index++) {
+        if(!mCurrentFrame.needsPipe(index))
+            continue;
         hwc_layer_1_t* layer = &list->hwLayers[index];
         if(configure(ctx, layer, mCurrentFrame.pipeLayer[index]) != 0 ) {
             ALOGD_IF(isDebug(), "%s: MDPComp failed to configure overlay for \
@@ -360,6 +747,13 @@ bool MDPComp::setup(hwc_context_t* ctx, hwc_display_contents_1_t* list) {
             return false;
         }
     }
+
+    //Last, so that a failure above leaves no FB pipe behind at this z-order
+    if(mCurrentFrame.fbStart >= 0 && !ctx->mFBUpdate[dpy]->prepare(ctx, list,
+            static_cast<eZorder>(mCurrentFrame.zOrder(mCurrentFrame.fbStart)))) {
+        ALOGD_IF(isDebug(), "%s: No pipe for the FB target", __FUNCTION__);
+        return false;
+    }
     return true;
 }
 
@@ -373,6 +767,21 @@ bool MDPComp::prepare(hwc_context_t *ctx,
     overlay::Overlay& ov = *ctx->mOverlay;
     bool isMDPCompUsed = true;
 
+    //Same layers with the same kind of buffers, keep last frame's pipes
+    if(isReusable(ctx, list)) {
+        FrameInfo prev = mCurrentFrame;
+        mCurrentFrame.pipeLayer = NULL;
+        mCurrentFrame.count = 0;
+        bool kept = keepFramePipes(ctx, list, prev);
+        releaseFrame(prev);
+        if(kept) {
+            setMDPCompLayerFlags(ctx, list);
+            return true;
+        }
+        ALOGD_IF(isDebug(), "%s: cannot keep last frame's pipes",
+                __FUNCTION__);
+    }
+
     //reset old data
     reset(ctx, list);
 
@@ -382,6 +791,9 @@ bool MDPComp::prepare(hwc_context_t *ctx,
             setMDPCompLayerFlags(ctx, list);
         } else {
             ALOGD_IF(isDebug(),"%s: MDP Comp Failed",__FUNCTION__);
+            //Hand back the pipes setup got so far, for the fallback to use
+            //and configDone to unset
+            ov.releasePipes(HWC_DISPLAY_PRIMARY);
             isMDPCompUsed = false;
         }
     } else {
@@ -394,6 +806,9 @@ bool MDPComp::prepare(hwc_context_t *ctx,
     if(!isMDPCompUsed) {
         //Reset current frame
         reset(ctx, list);
+        mReusable = false;
+    } else {
+        cacheFrame(ctx, list);
     }
 
     mState = isMDPCompUsed ? MDPCOMP_ON : MDPCOMP_OFF;
@@ -419,10 +834,21 @@ int MDPCompLowRes::configure(hwc_context_t *ctx, hwc_layer_1_t *layer,
             &pipeLayerPair.rot);
 }
 
-int MDPCompLowRes::pipesNeeded(hwc_context_t *ctx,
-                        hwc_display_contents_1_t* list) {
+int MDPCompLowRes::pipesNeeded(hwc_context_t *ctx, hwc_layer_1_t* layer) {
+    return 1;
+}
+
+MDPComp::MdpPipeInfo* MDPCompLowRes::keepPipeInfo(hwc_context_t *ctx,
+        const MdpPipeInfo& prev) {
     const int dpy = HWC_DISPLAY_PRIMARY;
-    return ctx->listStats[dpy].numAppLayers;
+    const MdpPipeInfoLowRes& prevInfo =
+            static_cast<const MdpPipeInfoLowRes&>(prev);
+    if(!ctx->mOverlay->keepPipe(prevInfo.index, dpy))
+        return NULL;
+    MdpPipeInfo* info = newPipeInfo<MdpPipeInfoLowRes>(ctx, dpy);
+    if(info)
+        *static_cast<MdpPipeInfoLowRes*>(info) = prevInfo;
+    return info;
 }
 
 bool MDPCompLowRes::allocLayerPipes(hwc_context_t *ctx,
@@ -433,47 +859,38 @@ bool MDPCompLowRes::allocLayerPipes(hwc_context_t *ctx,
     int layer_count = ctx->listStats[dpy].numAppLayers;
 
     currentFrame.count = layer_count;
-    currentFrame.pipeLayer = (PipeLayerPair*)
-            malloc(sizeof(PipeLayerPair) * currentFrame.count);
-
-    if(isYuvPresent(ctx, dpy)) {
-        int nYuvCount = ctx->listStats[dpy].yuvCount;
-
-        for(int index = 0; index < nYuvCount; index ++) {
-            int nYuvIndex = ctx->listStats[dpy].yuvIndices[index];
-            hwc_layer_1_t* layer = &list->hwLayers[nYuvIndex];
-            PipeLayerPair& info = currentFrame.pipeLayer[nYuvIndex];
-            info.pipeInfo = new MdpPipeInfoLowRes;
-            info.rot = NULL;
-            MdpPipeInfoLowRes& pipe_info = *(MdpPipeInfoLowRes*)info.pipeInfo;
-            pipe_info.index = getMdpPipe(ctx, MDPCOMP_OV_VG);
-            if(pipe_info.index == ovutils::OV_INVALID) {
-                ALOGD_IF(isDebug(), "%s: Unable to get pipe for Videos",
-                        __FUNCTION__);
-                return false;
-            }
-            pipe_info.zOrder = nYuvIndex;
-        }
+    currentFrame.pipeLayer = (PipeLayerPair*)ctx->mFrameArena[dpy].alloc(
+            sizeof(PipeLayerPair) * currentFrame.count);
+    if(!currentFrame.pipeLayer) {
+        currentFrame.count = 0;
+        return false;
     }
 
-    for(int index = 0 ; index < layer_count ; index++ ) {
-        hwc_layer_1_t* layer = &list->hwLayers[index];
-        private_handle_t *hnd = (private_handle_t *)layer->handle;
+    ePipeType types[MAX_NUM_LAYERS];
+    if(!assignPipeTypes(ctx, list, currentFrame, types)) {
+        ALOGD_IF(isDebug(), "%s: No pipe assignment fits the layers",
+                __FUNCTION__);
+        return false;
+    }
 
-        if(isYuvBuffer(hnd))
+    for(int index = 0 ; index < layer_count ; index++ ) {
+        if(!currentFrame.needsPipe(index))
             continue;
 
         PipeLayerPair& info = currentFrame.pipeLayer[index];
-        info.pipeInfo = new MdpPipeInfoLowRes;
+        info.pipeInfo = newPipeInfo<MdpPipeInfoLowRes>(ctx, dpy);
+        if(!info.pipeInfo)
+            return false;
         info.rot = NULL;
         MdpPipeInfoLowRes& pipe_info = *(MdpPipeInfoLowRes*)info.pipeInfo;
 
-        pipe_info.index = getMdpPipe(ctx, MDPCOMP_OV_ANY);
+        pipe_info.index = getMdpPipe(ctx, types[index]);
         if(pipe_info.index == ovutils::OV_INVALID) {
-            ALOGD_IF(isDebug(), "%s: Unable to get pipe for UI", __FUNCTION__);
+            ALOGD_IF(isDebug(), "%s: Unable to get pipe for layer %d",
+                    __FUNCTION__, index);
             return false;
         }
-        pipe_info.zOrder = index;
+        pipe_info.zOrder = currentFrame.zOrder(index);
     }
     return true;
 }
@@ -508,6 +925,10 @@ bool MDPCompLowRes::draw(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
             return false;
         }
 
+        if(!(layerProp[i].mFlags & HWC_MDPCOMP)) {
+            continue;
+        }
+
         MdpPipeInfoLowRes& pipe_info =
                 *(MdpPipeInfoLowRes*)mCurrentFrame.pipeLayer[i].pipeInfo;
         ovutils::eDest dest = pipe_info.index;
@@ -516,10 +937,6 @@ bool MDPCompLowRes::draw(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
             return false;
         }
 
-        if(!(layerProp[i].mFlags & HWC_MDPCOMP)) {
-            continue;
-        }
-
         ALOGD_IF(isDebug(),"%s: MDP Comp: Drawing layer: %p hnd: %p \
                 using  pipe: %d", __FUNCTION__, layer,
                 hnd, dest );
@@ -528,8 +945,10 @@ bool MDPCompLowRes::draw(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
         uint32_t offset = hnd->offset;
         Rotator *rot = mCurrentFrame.pipeLayer[i].rot;
         if(rot) {
+            rot->setAcquireFence(layer->acquireFenceFd);
             if(!rot->queueBuffer(fd, offset))
                 return false;
+            mergeRotReleaseFence(rot, layer);
             fd = rot->getDstMemId();
             offset = rot->getDstOffset();
         }
@@ -546,26 +965,18 @@ bool MDPCompLowRes::draw(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
 
 //=============MDPCompHighRes===================================================
 
-int MDPCompHighRes::pipesNeeded(hwc_context_t *ctx,
-                        hwc_display_contents_1_t* list) {
+int MDPCompHighRes::pipesNeeded(hwc_context_t *ctx, hwc_layer_1_t* layer) {
     const int dpy = HWC_DISPLAY_PRIMARY;
-    int numAppLayers = ctx->listStats[dpy].numAppLayers;
-    int pipesNeeded = 0;
-
     int hw_w = ctx->dpyAttr[dpy].xres;
 
-    for(int i = 0; i < numAppLayers; ++i) {
-        hwc_layer_1_t* layer = &list->hwLayers[i];
-        hwc_rect_t dst = layer->displayFrame;
-      if(dst.left > hw_w/2) {
-          pipesNeeded++;
-      } else if(dst.right <= hw_w/2) {
-          pipesNeeded++;
-      } else {
-          pipesNeeded += 2;
-      }
+    hwc_rect_t crop, dst;
+    getLayerRects(ctx, dpy, layer, crop, dst);
+    if(dst.left > hw_w/2) {
+        return 1;
+    } else if(dst.right <= hw_w/2) {
+        return 1;
     }
-    return pipesNeeded;
+    return 2;
 }
 
 bool MDPCompHighRes::acquireMDPPipes(hwc_context_t *ctx, hwc_layer_1_t* layer,
@@ -573,7 +984,8 @@ bool MDPCompHighRes::acquireMDPPipes(hwc_context_t *ctx, hwc_layer_1_t* layer,
      const int dpy = HWC_DISPLAY_PRIMARY;
      int hw_w = ctx->dpyAttr[dpy].xres;
 
-     hwc_rect_t dst = layer->displayFrame;
+     hwc_rect_t crop, dst;
+     getLayerRects(ctx, dpy, layer, crop, dst);
      if(dst.left > hw_w/2) {
          pipe_info.lIndex = ovutils::OV_INVALID;
          pipe_info.rIndex = getMdpPipe(ctx, type);
@@ -594,6 +1006,23 @@ bool MDPCompHighRes::acquireMDPPipes(hwc_context_t *ctx, hwc_layer_1_t* layer,
      return true;
 }
 
+MDPComp::MdpPipeInfo* MDPCompHighRes::keepPipeInfo(hwc_context_t *ctx,
+        const MdpPipeInfo& prev) {
+    const int dpy = HWC_DISPLAY_PRIMARY;
+    overlay::Overlay& ov = *ctx->mOverlay;
+    const MdpPipeInfoHighRes& prevInfo =
+            static_cast<const MdpPipeInfoHighRes&>(prev);
+    if((prevInfo.lIndex != ovutils::OV_INVALID &&
+            !ov.keepPipe(prevInfo.lIndex, dpy)) ||
+            (prevInfo.rIndex != ovutils::OV_INVALID &&
+            !ov.keepPipe(prevInfo.rIndex, dpy)))
+        return NULL;
+    MdpPipeInfo* info = newPipeInfo<MdpPipeInfoHighRes>(ctx, dpy);
+    if(info)
+        *static_cast<MdpPipeInfoHighRes*>(info) = prevInfo;
+    return info;
+}
+
 bool MDPCompHighRes::allocLayerPipes(hwc_context_t *ctx,
         hwc_display_contents_1_t* list,
         FrameInfo& currentFrame) {
@@ -602,51 +1031,39 @@ bool MDPCompHighRes::allocLayerPipes(hwc_context_t *ctx,
     int layer_count = ctx->listStats[dpy].numAppLayers;
 
     currentFrame.count = layer_count;
-    currentFrame.pipeLayer = (PipeLayerPair*)
-            malloc(sizeof(PipeLayerPair) * currentFrame.count);
-
-    if(isYuvPresent(ctx, dpy)) {
-        int nYuvCount = ctx->listStats[dpy].yuvCount;
-
-        for(int index = 0; index < nYuvCount; index ++) {
-            int nYuvIndex = ctx->listStats[dpy].yuvIndices[index];
-            hwc_layer_1_t* layer = &list->hwLayers[nYuvIndex];
-            PipeLayerPair& info = currentFrame.pipeLayer[nYuvIndex];
-            info.pipeInfo = new MdpPipeInfoHighRes;
-            MdpPipeInfoHighRes& pipe_info = *(MdpPipeInfoHighRes*)info.pipeInfo;
-            if(!acquireMDPPipes(ctx, layer, pipe_info,MDPCOMP_OV_VG)) {
-                ALOGD_IF(isDebug(),"%s: Unable to get pipe for videos",
-                                                            __FUNCTION__);
-                //TODO: windback pipebook data on fail
-                return false;
-            }
-            pipe_info.zOrder = nYuvIndex;
-        }
+    currentFrame.pipeLayer = (PipeLayerPair*)ctx->mFrameArena[dpy].alloc(
+            sizeof(PipeLayerPair) * currentFrame.count);
+    if(!currentFrame.pipeLayer) {
+        currentFrame.count = 0;
+        return false;
+    }
+
+    ePipeType types[MAX_NUM_LAYERS];
+    if(!assignPipeTypes(ctx, list, currentFrame, types)) {
+        ALOGD_IF(isDebug(), "%s: No pipe assignment fits the layers",
+                __FUNCTION__);
+        return false;
     }
 
     for(int index = 0 ; index < layer_count ; index++ ) {
         hwc_layer_1_t* layer = &list->hwLayers[index];
-        private_handle_t *hnd = (private_handle_t *)layer->handle;
 
-        if(isYuvBuffer(hnd))
+        if(!currentFrame.needsPipe(index))
             continue;
 
         PipeLayerPair& info = currentFrame.pipeLayer[index];
-        info.pipeInfo = new MdpPipeInfoHighRes;
+        info.pipeInfo = newPipeInfo<MdpPipeInfoHighRes>(ctx, dpy);
+        if(!info.pipeInfo)
+            return false;
         MdpPipeInfoHighRes& pipe_info = *(MdpPipeInfoHighRes*)info.pipeInfo;
 
-        ePipeType type = MDPCOMP_OV_ANY;
-
-        if(!qhwc::needsScaling(layer) && !ctx->mDMAInUse
-                             && ctx->mMDP.version >= qdutils::MDSS_V5)
-            type = MDPCOMP_OV_DMA;
-
-        if(!acquireMDPPipes(ctx, layer, pipe_info, type)) {
-            ALOGD_IF(isDebug(), "%s: Unable to get pipe for UI", __FUNCTION__);
+        if(!acquireMDPPipes(ctx, layer, pipe_info, types[index])) {
+            ALOGD_IF(isDebug(), "%s: Unable to get pipe for layer %d",
+                    __FUNCTION__, index);
             //TODO: windback pipebook data on fail
             return false;
         }
-        pipe_info.zOrder = index;
+        pipe_info.zOrder = currentFrame.zOrder(index);
     }
     return true;
 }
@@ -711,7 +1128,9 @@ bool MDPCompHighRes::draw(hwc_context_t *ctx, hwc_display_contents_1_t* list) {
         int offset = hnd->offset;
 
         if(rot) {
+            rot->setAcquireFence(layer->acquireFenceFd);
             rot->queueBuffer(fd, offset);
+            mergeRotReleaseFence(rot, layer);
             fd = rot->getDstMemId();
             offset = rot->getDstOffset();
         }
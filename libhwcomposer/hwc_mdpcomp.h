@@ -24,6 +24,7 @@
 #include <idle_invalidator.h>
 #include <cutils/properties.h>
 #include <overlay.h>
+#include <new>
 
 #define DEFAULT_IDLE_TIME 2000
 #define MAX_PIPES_PER_MIXER 4
@@ -77,11 +78,57 @@ protected:
     struct FrameInfo {
         int count;
         struct PipeLayerPair* pipeLayer;
+        /* z-range [fbStart, fbEnd] of the layers the GPU composes into the
+         * FB target, fbStart is -1 when MDP composes every layer */
+        int fbStart;
+        int fbEnd;
+        /* hidden layers, composed by nobody */
+        uint32_t droppedMask;
+
+        bool isFBComposed(int index) const {
+            return fbStart >= 0 && index >= fbStart && index <= fbEnd;
+        }
+        bool isDropped(int index) const {
+            return index < MAX_NUM_LAYERS && (droppedMask & (1u << index));
+        }
+        /* true if the layer is on an MDP pipe of its own */
+        bool needsPipe(int index) const {
+            return !isFBComposed(index) && !isDropped(index);
+        }
+        /* MDP stage of a layer, or of the FB target for index fbStart. The
+         * stages go to the pipes below and the FB target, in order. */
+        int zOrder(int index) const {
+            int z = 0;
+            for(int i = 0; i < index; i++) {
+                if(needsPipe(i))
+                    z++;
+            }
+            if(fbStart >= 0 && index > fbEnd)
+                z++;
+            return z;
+        }
+    };
+
+    /* buffer properties the pipe configuration of a layer depends on */
+    struct BufferProps {
+        int width;
+        int height;
+        int format;
+        bool secure;
+        bool interlaced;
+
+        void set(private_handle_t *hnd);
+        bool operator==(const BufferProps& other) const {
+            return width == other.width && height == other.height &&
+                    format == other.format && secure == other.secure &&
+                    interlaced == other.interlaced;
+        }
     };
 
-    /* calculates pipes needed for the panel */
-    virtual int pipesNeeded(hwc_context_t *ctx,
-                            hwc_display_contents_1_t* list) = 0;
+    /* calculates pipes needed by a layer on the panel */
+    virtual int pipesNeeded(hwc_context_t *ctx, hwc_layer_1_t* layer) = 0;
+    /* pipes needed by the FB target on the panel */
+    virtual int fbPipesNeeded() = 0;
     /* allocates pipe from pipe book */
     virtual bool allocLayerPipes(hwc_context_t *ctx,
                 hwc_display_contents_1_t* list,FrameInfo& current_frame) = 0;
@@ -90,6 +137,16 @@ protected:
                 PipeLayerPair& pipeLayerPair) = 0;
     /* Is rotation supported */
     virtual bool canRotate(){ return true; };
+    /* claims the pipe(s) of prev again, returns a copy in the frame arena */
+    virtual MdpPipeInfo* keepPipeInfo(hwc_context_t *ctx,
+                const MdpPipeInfo& prev) = 0;
+    /* constructs pipe info in the frame arena of dpy, the one the frame's
+     * pipeLayer array is in, NULL if it is full */
+    template <typename T> static MdpPipeInfo* newPipeInfo(hwc_context_t *ctx,
+                int dpy) {
+        void *mem = ctx->mFrameArena[dpy].alloc(sizeof(T));
+        return mem ? new (mem) T : NULL;
+    }
 
 
     /* set/reset flags for MDPComp */
@@ -103,10 +160,26 @@ protected:
     void reset( hwc_context_t *ctx, hwc_display_contents_1_t* list );
     /* allocate MDP pipes from overlay */
     ovutils::eDest getMdpPipe(hwc_context_t *ctx, ePipeType type);
+    /* picks the pipe type of every MDP composed layer, false if none fit */
+    bool assignPipeTypes(hwc_context_t *ctx, hwc_display_contents_1_t* list,
+                FrameInfo& currentFrame, ePipeType types[]);
     /* checks for conditions where mdpcomp is not possible */
     bool isDoable(hwc_context_t *ctx, hwc_display_contents_1_t* list);
+    /* checks if MDP can compose the layer on its own pipe */
+    bool isLayerDoable(hwc_context_t *ctx, hwc_layer_1_t* layer);
+    /* picks the layers for the GPU in mixed mode, false if none fit */
+    bool findFBBatch(hwc_context_t *ctx, hwc_display_contents_1_t* list);
     /* sets up MDP comp for current frame */
     bool setup(hwc_context_t* ctx, hwc_display_contents_1_t* list);
+    /* checks if last frame's pipes can be kept as they are configured */
+    bool isReusable(hwc_context_t *ctx, hwc_display_contents_1_t* list);
+    /* carries the pipes of prev into the current frame */
+    bool keepFramePipes(hwc_context_t *ctx, hwc_display_contents_1_t* list,
+                FrameInfo& prev);
+    /* records what isReusable checks on the next frame */
+    void cacheFrame(hwc_context_t *ctx, hwc_display_contents_1_t* list);
+    /* runs the destructors of the pipe info, the arena owns the memory */
+    static void releaseFrame(FrameInfo& frame);
     /* set up Border fill as Base pipe */
     static bool setupBasePipe(hwc_context_t*);
     /* Is debug enabled */
@@ -121,8 +194,15 @@ protected:
     static bool sEnabled;
     static bool sDebugLogs;
     static bool sIdleFallBack;
+    static unsigned long sIdleTimeout; //ms
+    static bool sMixedMode;
     static IdleInvalidator *idleInvalidator;
     struct FrameInfo mCurrentFrame;
+
+    /* Set up on the last frame, checked against the next one */
+    bool mReusable;
+    int mCachedCount;
+    BufferProps mCachedProps[MAX_NUM_LAYERS];
 };
 
 class MDPCompLowRes : public MDPComp {
@@ -145,8 +225,11 @@ private:
             hwc_display_contents_1_t* list,
             FrameInfo& current_frame);
 
-    virtual int pipesNeeded(hwc_context_t *ctx,
-            hwc_display_contents_1_t* list);
+    virtual int pipesNeeded(hwc_context_t *ctx, hwc_layer_1_t* layer);
+    virtual int fbPipesNeeded() { return 1; };
+
+    virtual MdpPipeInfo* keepPipeInfo(hwc_context_t *ctx,
+            const MdpPipeInfo& prev);
 };
 
 class MDPCompHighRes : public MDPComp {
@@ -172,8 +255,11 @@ private:
             hwc_display_contents_1_t* list,
             FrameInfo& current_frame);
 
-    virtual int pipesNeeded(hwc_context_t *ctx, hwc_display_contents_1_t* list);
+    virtual int pipesNeeded(hwc_context_t *ctx, hwc_layer_1_t* layer);
+    virtual int fbPipesNeeded() { return 2; };
     virtual bool canRotate(){ return false; };
+    virtual MdpPipeInfo* keepPipeInfo(hwc_context_t *ctx,
+            const MdpPipeInfo& prev);
 };
 }; //namespace
 #endif
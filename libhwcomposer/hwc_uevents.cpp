@@ -62,7 +62,8 @@ static void handle_uevent(hwc_context_t* ctx, const char* udata, int len)
 
     if (compositionType & (qdutils::COMPOSITION_TYPE_DYN |
                            qdutils::COMPOSITION_TYPE_MDP |
-                           qdutils::COMPOSITION_TYPE_C2D)) {
+                           qdutils::COMPOSITION_TYPE_C2D |
+                           qdutils::COMPOSITION_TYPE_CPU)) {
         usecopybit = true;
     }
 
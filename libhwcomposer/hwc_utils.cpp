@@ -19,6 +19,7 @@
  */
 #define HWC_UTILS_DEBUG 0
 #include <sys/ioctl.h>
+#include <sync/sync.h>
 #include <binder/IServiceManager.h>
 #include <EGL/egl.h>
 #include <cutils/properties.h>
@@ -31,6 +32,7 @@
 #include "hwc_video.h"
 #include "mdp_version.h"
 #include "hwc_copybit.h"
+#include "hwc_costmodel.h"
 #include "external.h"
 #include "hwc_qclient.h"
 #include "QService.h"
@@ -122,6 +124,14 @@ void initContext(hwc_context_t *ctx)
         HWC_DISPLAY_PRIMARY);
 
     char value[PROPERTY_VALUE_MAX];
+    // Rotate on the CPU when there is no h/w rotator to be had, rather than
+    // give the layer to the GPU. persist.hwc.swrot=0 turns it off.
+    ctx->mSwRotEnabled = true;
+    if(property_get("persist.hwc.swrot", value, NULL) > 0 &&
+            atoi(value) == 0) {
+        ctx->mSwRotEnabled = false;
+    }
+
     // Check if the target supports copybit compostion (dyn/mdp/c2d) to
     // decide if we need to open the copybit module.
     int compositionType =
@@ -129,7 +139,8 @@ void initContext(hwc_context_t *ctx)
 
     if (compositionType & (qdutils::COMPOSITION_TYPE_DYN |
                            qdutils::COMPOSITION_TYPE_MDP |
-                           qdutils::COMPOSITION_TYPE_C2D)) {
+                           qdutils::COMPOSITION_TYPE_C2D |
+                           qdutils::COMPOSITION_TYPE_CPU)) {
             ctx->mCopyBit[HWC_DISPLAY_PRIMARY] = new CopyBit();
     }
 
@@ -138,6 +149,7 @@ void initContext(hwc_context_t *ctx)
         ctx->mLayerCache[i] = new LayerCache();
     ctx->mMDPComp = MDPComp::getObject(ctx->dpyAttr[HWC_DISPLAY_PRIMARY].xres);
     MDPComp::init(ctx);
+    ctx->mCostModel = new CostModel(ctx->mMDP.version);
 
     pthread_mutex_init(&(ctx->vstate.lock), NULL);
     pthread_cond_init(&(ctx->vstate.cond), NULL);
@@ -202,6 +214,11 @@ void closeContext(hwc_context_t *ctx)
         ctx->mMDPComp = NULL;
     }
 
+    if(ctx->mCostModel) {
+        delete ctx->mCostModel;
+        ctx->mCostModel = NULL;
+    }
+
     pthread_mutex_destroy(&(ctx->vstate.lock));
     pthread_cond_destroy(&(ctx->vstate.cond));
 }
@@ -290,15 +307,117 @@ bool isAlphaScaled(hwc_layer_1_t const* layer) {
     return false;
 }
 
+static void unionRect(hwc_rect_t& dst, const hwc_rect_t& rect) {
+    if(rect.left >= rect.right || rect.top >= rect.bottom)
+        return;
+    if(dst.left >= dst.right || dst.top >= dst.bottom) {
+        dst = rect;
+        return;
+    }
+    dst.left = min(dst.left, rect.left);
+    dst.top = min(dst.top, rect.top);
+    dst.right = max(dst.right, rect.right);
+    dst.bottom = max(dst.bottom, rect.bottom);
+}
+
+static bool containsRect(const hwc_rect_t& outer, const hwc_rect_t& inner) {
+    return outer.left <= inner.left && outer.top <= inner.top &&
+            outer.right >= inner.right && outer.bottom >= inner.bottom;
+}
+
+//Trims the display frame of a layer to bound, which lies within it, into
+//trimFrame, and its source crop by the same amounts into trimCrop. Only
+//unscaled layers are trimmed, their crop and frame map pixel for pixel so
+//the trimmed pair samples exactly what the untrimmed one shows there.
+//A strip narrower than MDP takes is left whole, trimmed it would go to GPU.
+//Returns false if the layer is not trimmed, it is then composed whole.
+static bool trimToVisible(const hwc_layer_1_t *layer, const hwc_rect_t& bound,
+        hwc_rect_t& trimCrop, hwc_rect_t& trimFrame) {
+    const hwc_rect_t& frame = layer->displayFrame;
+    const hwc_rect_t& crop = layer->sourceCrop;
+    if(needsScaling(layer) || bound.left >= bound.right ||
+            bound.top >= bound.bottom ||
+            bound.right - bound.left < MIN_RGB_CROP_W)
+        return false;
+
+    trimCrop.left = crop.left + (bound.left - frame.left);
+    trimCrop.top = crop.top + (bound.top - frame.top);
+    trimCrop.right = crop.left + (bound.right - frame.left);
+    trimCrop.bottom = crop.top + (bound.bottom - frame.top);
+    trimFrame = bound;
+    return true;
+}
+
+/*
+ * Finds the layers nothing of which is on screen, per visibleRegionScreen
+ * or under an opaque layer above, and sets them to HWC_OVERLAY so neither
+ * the GPU nor MDP composes them. Partly covered unscaled RGB layers are
+ * composed trimmed to what is visible of them, the trimmed rects are kept
+ * in the list stats and the list itself is left alone. Skip layers are
+ * SurfaceFlinger's to draw and are left alone. SurfaceFlinger does not
+ * pass plane alpha to a 1.1 device, so HWC_BLENDING_NONE alone makes a
+ * layer opaque. Only the first MAX_NUM_LAYERS layers, those hiddenMask has
+ * a bit for, are culled.
+ */
+static void cullHiddenLayers(hwc_context_t *ctx,
+        hwc_display_contents_1_t *list, int dpy) {
+    const int numAppLayers = list->numHwLayers - 1;
+    ctx->listStats[dpy].hiddenCount = 0;
+    ctx->listStats[dpy].hiddenMask = 0;
+    ctx->listStats[dpy].hwLayers = list->hwLayers;
+    ctx->listStats[dpy].trimMask = 0;
+
+    for(int i = 0; i < min(numAppLayers, MAX_NUM_LAYERS); i++) {
+        hwc_layer_1_t *layer = &list->hwLayers[i];
+        private_handle_t *hnd = (private_handle_t *)layer->handle;
+        if(!hnd || isSkipLayer(layer))
+            continue;
+
+        const hwc_rect_t& frame = layer->displayFrame;
+        const hwc_region_t& visible = layer->visibleRegionScreen;
+        hwc_rect_t bound = {0, 0, 0, 0};
+        for(size_t j = 0; j < visible.numRects; j++) {
+            hwc_rect_t rect = visible.rects[j];
+            rect.left = max(rect.left, frame.left);
+            rect.top = max(rect.top, frame.top);
+            rect.right = min(rect.right, frame.right);
+            rect.bottom = min(rect.bottom, frame.bottom);
+            unionRect(bound, rect);
+        }
+
+        bool hidden = (bound.left >= bound.right || bound.top >= bound.bottom);
+        for(int j = i + 1; j < numAppLayers && !hidden; j++) {
+            hwc_layer_1_t *above = &list->hwLayers[j];
+            hidden = above->handle && !isSkipLayer(above) &&
+                    above->blending == HWC_BLENDING_NONE &&
+                    containsRect(above->displayFrame, frame);
+        }
+
+        if(hidden) {
+            ctx->listStats[dpy].hiddenCount++;
+            ctx->listStats[dpy].hiddenMask |= (1u << i);
+            layer->compositionType = HWC_OVERLAY;
+        } else if(!layer->transform && !isYuvBuffer(hnd) &&
+                !containsRect(bound, frame)) {
+            ListStats& stats = ctx->listStats[dpy];
+            if(trimToVisible(layer, bound, stats.trimCrop[i],
+                    stats.trimFrame[i]))
+                stats.trimMask |= (1u << i);
+        }
+    }
+}
+
 void setListStats(hwc_context_t *ctx,
-        const hwc_display_contents_1_t *list, int dpy) {
+        hwc_display_contents_1_t *list, int dpy) {
 
     ctx->listStats[dpy].numAppLayers = list->numHwLayers - 1;
     ctx->listStats[dpy].fbLayerIndex = list->numHwLayers - 1;
     ctx->listStats[dpy].skipCount = 0;
     ctx->listStats[dpy].needsAlphaScale = false;
     ctx->listStats[dpy].yuvCount = 0;
+    ctx->listStats[dpy].refreshRate = 0;
     ctx->mDMAInUse = false;
+    cullHiddenLayers(ctx, list, dpy);
 
     for (size_t i = 0; i < list->numHwLayers; i++) {
         hwc_layer_1_t const* layer = &list->hwLayers[i];
@@ -307,7 +426,8 @@ void setListStats(hwc_context_t *ctx,
         //reset stored yuv index
         ctx->listStats[dpy].yuvIndices[i] = -1;
 
-        if(list->hwLayers[i].compositionType == HWC_FRAMEBUFFER_TARGET) {
+        if(list->hwLayers[i].compositionType == HWC_FRAMEBUFFER_TARGET ||
+                isHiddenLayer(ctx, dpy, i)) {
             continue;
         //We disregard FB being skip for now! so the else if
         } else if (isSkipLayer(&list->hwLayers[i])) {
@@ -323,6 +443,10 @@ void setListStats(hwc_context_t *ctx,
 
         if(!ctx->listStats[dpy].needsAlphaScale)
             ctx->listStats[dpy].needsAlphaScale = isAlphaScaled(layer);
+
+        const MetaData_t *metadata = getMetaData(hnd, UPDATE_REFRESH_RATE);
+        if(metadata && metadata->refreshRate > ctx->listStats[dpy].refreshRate)
+            ctx->listStats[dpy].refreshRate = metadata->refreshRate;
     }
 }
 
@@ -458,6 +582,49 @@ void closeAcquireFds(hwc_display_contents_1_t* list) {
     }
 }
 
+void mergeRotReleaseFence(Rotator *rot, hwc_layer_1_t *layer) {
+    int rotFd = rot->getReleaseFence();
+    if(rotFd < 0)
+        return;
+    if(layer->releaseFenceFd < 0) {
+        layer->releaseFenceFd = rotFd;
+        return;
+    }
+    int fd = sync_merge("hwc_rot", layer->releaseFenceFd, rotFd);
+    if(fd < 0) {
+        //The producer must not get the buffer back before the read
+        ALOGE("%s: sync_merge failed, err=%s", __FUNCTION__, strerror(errno));
+        sync_wait(rotFd, -1);
+        close(rotFd);
+        return;
+    }
+    close(layer->releaseFenceFd);
+    close(rotFd);
+    layer->releaseFenceFd = fd;
+}
+
+void queueSwRotations(hwc_context_t *ctx, hwc_display_contents_1_t* list,
+        int dpy) {
+    const ListStats& stats = ctx->listStats[dpy];
+    if(stats.hwLayers != list->hwLayers)
+        return;
+    for(uint32_t i = 0; i < list->numHwLayers && i < MAX_NUM_LAYERS; i++) {
+        hwc_layer_1_t *layer = &list->hwLayers[i];
+        private_handle_t *hnd = (private_handle_t *)layer->handle;
+        Rotator *rot = stats.swRot[i];
+        if(!rot || !hnd || layer->compositionType != HWC_OVERLAY)
+            continue;
+        rot->setAcquireFence(layer->acquireFenceFd);
+        int fd = rot->prequeueBuffer(hnd->fd, hnd->offset);
+        if(fd < 0)
+            continue;
+        //MDP now waits for the rotated buffer instead of the source
+        if(layer->acquireFenceFd >= 0)
+            close(layer->acquireFenceFd);
+        layer->acquireFenceFd = fd;
+    }
+}
+
 int hwc_sync(hwc_context_t *ctx, hwc_display_contents_1_t* list, int dpy,
                                                         int fd) {
     int ret = 0;
@@ -607,6 +774,56 @@ static inline int configRotator(Rotator *rot, const Whf& whf,
     return 0;
 }
 
+//Plane layout of a YUV buffer as gralloc allocates it, see
+//getBufferSizeAndDimensions. The handle's width is the aligned one.
+static void getPlaneLayout(const private_handle_t *hnd, PlaneLayout& layout) {
+    layout = PlaneLayout();
+    layout.stride = hnd->width;
+    switch(hnd->format) {
+        case HAL_PIXEL_FORMAT_YCbCr_420_SP:
+        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+            layout.chromaOffset = hnd->width * hnd->height;
+            layout.chromaStride = hnd->width;
+            break;
+        case HAL_PIXEL_FORMAT_YV12:
+            layout.chromaOffset = hnd->width * hnd->height;
+            layout.chromaStride = ovutils::align(hnd->width / 2, 16);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Picks and configures a rotator for pre-rotation. When all h/w rotator
+ * sessions are taken, or the one we got cannot get its memory, a SW one
+ * stands in if that is enabled, otherwise the layer fails and goes to GPU.
+ */
+static int getRotator(hwc_context_t *ctx, const int& dpy,
+        hwc_layer_1_t *layer, Rotator **rot, const Whf& whf,
+        const eMdpFlags& mdpFlags, const eTransform& orient,
+        const int& downscale) {
+    *rot = ctx->mRotMgr->getNext();
+    if(*rot && configRotator(*rot, whf, mdpFlags, orient, downscale) == 0)
+        return 0;
+    if(!ctx->mSwRotEnabled)
+        return -1;
+    ALOGW("%s: %s, rotating on the CPU", __FUNCTION__,
+            *rot ? "h/w rotator config failed" : "out of h/w rotators");
+    *rot = ctx->mRotMgr->getNextSw();
+    if(*rot == NULL) return -1;
+    PlaneLayout layout;
+    getPlaneLayout((private_handle_t *)layer->handle, layout);
+    (*rot)->setPlaneLayout(layout);
+    if(configRotator(*rot, whf, mdpFlags, orient, downscale) < 0)
+        return -1;
+    //Remembered so set can start the rotation ahead of the MDP sync
+    ListStats& stats = ctx->listStats[dpy];
+    uint32_t index = layer - stats.hwLayers;
+    if(stats.hwLayers && index < MAX_NUM_LAYERS)
+        stats.swRot[index] = *rot;
+    return 0;
+}
+
 static inline int configMdp(Overlay *ov, const PipeArgs& parg,
         const eTransform& orient, const hwc_rect_t& crop,
         const hwc_rect_t& pos, const eDest& dest) {
@@ -654,8 +871,8 @@ int configureLowRes(hwc_context_t *ctx, hwc_layer_1_t *layer,
         return -1;
     }
 
-    hwc_rect_t crop = layer->sourceCrop;
-    hwc_rect_t dst = layer->displayFrame;
+    hwc_rect_t crop, dst;
+    getLayerRects(ctx, dpy, layer, crop, dst);
     int transform = layer->transform;
     eTransform orient = static_cast<eTransform>(transform);
     int downscale = 0;
@@ -680,10 +897,9 @@ int configureLowRes(hwc_context_t *ctx, hwc_layer_1_t *layer,
 
     if(isYuvBuffer(hnd) && //if 90 component or downscale, use rot
             ((transform & HWC_TRANSFORM_ROT_90) || downscale)) {
-        *rot = ctx->mRotMgr->getNext();
-        if(*rot == NULL) return -1;
         //Configure rotator for pre-rotation
-        if(configRotator(*rot, whf, mdpFlags, orient, downscale) < 0)
+        if(getRotator(ctx, dpy, layer, rot, whf, mdpFlags, orient,
+                    downscale) < 0)
             return -1;
         whf.format = (*rot)->getDstFormat();
         updateSource(orient, whf, crop);
@@ -714,8 +930,8 @@ int configureHighRes(hwc_context_t *ctx, hwc_layer_1_t *layer,
 
     int hw_w = ctx->dpyAttr[dpy].xres;
     int hw_h = ctx->dpyAttr[dpy].yres;
-    hwc_rect_t crop = layer->sourceCrop;
-    hwc_rect_t dst = layer->displayFrame;
+    hwc_rect_t crop, dst;
+    getLayerRects(ctx, dpy, layer, crop, dst);
     int transform = layer->transform;
     eTransform orient = static_cast<eTransform>(transform);
     const int downscale = 0;
@@ -728,10 +944,9 @@ int configureHighRes(hwc_context_t *ctx, hwc_layer_1_t *layer,
     trimLayer(ctx, dpy, transform, crop, dst);
 
     if(isYuvBuffer(hnd) && (transform & HWC_TRANSFORM_ROT_90)) {
-        (*rot) = ctx->mRotMgr->getNext();
-        if((*rot) == NULL) return -1;
         //Configure rotator for pre-rotation
-        if(configRotator(*rot, whf, mdpFlagsL, orient, downscale) < 0)
+        if(getRotator(ctx, dpy, layer, rot, whf, mdpFlagsL, orient,
+                    downscale) < 0)
             return -1;
         whf.format = (*rot)->getDstFormat();
         updateSource(orient, whf, crop);
@@ -807,6 +1022,19 @@ int configureHighRes(hwc_context_t *ctx, hwc_layer_1_t *layer,
     return 0;
 }
 
+void* FrameArena::alloc(size_t size) {
+    //Keep every allocation pointer aligned
+    size = ALIGN_TO(size, sizeof(uint64_t));
+    if(mUsed + size > sizeof(mBuf[0])) {
+        ALOGE("%s: out of space for %d bytes", __FUNCTION__, (int)size);
+        return NULL;
+    }
+    void *mem = (char*)mBuf[mHalf] + mUsed;
+    mUsed += size;
+    memset(mem, 0, size);
+    return mem;
+}
+
 void LayerCache::resetLayerCache(int num) {
     for(uint32_t i = 0; i < MAX_NUM_LAYERS; i++) {
         hnd[i] = NULL;
@@ -873,4 +1101,121 @@ void LayerCache::markCachedLayersAsOverlay(hwc_display_contents_1_t* list) {
     }
 }
 
+/*
+ * Screen bounds of what the producer says changed in the layer's buffer.
+ * Damage is relative to the producer's previous frame, so it is only used
+ * if that is the frame seq says the layer showed last. Otherwise, without
+ * damage metadata, or for transformed layers, it is the whole display
+ * frame. seq and hasSeq are updated to the frame the buffer holds.
+ */
+static hwc_rect_t getBufferDamage(hwc_layer_1_t *layer, uint32_t& seq,
+        bool& hasSeq) {
+    const hwc_rect_t& frame = layer->displayFrame;
+    const hwc_rect_t& crop = layer->sourceCrop;
+    private_handle_t *hnd = (private_handle_t *)layer->handle;
+    const MetaData_t *metadata = getMetaData(hnd, UPDATE_DAMAGE);
+    if(!metadata) {
+        hasSeq = false;
+        return frame;
+    }
+    //The producer may write the next frame's damage while we read
+    DamageData_t bufDamage = metadata->damage;
+    const bool follows = hasSeq && bufDamage.frameSeq == seq + 1;
+    seq = bufDamage.frameSeq;
+    hasSeq = true;
+
+    const int cropW = crop.right - crop.left;
+    const int cropH = crop.bottom - crop.top;
+    if(!follows || bufDamage.numRects <= 0 || layer->transform ||
+            cropW <= 0 || cropH <= 0)
+        return frame;
+
+    const int frameW = frame.right - frame.left;
+    const int frameH = frame.bottom - frame.top;
+    hwc_rect_t damage = {0, 0, 0, 0};
+    const int numRects = min((int)bufDamage.numRects, MAX_DAMAGE_RECTS);
+    for(int i = 0; i < numRects; i++) {
+        const MetaRect_t& r = bufDamage.rects[i];
+        int left = max(r.left, crop.left) - crop.left;
+        int top = max(r.top, crop.top) - crop.top;
+        int right = min(r.right, crop.right) - crop.left;
+        int bottom = min(r.bottom, crop.bottom) - crop.top;
+        if(left >= right || top >= bottom)
+            continue;
+        //Scale to the display frame, rounding outwards
+        hwc_rect_t rect;
+        rect.left = frame.left + left * frameW / cropW;
+        rect.top = frame.top + top * frameH / cropH;
+        rect.right = frame.left + (right * frameW + cropW - 1) / cropW;
+        rect.bottom = frame.top + (bottom * frameH + cropH - 1) / cropH;
+        unionRect(damage, rect);
+    }
+    return damage;
+}
+
+/*
+ * A layer damages what is visible of it when its buffer was swapped. Any
+ * geometry change, a change in the number of layers or a skip layer, whose
+ * content we cannot see, damages the whole display.
+ */
+void FrameDamage::update(hwc_context_t *ctx, hwc_display_contents_1_t* list,
+        int dpy) {
+    const int numAppLayers = ctx->listStats[dpy].numAppLayers;
+    const hwc_rect_t fullFrame = {0, 0, (int)ctx->dpyAttr[dpy].xres,
+            (int)ctx->dpyAttr[dpy].yres};
+
+    mPartial = false;
+    mFullFrame = (list->flags & HWC_GEOMETRY_CHANGED) ||
+            list->numHwLayers != mNumHwLayers;
+    memset(&mDirtyRect, 0, sizeof(mDirtyRect));
+
+    for(int i = 0; i < numAppLayers; i++) {
+        hwc_layer_1_t *layer = &list->hwLayers[i];
+        if(layer->flags & HWC_SKIP_LAYER)
+            mFullFrame = true;
+        if(layer->handle == mHnd[i])
+            continue;
+        mHnd[i] = layer->handle;
+
+        hwc_rect_t damage = getBufferDamage(layer, mFrameSeq[i],
+                mHasFrameSeq[i]);
+        const hwc_region_t& visible = layer->visibleRegionScreen;
+        for(size_t j = 0; j < visible.numRects; j++) {
+            hwc_rect_t rect = visible.rects[j];
+            rect.left = max(rect.left, damage.left);
+            rect.top = max(rect.top, damage.top);
+            rect.right = min(rect.right, damage.right);
+            rect.bottom = min(rect.bottom, damage.bottom);
+            unionRect(mDirtyRect, rect);
+        }
+    }
+    mNumHwLayers = list->numHwLayers;
+
+    if(mFullFrame)
+        mDirtyRect = fullFrame;
+}
+
+void FrameDamage::invalidate() {
+    mNumHwLayers = 0;
+    memset(mHnd, 0, sizeof(mHnd));
+    memset(mHasFrameSeq, 0, sizeof(mHasFrameSeq));
+    memset(&mDirtyRect, 0, sizeof(mDirtyRect));
+    mFullFrame = true;
+    mPartial = false;
+}
+
+void FrameDamage::enablePartial(hwc_context_t *ctx, int dpy) {
+#ifdef PARTIAL_UPDATE
+    //Command mode panels keep their frame, they take just what changed.
+    //An empty rect would leave the FB pipe without a crop.
+    mPartial = (dpy == HWC_DISPLAY_PRIMARY) && !mFullFrame &&
+            ctx->mMDP.panel == MIPI_CMD_PANEL &&
+            ctx->dpyAttr[dpy].xres <= MAX_DISPLAY_DIM &&
+            mDirtyRect.right > mDirtyRect.left &&
+            mDirtyRect.bottom > mDirtyRect.top;
+#else
+    mPartial = false;
+#endif
+}
+
 };//namespace qhwc
@@ -38,6 +38,7 @@
 #define MAX_NUM_DISPLAYS 4 //Yes, this is ambitious
 #define MAX_NUM_LAYERS 32
 #define MAX_DISPLAY_DIM 2048
+#define MIN_RGB_CROP_W 5 //Narrower RGB crops cap command mode panels at 30fps
 
 // For support of virtual displays
 #define HWC_DISPLAY_VIRTUAL     (HWC_DISPLAY_EXTERNAL+1)
@@ -62,6 +63,7 @@ class IFBUpdate;
 class IVideoOverlay;
 class MDPComp;
 class CopyBit;
+class CostModel;
 
 
 struct MDPInfo {
@@ -95,6 +97,19 @@ struct ListStats {
     int yuvCount;
     int yuvIndices[MAX_NUM_LAYERS];
     bool needsAlphaScale;
+    //Highest frame rate the producers declared in metadata, 0 if none did
+    int refreshRate;
+    //Layers covered by opaque layers above, nobody composes them
+    int hiddenCount;
+    uint32_t hiddenMask; //bit per layer, MAX_NUM_LAYERS is 32
+    //Layers HWC composes trimmed to what is visible of them, with the rects
+    //it uses instead of SurfaceFlinger's. See getLayerRects.
+    hwc_layer_1_t *hwLayers; //of the list the stats are for
+    uint32_t trimMask;
+    hwc_rect_t trimCrop[MAX_NUM_LAYERS];
+    hwc_rect_t trimFrame[MAX_NUM_LAYERS];
+    //SW rotators picked for the layers, see queueSwRotations
+    overlay::Rotator *swRot[MAX_NUM_LAYERS];
 };
 
 struct LayerProp {
@@ -108,6 +123,23 @@ enum {
     HWC_COPYBIT = 0x00000002,
 };
 
+//Bump allocator for per-frame bookkeeping of a display. The two halves
+//are used in turn, so what the previous frame allocated stays valid until
+//the next prepare of the display is done with it.
+class FrameArena {
+public:
+    FrameArena() : mHalf(0), mUsed(0) {}
+    //Switches halves, dropping what was allocated two resets ago
+    void reset() { mHalf ^= 1; mUsed = 0; }
+    //Returns zeroed memory, or NULL once the half is used up
+    void* alloc(size_t size);
+private:
+    enum { ARENA_SIZE = MAX_NUM_LAYERS * 128 };
+    int mHalf;
+    size_t mUsed;
+    uint64_t mBuf[2][ARENA_SIZE / sizeof(uint64_t)];
+};
+
 class LayerCache {
     public:
     LayerCache() {
@@ -128,10 +160,39 @@ class LayerCache {
 
 };
 
+//Tracks what changed on a display since the last frame. All zero is a valid
+//state, it damages the whole first frame.
+class FrameDamage {
+    public:
+    //Works out the dirty rect from geometry changes and buffer swaps
+    void update(hwc_context_t *ctx, hwc_display_contents_1_t* list, int dpy);
+    //Lets the frame go to the panel as just the dirty rect, if the panel
+    //takes partial updates. Only valid while the FB target is all there is.
+    void enablePartial(hwc_context_t *ctx, int dpy);
+    bool isPartial() const { return mPartial; }
+    //Called at the start of every prepare, a frame goes out whole unless
+    //that prepare enables partial
+    void reset() { mPartial = false; }
+    //Forgets the last frame, so the next one goes out whole. For frames
+    //update did not see and for the panel losing its content.
+    void invalidate();
+    //Bounds of what changed, the whole display after a geometry change
+    const hwc_rect_t& getDirtyRect() const { return mDirtyRect; }
+    private:
+    uint32_t mNumHwLayers;
+    buffer_handle_t mHnd[MAX_NUM_LAYERS];
+    //Producer frame shown last by each layer, to check damage against
+    uint32_t mFrameSeq[MAX_NUM_LAYERS];
+    bool mHasFrameSeq[MAX_NUM_LAYERS];
+    hwc_rect_t mDirtyRect;
+    bool mFullFrame;
+    bool mPartial;
+};
+
 // -----------------------------------------------------------------------------
 // Utility functions - implemented in hwc_utils.cpp
 void dumpLayer(hwc_layer_1_t const* l);
-void setListStats(hwc_context_t *ctx, const hwc_display_contents_1_t *list,
+void setListStats(hwc_context_t *ctx, hwc_display_contents_1_t *list,
         int dpy);
 void initContext(hwc_context_t *ctx);
 void closeContext(hwc_context_t *ctx);
@@ -156,6 +217,14 @@ void getActionSafePosition(hwc_context_t *ctx, int dpy, uint32_t& x,
 //Close acquireFenceFds of all layers of incoming list
 void closeAcquireFds(hwc_display_contents_1_t* list);
 
+//Holds the layer's release fence until its rotator has read the buffer
+void mergeRotReleaseFence(overlay::Rotator *rot, hwc_layer_1_t *layer);
+
+//Starts the SW rotations of the list and makes each layer's acquire fence
+//the one of its rotated buffer, so MDP waits for it. Call before hwc_sync.
+void queueSwRotations(hwc_context_t *ctx, hwc_display_contents_1_t* list,
+        int dpy);
+
 //Sync point impl.
 int hwc_sync(hwc_context_t *ctx, hwc_display_contents_1_t* list, int dpy,
         int fd);
@@ -281,7 +350,13 @@ struct hwc_context_t {
     qhwc::ListStats listStats[MAX_DISPLAYS];
     qhwc::LayerCache *mLayerCache[MAX_DISPLAYS];
     qhwc::LayerProp *layerProp[MAX_DISPLAYS];
+    //Per-frame allocations, reset when the display is prepared
+    qhwc::FrameArena mFrameArena[MAX_DISPLAYS];
+    //What changed on each display since its last frame
+    qhwc::FrameDamage mFrameDamage[MAX_DISPLAYS];
     qhwc::MDPComp *mMDPComp;
+    //Per frame cost of the composition strategies
+    qhwc::CostModel *mCostModel;
 
     //Securing in progress indicator
     bool mSecuring;
@@ -297,6 +372,8 @@ struct hwc_context_t {
     struct vsync_state vstate;
     //DMA used for rotator
     bool mDMAInUse;
+    //CPU rotation when no h/w rotator is to be had, else the layer goes to GPU
+    bool mSwRotEnabled;
 };
 
 namespace qhwc {
@@ -307,6 +384,29 @@ static inline bool isSkipPresent (hwc_context_t *ctx, int dpy) {
 static inline bool isYuvPresent (hwc_context_t *ctx, int dpy) {
     return  ctx->listStats[dpy].yuvCount;
 }
+
+static inline bool isHiddenLayer (hwc_context_t *ctx, int dpy, int index) {
+    return index < MAX_NUM_LAYERS &&
+            (ctx->listStats[dpy].hiddenMask & (1u << index));
+}
+
+//Source crop and display frame HWC composes a layer of dpy with, trimmed to
+//what is visible of it where the layer could be. The rects in the list are
+//SurfaceFlinger's and stay as they are.
+static inline void getLayerRects(hwc_context_t *ctx, int dpy,
+        const hwc_layer_1_t *layer, hwc_rect_t& crop, hwc_rect_t& frame) {
+    const ListStats& stats = ctx->listStats[dpy];
+    crop = layer->sourceCrop;
+    frame = layer->displayFrame;
+    if(!stats.trimMask || layer < stats.hwLayers ||
+            layer >= stats.hwLayers + MAX_NUM_LAYERS)
+        return;
+    const int index = layer - stats.hwLayers;
+    if(stats.trimMask & (1u << index)) {
+        crop = stats.trimCrop[index];
+        frame = stats.trimFrame[index];
+    }
+}
 };
 
 #endif //HWC_UTILS_H
@@ -155,8 +155,10 @@ bool VideoOverlayLowRes::draw(hwc_context_t *ctx,
     Rotator *rot = mRot;
 
     if(rot) {
+        rot->setAcquireFence(list->hwLayers[yuvIndex].acquireFenceFd);
         if(!rot->queueBuffer(fd, offset))
             return false;
+        mergeRotReleaseFence(rot, &list->hwLayers[yuvIndex]);
         fd = rot->getDstMemId();
         offset = rot->getDstOffset();
     }
@@ -267,8 +269,10 @@ bool VideoOverlayHighRes::draw(hwc_context_t *ctx,
     Rotator *rot = mRot;
 
     if(rot) {
+        rot->setAcquireFence(list->hwLayers[yuvIndex].acquireFenceFd);
         if(!rot->queueBuffer(fd, offset))
             return false;
+        mergeRotReleaseFence(rot, &list->hwLayers[yuvIndex]);
         fd = rot->getDstMemId();
         offset = rot->getDstOffset();
     }
@@ -27,6 +27,7 @@
 * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <new>
 #include "overlay.h"
 #include "pipes/overlayGenPipe.h"
 #include "mdp_version.h"
@@ -36,6 +37,13 @@
 namespace overlay {
 using namespace utils;
 
+//Backing store of the pipe objects, one slot per pipe of the singleton,
+//so pipes come and go across frames without touching the heap
+static union {
+    char mem[sizeof(GenericPipe)];
+    uint64_t align;
+} sPipeStore[OV_INVALID];
+
 Overlay::Overlay() {
     PipeBook::NUM_PIPES = qdutils::MDPVersion::getInstance().getTotalPipes();
     for(int i = 0; i < PipeBook::NUM_PIPES; i++) {
@@ -56,6 +64,7 @@ void Overlay::configBegin() {
         //Mark as available for this round.
         PipeBook::resetUse(i);
         PipeBook::resetAllocation(i);
+        PipeBook::resetKept(i);
     }
     mDumpStr[0] = '\0';
 }
@@ -104,7 +113,8 @@ eDest Overlay::nextPipe(eMdpPipeType type, int dpy) {
         //requested again by the same display using it, then go ahead.
         mPipeBook[index].mDisplay = dpy;
         if(not mPipeBook[index].valid()) {
-            mPipeBook[index].mPipe = new GenericPipe(dpy);
+            mPipeBook[index].mPipe =
+                    new (sPipeStore[index].mem) GenericPipe(dpy);
             char str[32];
             snprintf(str, 32, "Set pipe=%s dpy=%d; ",
                      PipeBook::getDestStr(dest), dpy);
@@ -118,6 +128,48 @@ eDest Overlay::nextPipe(eMdpPipeType type, int dpy) {
     return dest;
 }
 
+bool Overlay::keepPipe(utils::eDest dest, int dpy) {
+    int index = (int)dest;
+    if(index < 0 || index >= PipeBook::NUM_PIPES ||
+            not mPipeBook[index].valid() ||
+            mPipeBook[index].mDisplay != dpy ||
+            PipeBook::isAllocated(index)) {
+        return false;
+    }
+    //Pipes still valid were committed last round, see configDone
+    PipeBook::setAllocation(index);
+    PipeBook::setKept(index);
+    return true;
+}
+
+void Overlay::useKeptPipes(int dpy) {
+    for(int i = 0; i < PipeBook::NUM_PIPES; i++) {
+        if(PipeBook::isKept(i) && mPipeBook[i].mDisplay == dpy) {
+            PipeBook::setUse(i);
+            PipeBook::resetKept(i);
+        }
+    }
+}
+
+void Overlay::dropKeptPipes(int dpy) {
+    for(int i = 0; i < PipeBook::NUM_PIPES; i++) {
+        if(PipeBook::isKept(i) && mPipeBook[i].mDisplay == dpy) {
+            PipeBook::resetAllocation(i);
+            PipeBook::resetKept(i);
+        }
+    }
+}
+
+void Overlay::releasePipes(int dpy) {
+    for(int i = 0; i < PipeBook::NUM_PIPES; i++) {
+        if(mPipeBook[i].mDisplay == dpy) {
+            PipeBook::resetUse(i);
+            PipeBook::resetAllocation(i);
+            PipeBook::resetKept(i);
+        }
+    }
+}
+
 bool Overlay::commit(utils::eDest dest) {
     bool ret = false;
     int index = (int)dest;
@@ -296,7 +348,8 @@ void Overlay::PipeBook::init() {
 
 void Overlay::PipeBook::destroy() {
     if(mPipe) {
-        delete mPipe;
+        //Lives in sPipeStore
+        mPipe->~GenericPipe();
         mPipe = NULL;
     }
     mDisplay = DPY_UNUSED;
@@ -308,6 +361,7 @@ int Overlay::PipeBook::NUM_PIPES = 0;
 int Overlay::PipeBook::sPipeUsageBitmap = 0;
 int Overlay::PipeBook::sLastUsageBitmap = 0;
 int Overlay::PipeBook::sAllocatedBitmap = 0;
+int Overlay::PipeBook::sKeptBitmap = 0;
 utils::eMdpPipeType Overlay::PipeBook::pipeTypeLUT[utils::OV_MAX] =
     {utils::OV_MDP_PIPE_ANY};
 
@@ -60,6 +60,18 @@ public:
      * display without being garbage-collected once */
     utils::eDest nextPipe(utils::eMdpPipeType, int dpy);
 
+    /* Claims the pipe "dest" that "dpy" used in the previous round for this
+     * round too, keeping its configuration. Returns false if the pipe is gone
+     * or already taken. The pipe is only allocated until useKeptPipes, which
+     * makes the kept pipes of "dpy" count as used without a commit, or
+     * dropKeptPipes, which hands them back for others to allocate. */
+    bool keepPipe(utils::eDest dest, int dpy);
+    void useKeptPipes(int dpy);
+    void dropKeptPipes(int dpy);
+    /* Hands back every pipe "dpy" allocated or committed this round, when a
+     * composition it set up partly is given up */
+    void releasePipes(int dpy);
+
     void setSource(const utils::PipeArgs args, utils::eDest dest);
     void setCrop(const utils::Dim& d, utils::eDest dest);
     void setTransform(const int orientation, utils::eDest dest);
@@ -73,6 +85,8 @@ public:
     static Overlay* getInstance();
     /* Returns available ("unallocated") pipes for a display */
     int availablePipes(int dpy);
+    /* Same as above, counting only pipes of the given type */
+    int availablePipes(int dpy, utils::eMdpPipeType type);
     /* set the framebuffer index for external display */
     void setExtFbNum(int fbNum);
     /* Returns framebuffer index of the current external display */
@@ -116,6 +130,10 @@ private:
         static bool isAllocated(int index);
         static bool isNotAllocated(int index);
 
+        static void setKept(int index);
+        static void resetKept(int index);
+        static bool isKept(int index);
+
         static utils::eMdpPipeType getPipeType(utils::eDest dest);
         static const char* getDestStr(utils::eDest dest);
 
@@ -135,6 +153,8 @@ private:
         //3 pipe objects in one shot and proceed with config only if it gets all
         //3. The bitmap helps allocate different pipe objects on each request.
         static int sAllocatedBitmap;
+        //Pipes claimed by keepPipe and not yet used or dropped
+        static int sKeptBitmap;
     };
 
     PipeBook mPipeBook[utils::OV_INVALID]; //Used as max
@@ -165,6 +185,18 @@ inline int Overlay::availablePipes(int dpy) {
     return avail;
 }
 
+inline int Overlay::availablePipes(int dpy, utils::eMdpPipeType type) {
+     int avail = 0;
+     for(int i = 0; i < PipeBook::NUM_PIPES; i++) {
+       if(type == PipeBook::getPipeType((utils::eDest)i) &&
+           (mPipeBook[i].mDisplay == PipeBook::DPY_UNUSED ||
+           mPipeBook[i].mDisplay == dpy) && PipeBook::isNotAllocated(i)) {
+                avail++;
+        }
+    }
+    return avail;
+}
+
 inline void Overlay::setExtFbNum(int fbNum) {
     sExtFbIndex = fbNum;
 }
@@ -217,6 +249,18 @@ inline bool Overlay::PipeBook::isNotAllocated(int index) {
     return !isAllocated(index);
 }
 
+inline void Overlay::PipeBook::setKept(int index) {
+    sKeptBitmap |= (1 << index);
+}
+
+inline void Overlay::PipeBook::resetKept(int index) {
+    sKeptBitmap &= ~(1 << index);
+}
+
+inline bool Overlay::PipeBook::isKept(int index) {
+    return sKeptBitmap & (1 << index);
+}
+
 inline utils::eMdpPipeType Overlay::PipeBook::getPipeType(utils::eDest dest) {
     return pipeTypeLUT[(int)dest];
 }
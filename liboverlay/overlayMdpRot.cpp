@@ -125,6 +125,13 @@ bool MdpRot::commit() {
             mRotImgInfo.enable = 0;
             return false;
         }
+        // Allocate here so running out of rotator memory fails the
+        // configuration, where the caller can still pick another path.
+        if(!remap(RotMem::Mem::ROT_NUM_BUFS)) {
+            ALOGE("MdpRot commit failed to allocate rotator memory");
+            mRotImgInfo.enable = 0;
+            return false;
+        }
         save();
         mRotDataInfo.session_id = mRotImgInfo.session_id;
     }
@@ -194,6 +201,8 @@ bool MdpRot::remap(uint32_t numbufs) {
     ++mMem;
     if(!open_i(numbufs, opBufSize)) {
         ALOGE("%s Error could not open", __FUNCTION__);
+        // Swap back so the still valid buffers remain current
+        ++mMem;
         return false;
     }
     for (uint32_t i = 0; i < numbufs; ++i) {
@@ -218,7 +227,10 @@ bool MdpRot::queueBuffer(int fd, uint32_t offset) {
         mRotDataInfo.src.memory_id = fd;
         mRotDataInfo.src.offset = offset;
 
-        remap(RotMem::Mem::ROT_NUM_BUFS);
+        if(!remap(RotMem::Mem::ROT_NUM_BUFS)) {
+            ALOGE("%s remap failed", __FUNCTION__);
+            return false;
+        }
         OVASSERT(mMem.curr().m.numBufs(),
                 "queueBuffer numbufs is 0");
         mRotDataInfo.dst.offset =
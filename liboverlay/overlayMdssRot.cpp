@@ -117,6 +117,13 @@ bool MdssRot::commit() {
         return (mEnabled = false);
     }
     mRotData.id = mRotInfo.id;
+    // Allocate here so running out of rotator memory fails the
+    // configuration, where the caller can still pick another path.
+    if(!remap(RotMem::Mem::ROT_NUM_BUFS)) {
+        ALOGE("MdssRot commit failed to allocate rotator memory");
+        mRotInfo.flags &= ~MDSS_ROT_MASK;
+        return (mEnabled = false);
+    }
     // reset rotation flags to avoid stale orientation values
     mRotInfo.flags &= ~MDSS_ROT_MASK;
     return true;
@@ -127,7 +134,10 @@ bool MdssRot::queueBuffer(int fd, uint32_t offset) {
         mRotData.data.memory_id = fd;
         mRotData.data.offset = offset;
 
-        remap(RotMem::Mem::ROT_NUM_BUFS);
+        if(!remap(RotMem::Mem::ROT_NUM_BUFS)) {
+            ALOGE("%s remap failed", __FUNCTION__);
+            return false;
+        }
         OVASSERT(mMem.curr().m.numBufs(), "queueBuffer numbufs is 0");
 
         mRotData.dst_data.offset =
@@ -192,6 +202,8 @@ bool MdssRot::remap(uint32_t numbufs) {
     ++mMem;
     if(!open_i(numbufs, opBufSize)) {
         ALOGE("%s Error could not open", __FUNCTION__);
+        // Swap back so the still valid buffers remain current
+        ++mMem;
         return false;
     }
     for (uint32_t i = 0; i < numbufs; ++i) {
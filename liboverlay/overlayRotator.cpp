@@ -40,6 +40,10 @@ Rotator* Rotator::getRotator() {
     }
 }
 
+Rotator* Rotator::getSwRotator() {
+    return new SwRot();
+}
+
 uint32_t Rotator::calcOutputBufSize(const utils::Whf& destWhf) {
     //dummy aligned w & h.
     int alW = 0, alH = 0;
@@ -73,8 +77,10 @@ bool RotMem::close() {
 RotMgr::RotMgr() {
     for(int i = 0; i < MAX_ROT_SESS; i++) {
         mRot[i] = 0;
+        mSwRot[i] = 0;
     }
     mUseCount = 0;
+    mSwUseCount = 0;
 }
 
 RotMgr::~RotMgr() {
@@ -84,6 +90,7 @@ RotMgr::~RotMgr() {
 void RotMgr::configBegin() {
     //Reset the number of objects used
     mUseCount = 0;
+    mSwUseCount = 0;
 }
 
 void RotMgr::configDone() {
@@ -94,6 +101,12 @@ void RotMgr::configDone() {
             mRot[i] = 0;
         }
     }
+    for(int i = mSwUseCount; i < MAX_ROT_SESS; i++) {
+        if(mSwRot[i]) {
+            delete mSwRot[i];
+            mSwRot[i] = 0;
+        }
+    }
 }
 
 Rotator* RotMgr::getNext() {
@@ -109,6 +122,18 @@ Rotator* RotMgr::getNext() {
     return rot;
 }
 
+Rotator* RotMgr::getNextSw() {
+    overlay::Rotator *rot = NULL;
+    if(mSwUseCount >= MAX_ROT_SESS) {
+        ALOGE("%s, MAX SW rotator sessions reached", __func__);
+    } else {
+        if(mSwRot[mSwUseCount] == NULL)
+            mSwRot[mSwUseCount] = overlay::Rotator::getSwRotator();
+        rot = mSwRot[mSwUseCount++];
+    }
+    return rot;
+}
+
 void RotMgr::clear() {
     //Brute force obj destruction, helpful in suspend.
     for(int i = 0; i < MAX_ROT_SESS; i++) {
@@ -116,8 +141,13 @@ void RotMgr::clear() {
             delete mRot[i];
             mRot[i] = 0;
         }
+        if(mSwRot[i]) {
+            delete mSwRot[i];
+            mSwRot[i] = 0;
+        }
     }
     mUseCount = 0;
+    mSwUseCount = 0;
 }
 
 void RotMgr::getDump(char *buf, size_t len) {
@@ -125,6 +155,9 @@ void RotMgr::getDump(char *buf, size_t len) {
         if(mRot[i]) {
             mRot[i]->getDump(buf, len);
         }
+        if(mSwRot[i]) {
+            mSwRot[i]->getDump(buf, len);
+        }
     }
     char str[32] = {'\0'};
     snprintf(str, 32, "\n================\n");
@@ -31,6 +31,7 @@
 #define OVERlAY_ROTATOR_H
 
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "mdpWrapper.h"
 #include "overlayUtils.h"
@@ -44,6 +45,9 @@ public:
     enum { TYPE_MDP, TYPE_MDSS };
     virtual ~Rotator();
     virtual void setSource(const utils::Whf& wfh) = 0;
+    /* Plane layout of the source. The h/w rotators take it from the
+     * format, like the MDP. */
+    virtual void setPlaneLayout(const utils::PlaneLayout& /*layout*/) {}
     virtual void setFlags(const utils::eMdpFlags& flags) = 0;
     virtual void setTransform(const utils::eTransform& rot) = 0;
     virtual bool commit() = 0;
@@ -53,9 +57,23 @@ public:
     virtual uint32_t getDstFormat() const = 0;
     virtual uint32_t getSessId() const = 0;
     virtual bool queueBuffer(int fd, uint32_t offset) = 0;
+    /* Starts the rotation of the next buffer before queueBuffer is called
+     * with it, so the display can be made to wait for it. Returns a fence
+     * that signals once the rotated buffer is written, owned by the caller,
+     * or -1 if there is nothing to wait for. The h/w rotators do all the
+     * work in queueBuffer. */
+    virtual int prequeueBuffer(int /*fd*/, uint32_t /*offset*/) { return -1; }
+    /* Fence the next queued buffer signals once it is written. The h/w
+     * rotators leave the wait to the kernel. Not owned by the rotator. */
+    virtual void setAcquireFence(int /*fenceFd*/) {}
+    /* Fence that signals once the last queued buffer has been read, -1 if
+     * it already has. Owned by the caller. */
+    virtual int getReleaseFence() { return -1; }
     virtual void dump() const = 0;
     virtual void getDump(char *buf, size_t len) const = 0;
     static Rotator *getRotator();
+    /* CPU rotator used when no h/w rotator session can be had */
+    static Rotator *getSwRotator();
 
 protected:
     explicit Rotator() {}
@@ -212,6 +230,138 @@ private:
     friend Rotator* Rotator::getRotator();
 };
 
+/*
+* SW rot rotates on the CPU into its own pool of buffers. It stands in for
+* a h/w rotator when all sessions are taken or one could not get its memory.
+* Each queued buffer is rotated into a buffer of its own, which is the one
+* shown from then on. The rotation runs on a worker thread that also waits
+* for the acquire fence. A buffer started with prequeueBuffer comes with a
+* fence the display waits on, queueBuffer alone waits for the rotation.
+* The release fence signals once the worker has read the source.
+*
+* */
+class SwRot : public Rotator {
+public:
+    virtual ~SwRot();
+    virtual void setSource(const utils::Whf& wfh);
+    virtual void setPlaneLayout(const utils::PlaneLayout& layout);
+    virtual void setFlags(const utils::eMdpFlags& flags);
+    virtual void setTransform(const utils::eTransform& rot);
+    virtual bool commit();
+    virtual void setDownscale(int ds);
+    virtual int getDstMemId() const;
+    virtual uint32_t getDstOffset() const;
+    virtual uint32_t getDstFormat() const;
+    virtual uint32_t getSessId() const;
+    virtual bool queueBuffer(int fd, uint32_t offset);
+    virtual int prequeueBuffer(int fd, uint32_t offset);
+    virtual void setAcquireFence(int fenceFd);
+    virtual int getReleaseFence();
+    virtual void dump() const;
+    virtual void getDump(char *buf, size_t len) const;
+
+private:
+    /* Output buffers: the shown one, the one shown before it which MDP may
+     * still be reading, and two for rotations still running */
+    enum { SW_ROT_NUM_BUFS = 4 };
+    /* A queued source buffer with the geometry it was queued with */
+    struct Job {
+        int fd;
+        uint32_t offset;
+        int fenceFd;
+        uint32_t seq;
+        int slot;
+        utils::Whf srcWhf;
+        utils::PlaneLayout layout;
+        utils::Whf dstWhf;
+        utils::eTransform orient;
+    };
+
+    explicit SwRot();
+    bool close();
+    bool enabled () const;
+    /* remap rot buffers */
+    bool remap(uint32_t numbufs);
+    bool open_i(uint32_t numbufs, uint32_t bufsz);
+    /* Closes the previous buffers, once a new buffer is shown */
+    bool closePrevMem();
+    /* Deferred transform calculations */
+    void doTransform();
+    /* reset underlying data */
+    void reset();
+    /* Calculates the o/p buffer size post the transform calcs */
+    uint32_t calcOutputBufSize();
+    /* Rotate a mapped source buffer into dst */
+    static void rotate(const Job& job, const uint8_t *src, uint8_t *dst);
+    /* Returns true for the MDP formats the CPU path handles */
+    static bool isFormatSupported(int format);
+    /* Worker thread, rotates the queued jobs in order */
+    static void *rotThread(void *data);
+    void startThread();
+    void stopThread();
+    /* Queues the rotation of a buffer into a free slot and shows that
+     * slot. Returns the seq of the job, 0 on failure */
+    uint32_t postJob(int fd, uint32_t offset, int acqFenceFd);
+    /* Waits for and rotates a job into its slot, false on failure */
+    bool runJob(const Job& job);
+    /* Free output slot for the next job, -1 if there is none. mLock held */
+    int pickSlotLocked() const;
+    /* Publishes a finished job and signals its fences. mLock held */
+    void finishJobLocked(const Job& job);
+    /* Waits until the job seq has finished, false if it failed */
+    bool waitJob(uint32_t seq);
+    /* Drops the queued jobs and waits for the running one. mLock held */
+    void drainLocked();
+    static void closeJob(Job& job);
+
+    /* Source and rotated geometry */
+    utils::Whf mSrcWhf;
+    utils::PlaneLayout mLayout;
+    utils::Whf mDstWhf;
+    /* Orientation */
+    utils::eTransform mOrientation;
+    /* Offset of the shown buffer */
+    uint32_t mDstOffset;
+    int mDownscale;
+    bool mSecure;
+    bool mEnabled;
+    /* Acquire fence of the next queued buffer, -1 if there is none */
+    int mAcqFenceFd;
+    /* Release fence of the last queued buffer, not yet handed out */
+    int mRelFenceFd;
+    /* Source started by prequeueBuffer, for queueBuffer to pick up */
+    bool mPreQueued;
+    int mPreFd;
+    uint32_t mPreOffset;
+    /* Rotator memory manager */
+    RotMem mMem;
+
+    /* Worker state, under mLock */
+    pthread_t mThread;
+    pthread_mutex_t mLock;
+    pthread_cond_t mCond;       // signals queued and finished jobs
+    bool mThreadRunning;
+    bool mStop;
+    bool mBusy;                 // the worker is rotating a job
+    Job mJobs[SW_ROT_NUM_BUFS]; // FIFO of the jobs not started yet
+    int mJobHead;
+    int mJobCount;
+    int mTimelineFd;            // sw_sync timeline of the job fences
+    uint32_t mQueued;           // seq of the last queued job
+    uint32_t mDone;             // seq of the last finished job
+    uint32_t mFailed;           // seq of the last job that failed
+    /* Geometry of the rotated buffers */
+    utils::Whf mActiveWhf;
+    utils::eTransform mActiveOrient;
+    /* Seq of the last job written to each slot */
+    uint32_t mSlotSeq[SW_ROT_NUM_BUFS];
+    /* Shown slots, -1 if unused */
+    int mShown;
+    int mPrevShown;
+
+    friend Rotator* Rotator::getSwRotator();
+};
+
 // Holder of rotator objects. Manages lifetimes
 class RotMgr {
 public:
@@ -223,6 +373,9 @@ public:
     void configBegin();
     void configDone();
     overlay::Rotator *getNext();
+    /* Returns the next SW rotator, for when getNext() has none or the one
+     * it returned cannot be configured */
+    overlay::Rotator *getNextSw();
     void clear(); //Removes all instances
     /* Returns rot dump.
      * Expects a NULL terminated buffer of big enough size.
@@ -231,6 +384,9 @@ public:
 private:
     overlay::Rotator *mRot[MAX_ROT_SESS];
     int mUseCount;
+    //SW rotators, kept across frames along with their buffers
+    overlay::Rotator *mSwRot[MAX_ROT_SESS];
+    int mSwUseCount;
 };
 
 
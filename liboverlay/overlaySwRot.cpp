@@ -0,0 +1,861 @@
+/*
+ * Copyright (c) 2013, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Linux Foundation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sync/sync.h>
+#include <sw_sync.h>
+#include "overlayUtils.h"
+#include "overlayRotator.h"
+
+#ifdef __ARM_HAVE_NEON
+#include <arm_neon.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace ovutils = overlay::utils;
+
+namespace overlay {
+
+/*
+ * Plane transposes. A rotation by 90 degrees is a transpose where the rows
+ * of the source and/or destination are walked backwards, so the kernels
+ * take signed strides in bytes. Work is blocked in 64x64 element tiles so
+ * both sides stay in cache, with 8x8 element blocks done in registers.
+ */
+enum { TILE = 64, BLOCK = 8 };
+
+/* Transpose a w x h block of T, dst gets h elements per row, w rows */
+template <typename T>
+static void transpose_c(const uint8_t *src, int sstride, uint8_t *dst,
+                        int dstride, int w, int h)
+{
+    for (int y = 0; y < w; y++) {
+        T *d = (T *)(dst + y * dstride);
+        for (int x = 0; x < h; x++)
+            d[x] = ((const T *)(src + x * sstride))[y];
+    }
+}
+
+#if defined(__SSE2__)
+static void transpose8x8_u8(const uint8_t *src, int ss, uint8_t *dst, int ds)
+{
+    __m128i a0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)src),
+                                   _mm_loadl_epi64((const __m128i *)(src + ss)));
+    __m128i a1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(src + 2*ss)),
+                                   _mm_loadl_epi64((const __m128i *)(src + 3*ss)));
+    __m128i a2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(src + 4*ss)),
+                                   _mm_loadl_epi64((const __m128i *)(src + 5*ss)));
+    __m128i a3 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(src + 6*ss)),
+                                   _mm_loadl_epi64((const __m128i *)(src + 7*ss)));
+    __m128i b0 = _mm_unpacklo_epi16(a0, a1);
+    __m128i b1 = _mm_unpackhi_epi16(a0, a1);
+    __m128i b2 = _mm_unpacklo_epi16(a2, a3);
+    __m128i b3 = _mm_unpackhi_epi16(a2, a3);
+    __m128i c[4] = { _mm_unpacklo_epi32(b0, b2), _mm_unpackhi_epi32(b0, b2),
+                     _mm_unpacklo_epi32(b1, b3), _mm_unpackhi_epi32(b1, b3) };
+    for (int i = 0; i < 4; i++) {
+        _mm_storel_epi64((__m128i *)(dst + 2*i*ds), c[i]);
+        _mm_storel_epi64((__m128i *)(dst + (2*i + 1)*ds),
+                         _mm_unpackhi_epi64(c[i], c[i]));
+    }
+}
+
+static void transpose8x8_u16(const uint8_t *src, int ss, uint8_t *dst, int ds)
+{
+    __m128i r[8], a[8], b[8];
+    for (int i = 0; i < 8; i++)
+        r[i] = _mm_loadu_si128((const __m128i *)(src + i*ss));
+    for (int i = 0; i < 8; i += 2) {
+        a[i] = _mm_unpacklo_epi16(r[i], r[i + 1]);
+        a[i + 1] = _mm_unpackhi_epi16(r[i], r[i + 1]);
+    }
+    for (int i = 0; i < 8; i += 4) {
+        b[i] = _mm_unpacklo_epi32(a[i], a[i + 2]);
+        b[i + 1] = _mm_unpackhi_epi32(a[i], a[i + 2]);
+        b[i + 2] = _mm_unpacklo_epi32(a[i + 1], a[i + 3]);
+        b[i + 3] = _mm_unpackhi_epi32(a[i + 1], a[i + 3]);
+    }
+    for (int i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i *)(dst + 2*i*ds),
+                         _mm_unpacklo_epi64(b[i], b[i + 4]));
+        _mm_storeu_si128((__m128i *)(dst + (2*i + 1)*ds),
+                         _mm_unpackhi_epi64(b[i], b[i + 4]));
+    }
+}
+
+static void transpose4x4_u32(const uint8_t *src, int ss, uint8_t *dst, int ds)
+{
+    __m128i r0 = _mm_loadu_si128((const __m128i *)src);
+    __m128i r1 = _mm_loadu_si128((const __m128i *)(src + ss));
+    __m128i r2 = _mm_loadu_si128((const __m128i *)(src + 2*ss));
+    __m128i r3 = _mm_loadu_si128((const __m128i *)(src + 3*ss));
+    __m128i a0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i a1 = _mm_unpackhi_epi32(r0, r1);
+    __m128i a2 = _mm_unpacklo_epi32(r2, r3);
+    __m128i a3 = _mm_unpackhi_epi32(r2, r3);
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi64(a0, a2));
+    _mm_storeu_si128((__m128i *)(dst + ds), _mm_unpackhi_epi64(a0, a2));
+    _mm_storeu_si128((__m128i *)(dst + 2*ds), _mm_unpacklo_epi64(a1, a3));
+    _mm_storeu_si128((__m128i *)(dst + 3*ds), _mm_unpackhi_epi64(a1, a3));
+}
+#elif defined(__ARM_HAVE_NEON)
+static void transpose8x8_u8(const uint8_t *src, int ss, uint8_t *dst, int ds)
+{
+    uint8x8x2_t t01 = vtrn_u8(vld1_u8(src), vld1_u8(src + ss));
+    uint8x8x2_t t23 = vtrn_u8(vld1_u8(src + 2*ss), vld1_u8(src + 3*ss));
+    uint8x8x2_t t45 = vtrn_u8(vld1_u8(src + 4*ss), vld1_u8(src + 5*ss));
+    uint8x8x2_t t67 = vtrn_u8(vld1_u8(src + 6*ss), vld1_u8(src + 7*ss));
+    uint16x4x2_t u02 = vtrn_u16(vreinterpret_u16_u8(t01.val[0]),
+                                vreinterpret_u16_u8(t23.val[0]));
+    uint16x4x2_t u13 = vtrn_u16(vreinterpret_u16_u8(t01.val[1]),
+                                vreinterpret_u16_u8(t23.val[1]));
+    uint16x4x2_t u46 = vtrn_u16(vreinterpret_u16_u8(t45.val[0]),
+                                vreinterpret_u16_u8(t67.val[0]));
+    uint16x4x2_t u57 = vtrn_u16(vreinterpret_u16_u8(t45.val[1]),
+                                vreinterpret_u16_u8(t67.val[1]));
+    uint32x2x2_t v04 = vtrn_u32(vreinterpret_u32_u16(u02.val[0]),
+                                vreinterpret_u32_u16(u46.val[0]));
+    uint32x2x2_t v15 = vtrn_u32(vreinterpret_u32_u16(u13.val[0]),
+                                vreinterpret_u32_u16(u57.val[0]));
+    uint32x2x2_t v26 = vtrn_u32(vreinterpret_u32_u16(u02.val[1]),
+                                vreinterpret_u32_u16(u46.val[1]));
+    uint32x2x2_t v37 = vtrn_u32(vreinterpret_u32_u16(u13.val[1]),
+                                vreinterpret_u32_u16(u57.val[1]));
+    vst1_u8(dst, vreinterpret_u8_u32(v04.val[0]));
+    vst1_u8(dst + ds, vreinterpret_u8_u32(v15.val[0]));
+    vst1_u8(dst + 2*ds, vreinterpret_u8_u32(v26.val[0]));
+    vst1_u8(dst + 3*ds, vreinterpret_u8_u32(v37.val[0]));
+    vst1_u8(dst + 4*ds, vreinterpret_u8_u32(v04.val[1]));
+    vst1_u8(dst + 5*ds, vreinterpret_u8_u32(v15.val[1]));
+    vst1_u8(dst + 6*ds, vreinterpret_u8_u32(v26.val[1]));
+    vst1_u8(dst + 7*ds, vreinterpret_u8_u32(v37.val[1]));
+}
+
+static void transpose8x8_u16(const uint8_t *src, int ss, uint8_t *dst, int ds)
+{
+    uint16x8x2_t t01 = vtrnq_u16(vld1q_u16((const uint16_t *)src),
+                                 vld1q_u16((const uint16_t *)(src + ss)));
+    uint16x8x2_t t23 = vtrnq_u16(vld1q_u16((const uint16_t *)(src + 2*ss)),
+                                 vld1q_u16((const uint16_t *)(src + 3*ss)));
+    uint16x8x2_t t45 = vtrnq_u16(vld1q_u16((const uint16_t *)(src + 4*ss)),
+                                 vld1q_u16((const uint16_t *)(src + 5*ss)));
+    uint16x8x2_t t67 = vtrnq_u16(vld1q_u16((const uint16_t *)(src + 6*ss)),
+                                 vld1q_u16((const uint16_t *)(src + 7*ss)));
+    uint32x4x2_t u02 = vtrnq_u32(vreinterpretq_u32_u16(t01.val[0]),
+                                 vreinterpretq_u32_u16(t23.val[0]));
+    uint32x4x2_t u13 = vtrnq_u32(vreinterpretq_u32_u16(t01.val[1]),
+                                 vreinterpretq_u32_u16(t23.val[1]));
+    uint32x4x2_t u46 = vtrnq_u32(vreinterpretq_u32_u16(t45.val[0]),
+                                 vreinterpretq_u32_u16(t67.val[0]));
+    uint32x4x2_t u57 = vtrnq_u32(vreinterpretq_u32_u16(t45.val[1]),
+                                 vreinterpretq_u32_u16(t67.val[1]));
+    // Each register now holds two half columns, pair them up
+    const uint32x4_t top[4] = { u02.val[0], u13.val[0], u02.val[1], u13.val[1] };
+    const uint32x4_t bot[4] = { u46.val[0], u57.val[0], u46.val[1], u57.val[1] };
+    for (int i = 0; i < 4; i++) {
+        vst1q_u32((uint32_t *)(dst + i*ds),
+                  vcombine_u32(vget_low_u32(top[i]), vget_low_u32(bot[i])));
+        vst1q_u32((uint32_t *)(dst + (i + 4)*ds),
+                  vcombine_u32(vget_high_u32(top[i]), vget_high_u32(bot[i])));
+    }
+}
+
+static void transpose4x4_u32(const uint8_t *src, int ss, uint8_t *dst, int ds)
+{
+    uint32x4x2_t t01 = vtrnq_u32(vld1q_u32((const uint32_t *)src),
+                                 vld1q_u32((const uint32_t *)(src + ss)));
+    uint32x4x2_t t23 = vtrnq_u32(vld1q_u32((const uint32_t *)(src + 2*ss)),
+                                 vld1q_u32((const uint32_t *)(src + 3*ss)));
+    vst1q_u32((uint32_t *)dst, vcombine_u32(vget_low_u32(t01.val[0]),
+                                            vget_low_u32(t23.val[0])));
+    vst1q_u32((uint32_t *)(dst + ds), vcombine_u32(vget_low_u32(t01.val[1]),
+                                                   vget_low_u32(t23.val[1])));
+    vst1q_u32((uint32_t *)(dst + 2*ds), vcombine_u32(vget_high_u32(t01.val[0]),
+                                                     vget_high_u32(t23.val[0])));
+    vst1q_u32((uint32_t *)(dst + 3*ds), vcombine_u32(vget_high_u32(t01.val[1]),
+                                                     vget_high_u32(t23.val[1])));
+}
+#else
+static void transpose8x8_u8(const uint8_t *src, int ss, uint8_t *dst, int ds)
+{
+    transpose_c<uint8_t>(src, ss, dst, ds, BLOCK, BLOCK);
+}
+
+static void transpose8x8_u16(const uint8_t *src, int ss, uint8_t *dst, int ds)
+{
+    transpose_c<uint16_t>(src, ss, dst, ds, BLOCK, BLOCK);
+}
+
+static void transpose4x4_u32(const uint8_t *src, int ss, uint8_t *dst, int ds)
+{
+    transpose_c<uint32_t>(src, ss, dst, ds, BLOCK / 2, BLOCK / 2);
+}
+#endif
+
+static void transpose8x8_u32(const uint8_t *src, int ss, uint8_t *dst, int ds)
+{
+    transpose4x4_u32(src, ss, dst, ds);
+    transpose4x4_u32(src + 16, ss, dst + 4*ds, ds);
+    transpose4x4_u32(src + 4*ss, ss, dst + 16, ds);
+    transpose4x4_u32(src + 4*ss + 16, ss, dst + 4*ds + 16, ds);
+}
+
+typedef void (*block_fn)(const uint8_t *, int, uint8_t *, int);
+
+/* Transpose a plane of w x h elements of T */
+template <typename T>
+static void transpose_plane(const uint8_t *src, int ss, uint8_t *dst, int ds,
+                            int w, int h, block_fn block)
+{
+    const int bpp = sizeof(T);
+    for (int ty = 0; ty < h; ty += TILE) {
+        int th = (h - ty < TILE) ? h - ty : TILE;
+        int bh = th & ~(BLOCK - 1);
+        for (int tx = 0; tx < w; tx += TILE) {
+            int tw = (w - tx < TILE) ? w - tx : TILE;
+            int bw = tw & ~(BLOCK - 1);
+            const uint8_t *s = src + ty * ss + tx * bpp;
+            uint8_t *d = dst + tx * ds + ty * bpp;
+            for (int y = 0; y < bh; y += BLOCK)
+                for (int x = 0; x < bw; x += BLOCK)
+                    block(s + y * ss + x * bpp, ss, d + x * ds + y * bpp, ds);
+            // Ragged right and bottom edges of the tile
+            transpose_c<T>(s + bw * bpp, ss, d + bw * ds, ds, tw - bw, th);
+            transpose_c<T>(s + bh * ss, ss, d + bh * bpp, ds, bw, th - bh);
+        }
+    }
+}
+
+/* Copy a plane of w x h elements of T, mirroring each row if asked */
+template <typename T>
+static void copy_plane(const uint8_t *src, int ss, uint8_t *dst, int ds,
+                       int w, int h, bool mirror)
+{
+    for (int y = 0; y < h; y++) {
+        const T *s = (const T *)(src + y * ss);
+        T *d = (T *)(dst + y * ds);
+        if (!mirror) {
+            memcpy(d, s, w * sizeof(T));
+            continue;
+        }
+        for (int x = 0; x < w; x++)
+            d[x] = s[w - 1 - x];
+    }
+}
+
+/*
+ * Apply an MDP orientation to a plane. The MDP rotates by 90 degrees
+ * clockwise before flipping, so with the source w x h:
+ *   dst(x, y) = src(FLIP_V ? w-1-y : y, FLIP_H ? x : h-1-x)
+ * i.e. a transpose reading the source rows backwards unless FLIP_H, and
+ * writing the destination rows backwards when FLIP_V.
+ */
+template <typename T>
+static void rotate_plane(const uint8_t *src, int ss, uint8_t *dst, int ds,
+                         int w, int h, int orient, block_fn block)
+{
+    bool flipH = orient & utils::OVERLAY_TRANSFORM_FLIP_H;
+    bool flipV = orient & utils::OVERLAY_TRANSFORM_FLIP_V;
+    if (orient & utils::OVERLAY_TRANSFORM_ROT_90) {
+        if (!flipH) {
+            src += (h - 1) * ss;
+            ss = -ss;
+        }
+        if (flipV) {
+            dst += (w - 1) * ds;
+            ds = -ds;
+        }
+        transpose_plane<T>(src, ss, dst, ds, w, h, block);
+        return;
+    }
+    if (flipV) {
+        src += (h - 1) * ss;
+        ss = -ss;
+    }
+    copy_plane<T>(src, ss, dst, ds, w, h, flipH);
+}
+
+//--------------------------------------------------------------------------
+
+SwRot::SwRot() : mRelFenceFd(-1), mThreadRunning(false), mStop(false),
+        mBusy(false), mJobHead(0), mJobCount(0), mTimelineFd(-1), mQueued(0),
+        mDone(0), mFailed(0) {
+    pthread_mutex_init(&mLock, NULL);
+    pthread_cond_init(&mCond, NULL);
+    reset();
+}
+
+SwRot::~SwRot() {
+    stopThread();
+    close();
+    pthread_cond_destroy(&mCond);
+    pthread_mutex_destroy(&mLock);
+}
+
+bool SwRot::enabled() const { return mEnabled; }
+
+int SwRot::getDstMemId() const {
+    return mMem.curr().m.getFD();
+}
+
+uint32_t SwRot::getDstOffset() const {
+    return mDstOffset;
+}
+
+uint32_t SwRot::getDstFormat() const {
+    return mDstWhf.format;
+}
+
+// There is no kernel session behind a CPU rotation
+uint32_t SwRot::getSessId() const { return 0; }
+
+void SwRot::setSource(const overlay::utils::Whf& whf) {
+    mSrcWhf = whf;
+    mDstWhf = whf;
+}
+
+void SwRot::setPlaneLayout(const utils::PlaneLayout& layout) {
+    mLayout = layout;
+}
+
+void SwRot::setFlags(const utils::eMdpFlags& flags) {
+    mSecure = (flags & utils::OV_MDP_SECURE_OVERLAY_SESSION);
+}
+
+void SwRot::setTransform(const utils::eTransform& rot)
+{
+    //getMdpOrient will switch the flips if the source is 90 rotated.
+    //Clients in Android dont factor in 90 rotation while deciding the flip.
+    int r = utils::getMdpOrient(rot);
+    mOrientation = static_cast<utils::eTransform>(r == -1 ? 0 : r);
+}
+
+void SwRot::setDownscale(int ds) { mDownscale = ds; }
+
+void SwRot::doTransform() {
+    mDstWhf = mSrcWhf;
+    if(mOrientation & utils::OVERLAY_TRANSFORM_ROT_90)
+        utils::swap(mDstWhf.w, mDstWhf.h);
+}
+
+bool SwRot::isFormatSupported(int format) {
+    switch(format) {
+        case MDP_Y_CBCR_H2V2:
+        case MDP_Y_CRCB_H2V2:
+        case MDP_Y_CR_CB_GH2V2:
+        case MDP_RGBA_8888:
+        case MDP_RGBX_8888:
+        case MDP_BGRA_8888:
+        case MDP_RGB_565:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool SwRot::commit() {
+    mEnabled = false;
+    if(mSecure || mDownscale) {
+        // Protected content cannot be read by the CPU, and the pipe is
+        // set up for a rotator that also decimates
+        ALOGE_IF(DEBUG_OVERLAY, "%s: secure=%d downscale=%d not supported",
+                __FUNCTION__, mSecure, mDownscale);
+        return false;
+    }
+    if(!isFormatSupported(mSrcWhf.format) ||
+            (mSrcWhf.w & 1) || (mSrcWhf.h & 1)) {
+        ALOGE("%s: unsupported source %dx%d format %s", __FUNCTION__,
+                mSrcWhf.w, mSrcWhf.h, ovutils::getFormatString(mSrcWhf.format));
+        return false;
+    }
+    // Where the semiplanar chroma starts is up to the allocator, it has to
+    // come with the source
+    if((mSrcWhf.format == MDP_Y_CBCR_H2V2 ||
+            mSrcWhf.format == MDP_Y_CRCB_H2V2) &&
+            (mLayout.stride < mSrcWhf.w || mLayout.chromaStride < mSrcWhf.w ||
+            mLayout.chromaOffset < mLayout.stride * mSrcWhf.h)) {
+        ALOGE("%s: no plane layout for the semiplanar source", __FUNCTION__);
+        return false;
+    }
+    doTransform();
+
+    pthread_mutex_lock(&mLock);
+    // Jobs carry their own geometry, only a new geometry or a reallocation
+    // has to stop the worker and forget the rotated buffers
+    if(mDstWhf != mActiveWhf || mOrientation != mActiveOrient ||
+            calcOutputBufSize() > mMem.curr().size()) {
+        drainLocked();
+        mShown = mPrevShown = -1;
+        mPreQueued = false;
+        mActiveWhf = mDstWhf;
+        mActiveOrient = mOrientation;
+    }
+    pthread_mutex_unlock(&mLock);
+
+    // Allocate now so running out of memory shows up at configuration
+    // time, while the layer can still go to the GPU
+    if(!remap(SW_ROT_NUM_BUFS)) {
+        ALOGE("%s: failed to allocate output buffers", __FUNCTION__);
+        return false;
+    }
+    startThread();
+    mEnabled = true;
+    return true;
+}
+
+uint32_t SwRot::calcOutputBufSize() {
+    return Rotator::calcOutputBufSize(mDstWhf);
+}
+
+bool SwRot::open_i(uint32_t numbufs, uint32_t bufsz)
+{
+    OvMem mem;
+
+    OVASSERT(MAP_FAILED == mem.addr(), "MAP failed in open_i");
+
+    if(!mem.open(numbufs, bufsz, false)){
+        ALOGE("%s: Failed to open", __func__);
+        mem.close();
+        return false;
+    }
+
+    OVASSERT(MAP_FAILED != mem.addr(), "MAP failed");
+    OVASSERT(mem.getFD() != -1, "getFd is -1");
+
+    mMem.curr().m = mem;
+    return true;
+}
+
+bool SwRot::remap(uint32_t numbufs) {
+    // The output buffers only grow, so a session keeps its pool across
+    // resolution changes and the common case never reallocates
+    uint32_t opBufSize = calcOutputBufSize();
+    if(mMem.curr().valid() && opBufSize <= mMem.curr().size()) {
+        return true;
+    }
+
+    ALOGE_IF(DEBUG_OVERLAY, "%s: size changed - remapping", __FUNCTION__);
+    if(mMem.prev().valid() && !mMem.prev().close()) {
+        ALOGE("%s error in closing prev rot mem", __FUNCTION__);
+        return false;
+    }
+
+    // ++mMem will make curr to be prev, and prev will be curr
+    ++mMem;
+    if(!open_i(numbufs, opBufSize)) {
+        ALOGE("%s Error could not open", __FUNCTION__);
+        // Keep the previous buffers, they are still being displayed
+        ++mMem;
+        return false;
+    }
+    return true;
+}
+
+bool SwRot::close() {
+    bool success = true;
+    if (!mMem.close()) {
+        ALOGE("Sw Rot error closing mem");
+        success = false;
+    }
+    reset();
+    return success;
+}
+
+void SwRot::reset() {
+    mSrcWhf = utils::Whf();
+    mLayout = utils::PlaneLayout();
+    mDstWhf = utils::Whf();
+    mOrientation = utils::OVERLAY_TRANSFORM_0;
+    mDstOffset = 0;
+    mDownscale = 0;
+    mSecure = false;
+    mEnabled = false;
+    mAcqFenceFd = -1;
+    if(mRelFenceFd >= 0)
+        ::close(mRelFenceFd);
+    mRelFenceFd = -1;
+    mPreQueued = false;
+    mPreFd = -1;
+    mPreOffset = 0;
+    utils::memset0(mSlotSeq);
+    mShown = mPrevShown = -1;
+    mActiveWhf = utils::Whf();
+    mActiveOrient = utils::OVERLAY_TRANSFORM_0;
+}
+
+void SwRot::rotate(const Job& job, const uint8_t *src, uint8_t *dst) {
+    const int w = job.srcWhf.w, h = job.srcWhf.h;
+    const int dw = job.dstWhf.w;
+    const int o = job.orient;
+
+    switch(job.srcWhf.format) {
+        case MDP_Y_CR_CB_GH2V2: {
+            // Gralloc YV12: 16 aligned luma and chroma strides
+            int sc = utils::align(w / 2, 16);
+            int dy = utils::align(dw, 16), dc = utils::align(dw / 2, 16);
+            int dh = job.dstWhf.h;
+            rotate_plane<uint8_t>(src, w, dst, dy, w, h, o, transpose8x8_u8);
+            for (int p = 0; p < 2; p++) {
+                rotate_plane<uint8_t>(src + w * h + p * sc * (h / 2), sc,
+                                      dst + dy * dh + p * dc * (dh / 2), dc,
+                                      w / 2, h / 2, o, transpose8x8_u8);
+            }
+            break;
+        }
+        case MDP_Y_CBCR_H2V2:
+        case MDP_Y_CRCB_H2V2: {
+            // The source planes are where gralloc put them. The MDP reads
+            // the rotated buffer with both strides dw and the chroma right
+            // after the luma, CbCr pairs move as one 16 bit element.
+            int dh = job.dstWhf.h;
+            rotate_plane<uint8_t>(src, job.layout.stride, dst, dw, w, h, o,
+                                  transpose8x8_u8);
+            rotate_plane<uint16_t>(src + job.layout.chromaOffset,
+                                   job.layout.chromaStride, dst + dw * dh, dw,
+                                   w / 2, h / 2, o, transpose8x8_u16);
+            break;
+        }
+        case MDP_RGB_565:
+            rotate_plane<uint16_t>(src, w * 2, dst, dw * 2, w, h, o,
+                                   transpose8x8_u16);
+            break;
+        default:
+            rotate_plane<uint32_t>(src, w * 4, dst, dw * 4, w, h, o,
+                                   transpose8x8_u32);
+            break;
+    }
+}
+
+void SwRot::closeJob(Job& job) {
+    if(job.fd >= 0)
+        ::close(job.fd);
+    if(job.fenceFd >= 0)
+        ::close(job.fenceFd);
+    job.fd = job.fenceFd = -1;
+}
+
+bool SwRot::runJob(const Job& job) {
+    // MDP waits for the producer in the kernel, the CPU has to wait here
+    // before it reads the source
+    if(job.fenceFd >= 0 && sync_wait(job.fenceFd, 1000) < 0) {
+        ALOGE("%s: sync_wait on fence %d failed: %s", __FUNCTION__,
+                job.fenceFd, strerror(errno));
+        return false;
+    }
+
+    gralloc::IAllocController* alloc = gralloc::IAllocController::getInstance();
+    IMemAlloc* memalloc =
+            alloc->getAllocator(private_handle_t::PRIV_FLAGS_USES_ION);
+    size_t mapSize = job.offset + job.srcWhf.size;
+    void *base = 0;
+    if(!memalloc || memalloc->map_buffer(&base, mapSize, 0, job.fd)) {
+        ALOGE("%s: failed to map source fd=%d", __FUNCTION__, job.fd);
+        return false;
+    }
+    // Drop any stale lines from the last time this buffer was read
+    memalloc->clean_buffer(base, mapSize, 0, job.fd);
+
+    const RotMem::Mem& mem = mMem.curr();
+    rotate(job, (const uint8_t *)base + job.offset,
+           (uint8_t *)mem.m.addr() + job.slot * mem.m.bufSz());
+
+    memalloc->unmap_buffer(base, mapSize, 0);
+    return true;
+}
+
+int SwRot::pickSlotLocked() const {
+    for(int i = 0; i < SW_ROT_NUM_BUFS; i++) {
+        if(i != mShown && i != mPrevShown && mSlotSeq[i] <= mDone)
+            return i;
+    }
+    return -1;
+}
+
+void SwRot::finishJobLocked(const Job& job) {
+    // Jobs finish in order, a dropped one signals its fences too
+    if(mTimelineFd >= 0 && job.seq > mDone)
+        sw_sync_timeline_inc(mTimelineFd, job.seq - mDone);
+    if(job.seq > mDone)
+        mDone = job.seq;
+    pthread_cond_broadcast(&mCond);
+}
+
+bool SwRot::waitJob(uint32_t seq) {
+    pthread_mutex_lock(&mLock);
+    while(mDone < seq)
+        pthread_cond_wait(&mCond, &mLock);
+    bool ok = (mFailed != seq);
+    pthread_mutex_unlock(&mLock);
+    return ok;
+}
+
+void SwRot::drainLocked() {
+    // The running job is older than the queued ones, let it finish first
+    // so the fences still signal in order
+    Job dropped[SW_ROT_NUM_BUFS];
+    int count = 0;
+    while(mJobCount) {
+        dropped[count++] = mJobs[mJobHead];
+        mJobHead = (mJobHead + 1) % SW_ROT_NUM_BUFS;
+        mJobCount--;
+    }
+    while(mBusy)
+        pthread_cond_wait(&mCond, &mLock);
+    for(int i = 0; i < count; i++) {
+        closeJob(dropped[i]);
+        finishJobLocked(dropped[i]);
+    }
+}
+
+void* SwRot::rotThread(void *data) {
+    SwRot *rot = (SwRot *)data;
+    pthread_mutex_lock(&rot->mLock);
+    while(true) {
+        while(!rot->mJobCount && !rot->mStop)
+            pthread_cond_wait(&rot->mCond, &rot->mLock);
+        if(!rot->mJobCount)
+            break;
+        Job job = rot->mJobs[rot->mJobHead];
+        rot->mJobHead = (rot->mJobHead + 1) % SW_ROT_NUM_BUFS;
+        rot->mJobCount--;
+        rot->mBusy = true;
+        pthread_mutex_unlock(&rot->mLock);
+        bool ok = rot->runJob(job);
+        closeJob(job);
+        pthread_mutex_lock(&rot->mLock);
+        if(!ok) {
+            ALOGE("%s: rotation %u failed, slot %d is stale", __FUNCTION__,
+                    job.seq, job.slot);
+            rot->mFailed = job.seq;
+        }
+        rot->mBusy = false;
+        rot->finishJobLocked(job);
+    }
+    pthread_mutex_unlock(&rot->mLock);
+    return NULL;
+}
+
+void SwRot::startThread() {
+    if(mThreadRunning)
+        return;
+    // Nothing is queued here, the job seqs restart with the new timeline
+    mQueued = mDone = mFailed = 0;
+    utils::memset0(mSlotSeq);
+    // Without sw_sync the source cannot be held past set, rotate inline
+    mTimelineFd = sw_sync_timeline_create();
+    if(mTimelineFd < 0) {
+        ALOGE("%s: no sw_sync timeline, rotating synchronously",
+                __FUNCTION__);
+        return;
+    }
+    mStop = false;
+    if(pthread_create(&mThread, NULL, rotThread, this) != 0) {
+        ALOGE("%s: failed to start the rotation thread", __FUNCTION__);
+        ::close(mTimelineFd);
+        mTimelineFd = -1;
+        return;
+    }
+    mThreadRunning = true;
+}
+
+void SwRot::stopThread() {
+    if(!mThreadRunning)
+        return;
+    pthread_mutex_lock(&mLock);
+    drainLocked();
+    mStop = true;
+    pthread_cond_broadcast(&mCond);
+    pthread_mutex_unlock(&mLock);
+    pthread_join(mThread, NULL);
+    mThreadRunning = false;
+    // Destroying the timeline signals any fence still out on it
+    ::close(mTimelineFd);
+    mTimelineFd = -1;
+}
+
+void SwRot::setAcquireFence(int fenceFd) {
+    mAcqFenceFd = fenceFd;
+}
+
+int SwRot::getReleaseFence() {
+    int fd = mRelFenceFd;
+    mRelFenceFd = -1;
+    return fd;
+}
+
+uint32_t SwRot::postJob(int fd, uint32_t offset, int acqFenceFd) {
+    // The layer's fd and fence are closed after set, the job outlives them
+    Job job;
+    job.fd = dup(fd);
+    job.offset = offset;
+    job.fenceFd = (acqFenceFd >= 0) ? dup(acqFenceFd) : -1;
+    job.srcWhf = mSrcWhf;
+    job.layout = mLayout;
+    job.dstWhf = mDstWhf;
+    job.orient = mOrientation;
+    if(job.fd < 0) {
+        ALOGE("%s: dup of fd=%d failed: %s", __FUNCTION__, fd,
+                strerror(errno));
+        closeJob(job);
+        return 0;
+    }
+
+    pthread_mutex_lock(&mLock);
+    // All slots are only taken while the worker is two frames behind
+    int slot;
+    while((slot = pickSlotLocked()) < 0 && mThreadRunning)
+        pthread_cond_wait(&mCond, &mLock);
+    if(slot < 0) {
+        pthread_mutex_unlock(&mLock);
+        ALOGE("%s: no free output buffer", __FUNCTION__);
+        closeJob(job);
+        return 0;
+    }
+    job.slot = slot;
+    job.seq = ++mQueued;
+    mSlotSeq[slot] = job.seq;
+    mPrevShown = mShown;
+    mShown = slot;
+    mDstOffset = slot * mMem.curr().m.bufSz();
+
+    if(mThreadRunning) {
+        mJobs[(mJobHead + mJobCount) % SW_ROT_NUM_BUFS] = job;
+        mJobCount++;
+        pthread_cond_broadcast(&mCond);
+    } else {
+        pthread_mutex_unlock(&mLock);
+        bool ok = runJob(job);
+        closeJob(job);
+        pthread_mutex_lock(&mLock);
+        if(!ok) {
+            ALOGE("%s: rotation %u failed, slot %d is stale", __FUNCTION__,
+                    job.seq, job.slot);
+            mFailed = job.seq;
+        }
+        finishJobLocked(job);
+    }
+    pthread_mutex_unlock(&mLock);
+    return job.seq;
+}
+
+int SwRot::prequeueBuffer(int fd, uint32_t offset) {
+    // The fence only covers this buffer
+    int acqFenceFd = mAcqFenceFd;
+    mAcqFenceFd = -1;
+    mPreQueued = false;
+    // Only the worker's timeline gives a fence to wait on
+    if(!enabled() || !mThreadRunning)
+        return -1;
+
+    uint32_t seq = postJob(fd, offset, acqFenceFd);
+    if(!seq)
+        return -1;
+    mPreQueued = true;
+    mPreFd = fd;
+    mPreOffset = offset;
+
+    // The same fence tells the display the slot is written and the
+    // producer the source is read
+    int relFenceFd = sw_sync_fence_create(mTimelineFd, "swrot", seq);
+    int dstFenceFd = (relFenceFd >= 0) ? dup(relFenceFd) : -1;
+    if(dstFenceFd < 0) {
+        ALOGE("%s: fence creation failed: %s", __FUNCTION__,
+                strerror(errno));
+        if(relFenceFd >= 0)
+            ::close(relFenceFd);
+        waitJob(seq);
+        return -1;
+    }
+    if(mRelFenceFd >= 0)
+        ::close(mRelFenceFd);
+    mRelFenceFd = relFenceFd;
+    return dstFenceFd;
+}
+
+bool SwRot::queueBuffer(int fd, uint32_t offset) {
+    // The fence only covers this buffer
+    int acqFenceFd = mAcqFenceFd;
+    mAcqFenceFd = -1;
+    if(!enabled())
+        return true;
+
+    if(mPreQueued && fd == mPreFd && offset == mPreOffset) {
+        // Started by prequeueBuffer, the display waits for it
+        mPreQueued = false;
+        return closePrevMem();
+    }
+    mPreQueued = false;
+
+    // Nothing makes the display wait for this rotation, so it has to be
+    // done before its slot is shown
+    uint32_t seq = postJob(fd, offset, acqFenceFd);
+    if(!seq)
+        return false;
+    bool ok = waitJob(seq);
+    if(mRelFenceFd >= 0)
+        ::close(mRelFenceFd);
+    mRelFenceFd = -1;
+    if(!ok)
+        return false;
+    return closePrevMem();
+}
+
+bool SwRot::closePrevMem() {
+    // if the prev mem is valid, we need to close
+    if(mMem.prev().valid()) {
+        if(!mMem.prev().close()) {
+            ALOGE("%s error in closing prev rot mem", __FUNCTION__);
+            return false;
+        }
+    }
+    return true;
+}
+
+void SwRot::dump() const {
+    ALOGE("== Dump SwRot start ==");
+    mMem.curr().m.dump();
+    ALOGE("src w=%d h=%d fmt=%s dst w=%d h=%d orient=%d offset=%u",
+            mSrcWhf.w, mSrcWhf.h, ovutils::getFormatString(mSrcWhf.format),
+            mDstWhf.w, mDstWhf.h, mOrientation, mDstOffset);
+    ALOGE("== Dump SwRot end ==");
+}
+
+void SwRot::getDump(char *buf, size_t len) const {
+    char str[256] = {'\0'};
+    snprintf(str, sizeof(str), "SwRot src w=%d h=%d fmt=%s dst w=%d h=%d "
+            "orient=%d enabled=%d\n", mSrcWhf.w, mSrcWhf.h,
+            ovutils::getFormatString(mSrcWhf.format), mDstWhf.w, mDstWhf.h,
+            mOrientation, mEnabled);
+    strncat(buf, str, len - strlen(buf) - 1);
+}
+
+} // namespace overlay
@@ -210,6 +210,15 @@ struct Whf {
     uint32_t size;
 };
 
+/* Plane layout of a YUV buffer in bytes, as its allocator laid it out.
+ * The MDP derives it from the format, a CPU reader needs it spelled out. */
+struct PlaneLayout {
+    PlaneLayout() : stride(0), chromaOffset(0), chromaStride(0) {}
+    uint32_t stride;
+    uint32_t chromaOffset;
+    uint32_t chromaStride;
+};
+
 enum { MAX_PATH_LEN = 256 };
 
 /**
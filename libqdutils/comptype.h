@@ -67,6 +67,8 @@ inline QCCompositionType::QCCompositionType()
             mCompositionType = COMPOSITION_TYPE_MDP;
         } else if ((strncmp(property, "c2d", 3)) == 0) {
             mCompositionType = COMPOSITION_TYPE_C2D;
+        } else if ((strncmp(property, "cpu", 3)) == 0) {
+            mCompositionType = COMPOSITION_TYPE_CPU;
         } else if ((strncmp(property, "dyn", 3)) == 0) {
 #ifdef USE_MDP3
             mCompositionType = COMPOSITION_TYPE_DYN | COMPOSITION_TYPE_MDP;
@@ -43,6 +43,11 @@ int setMetaData(private_handle_t *handle, DispParamType paramType,
         ALOGE("%s: Bad fd for extra data!", __func__);
         return -1;
     }
+    // Consumers divide by it
+    if (paramType == UPDATE_REFRESH_RATE && *((int32_t *)param) <= 0) {
+        ALOGE("%s: Bad refresh rate %d", __func__, *((int32_t *)param));
+        return -1;
+    }
     unsigned long size = ROUND_UP_PAGESIZE(sizeof(MetaData_t));
     void *base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
         handle->fd_metadata, 0);
@@ -65,6 +70,15 @@ int setMetaData(private_handle_t *handle, DispParamType paramType,
         case PP_PARAM_INTERLACED:
             data->interlaced = *((int32_t *)param);
             break;
+        case UPDATE_DAMAGE:
+            memcpy((void *)&data->damage, param, sizeof(DamageData_t));
+            if (data->damage.numRects < 0 ||
+                    data->damage.numRects > MAX_DAMAGE_RECTS)
+                data->damage.numRects = 0;
+            break;
+        case UPDATE_REFRESH_RATE:
+            data->refreshRate = *((int32_t *)param);
+            break;
         default:
             ALOGE("Unknown paramType %d", paramType);
             break;
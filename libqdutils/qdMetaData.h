@@ -30,6 +30,7 @@
 #ifndef _QDMETADATA_H
 #define _QDMETADATA_H
 
+#define MAX_DAMAGE_RECTS 4
 
 typedef struct {
     int32_t hue;
@@ -38,22 +39,55 @@ typedef struct {
     float   contrast;
 } HSICData_t;
 
+typedef struct {
+    int32_t left;
+    int32_t top;
+    int32_t right;
+    int32_t bottom;
+} MetaRect_t;
+
+/* What the producer changed since its previous frame, in buffer
+ * coordinates. No rects means the whole buffer changed. frameSeq counts the
+ * frames of the producer, across all of its buffers. The damage is only
+ * used if the composer showed frame frameSeq - 1 last, any other frame,
+ * e.g. after a dropped one, is a full update. */
+typedef struct {
+    int32_t numRects;
+    MetaRect_t rects[MAX_DAMAGE_RECTS];
+    uint32_t frameSeq;
+} DamageData_t;
+
 typedef struct {
     int32_t operation;
     int32_t interlaced;
     HSICData_t hsicData;
     int32_t sharpness;
     int32_t video_interface;
+    DamageData_t damage;
+    int32_t refreshRate; /* frames per second the content is produced at */
 } MetaData_t;
 
 typedef enum {
     PP_PARAM_HSIC       = 0x0001,
     PP_PARAM_SHARPNESS  = 0x0002,
     PP_PARAM_INTERLACED = 0x0004,
-    PP_PARAM_VID_INTFC  = 0x0008
+    PP_PARAM_VID_INTFC  = 0x0008,
+    UPDATE_DAMAGE       = 0x0010,
+    UPDATE_REFRESH_RATE = 0x0020
 } DispParamType;
 
 int setMetaData(private_handle_t *handle, DispParamType paramType, void *param);
 
+/* Zero-copy read of the metadata through the mapping gralloc keeps at
+ * base_metadata. Returns NULL if none is mapped or paramType is not set. */
+static inline const MetaData_t* getMetaData(const private_handle_t *handle,
+                                            DispParamType paramType) {
+    if (!handle || !handle->base_metadata)
+        return NULL;
+    const MetaData_t *data =
+            reinterpret_cast<const MetaData_t *>(handle->base_metadata);
+    return (data->operation & paramType) ? data : NULL;
+}
+
 #endif /* _QDMETADATA_H */
 